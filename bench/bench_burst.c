@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "burst.h"
+#include "bench.h"
+
+/*
+ * fires a full hole punching burst at a loopback address and reports
+ * probes/sec and wall time, optionally against the legacy paced loop
+ * (one socket, one SO_SNDTIMEO and one sendto per probe). -u submits the
+ * burst through io_uring, -e registers every socket to an epoll set as the
+ * real traversal does.
+ */
+
+static int legacy_burst(struct sockaddr_in addr, const uint16_t* ports, int n, int gap_us, int* socks) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (socks[i] < 0) {
+            break;
+        }
+
+        struct timeval tv = {5, 0};
+        setsockopt(socks[i], SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof(tv));
+        addr.sin_port = htons(ports[i]);
+        char dummy = 'c';
+        if (sendto(socks[i], &dummy, 1, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(socks[i]);
+            break;
+        }
+        if (gap_us) {
+            usleep(gap_us);
+        }
+    }
+
+    return i;
+}
+
+int main(int argc, char** argv) {
+    struct burst_config cfg;
+    burst_default_config(&cfg);
+    int legacy = 0;
+    int with_set = 0;
+    int rounds = 5;
+    const char* target = "127.0.0.1";
+
+    static char usage[] = "usage: [-n SOCKETS] [-k PROBES_PER_SOCKET] [-b BATCH] [-g GAP_US] [-r ROUNDS] [-a ADDR] [-l legacy] [-u io_uring] [-e epoll set]\n";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:k:b:g:r:a:lue")) != -1) {
+        switch (opt) {
+            case 'n': cfg.num_socks = atoi(optarg); break;
+            case 'k': cfg.probes_per_sock = atoi(optarg); break;
+            case 'b': cfg.batch_size = atoi(optarg); break;
+            case 'g': cfg.gap_us = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            case 'a': target = optarg; break;
+            case 'l': legacy = 1; break;
+            case 'u': cfg.use_uring = 1; break;
+            case 'e': with_set = 1; break;
+            default:
+                printf("%s", usage);
+                return -1;
+        }
+    }
+    if (cfg.probes_per_sock > MAX_PROBES_PER_SOCK) {
+        cfg.probes_per_sock = MAX_PROBES_PER_SOCK;
+    }
+
+    bench_raise_nofile();
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(target);
+
+    int num_ports = cfg.num_socks * cfg.probes_per_sock;
+    uint16_t* ports = malloc(num_ports * sizeof(uint16_t));
+    int* socks = malloc(cfg.num_socks * sizeof(int));
+    srand(time(NULL));
+
+    printf("mode=%s sockets=%d probes_per_socket=%d batch=%d gap_us=%d\n",
+            legacy ? "legacy" : cfg.use_uring ? "io_uring" : "burst", cfg.num_socks, cfg.probes_per_sock, cfg.batch_size, cfg.gap_us);
+
+    int r;
+    for (r = 0; r < rounds; ++r) {
+        int i;
+        for (i = 0; i < num_ports; ++i) {
+            ports[i] = 1025 + rand() % (65535 - 1025 + 1);
+        }
+
+        int sent, opened;
+        uint64_t start = bench_now_us();
+        struct burst b;
+        struct probe_set set;
+        if (with_set) {
+            probe_set_init(&set);
+        }
+        if (legacy) {
+            sent = opened = legacy_burst(addr, ports, cfg.num_socks, cfg.gap_us, socks);
+        } else {
+            sent = burst_run(&b, &cfg, NULL, with_set ? &set : NULL, addr, ports);
+            opened = b.num_socks;
+            if (cfg.use_uring && !b.uring) {
+                printf("io_uring unavailable, fell back to syscalls\n");
+            }
+        }
+        uint64_t elapsed = bench_now_us() - start;
+
+        if (legacy) {
+            for (i = 0; i < opened; ++i) {
+                close(socks[i]);
+            }
+        } else {
+            burst_close(&b, -1);
+        }
+        if (with_set) {
+            probe_set_destroy(&set);
+        }
+
+        printf("round %d: probes=%d sockets=%d wall=%.3f ms rate=%.0f probes/sec\n",
+                r, sent, opened, elapsed / 1000.0, elapsed ? sent * 1e6 / elapsed : 0.0);
+    }
+
+    free(ports);
+    free(socks);
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "channel.h"
+
+/*
+ * throughput of the data channel over loopback, one thread sending and one
+ * receiving, with one syscall per datagram, with sendmmsg()/recvmmsg(), and
+ * with those plus UDP_SEGMENT/UDP_GRO. the sender doesn't pace itself, what
+ * the receiver can't keep up with shows as loss.
+ */
+
+int verbose = 0;
+
+#define IDLE_MS 500
+
+struct receiver {
+    struct channel ch;
+    uint64_t done_us;
+    unsigned sum;
+};
+
+static int open_socket(struct sockaddr_in* addr) {
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(*addr);
+    if (s < 0 || bind(s, (struct sockaddr*)addr, len) < 0 || getsockname(s, (struct sockaddr*)addr, &len) < 0) {
+        return -1;
+    }
+
+    return s;
+}
+
+static void* receive(void* arg) {
+    struct receiver* r = arg;
+    struct channel_msg msgs[CHANNEL_RX_BATCH];
+    int fin = 0;
+    while (!fin) {
+        int n = channel_recv(&r->ch, msgs, CHANNEL_RX_BATCH, IDLE_MS);
+        if (n <= 0) {
+            break;
+        }
+        // touch the payload like a consumer would
+        int i;
+        for (i = 0; i < n; ++i) {
+            fin |= msgs[i].flags & CHANNEL_FIN;
+            r->sum += (unsigned char)msgs[i].data[0];
+        }
+        r->done_us = bench_now_us();
+    }
+
+    return NULL;
+}
+
+static int run(const char* name, int use_mmsg, int use_gso, int payload, uint64_t bytes) {
+    struct channel_config cfg;
+    channel_default_config(&cfg);
+    cfg.payload = payload;
+    cfg.use_mmsg = use_mmsg;
+    cfg.use_gso = use_gso;
+    cfg.use_gro = use_gso;
+
+    struct sockaddr_in tx_addr, rx_addr;
+    int tx = open_socket(&tx_addr);
+    int rx = open_socket(&rx_addr);
+    struct channel sender;
+    struct receiver r;
+    memset(&r, 0, sizeof(r));
+    if (tx < 0 || rx < 0 || channel_init(&sender, tx, (struct sockaddr*)&rx_addr, &cfg) < 0
+            || channel_init(&r.ch, rx, (struct sockaddr*)&tx_addr, &cfg) < 0) {
+        printf("failed to set up %s\n", name);
+        return -1;
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, receive, &r);
+
+    uint64_t cpu = bench_cpu_us();
+    uint64_t start = bench_now_us();
+    uint64_t left = bytes;
+    while (left > 0) {
+        int len = left < (uint64_t)payload ? (int)left : payload;
+        channel_reserve(&sender)[0] = 0;
+        left -= len;
+        channel_commit(&sender, len, left ? 0 : CHANNEL_FIN);
+    }
+    channel_flush(&sender);
+    uint64_t sent_us = bench_now_us();
+    pthread_join(tid, NULL);
+    cpu = bench_cpu_us() - cpu;
+
+    // a lost FIN leaves the receiver waiting out its idle timeout, that isn't transfer time
+    uint64_t us = (r.done_us ? r.done_us : sent_us) - start;
+    struct channel_stats* s = &r.ch.stats;
+    printf("%-10s %7.2f Gb/s %9.0f pkts/s %7.2f cpu s/GB  %5.2f%% lost  %llu+%llu syscalls  (gso %s, gro %s)\n",
+        name, s->bytes_received * 8.0 / us / 1e3, s->received * 1e6 / us,
+        s->bytes_received ? cpu / 1e6 / (s->bytes_received / 1e9) : 0,
+        sender.stats.sent ? 100.0 * (sender.stats.sent - s->received) / sender.stats.sent : 0,
+        (unsigned long long)sender.stats.syscalls, (unsigned long long)s->syscalls,
+        sender.gso ? "on" : "off", r.ch.gro ? "on" : "off");
+    if (verbose) {
+        printf("           %llu received, %llu lost, %llu reordered, %llu duplicates\n",
+            (unsigned long long)s->received, (unsigned long long)s->lost,
+            (unsigned long long)s->reordered, (unsigned long long)s->duplicates);
+    }
+
+    channel_destroy(&sender);
+    channel_destroy(&r.ch);
+    close(tx);
+    close(rx);
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int payload = DEFAULT_CHANNEL_PAYLOAD;
+    uint64_t mb = 1024;
+
+    static char usage[] = "usage: [-l PAYLOAD_BYTES] [-m MEGABYTES] [-v]\n";
+    int opt;
+    while ((opt = getopt(argc, argv, "l:m:v")) != -1) {
+        switch (opt) {
+            case 'l': payload = atoi(optarg); break;
+            case 'm': mb = strtoull(optarg, NULL, 10); break;
+            case 'v': verbose = 1; break;
+            default:
+                printf("%s", usage);
+                return -1;
+        }
+    }
+
+    uint64_t bytes = mb * 1024 * 1024;
+    printf("%llu MB over loopback, %d byte payloads\n", (unsigned long long)mb, payload);
+    run("sendto", 0, 0, payload, bytes);
+    run("mmsg", 1, 0, payload, bytes);
+    run("mmsg+gso", 1, 1, payload, bytes);
+
+    return 0;
+}
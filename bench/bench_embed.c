@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "libnattraversal.h"
+#include "nat_traversal.h"
+#include "nat_cache.h"
+
+/*
+ * many concurrent sessions of several libnattraversal contexts, driven by one
+ * epoll loop of the program's own, against a running punch server (go run
+ * punch_server.go). every context enrolls over the UDP rendezvous from a
+ * loopback port of its own, with a cached symmetric profile the server's
+ * reply validates, so nothing goes to a STUN server. the contexts connect to
+ * N simulated peers, then the same peers notify them. the peers advertise a
+ * blackholed address, so every session ends up waiting for probes that never
+ * come. reports sessions per second, wakeups of the loop and how long a call
+ * to nt_process() holds it up.
+ */
+
+#define NAT_INFO_SIZE 26
+#define BLACKHOLE "192.0.2.1"
+#define MAX_CONTEXTS 64
+#define FIRST_PORT 42000
+
+// enroll one simulated peer on a plain blocking connection, returns its id
+static uint32_t fake_enroll(struct sockaddr_in server, int* sock) {
+    *sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*sock, (struct sockaddr*)&server, sizeof(server)) < 0) {
+        return 0;
+    }
+
+    char frame[RPC_HEADER_LENGTH + NAT_INFO_SIZE];
+    memset(frame, 0, sizeof(frame));
+    char* p = frame;
+    p = encode16(p, sizeof(frame) - 2);
+    p = encode16(p, Enroll);
+    p = encode32(p, 1);
+    p = encode(p, BLACKHOLE, 16);
+    p = encode16(p, 40000);
+    p = encode16(p, SymmetricNAT);
+    p = encode16(p, PatternRandom);
+    if (send(*sock, frame, sizeof(frame), 0) != sizeof(frame)) {
+        return 0;
+    }
+
+    char reply[RPC_HEADER_LENGTH + 4];
+    if (recv(*sock, reply, sizeof(reply), MSG_WAITALL) != sizeof(reply) || decode16(reply + 2) != Enrolled) {
+        return 0;
+    }
+
+    return decode32(reply + RPC_HEADER_LENGTH);
+}
+
+// ask the server to push a notification to id, the acks are never read
+static int fake_notify(int sock, uint32_t id) {
+    char frame[RPC_HEADER_LENGTH + 10];
+    memset(frame, 0, sizeof(frame));
+    char* p = frame;
+    p = encode16(p, sizeof(frame) - 2);
+    p = encode16(p, NotifyPeer);
+    p = encode32(p, 1);
+    p = encode32(p, id);
+    p = encode16(p, PatternRandom);
+
+    return send(sock, frame, sizeof(frame), 0) == sizeof(frame) ? 0 : -1;
+}
+
+// what a cached detection behind a symmetric NAT with random allocation would have left
+static int seed_profile(const char* state_dir, uint16_t port) {
+    struct nat_cache_key key;
+    if (nat_cache_key_init(&key, "127.0.0.1", port) < 0) {
+        return -1;
+    }
+
+    struct nat_profile profile;
+    memset(&profile, 0, sizeof(profile));
+    profile.type = SymmetricNAT;
+    strcpy(profile.ext_ip, "127.0.0.1");
+    profile.ext_port = port;
+    profile.port_pattern = PatternRandom;
+    // never asked, the server's reply validates the profile
+    strcpy(profile.stun_ip, "127.0.0.1");
+    profile.stun_port = DEFAULT_STUN_SERVER_PORT;
+    strcpy(profile.changed_ip, "127.0.0.1");
+    profile.changed_port = DEFAULT_STUN_SERVER_PORT;
+    char path[256];
+    snprintf(path, sizeof(path), "%s/profiles", state_dir);
+
+    return nat_cache_store(path, &key, &profile, time(NULL), DEFAULT_PROFILE_TTL);
+}
+
+struct driver {
+    int epfd;
+    nt_context* nts[MAX_CONTEXTS];
+    int64_t deadlines[MAX_CONTEXTS];
+    int num;
+    // microseconds of every nt_process() call
+    uint32_t* calls;
+    int num_calls;
+    int max_calls;
+    int wakeups;
+    int failed;
+};
+
+static void on_failed(nt_context* nt, uint32_t peer_id, const char* why, void* ctx) {
+    struct driver* d = ctx;
+    d->failed++;
+}
+
+static int open_contexts(struct driver* d, int num, const char* server_ip, uint16_t port,
+        const char* state_dir, int max_socks) {
+    int i;
+    d->num = 0;
+    for (i = 0; i < num; ++i) {
+        struct nt_config cfg;
+        nt_default_config(&cfg);
+        cfg.punch_server = server_ip;
+        cfg.server_port = port;
+        cfg.local_ip = "127.0.0.1";
+        cfg.local_port = FIRST_PORT + i;
+        cfg.state_dir = state_dir;
+        cfg.udp = 1;
+        cfg.ttl = 2;
+        cfg.max_socks = max_socks;
+        cfg.failed = on_failed;
+        cfg.ctx = d;
+        if ((d->nts[i] = nt_open(&cfg)) == NULL) {
+            return -1;
+        }
+        d->num++;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        if (epoll_ctl(d->epfd, EPOLL_CTL_ADD, nt_fd(d->nts[i]), &ev) < 0) {
+            return -1;
+        }
+        d->deadlines[i] = nt_now_ms();
+    }
+
+    return 0;
+}
+
+static void close_contexts(struct driver* d) {
+    int i;
+    for (i = 0; i < d->num; ++i) {
+        epoll_ctl(d->epfd, EPOLL_CTL_DEL, nt_fd(d->nts[i]), NULL);
+        nt_close(d->nts[i]);
+    }
+    d->num = 0;
+}
+
+static int process(struct driver* d, int i) {
+    uint64_t start = bench_now_us();
+    d->deadlines[i] = nt_process(d->nts[i], nt_now_ms());
+    if (d->num_calls < d->max_calls) {
+        d->calls[d->num_calls++] = bench_now_us() - start;
+    }
+
+    return d->deadlines[i] < 0 ? -1 : 0;
+}
+
+static int punched(struct driver* d) {
+    int i, n = 0;
+    for (i = 0; i < d->num; ++i) {
+        struct nt_stats stats;
+        nt_stats(d->nts[i], &stats);
+        n += stats.punched;
+    }
+
+    return n;
+}
+
+// the program's own loop, until target sessions got their probes out, returns the microseconds it took
+static uint64_t run_until_punched(struct driver* d, int target, uint64_t start) {
+    while (punched(d) < target) {
+        if (bench_now_us() - start > 60 * 1000000ULL) {
+            return 0;
+        }
+
+        int64_t first = INT64_MAX;
+        int i;
+        for (i = 0; i < d->num; ++i) {
+            if (d->deadlines[i] < first) {
+                first = d->deadlines[i];
+            }
+        }
+        int64_t wait = first - (int64_t)nt_now_ms();
+        struct epoll_event events[MAX_CONTEXTS];
+        int n = epoll_wait(d->epfd, events, MAX_CONTEXTS, wait < 0 ? 0 : wait > 100 ? 100 : wait);
+        d->wakeups++;
+
+        // readable contexts, then the ones whose timers are due
+        uint64_t now = nt_now_ms();
+        for (i = 0; i < n; ++i) {
+            if (process(d, events[i].data.u32) < 0) {
+                return 0;
+            }
+        }
+        for (i = 0; i < d->num; ++i) {
+            if (d->deadlines[i] <= (int64_t)now && process(d, i) < 0) {
+                return 0;
+            }
+        }
+    }
+
+    return bench_now_us() - start;
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char* name, int n, uint64_t us, struct driver* d) {
+    qsort(d->calls, d->num_calls, sizeof(uint32_t), compare_u32);
+    uint32_t p50 = d->num_calls ? d->calls[d->num_calls / 2] : 0;
+    uint32_t p99 = d->num_calls ? d->calls[d->num_calls * 99 / 100] : 0;
+    uint32_t max = d->num_calls ? d->calls[d->num_calls - 1] : 0;
+    printf("%-9s %8.0f sessions/s, %6d wakeups, %6d nt_process() calls, p50 %u us p99 %u us max %u us\n",
+        name, n * 1e6 / us, d->wakeups, d->num_calls, p50, p99, max);
+    d->num_calls = 0;
+    d->wakeups = 0;
+}
+
+int main(int argc, char** argv) {
+    const char* server_ip = "127.0.0.1";
+    uint16_t port = 9988;
+    int n = 1000;
+    int num_contexts = 4;
+    int max_socks = 16;
+
+    static char usage[] = "usage: [-s PUNCH_SERVER] [-p PORT] [-n SESSIONS] [-C CONTEXTS] [-k SOCKS_PER_SESSION]\n";
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:n:C:k:")) != -1) {
+        switch (opt) {
+            case 's': server_ip = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': n = atoi(optarg); break;
+            case 'C': num_contexts = atoi(optarg); break;
+            case 'k': max_socks = atoi(optarg); break;
+            default:
+                printf("%s", usage);
+                return -1;
+        }
+    }
+    if (num_contexts < 1 || num_contexts > MAX_CONTEXTS || n < 1) {
+        printf("out of range\n");
+        return -1;
+    }
+    bench_raise_nofile();
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(server_ip);
+    server.sin_port = htons(port);
+
+    int* socks = malloc(n * sizeof(int));
+    uint32_t* ids = malloc(n * sizeof(uint32_t));
+    int i;
+    for (i = 0; i < n; ++i) {
+        if ((ids[i] = fake_enroll(server, &socks[i])) == 0) {
+            printf("failed to enroll simulated peer %d at %s:%d, is the punch server running?\n", i, server_ip, port);
+            return -1;
+        }
+    }
+
+    char state_dir[] = "/tmp/bench_embed.XXXXXX";
+    if (mkdtemp(state_dir) == NULL) {
+        perror("mkdtemp");
+        return -1;
+    }
+    for (i = 0; i < num_contexts; ++i) {
+        if (seed_profile(state_dir, FIRST_PORT + i) < 0) {
+            printf("failed to seed the profile cache, no default route?\n");
+            return -1;
+        }
+    }
+
+    struct driver d;
+    memset(&d, 0, sizeof(d));
+    d.epfd = epoll_create1(EPOLL_CLOEXEC);
+    d.max_calls = 1 << 20;
+    d.calls = malloc(d.max_calls * sizeof(uint32_t));
+
+    // the library reports every step, only the results are of interest here
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+
+    uint64_t start = bench_now_us();
+    int opened = open_contexts(&d, num_contexts, server_ip, port, state_dir, max_socks);
+    uint64_t open_us = bench_now_us() - start;
+    uint64_t outgoing_us = 0, incoming_us = 0;
+    int outgoing_failed = 0;
+    if (opened == 0) {
+        start = bench_now_us();
+        for (i = 0; i < n; ++i) {
+            nt_connect(d.nts[i % num_contexts], ids[i]);
+        }
+        outgoing_us = run_until_punched(&d, n, start);
+        outgoing_failed = d.failed;
+    }
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    if (opened < 0) {
+        printf("failed to open context %d: %s\n", d.num, strerror(errno));
+        return -1;
+    }
+    printf("%d contexts, %d sessions, %d probe sockets each, one epoll loop\n", num_contexts, n, max_socks);
+    printf("open      %8.1f ms a context, cached profile over the UDP rendezvous\n", open_us / 1000.0 / num_contexts);
+    if (outgoing_us) {
+        report("outgoing", n, outgoing_us, &d);
+    }
+    fflush(stdout);
+    dup2(devnull, STDOUT_FILENO);
+
+    // fresh contexts, the same peers turn around and notify them
+    close_contexts(&d);
+    d.failed = 0;
+    d.num_calls = 0;
+    d.wakeups = 0;
+    if (open_contexts(&d, num_contexts, server_ip, port, state_dir, max_socks) == 0) {
+        start = bench_now_us();
+        for (i = 0; i < n; ++i) {
+            fake_notify(socks[i], nt_id(d.nts[i % num_contexts]));
+        }
+        incoming_us = run_until_punched(&d, n, start);
+    }
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    if (incoming_us) {
+        report("incoming", n, incoming_us, &d);
+    }
+    if (!outgoing_us || !incoming_us) {
+        printf("sessions didn't get their probes out in time, %d outgoing and %d incoming failed\n",
+            outgoing_failed, d.failed);
+        return -1;
+    }
+    close_contexts(&d);
+
+    for (i = 0; i < n; ++i) {
+        close(socks[i]);
+    }
+    char path[sizeof(state_dir) + 16];
+    snprintf(path, sizeof(path), "%s/profiles", state_dir);
+    unlink(path);
+    rmdir(state_dir);
+
+    return 0;
+}
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "keepalive.h"
+
+/*
+ * wakeups and cpu time it takes to keep N NAT bindings alive, with a timer of
+ * its own per binding (a binary heap of deadlines, a wakeup whenever the
+ * earliest is due) against the keepalive wheel, which refreshes everything
+ * due within a tick at once, with a sendmsg() per binding or through io_uring.
+ * the bindings start at random times within an interval, as sessions would.
+ * bindings share sockets once there are more of them than file descriptors,
+ * every keepalive goes to one loopback sink that nobody reads.
+ */
+
+int verbose = 0;
+
+#define RESERVED_FDS 64
+
+struct heap_entry {
+    uint64_t due;
+    int binding;
+};
+
+struct bench {
+    int n;
+    int interval_ms;
+    int duration_ms;
+    int* socks;
+    int num_socks;
+    struct sockaddr_in sink;
+    uint64_t* phase;    // first refresh of every binding
+};
+
+static uint64_t now_ms(void) {
+    return bench_now_us() / 1000;
+}
+
+// every run starts with the bindings spread over one interval from now
+static void spread(struct bench* b) {
+    uint64_t now = now_ms();
+    int i;
+    srand(1);
+    for (i = 0; i < b->n; ++i) {
+        b->phase[i] = now + 1 + rand() % b->interval_ms;
+    }
+}
+
+static void heap_down(struct heap_entry* h, int n, int i) {
+    for (; ;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && h[l].due < h[m].due) {
+            m = l;
+        }
+        if (r < n && h[r].due < h[m].due) {
+            m = r;
+        }
+        if (m == i) {
+            return;
+        }
+        struct heap_entry t = h[i];
+        h[i] = h[m];
+        h[m] = t;
+        i = m;
+    }
+}
+
+static void report(const char* name, struct bench* b, uint64_t wakeups, uint64_t sent, uint64_t syscalls,
+        uint64_t cpu_us, uint64_t us) {
+    printf("%-18s %10.1f wakeups/s %10.0f keepalives/s %10.0f syscalls/s %6.2f%% cpu\n", name,
+        wakeups * 1e6 / us, sent * 1e6 / us, syscalls * 1e6 / us, 100.0 * cpu_us / us);
+}
+
+// a deadline per binding, sleep until the earliest one and refresh whatever is due
+static void run_timers(struct bench* b) {
+    struct heap_entry* h = malloc(b->n * sizeof(struct heap_entry));
+    int i;
+    spread(b);
+    for (i = 0; i < b->n; ++i) {
+        h[i].due = b->phase[i];
+        h[i].binding = i;
+    }
+    for (i = b->n / 2 - 1; i >= 0; --i) {
+        heap_down(h, b->n, i);
+    }
+
+    uint64_t wakeups = 0, sent = 0;
+    uint64_t cpu = bench_cpu_us();
+    uint64_t start = bench_now_us();
+    uint64_t end = now_ms() + b->duration_ms;
+    for (; ;) {
+        uint64_t now = now_ms();
+        if (now >= end) {
+            break;
+        }
+        if (h[0].due > now) {
+            poll(NULL, 0, h[0].due - now);
+            continue;
+        }
+
+        wakeups++;
+        while (h[0].due <= now) {
+            int k = h[0].binding;
+            sendto(b->socks[k % b->num_socks], "c", 1, MSG_DONTWAIT, (struct sockaddr*)&b->sink, sizeof(b->sink));
+            sent++;
+            h[0].due = now + b->interval_ms;
+            heap_down(h, b->n, 0);
+        }
+    }
+
+    report("per-binding timers", b, wakeups, sent, sent, bench_cpu_us() - cpu, bench_now_us() - start);
+    free(h);
+}
+
+static void run_wheel(struct bench* b, int use_uring) {
+    struct keepalive_set ks;
+    struct keepalive* keeps = malloc(b->n * sizeof(struct keepalive));
+    spread(b);
+    uint64_t now = now_ms();
+    keepalive_set_init(&ks, use_uring, now);
+    if (use_uring && !ks.uring) {
+        printf("%-18s no io_uring\n", "wheel, io_uring");
+        free(keeps);
+        return;
+    }
+
+    int i;
+    for (i = 0; i < b->n; ++i) {
+        keepalive_init(&keeps[i], b->socks[i % b->num_socks], (struct sockaddr*)&b->sink, b->interval_ms);
+        // scheduled at now + interval, so this lands on the binding's phase
+        keepalive_add(&ks, &keeps[i], b->phase[i] - b->interval_ms);
+    }
+
+    uint64_t cpu = bench_cpu_us();
+    uint64_t start = bench_now_us();
+    uint64_t end = now_ms() + b->duration_ms;
+    for (; ;) {
+        now = now_ms();
+        if (now >= end) {
+            break;
+        }
+        int wait = keepalive_timeout(&ks, now);
+        if (wait > 0) {
+            poll(NULL, 0, wait < end - now ? wait : end - now);
+            continue;
+        }
+        keepalive_run(&ks, now);
+    }
+
+    report(use_uring ? "wheel, io_uring" : "wheel, sendmsg", b, ks.stats.wakeups, ks.stats.sent, ks.stats.syscalls,
+        bench_cpu_us() - cpu, bench_now_us() - start);
+    keepalive_set_destroy(&ks);
+    free(keeps);
+}
+
+int main(int argc, char** argv) {
+    int counts[2] = {10000, 100000};
+    int num_counts = 2;
+    struct bench b;
+    memset(&b, 0, sizeof(b));
+    b.interval_ms = 5000;
+    b.duration_ms = 10000;
+
+    static char usage[] = "usage: [-n BINDINGS] [-i INTERVAL_MS] [-d DURATION_MS]\n";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:i:d:v")) != -1) {
+        switch (opt) {
+            case 'n': counts[0] = atoi(optarg); num_counts = 1; break;
+            case 'i': b.interval_ms = atoi(optarg); break;
+            case 'd': b.duration_ms = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default:
+                printf("%s", usage);
+                return -1;
+        }
+    }
+    bench_raise_nofile();
+
+    // nobody reads it, a full receive buffer drops silently
+    int sink = socket(AF_INET, SOCK_DGRAM, 0);
+    b.sink.sin_family = AF_INET;
+    b.sink.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(b.sink);
+    if (bind(sink, (struct sockaddr*)&b.sink, len) < 0 || getsockname(sink, (struct sockaddr*)&b.sink, &len) < 0) {
+        printf("failed to open the sink\n");
+        return -1;
+    }
+
+    int c;
+    for (c = 0; c < num_counts; ++c) {
+        b.n = counts[c];
+        struct rlimit rl;
+        getrlimit(RLIMIT_NOFILE, &rl);
+        b.num_socks = b.n;
+        if (rl.rlim_cur > RESERVED_FDS && b.num_socks > (int)(rl.rlim_cur - RESERVED_FDS)) {
+            b.num_socks = rl.rlim_cur - RESERVED_FDS;
+        }
+        b.socks = malloc(b.num_socks * sizeof(int));
+        b.phase = malloc(b.n * sizeof(uint64_t));
+
+        int i;
+        for (i = 0; i < b.num_socks; ++i) {
+            b.socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        }
+
+        printf("%d bindings on %d sockets, one keepalive every %d ms each, %d ms\n", b.n, b.num_socks,
+            b.interval_ms, b.duration_ms);
+        run_timers(&b);
+        run_wheel(&b, 0);
+        run_wheel(&b, 1);
+
+        for (i = 0; i < b.num_socks; ++i) {
+            close(b.socks[i]);
+        }
+        free(b.socks);
+        free(b.phase);
+    }
+
+    close(sink);
+    return 0;
+}
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "bench.h"
+#include "port_perm.h"
+
+/*
+ * the cost of drawing the probe ports of an attempt, the way random_ports()
+ * used to (a 64k entry table, Fisher-Yates over the part it uses) against the
+ * keyed permutation, then checks of the permutation itself: every key gives
+ * every port exactly once, excluded ports never come out, and over many keys
+ * the port at a position is uniform, chi-square over bins of the range, and
+ * so is the order of two neighbouring positions. exits 1 if a check fails.
+ */
+
+#define MIN_PORT 1025
+#define MAX_PORT 65535
+#define RANGE (MAX_PORT - MIN_PORT + 1)
+#define BINS 64
+
+static int table[RANGE];
+
+// the old random_ports(), kept here as the baseline
+static void shuffle_ports(uint16_t* out, int n, uint16_t exclude) {
+    int i, j, r, temp;
+    if (table[0] == 0) {
+        for (i = 0; i < RANGE; ++i) {
+            table[i] = MIN_PORT + i;
+        }
+    }
+    for (i = 0; i < n + 1 && i < RANGE - 1; i++) {
+        r = i + rand() % (RANGE - i);
+        temp = table[i];
+        table[i] = table[r];
+        table[r] = temp;
+    }
+    for (i = 0, j = 0; i < n && j < RANGE; ++j) {
+        if (table[j] != exclude) {
+            out[i++] = table[j];
+        }
+    }
+}
+
+static void bench_draws(int n, int rounds) {
+    uint16_t* out = malloc(n * sizeof(uint16_t));
+    uint16_t exclude = 40000;
+    int r;
+
+    uint64_t start = bench_now_us();
+    for (r = 0; r < rounds; ++r) {
+        shuffle_ports(out, n, exclude);
+    }
+    uint64_t shuffled = bench_now_us() - start;
+
+    start = bench_now_us();
+    for (r = 0; r < rounds; ++r) {
+        struct port_perm perm;
+        port_perm_init(&perm, MIN_PORT, MAX_PORT);
+        port_perm_take(&perm, out, n, &exclude, 1);
+    }
+    uint64_t permuted = bench_now_us() - start;
+
+    printf("%d ports an attempt, %d attempts\n", n, rounds);
+    printf("  shuffled table    %8.2f us/attempt, %zu bytes of state\n", (double)shuffled / rounds, sizeof(table));
+    printf("  keyed permutation %8.2f us/attempt, %zu bytes of state\n", (double)permuted / rounds, sizeof(struct port_perm));
+    free(out);
+}
+
+// every port once, whatever the key
+static int check_bijection(int keys) {
+    static uint8_t seen[65536];
+    int k, i;
+    for (k = 0; k < keys; ++k) {
+        struct port_perm perm;
+        port_perm_init_key(&perm, MIN_PORT, MAX_PORT, k * 0x9E3779B97F4A7C15ULL);
+        memset(seen, 0, sizeof(seen));
+        for (i = 0; i < RANGE; ++i) {
+            uint16_t port = port_perm_at(&perm, i);
+            if (port < MIN_PORT || seen[port]++) {
+                printf("  bijection: key %d repeats or leaves the range at %d, port %d FAILED\n", k, i, port);
+                return -1;
+            }
+        }
+    }
+    printf("  bijection: %d keys, every port exactly once\n", keys);
+
+    return 0;
+}
+
+static int check_exclusion(int keys) {
+    uint16_t exclude[3] = {MIN_PORT, 40000, MAX_PORT};
+    uint16_t* out = malloc(RANGE * sizeof(uint16_t));
+    int k, i, ret = 0;
+    for (k = 0; k < keys && ret == 0; ++k) {
+        struct port_perm perm;
+        port_perm_init(&perm, MIN_PORT, MAX_PORT);
+        int n = port_perm_take(&perm, out, RANGE, exclude, 3);
+        if (n != RANGE - 3) {
+            ret = -1;
+        }
+        for (i = 0; i < n; ++i) {
+            if (out[i] == exclude[0] || out[i] == exclude[1] || out[i] == exclude[2]) {
+                ret = -1;
+            }
+        }
+    }
+    free(out);
+    printf("  exclusion: %d full orders without 3 excluded ports %s\n", keys, ret ? "FAILED" : "ok");
+
+    return ret;
+}
+
+// upper tail critical value of chi-square, Wilson-Hilferty, z for p = 0.001
+static double chi2_critical(int df) {
+    double z = 3.09, a = 2.0 / (9 * df);
+
+    return df * pow(1 - a + z * sqrt(a), 3);
+}
+
+static int bin_of(uint16_t port) {
+    return (long)(port - MIN_PORT) * BINS / RANGE;
+}
+
+// the port at `pos`, over fresh keys, falls into every bin as often as the bin is wide
+static int check_uniformity(int trials, uint32_t pos) {
+    double expected[BINS];
+    long counts[BINS];
+    long above = 0;
+    int i, t;
+    memset(expected, 0, sizeof(expected));
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < RANGE; ++i) {
+        expected[bin_of(MIN_PORT + i)] += (double)trials / RANGE;
+    }
+
+    for (t = 0; t < trials; ++t) {
+        struct port_perm perm;
+        port_perm_init(&perm, MIN_PORT, MAX_PORT);
+        uint16_t a = port_perm_at(&perm, pos), b = port_perm_at(&perm, pos + 1);
+        counts[bin_of(a)]++;
+        above += b > a;
+    }
+
+    double chi2 = 0;
+    for (i = 0; i < BINS; ++i) {
+        chi2 += (counts[i] - expected[i]) * (counts[i] - expected[i]) / expected[i];
+    }
+    double critical = chi2_critical(BINS - 1);
+    // the next port is above half the time, within 3.3 sigma
+    double share = (double)above / trials, sigma = 0.5 / sqrt(trials);
+    int ok = chi2 < critical && fabs(share - 0.5) < 3.3 * sigma;
+    printf("  uniformity at position %u: chi2 %.1f (< %.1f at p 0.001), next port above %.4f, %s\n",
+            pos, chi2, critical, share, ok ? "ok" : "FAILED");
+
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char** argv) {
+    int n = 700, rounds = 10000, trials = 200000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:t:")) != -1) {
+        switch (opt) {
+            case 'n': n = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            case 't': trials = atoi(optarg); break;
+            default:
+                printf("usage: [-n PORTS_PER_ATTEMPT] [-r ROUNDS] [-t UNIFORMITY_TRIALS]\n");
+                return -1;
+        }
+    }
+    if (n < 1 || n > RANGE - 1 || rounds < 1 || trials < 1) {
+        printf("out of range\n");
+        return -1;
+    }
+    srand(time(NULL));
+
+    bench_draws(n, rounds);
+
+    printf("checks\n");
+    int failed = 0;
+    failed |= check_bijection(64);
+    failed |= check_exclusion(16);
+    failed |= check_uniformity(trials, 0);
+    failed |= check_uniformity(trials, n - 2);
+    failed |= check_uniformity(trials, RANGE - 2);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "predict.h"
+
+/*
+ * simulates two symmetric NATs and compares the random spray with the
+ * predicted window: success rate and probes sent per successful connection.
+ * each NAT allocates a new external port per (socket, destination) with a
+ * fixed stride or at random, and other hosts behind it keep allocating
+ * ports in the background.
+ */
+
+#define NUM_OF_RANDOM_PROBES 700
+#define PREDICT_WINDOW (2 * (DEFAULT_PREDICT_SPREAD + 1))
+#define MEASURE_ALLOCATIONS 8
+#define MAX_HOLES 1024
+
+struct sim_nat {
+    int delta;          // 0 for random allocation
+    uint16_t next;
+    double background;  // allocations by other hosts per ms
+    // (external port, remote port) pairs our probes opened
+    uint16_t holes[MAX_HOLES][2];
+    int num_holes;
+};
+
+static uint16_t allocate(struct sim_nat* nat) {
+    if (nat->delta == 0) {
+        return 1024 + rand() % (65536 - 1024);
+    }
+
+    uint16_t port = nat->next;
+    nat->next = 1024 + (nat->next - 1024 + nat->delta) % (65536 - 1024);
+
+    return port;
+}
+
+// other hosts behind the NAT
+static void elapse(struct sim_nat* nat, int ms) {
+    double n = nat->background * ms;
+    int i, count = (int)n + ((rand() % 1000) < (n - (int)n) * 1000);
+    for (i = 0; i < count; ++i) {
+        allocate(nat);
+    }
+}
+
+static void measure(struct sim_nat* nat, struct port_prediction* pred) {
+    uint16_t ports[MEASURE_ALLOCATIONS];
+    int i;
+    for (i = 0; i < MEASURE_ALLOCATIONS; ++i) {
+        // the second measuring socket binds one rtt after the first one
+        if (i == MEASURE_ALLOCATIONS / 2) {
+            elapse(nat, 20);
+        }
+        ports[i] = allocate(nat);
+    }
+    classify_ports(ports, MEASURE_ALLOCATIONS, pred);
+}
+
+static void open_holes(struct sim_nat* nat, const uint16_t* targets, int n) {
+    int i;
+    nat->num_holes = 0;
+    for (i = 0; i < n && i < MAX_HOLES; ++i) {
+        nat->holes[nat->num_holes][0] = allocate(nat);
+        nat->holes[nat->num_holes][1] = targets[i];
+        nat->num_holes++;
+    }
+}
+
+// full ttl probes from behind `from` towards `to`, 1 if one of them gets through a hole
+static int probe(struct sim_nat* from, struct sim_nat* to, const uint16_t* targets, int n) {
+    int i, j, hit = 0;
+    for (i = 0; i < n; ++i) {
+        uint16_t src = allocate(from);
+        for (j = 0; j < to->num_holes && !hit; ++j) {
+            hit = to->holes[j][0] == targets[i] && to->holes[j][1] == src;
+        }
+    }
+
+    return hit;
+}
+
+static void random_targets(uint16_t* out, int n) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        out[i] = 1024 + rand() % (65536 - 1024);
+    }
+}
+
+// same steps as connect_to_symmetric_nat() and server_notify_handler()
+static int attempt(struct sim_nat* a, struct sim_nat* b, int relay_ms, int force_random, int* probes) {
+    struct port_prediction pa, pb;
+    uint16_t targets[MAX_HOLES];
+
+    // published at enrollment
+    measure(a, &pa);
+    measure(b, &pb);
+    elapse(a, 1000);
+    elapse(b, 1000);
+
+    if (!force_random && is_predictable(&pa) && is_predictable(&pb)) {
+        // a notifies b with where its NAT is now
+        measure(a, &pa);
+        elapse(a, relay_ms);
+        elapse(b, relay_ms);
+
+        // b opens limited ttl holes sweeping a's next ports, then tells a where it is
+        measure(b, &pb);
+        predict_sweep(&pa, DEFAULT_PREDICT_SPREAD, targets, PREDICT_WINDOW);
+        open_holes(b, targets, PREDICT_WINDOW);
+        elapse(a, relay_ms);
+        elapse(b, relay_ms);
+
+        // a probes b's next ports
+        predict_window(&pb, targets, PREDICT_WINDOW);
+        *probes += 2 * PREDICT_WINDOW;
+
+        return probe(a, b, targets, PREDICT_WINDOW);
+    }
+
+    // a opens limited ttl holes at random, b sprays at random
+    random_targets(targets, NUM_OF_RANDOM_PROBES);
+    open_holes(a, targets, NUM_OF_RANDOM_PROBES);
+    elapse(a, relay_ms);
+    elapse(b, relay_ms);
+    random_targets(targets, NUM_OF_RANDOM_PROBES);
+    *probes += 2 * NUM_OF_RANDOM_PROBES;
+
+    return probe(b, a, targets, NUM_OF_RANDOM_PROBES);
+}
+
+static void run(const char* name, int delta, double background, int relay_ms, int force_random, int trials) {
+    struct sim_nat a, b;
+    int i, successes = 0, probes = 0;
+
+    for (i = 0; i < trials; ++i) {
+        memset(&a, 0, sizeof(a));
+        memset(&b, 0, sizeof(b));
+        a.delta = b.delta = delta;
+        a.next = 1024 + rand() % 60000;
+        b.next = 1024 + rand() % 60000;
+        a.background = b.background = background;
+
+        successes += attempt(&a, &b, relay_ms, force_random, &probes);
+    }
+
+    printf("%-28s delta=%d background=%.2f/ms relay=%dms: success %5.1f%%, probes/attempt %6d, ",
+            name, delta, background, relay_ms, 100.0 * successes / trials, probes / trials);
+    if (successes) {
+        printf("probes/success %.0f\n", (double)probes / successes);
+    } else {
+        printf("probes/success > %d\n", probes);
+    }
+}
+
+int main(int argc, char** argv) {
+    int trials = 1000;
+    if (argc > 1) {
+        trials = atoi(argv[1]);
+    }
+    srand(getpid());
+
+    run("random allocation", 0, 0, 50, 0, trials);
+    run("sequential, random spray", 1, 0.1, 50, 1, trials);
+    run("sequential, idle", 1, 0, 50, 0, trials);
+    run("sequential, busy", 1, 0.1, 50, 0, trials);
+    run("delta 2, busy", 2, 0.1, 50, 0, trials);
+    run("delta 4, very busy", 4, 0.3, 50, 0, trials);
+    run("sequential, slow relay", 1, 0.1, 200, 0, trials);
+
+    return 0;
+}
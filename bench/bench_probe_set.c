@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "probe_set.h"
+#include "bench.h"
+
+/*
+ * replays the responder loop (register one more probe socket, check for
+ * readiness, repeat) and the final wait for the peer's packet, with the
+ * select() based wait_for_peer() and with the epoll probe set.
+ */
+
+// the former wait_for_peer(): fd_set rebuilt over every socket on each call
+static int select_wait(int* socks, int sock_num, struct timeval* timeout) {
+    fd_set fds;
+    int max_fd = 0;
+    FD_ZERO(&fds);
+
+    int i;
+    for (i = 0; i < sock_num; ++i) {
+        FD_SET(socks[i], &fds);
+        if (socks[i] > max_fd) {
+            max_fd = socks[i];
+        }
+    }
+    if (select(max_fd + 1, &fds, NULL, NULL, timeout) > 0) {
+        for (i = 0; i < sock_num; ++i) {
+            if (FD_ISSET(socks[i], &fds)) {
+                return socks[i];
+            }
+        }
+    }
+
+    return -1;
+}
+
+static int open_socks(int* socks, int n) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int i;
+    for (i = 0; i < n; ++i) {
+        socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (socks[i] < 0 || bind(socks[i], (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+static void poke(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr*)&addr, &len);
+
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    sendto(s, "x", 1, 0, (struct sockaddr*)&addr, len);
+    close(s);
+}
+
+static void drain(int fd) {
+    char buf[16];
+    recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+}
+
+static void run(int n) {
+    if (n <= 0) {
+        printf("%6d sockets: nothing to wait on\n", n);
+        return;
+    }
+    int* socks = malloc(n * sizeof(int));
+    int opened = open_socks(socks, n);
+    if (opened < n) {
+        printf("%6d sockets: only %d could be opened, raise RLIMIT_NOFILE\n", n, opened);
+        goto cleanup;
+    }
+
+    int i;
+    uint64_t loop_us, wake_us, start;
+    int winner = socks[n - 1];
+
+    if (socks[n - 1] >= FD_SETSIZE) {
+        printf("%6d sockets: select   unsupported, fd %d >= FD_SETSIZE\n", n, socks[n - 1]);
+    } else {
+        start = bench_now_us();
+        for (i = 1; i <= n; ++i) {
+            struct timeval tv = {0, 0};
+            select_wait(socks, i, &tv);
+        }
+        loop_us = bench_now_us() - start;
+
+        poke(winner);
+        start = bench_now_us();
+        struct timeval tv = {1, 0};
+        int fd = select_wait(socks, n, &tv);
+        wake_us = bench_now_us() - start;
+        drain(winner);
+        printf("%6d sockets: select   probe loop %10.3f ms, final wait %8.3f ms%s\n",
+                n, loop_us / 1000.0, wake_us / 1000.0, fd == winner ? "" : " (missed)");
+    }
+
+    struct probe_set set;
+    probe_set_init(&set);
+    start = bench_now_us();
+    for (i = 0; i < n; ++i) {
+        probe_set_add(&set, socks[i]);
+        probe_set_wait(&set, 0);
+    }
+    loop_us = bench_now_us() - start;
+
+    poke(winner);
+    start = bench_now_us();
+    int fd = probe_set_wait(&set, 1000);
+    wake_us = bench_now_us() - start;
+    drain(winner);
+    probe_set_destroy(&set);
+    printf("%6d sockets: epoll    probe loop %10.3f ms, final wait %8.3f ms%s\n",
+            n, loop_us / 1000.0, wake_us / 1000.0, fd == winner ? "" : " (missed)");
+
+cleanup:
+    for (i = 0; i < opened; ++i) {
+        close(socks[i]);
+    }
+    free(socks);
+}
+
+int main(int argc, char** argv) {
+    bench_raise_nofile();
+
+    if (argc > 1) {
+        int i;
+        for (i = 1; i < argc; ++i) {
+            run(atoi(argv[i]));
+        }
+    } else {
+        run(700);
+        run(5000);
+        run(20000);
+    }
+
+    return 0;
+}
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "nat_type.h"
+#include "stun_servers.h"
+#include "resolver.h"
+
+/*
+ * startup latency of name resolution against an embedded stub nameserver
+ * that answers every A query with 127.0.0.1 after a fixed delay.
+ * compares resolving the hosts one after another, as gethostbyname() did,
+ * with starting every lookup at once, and measures a warm cache.
+ * with -S the whole NAT detection is timed too, against a stun_responder
+ * listening on 127.0.0.1 (cold cache, then warm cache).
+ */
+
+#define MAX_QUERIES 1024
+
+struct stub_query {
+    uint64_t due;
+    struct sockaddr_in from;
+    int len;
+    unsigned char buf[512];
+};
+
+static int stub_sock;
+static int stub_delay_ms = 50;
+static uint32_t stub_ttl = 60;
+static int stub_queries = 0;
+
+// answer with the question, one A record pointing back to the question's name
+static int build_answer(struct stub_query* q) {
+    unsigned char* p = q->buf;
+    if (q->len < 12 || q->len + 16 > sizeof(q->buf)) {
+        return -1;
+    }
+
+    p[2] |= 0x80;  // response
+    p[3] = 0x80;   // recursion available, NOERROR
+    p[7] = 1;      // one answer
+
+    unsigned char* a = p + q->len;
+    uint32_t ttl = htonl(stub_ttl);
+    *a++ = 0xC0;   // pointer to the question name
+    *a++ = 12;
+    *a++ = 0; *a++ = 1;   // A
+    *a++ = 0; *a++ = 1;   // IN
+    memcpy(a, &ttl, 4);
+    a += 4;
+    *a++ = 0; *a++ = 4;
+    *a++ = 127; *a++ = 0; *a++ = 0; *a++ = 1;
+
+    return a - p;
+}
+
+static void* stub_nameserver(void* arg) {
+    static struct stub_query queue[MAX_QUERIES];
+    int num_queued = 0;
+
+    for (; ;) {
+        uint64_t now = bench_now_us();
+        int i, timeout = -1;
+        for (i = 0; i < num_queued; ) {
+            if (queue[i].due <= now) {
+                int len = build_answer(&queue[i]);
+                if (len > 0) {
+                    sendto(stub_sock, queue[i].buf, len, 0, (struct sockaddr*)&queue[i].from, sizeof(queue[i].from));
+                }
+                queue[i] = queue[--num_queued];
+                continue;
+            }
+            int wait_ms = (queue[i].due - now + 999) / 1000;
+            if (timeout < 0 || wait_ms < timeout) {
+                timeout = wait_ms;
+            }
+            ++i;
+        }
+
+        struct pollfd fd = {stub_sock, POLLIN, 0};
+        if (poll(&fd, 1, timeout) <= 0 || num_queued == MAX_QUERIES) {
+            continue;
+        }
+
+        struct stub_query* q = &queue[num_queued];
+        socklen_t addr_len = sizeof(q->from);
+        q->len = recvfrom(stub_sock, q->buf, sizeof(q->buf), 0, (struct sockaddr*)&q->from, &addr_len);
+        if (q->len > 0) {
+            q->due = bench_now_us() + stub_delay_ms * 1000;
+            __sync_fetch_and_add(&stub_queries, 1);
+            num_queued++;
+        }
+    }
+
+    return NULL;
+}
+
+static struct resolver resolver;
+
+static void host_name(char* buf, size_t len, int run, int i) {
+    snprintf(buf, len, "stun%d.run%d.bench.test", i, run);
+}
+
+static uint64_t resolve_serial(int run, int num_hosts) {
+    char host[64];
+    struct in_addr addr;
+    uint64_t start = bench_now_us();
+    int i;
+    for (i = 0; i < num_hosts; ++i) {
+        host_name(host, sizeof(host), run, i);
+        if (resolver_lookup(&resolver, host, &addr, 5000) < 0) {
+            fprintf(stderr, "failed to resolve %s\n", host);
+        }
+    }
+
+    return bench_now_us() - start;
+}
+
+static uint64_t resolve_parallel(int run, int num_hosts) {
+    char host[64];
+    struct in_addr addr;
+    uint64_t start = bench_now_us();
+    int i;
+    for (i = 0; i < num_hosts; ++i) {
+        host_name(host, sizeof(host), run, i);
+        resolver_start(&resolver, host);
+    }
+    for (i = 0; i < num_hosts; ++i) {
+        host_name(host, sizeof(host), run, i);
+        if (resolver_lookup(&resolver, host, &addr, 5000) < 0) {
+            fprintf(stderr, "failed to resolve %s\n", host);
+        }
+    }
+
+    return bench_now_us() - start;
+}
+
+static uint64_t time_detection(int num_hosts) {
+    struct stun_server_list servers;
+    struct nat_profile profile;
+    char host[64];
+    servers.count = 0;
+    servers.resolver = &resolver;
+    int i;
+    for (i = 0; i < num_hosts; ++i) {
+        host_name(host, sizeof(host), 0, i);
+        stun_servers_add(&servers, host, DEFAULT_STUN_SERVER_PORT);
+    }
+
+    uint64_t start = bench_now_us();
+    nat_type type = detect_nat_type(&servers, "0.0.0.0", 0, &profile);
+    uint64_t elapsed = bench_now_us() - start;
+    if (type == Error) {
+        fprintf(stderr, "detection failed, is stun_responder running?\n");
+    }
+
+    return elapsed;
+}
+
+int main(int argc, char** argv) {
+    int num_hosts = 3;
+    int rounds = 5;
+    int detection = 0;
+    static char usage[] = "usage: [-n HOSTS] [-r ROUNDS] [-d DNS_DELAY_MS] [-S time NAT detection]\n";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:d:S")) != -1) {
+        switch (opt) {
+            case 'n':
+                num_hosts = atoi(optarg);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 'd':
+                stub_delay_ms = atoi(optarg);
+                break;
+            case 'S':
+                detection = 1;
+                break;
+            default:
+                printf("%s", usage);
+                return -1;
+        }
+    }
+    if (num_hosts > MAX_STUN_SERVERS) {
+        num_hosts = MAX_STUN_SERVERS;
+    }
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    stub_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (stub_sock < 0 || bind(stub_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("stub nameserver");
+        return -1;
+    }
+    getsockname(stub_sock, (struct sockaddr*)&addr, &addr_len);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, stub_nameserver, NULL);
+
+    char ns[32];
+    snprintf(ns, sizeof(ns), "127.0.0.1:%d", ntohs(addr.sin_port));
+    resolver_init(&resolver, ns);
+
+    printf("%d hosts, nameserver delay %d ms, %d rounds\n", num_hosts, stub_delay_ms, rounds);
+    uint64_t serial = 0, parallel = 0, warm = 0;
+    int run;
+    for (run = 0; run < rounds; ++run) {
+        serial += resolve_serial(2 * run, num_hosts);
+        parallel += resolve_parallel(2 * run + 1, num_hosts);
+        // every name of the parallel run is cached now
+        warm += resolve_parallel(2 * run + 1, num_hosts);
+    }
+    printf("%-22s %10.2f ms\n", "serial, cold", serial / 1000.0 / rounds);
+    printf("%-22s %10.2f ms\n", "parallel, cold", parallel / 1000.0 / rounds);
+    printf("%-22s %10.3f ms\n", "warm cache", warm / 1000.0 / rounds);
+    printf("%-22s %10d\n", "queries sent", stub_queries);
+
+    if (detection) {
+        resolver_flush();
+        printf("%-22s %10.2f ms\n", "detection, cold", time_detection(num_hosts) / 1000.0);
+        printf("%-22s %10.2f ms\n", "detection, warm", time_detection(num_hosts) / 1000.0);
+    }
+
+    return 0;
+}
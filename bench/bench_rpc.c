@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "rpc.h"
+
+/*
+ * GetPeerInfo throughput against a running punch server at pipeline depths
+ * 1, 16 and 256, i.e. how many lookups are in flight on the one connection.
+ * start the server first, e.g. go run punch_server.go [-delay 1ms]
+ */
+
+// message types of the punch server protocol, see nat_traversal.h
+#define Enroll 0x01
+#define GetPeerInfo 0x02
+#define Enrolled 0x12
+#define PeerInfo 0x13
+
+#define NAT_INFO_SIZE 26
+
+static int depths[] = {1, 16, 256};
+
+// lookups of our own id, depth of them outstanding at any time
+static int run(struct rpc* r, uint32_t self, int n, int depth) {
+    uint32_t ids[RPC_MAX_PENDING];
+    char body[4];
+    uint32_t v = htonl(self);
+    memcpy(body, &v, sizeof(v));
+
+    int sent = 0, done = 0;
+    uint64_t start = bench_now_us();
+    while (done < n) {
+        while (sent < n && sent - done < depth) {
+            ids[sent % depth] = rpc_send(r, GetPeerInfo, body, sizeof(body));
+            if (ids[sent % depth] == 0) {
+                perror("send");
+                return -1;
+            }
+            sent++;
+        }
+
+        struct rpc_frame reply;
+        if (rpc_wait(r, ids[done % depth], &reply, 5000) < 0 || reply.type != PeerInfo || reply.body[4] != 1) {
+            printf("lookup %d failed: %s\n", done, strerror(errno));
+            return -1;
+        }
+        done++;
+    }
+    uint64_t elapsed = bench_now_us() - start;
+
+    printf("depth %3d  %8d lookups  %10.0f lookups/s  %8.1f us per lookup\n",
+        depth, n, n * 1e6 / elapsed, (double)elapsed * depth / n);
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* server = "127.0.0.1";
+    uint16_t port = 9988;
+    int n = 100000;
+
+    static char usage[] = "usage: [-s PUNCH_SERVER] [-p PORT] [-n LOOKUPS]\n";
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:n:")) != -1) {
+        switch (opt) {
+            case 's': server = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': n = atoi(optarg); break;
+            default:
+                printf("%s", usage);
+                return -1;
+        }
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(server);
+    addr.sin_port = htons(port);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("failed to connect to punch server %s:%d, is it running?\n", server, port);
+        return -1;
+    }
+
+    struct rpc r;
+    if (rpc_init(&r, sock) < 0) {
+        return -1;
+    }
+
+    char info[NAT_INFO_SIZE] = "127.0.0.1";
+    struct rpc_frame reply;
+    if (rpc_call(&r, Enroll, info, sizeof(info), &reply, 5000) < 0 || reply.type != Enrolled) {
+        printf("failed to enroll\n");
+        return -1;
+    }
+    uint32_t self;
+    memcpy(&self, reply.body, sizeof(self));
+    self = ntohl(self);
+
+    int i;
+    for (i = 0; i < sizeof(depths) / sizeof(depths[0]); ++i) {
+        if (run(&r, self, n, depths[i]) < 0) {
+            return -1;
+        }
+    }
+    rpc_close(&r);
+
+    return 0;
+}
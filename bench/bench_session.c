@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "session.h"
+#include "log.h"
+
+/*
+ * sessions per second and memory per in-flight session of one session loop,
+ * against a running punch server (go run punch_server.go).
+ * the loop's client opens sessions to N simulated peers, then the same peers
+ * all notify it at once. the peers advertise a blackholed address, so every
+ * session ends up waiting for probes that never come, which is the state a
+ * session spends most of its life in.
+ */
+
+int verbose = 0;
+
+#define NAT_INFO_SIZE 26
+#define BLACKHOLE "192.0.2.1"
+
+static void discard_log(int level, const char* line, void* ctx) {
+}
+
+// enroll one simulated peer on a plain blocking connection, returns its id
+static uint32_t fake_enroll(struct sockaddr_in server, int* sock) {
+    *sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(*sock, (struct sockaddr*)&server, sizeof(server)) < 0) {
+        return 0;
+    }
+
+    char frame[RPC_HEADER_LENGTH + NAT_INFO_SIZE];
+    memset(frame, 0, sizeof(frame));
+    char* p = frame;
+    p = encode16(p, sizeof(frame) - 2);
+    p = encode16(p, Enroll);
+    p = encode32(p, 1);
+    p = encode(p, BLACKHOLE, 16);
+    p = encode16(p, 40000);
+    p = encode16(p, SymmetricNAT);
+    p = encode16(p, PatternRandom);
+    if (send(*sock, frame, sizeof(frame), 0) != sizeof(frame)) {
+        return 0;
+    }
+
+    char reply[RPC_HEADER_LENGTH + 4];
+    if (recv(*sock, reply, sizeof(reply), MSG_WAITALL) != sizeof(reply) || decode16(reply + 2) != Enrolled) {
+        return 0;
+    }
+
+    return decode32(reply + RPC_HEADER_LENGTH);
+}
+
+// ask the server to push a notification to id, the acks are never read
+static int fake_notify(int sock, uint32_t id) {
+    char frame[RPC_HEADER_LENGTH + 10];
+    memset(frame, 0, sizeof(frame));
+    char* p = frame;
+    p = encode16(p, sizeof(frame) - 2);
+    p = encode16(p, NotifyPeer);
+    p = encode32(p, 1);
+    p = encode32(p, id);
+    p = encode16(p, PatternRandom);
+
+    return send(sock, frame, sizeof(frame), 0) == sizeof(frame) ? 0 : -1;
+}
+
+static int count_fds(void) {
+    int fd, n = 0;
+    for (fd = 0; fd < 65536; ++fd) {
+        if (fcntl(fd, F_GETFD) >= 0) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+// run the loop until target sessions got their probes out, returns the microseconds it took
+static uint64_t run_until_punched(struct session_loop* l, int target, uint64_t start) {
+    while (l->punched < target) {
+        if (session_loop_run_once(l, 100) < 0 || bench_now_us() - start > 60 * 1000000ULL) {
+            return 0;
+        }
+    }
+
+    return bench_now_us() - start;
+}
+
+int main(int argc, char** argv) {
+    const char* server_ip = "127.0.0.1";
+    uint16_t port = 9988;
+    int n = 500;
+    struct session_budget budget;
+    session_default_budget(&budget);
+    budget.max_socks = 16;
+
+    static char usage[] = "usage: [-s PUNCH_SERVER] [-p PORT] [-n SESSIONS] [-k SOCKS_PER_SESSION]\n";
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:n:k:v")) != -1) {
+        switch (opt) {
+            case 's': server_ip = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': n = atoi(optarg); break;
+            case 'k': budget.max_socks = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default:
+                printf("%s", usage);
+                return -1;
+        }
+    }
+    if (n > DEFAULT_MAX_SESSIONS) {
+        n = DEFAULT_MAX_SESSIONS;
+    }
+    bench_raise_nofile();
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(server_ip);
+    server.sin_port = htons(port);
+
+    int* socks = malloc(n * sizeof(int));
+    uint32_t* ids = malloc(n * sizeof(uint32_t));
+    int i;
+    for (i = 0; i < n; ++i) {
+        if ((ids[i] = fake_enroll(server, &socks[i])) == 0) {
+            printf("failed to enroll simulated peer %d at %s:%d, is the punch server running?\n", i, server_ip, port);
+            return -1;
+        }
+    }
+
+    // a symmetric NAT with random allocation, so every session sprays its full budget
+    client c;
+    memset(&c, 0, sizeof(c));
+    c.type = SymmetricNAT;
+    c.ttl = 2;
+    c.pred.pattern = PatternRandom;
+    burst_default_config(&c.burst);
+    struct peer_info self;
+    memset(&self, 0, sizeof(self));
+    strcpy(self.ip, BLACKHOLE);
+    self.type = SymmetricNAT;
+    self.pattern = PatternRandom;
+    if (enroll(self, server, &c) < 0) {
+        printf("failed to enroll\n");
+        return -1;
+    }
+
+    struct session_loop loop;
+    if (session_loop_init(&loop, &c, &budget, NULL) < 0) {
+        return -1;
+    }
+
+    // the sessions report every step, only the results are of interest here unless -v
+    struct logger lg = {.verbose = verbose, .fn = verbose ? NULL : discard_log};
+    log_use(&lg);
+
+    int fds_before = count_fds();
+    struct mallinfo2 before = mallinfo2();
+    uint64_t start = bench_now_us();
+    for (i = 0; i < n; ++i) {
+        session_connect(&loop, ids[i]);
+    }
+    uint64_t outgoing_us = run_until_punched(&loop, n, start);
+    int outgoing_failed = loop.failed;
+    struct mallinfo2 after = mallinfo2();
+    int fds_after = count_fds();
+    int in_flight = loop.num_sessions;
+    session_loop_destroy(&loop);
+
+    // the same peers turn around and all notify us
+    session_loop_init(&loop, &c, &budget, NULL);
+    start = bench_now_us();
+    for (i = 0; i < n; ++i) {
+        fake_notify(socks[i], c.id);
+    }
+    uint64_t incoming_us = run_until_punched(&loop, n, start);
+    int incoming_failed = loop.failed;
+    int incoming = loop.num_sessions;
+    session_loop_destroy(&loop);
+
+    log_use(NULL);
+
+    if (!outgoing_us || !incoming_us) {
+        printf("sessions didn't get their probes out in time, %d outgoing and %d incoming failed\n",
+            outgoing_failed, incoming_failed);
+        return -1;
+    }
+    printf("%d sessions, %d probe sockets each\n", n, budget.max_socks);
+    printf("outgoing  %8.0f sessions/s  (lookup, probes, notify)\n", n * 1e6 / outgoing_us);
+    printf("incoming  %8.0f sessions/s  (notification, probes)\n", n * 1e6 / incoming_us);
+    printf("in flight %d outgoing, %d incoming\n", in_flight, incoming);
+    printf("per in-flight session: %zu bytes of heap, %.1f file descriptors\n",
+        (after.uordblks - before.uordblks) / n, (double)(fds_after - fds_before) / n);
+
+    for (i = 0; i < n; ++i) {
+        close(socks[i]);
+    }
+
+    return 0;
+}
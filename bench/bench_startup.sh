@@ -0,0 +1,50 @@
+#!/bin/bash
+#
+# time from start until enrolled at the punch server, for the TCP enrollment
+# after STUN detection and for the UDP rendezvous (-U), with a cold (-f) and
+# a warm profile cache. the STUN server and the punch server both delay their
+# replies by RTT_MS to emulate distant servers, TCP handshakes aren't delayed.
+#
+# usage: bench/bench_startup.sh [RTT_MS] [RUNS], from the top directory after make benchmarks
+
+RTT=${1:-50}
+RUNS=${2:-5}
+STATE=$(mktemp -d)
+PS=$STATE/punch_server
+
+go build -o $PS punch_server.go || exit 1
+bench/stun_responder -p 4300 -P 4301 -d $RTT -t port-restricted > /dev/null & RESPONDER=$!
+$PS -delay ${RTT}ms > /dev/null & SERVER=$!
+trap "kill $RESPONDER $SERVER; rm -rf $STATE" EXIT
+sleep 0.5
+
+# prints the milliseconds until the client reports its id
+startup() {
+    local start=${EPOCHREALTIME/./} pid line
+    coproc CLIENT { exec stdbuf -oL ./nat_traversal -H 127.0.0.1:4300 -s 127.0.0.1 -p 43000 -c $STATE "$@" 2>&1; }
+    pid=$CLIENT_PID
+    while read -t 30 -u ${CLIENT[0]} line; do
+        if [[ $line == enroll\ successfully* ]]; then
+            echo $(( (${EPOCHREALTIME/./} - start) / 1000 ))
+            break
+        fi
+    done
+    kill $pid 2> /dev/null
+    wait $pid 2> /dev/null
+}
+
+run() {
+    local name=$1 total=0 i ms
+    shift
+    for ((i = 0; i < RUNS; i++)); do
+        ms=$(startup "$@")
+        total=$((total + ms))
+    done
+    printf "%-24s %6d ms\n" "$name" $((total / RUNS))
+}
+
+echo "RTT $RTT ms, $RUNS runs each"
+run "tcp, cold cache" -f
+run "tcp, warm cache"
+run "udp rendezvous, cold" -f -U
+run "udp rendezvous, warm" -U
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "stun.h"
+
+/*
+ * messages per second through the STUN codec: a binding request is encoded
+ * and decoded, then a response with MAPPED, XOR-MAPPED and CHANGED addresses.
+ * -l runs the previous code instead, a malloc'ed buffer per request, rand()
+ * per transaction ID byte and attribute headers cast onto the buffer.
+ */
+
+static volatile uint32_t sink;
+
+static void legacy_tid(char* s, int len) {
+    static const char alphanum[] =
+        "0123456789"
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+        "abcdefghijklmnopqrstuvwxyz";
+    int i;
+    for (i = 0; i < len; ++i) {
+        s[i] = alphanum[rand() % (sizeof(alphanum) - 1)];
+    }
+}
+
+static int legacy_round(const char* response, int response_len) {
+    char* buf = malloc(MAX_STUN_MESSAGE_LENGTH);
+    char* ptr = buf;
+    StunHeader h;
+    legacy_tid((char*)&h.magicCookieAndTid, 16);
+    ptr = encode16(ptr, BindRequest);
+    char* lengthp = ptr;
+    ptr = encode16(ptr, 0);
+    ptr = encode(ptr, (const char*)&h.id, sizeof(h.id));
+    ptr = encode16(ptr, ChangeRequest);
+    ptr = encode16(ptr, 4);
+    ptr = encode32(ptr, ChangeIpFlag | ChangePortFlag);
+    encode16(lengthp, ptr - buf - sizeof(StunHeader));
+    sink += buf[4];
+
+    // as if the response had been received into the same buffer
+    memcpy(buf, response, response_len);
+    StunHeader* reply = (StunHeader*)buf;
+    StunAtrAddress addr[2];
+    int ret = -1;
+    if (ntohs(reply->msgType) == BindResponse) {
+        char* body = buf + sizeof(StunHeader);
+        uint16_t size = ntohs(reply->msgLength);
+        while (size > 0) {
+            StunAtrHdr* attr = (StunAtrHdr*)body;
+            unsigned int len = ntohs(attr->length);
+            unsigned int pad = len % 4 == 0 ? 0 : 4 - len % 4;
+            int type = ntohs(attr->type);
+            if (len + pad + 4 > size) {
+                break;
+            }
+            body += 4;
+            size -= 4;
+            if (type == MappedAddress || type == ChangedAddress) {
+                StunAtrAddress* a = &addr[type == ChangedAddress];
+                uint16_t port;
+                uint32_t ip;
+                a->family = body[1];
+                memcpy(&port, body + 2, 2);
+                memcpy(&ip, body + 4, 4);
+                a->port = ntohs(port);
+                a->addr.ipv4 = ntohl(ip);
+            }
+            body += len + pad;
+            size -= len + pad;
+        }
+        ret = 0;
+        sink += addr[0].port + addr[1].port;
+    }
+    free(buf);
+
+    return ret;
+}
+
+static int codec_round(const char* response, int response_len) {
+    char buf[MAX_STUN_MESSAGE_LENGTH];
+    uint8_t tid[STUN_TID_LENGTH];
+    struct stun_message msg;
+
+    stun_new_tid(tid);
+    int len = stun_encode_bind_request(buf, sizeof(buf), tid, ChangeIpFlag | ChangePortFlag);
+    if (stun_decode(buf, len, &msg) < 0) {
+        return -1;
+    }
+    sink += msg.change;
+
+    if (stun_decode(response, response_len, &msg) < 0) {
+        return -1;
+    }
+    sink += stun_mapped_address(&msg)->port + msg.changed.port;
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    long rounds = 5000000;
+    int legacy = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:l")) != -1) {
+        switch (opt) {
+            case 'n':
+                rounds = atol(optarg);
+                break;
+            case 'l':
+                legacy = 1;
+                break;
+            default:
+                printf("usage: [-n ROUNDS] [-l legacy codec]\n");
+                return -1;
+        }
+    }
+
+    char response[MAX_STUN_MESSAGE_LENGTH];
+    uint8_t tid[STUN_TID_LENGTH];
+    stun_new_tid(tid);
+    StunAtrAddress mapped = {IPv4Family, 40123, {0xC6336407}};
+    StunAtrAddress changed = {IPv4Family, 3479, {0xC6336408}};
+    int response_len = stun_encode_bind_response(response, sizeof(response), tid, &mapped, &changed);
+
+    uint64_t start = bench_now_us();
+    long i, failed = 0;
+    for (i = 0; i < rounds; ++i) {
+        failed += (legacy ? legacy_round(response, response_len) : codec_round(response, response_len)) < 0;
+    }
+    uint64_t elapsed = bench_now_us() - start;
+
+    // every round is one request and one response through encode and decode
+    printf("%s codec: %ld rounds in %.1f ms, %.2f M messages/s, %.1f ns per message, %ld failed\n",
+            legacy ? "legacy" : "new", rounds, elapsed / 1000.0,
+            2.0 * rounds / elapsed, elapsed * 1000.0 / (2.0 * rounds), failed);
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "stun.h"
+
+/*
+ * fuzz harness for stun_decode(). LLVMFuzzerTestOneInput() can be linked
+ * against libFuzzer (clang -fsanitize=fuzzer,address -DUSE_LIBFUZZER), the
+ * built-in driver mutates valid requests and responses instead.
+ * each input is copied to the very end of a page followed by an inaccessible
+ * one, so reading a single byte past the message crashes. decoded addresses
+ * must also survive a round trip through the encoder.
+ */
+
+static uint8_t* guarded;
+static long page_size;
+
+static void check_roundtrip(const struct stun_message* msg) {
+    const StunAtrAddress* mapped = stun_mapped_address(msg);
+    if (msg->type != BindResponse || mapped == NULL) {
+        return;
+    }
+
+    char buf[MAX_STUN_MESSAGE_LENGTH];
+    struct stun_message again;
+    const StunAtrAddress* changed = (msg->attrs & STUN_HAS_CHANGED) ? &msg->changed : NULL;
+    int len = stun_encode_bind_response(buf, sizeof(buf), msg->tid, mapped, changed);
+    if (len < 0 || stun_decode(buf, len, &again) < 0) {
+        fprintf(stderr, "re-encoded response doesn't decode\n");
+        abort();
+    }
+
+    const StunAtrAddress* a = stun_mapped_address(&again);
+    if (a->family != mapped->family || a->port != mapped->port
+            || (a->family == IPv4Family && a->addr.ipv4 != mapped->addr.ipv4)
+            || (a->family == IPv6Family && memcmp(&a->addr.ipv6, &mapped->addr.ipv6, 16))) {
+        fprintf(stderr, "mapped address changed through a round trip\n");
+        abort();
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (guarded == NULL) {
+        page_size = sysconf(_SC_PAGESIZE);
+        guarded = mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (guarded == MAP_FAILED || mprotect(guarded + page_size, page_size, PROT_NONE) < 0) {
+            perror("mmap");
+            exit(1);
+        }
+    }
+    if (size > page_size) {
+        size = page_size;
+    }
+
+    uint8_t* msg_buf = guarded + page_size - size;
+    memcpy(msg_buf, data, size);
+
+    struct stun_message msg;
+    if (stun_decode((const char*)msg_buf, size, &msg) == 0) {
+        check_roundtrip(&msg);
+    }
+
+    return 0;
+}
+
+#ifndef USE_LIBFUZZER
+
+static int seed(uint8_t* buf, int which) {
+    uint8_t tid[STUN_TID_LENGTH];
+    stun_new_tid(tid);
+    // old style transaction ID, no cookie
+    if (which & 1) {
+        tid[0] ^= 0xFF;
+    }
+
+    StunAtrAddress mapped = {IPv4Family, 40123, {0xC6336407}};
+    StunAtrAddress changed = {IPv4Family, 3479, {0xC6336408}};
+    if (which & 2) {
+        mapped.family = IPv6Family;
+        memset(&mapped.addr.ipv6, 0x20, 16);
+    }
+
+    switch ((which >> 2) % 3) {
+    case 0:
+        return stun_encode_bind_request((char*)buf, MAX_STUN_MESSAGE_LENGTH, tid, which & 8 ? ChangeIpFlag : 0);
+    case 1:
+        return stun_encode_bind_response((char*)buf, MAX_STUN_MESSAGE_LENGTH, tid, &mapped, &changed);
+    default:
+        return stun_encode_bind_response((char*)buf, MAX_STUN_MESSAGE_LENGTH, tid, &mapped, NULL);
+    }
+}
+
+// flip bits, overwrite bytes with interesting values, truncate or extend
+static int mutate(uint8_t* buf, int len) {
+    static const uint8_t interesting[] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x07, 0x08, 0x13, 0x14, 0x20, 0x7F, 0x80, 0xFF};
+    int n = 1 + rand() % 4;
+    while (n--) {
+        int pos = len ? rand() % len : 0;
+        switch (rand() % 5) {
+        case 0:
+            buf[pos] ^= 1 << (rand() % 8);
+            break;
+        case 1:
+            buf[pos] = interesting[rand() % sizeof(interesting)];
+            break;
+        case 2:
+            len = rand() % (len + 1);
+            break;
+        case 3:
+            if (len < MAX_STUN_MESSAGE_LENGTH - 4) {
+                int extra = 1 + rand() % 4;
+                while (extra--) {
+                    buf[len++] = rand();
+                }
+            }
+            break;
+        default:
+            // attribute and message lengths are the interesting fields
+            if (len >= 4) {
+                pos = (rand() % 2) ? 2 : STUN_HEADER_LENGTH + 2 + 4 * (rand() % 8);
+                if (pos + 1 < len) {
+                    buf[pos] = 0;
+                    buf[pos + 1] = interesting[rand() % sizeof(interesting)];
+                }
+            }
+            break;
+        }
+    }
+
+    return len;
+}
+
+int main(int argc, char** argv) {
+    long iterations = 1000000;
+    unsigned int rand_seed = getpid();
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = atol(optarg);
+                break;
+            case 's':
+                rand_seed = atoi(optarg);
+                break;
+            default:
+                printf("usage: [-n ITERATIONS] [-s SEED]\n");
+                return -1;
+        }
+    }
+    srand(rand_seed);
+
+    uint8_t buf[MAX_STUN_MESSAGE_LENGTH];
+    long i, decoded = 0;
+    for (i = 0; i < iterations; ++i) {
+        int len = mutate(buf, seed(buf, rand()));
+        struct stun_message msg;
+        decoded += stun_decode((const char*)buf, len, &msg) == 0;
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    printf("seed %u: %ld inputs, %ld decoded, no crash\n", rand_seed, iterations, decoded);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,276 @@
+#!/bin/bash
+#
+# end to end traversal benchmark, with bench/nat_emulator between two clients
+# in network namespaces of their own and the punch server and the STUN
+# responder in a third one, the internet. every run starts from fresh NATs and
+# a cold profile cache, b enrolls, a connects to it. per scenario it reports
+# the success rate and p50/p90/p99 of
+#   detect        a's NAT detection
+#   enroll        a's enrollment after it, 0 with the UDP rendezvous (-U)
+#   lookup        a asking the server for b until the answer
+#   burst         a firing its probes, until the first packet if that came earlier
+#   first_packet  a asking for b until either side heard from the other
+#   connect       a asking for b until either side greeted the other
+#   probes        UDP packets either NAT let out towards the other one
+#   drops         new mappings either NAT's flooding protection refused
+#   syscalls      of both clients, counted by bench/syscount
+#   fds           the most either client had open at the end of its session
+#   socks         probe sockets both clients opened for the session
+#   mbps          b receiving what a sent once connected, with -x
+# times over the runs that connected, except burst, which is over every run
+# that fired its probes, and the rest over every run. the clients share the
+# monotonic clock, so their timestamps are comparable.
+#
+# a scenario is NAT_A,NAT_B[,CLIENT_ARGS], each NAT as bench/nat_emulator takes
+# it (type[:seq|deltaN|random[:LIFETIME_S[:FLOOD[/BURST][:icmp]]]]), the arguments go to both
+# clients, to compare strategies and backends side by side (-u, -U, -g, -b...)
+#
+# -x MB makes a send that much to b, run with -r, once connected, over the
+# channel or, with -S, the punched TCP stream, and the run last until b has it
+# all
+#
+# -w keeps the clients' state from one run of a scenario to the next, the
+# first run is cold, the others start from the cached profile and the probe
+# rate learned for the NAT
+#
+# the clients also share a link with IPv6 and no NAT, 2001:db8::1 and ::2, which
+# -6 auto makes them race against IPv4. -B keeps the addresses but drops
+# everything between them, to time the fallback to IPv4
+#
+# usage: sudo bench/nat_bench.sh [-n RUNS] [-o JSON_FILE] [-w] [-B] [-x MB] [SCENARIO]..., from the
+# top directory after make benchmarks, or make bench. syscalls need tracefs
+# mounted (mount -t tracefs nodev /sys/kernel/tracing), -1 otherwise
+
+RUNS=5
+JSON=
+WARM=
+BROKEN6=
+XFER=
+while getopts "n:o:wBx:" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        o) JSON=$OPTARG ;;
+        w) WARM=1 ;;
+        B) BROKEN6=1 ;;
+        x) XFER=$OPTARG ;;
+        *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+SCENARIOS=("$@")
+if [ ${#SCENARIOS[@]} -eq 0 ]; then
+    SCENARIOS=(symmetric,symmetric symmetric,symmetric,-u symmetric,symmetric,-U symmetric:delta2,symmetric
+        symmetric:random,symmetric:random symmetric:random:120:200,symmetric:random
+        symmetric:random:120:2000/100:icmp,symmetric:random:120:2000/100:icmp port-restricted,symmetric
+        symmetric,port-restricted port-restricted,symmetric:random full-cone,symmetric
+        port-restricted,port-restricted restricted,full-cone full-cone,full-cone
+        "symmetric:random,symmetric:random,-6 auto" "port-restricted,symmetric,-6 auto"
+        port-restricted,port-restricted,-S port-restricted,symmetric,-S full-cone,symmetric,-S symmetric,symmetric,-S)
+fi
+if [ $(id -u) -ne 0 ]; then
+    echo "needs root for the network namespaces"
+    exit 1
+fi
+TIMEOUT=15
+PREFIX=nb$$
+STATE=$(mktemp -d)
+PS=$STATE/punch_server
+
+go build -o $PS punch_server.go || exit 1
+
+cleanup() {
+    kill $RESPONDER $SERVER 2> /dev/null
+    for ns in a b i; do
+        ip netns del $PREFIX$ns 2> /dev/null
+    done
+    rm -rf $STATE
+}
+trap cleanup EXIT
+
+for ns in a b i; do
+    ip netns add $PREFIX$ns
+    ip netns exec $PREFIX$ns ip link set lo up
+done
+ip link add $PREFIX-6a netns ${PREFIX}a type veth peer name $PREFIX-6b netns ${PREFIX}b
+for side in a b; do
+    n=$([ $side = a ] && echo 1 || echo 2)
+    ip netns exec $PREFIX$side ip addr add 2001:db8::$n/64 dev $PREFIX-6$side nodad
+    ip netns exec $PREFIX$side ip link set $PREFIX-6$side up
+    # to a MAC address nobody has, the other end drops the frames without an error
+    [ -n "$BROKEN6" ] && ip netns exec $PREFIX$side ip -6 neigh replace 2001:db8::$((3 - n)) \
+        lladdr 02:00:00:00:00:01 dev $PREFIX-6$side nud permanent
+done
+# the punch server, then the primary and alternate address of the STUN responder
+for ip in 198.51.100.1 198.51.100.2 198.51.100.3; do
+    ip netns exec ${PREFIX}i ip addr add $ip/32 dev lo
+done
+ip netns exec ${PREFIX}i $PS > /dev/null 2>&1 & SERVER=$!
+ip netns exec ${PREFIX}i bench/stun_responder -a 198.51.100.2 -A 198.51.100.3 > /dev/null & RESPONDER=$!
+sleep 0.5
+
+now_ms() {
+    echo $((${EPOCHREALTIME/./} / 1000))
+}
+
+# starts the emulator, hands its devices to the namespaces
+start_nat() {
+    bench/nat_emulator -a $1 -b $2 -n $PREFIX > $STATE/nat.log & NAT=$!
+    while ! ip link show $PREFIX-i > /dev/null 2>&1; do
+        kill -0 $NAT 2> /dev/null || return 1
+        sleep 0.01
+    done
+    ip link set $PREFIX-i netns ${PREFIX}i
+    ip netns exec ${PREFIX}i ip link set $PREFIX-i up
+    ip netns exec ${PREFIX}i ip route add 203.0.113.0/24 dev $PREFIX-i
+    local side n
+    for side in a b; do
+        n=$([ $side = a ] && echo 1 || echo 2)
+        ip link set $PREFIX-$side netns $PREFIX$side
+        ip netns exec $PREFIX$side ip addr add 192.168.$n.2/24 dev $PREFIX-$side
+        ip netns exec $PREFIX$side ip link set $PREFIX-$side up
+        ip netns exec $PREFIX$side ip route add default dev $PREFIX-$side
+    done
+}
+
+client() {
+    local side=$1
+    shift
+    # a warm client doesn't force the detection either
+    bench/syscount -n $PREFIX$side stdbuf -oL ./nat_traversal -v -c $STATE/$side $([ -z "$WARM" ] && echo -f) -H 198.51.100.2 \
+        -s 198.51.100.1 -T $((TIMEOUT - 2)) "$@" > $STATE/$side.log 2>&1
+}
+
+# the numbers of one run out of the logs, -1 for what it didn't get to
+measure() {
+    awk -v result=$1 '
+        BEGIN { detect = enroll = lookup = punching = punched = fds = mbps = -1 }
+        FILENAME ~ /a.log$/ && /^timing: detect/ { detect = $3; enroll = $5 }
+        /^timing: peer/ {
+            side = FILENAME ~ /a.log$/ ? "a" : "b"
+            start[side] = $5; first[side] = $13; conn[side] = $15
+            if ($17 > fds) fds = $17
+            socks += $19
+            if (side == "a") { lookup = $7; punching = $9; punched = $11 }
+        }
+        FILENAME ~ /b.log$/ && /^received / { for (i = 2; i <= NF; i++) if ($i == "Gb/s") mbps = $(i - 1) * 1000 }
+        /^syscalls:/ { syscalls = syscalls < 0 || $2 < 0 ? -1 : syscalls + $2 }
+        /^nat [ab]: mappings/ { probes += $12; drops += $16 }
+        # ms since a started its session, of the earliest side that got there
+        function earliest(at,    s, t, best) {
+            best = -1
+            for (s in start) {
+                if (at[s] >= 0) {
+                    t = (start[s] - start["a"]) / 1000 + at[s]
+                    if (best < 0 || t < best) best = t
+                }
+            }
+            return best
+        }
+        END {
+            burst = fp = cn = -1
+            if ("a" in start) {
+                end = punched >= 0 ? punched : first["a"]
+                if (punching >= 0 && end >= 0) burst = sprintf("%.1f", end - punching)
+                fp = sprintf("%.1f", earliest(first))
+                cn = sprintf("%.1f", earliest(conn))
+            }
+            printf "%s %s %s %s %s %s %s %d %d %d %d %d %s\n", result, detect, enroll, lookup, burst, fp, cn, probes, drops, syscalls, fds, socks, mbps
+        }' $STATE/a.log $STATE/b.log $STATE/nat.log
+}
+
+# one run, prints "ok|failed DETECT ENROLL LOOKUP BURST FIRST_PACKET CONNECT PROBES DROPS SYSCALLS FDS SOCKS MBPS"
+run() {
+    [ -z "$WARM" ] && rm -rf $STATE/a $STATE/b
+    rm -f $STATE/a.log $STATE/b.log
+    mkdir -p $STATE/a $STATE/b
+    start_nat $1 $2 || { echo "failed -1 -1 -1 -1 -1 -1 0 0 -1 -1 0 -1"; return; }
+    shift 2
+
+    client b $([ -n "$XFER" ] && echo -r) "$@" & B=$!
+    local deadline=$(($(now_ms) + TIMEOUT * 1000)) id=
+    while [ -z "$id" ] && [ $(now_ms) -lt $deadline ]; do
+        sleep 0.01
+        id=$(sed -n 's/^enroll successfully, ID: //p' $STATE/b.log 2> /dev/null)
+    done
+
+    # until a's session is over one way or another
+    local started=
+    if [ -n "$id" ]; then
+        client a -d $id $([ -n "$XFER" ] && echo -x $XFER) "$@" & A=$!
+        while [ $(now_ms) -lt $deadline ] && ! grep -qs "^timing: peer" $STATE/a.log; do
+            if [ -z "$started" ] && grep -qs "^connecting to peer" $STATE/a.log; then
+                started=1
+                deadline=$(($(now_ms) + TIMEOUT * 1000))
+            fi
+            sleep 0.01
+        done
+        # give b a moment to log its side
+        sleep 0.1
+        if [ -n "$XFER" ] && grep -qs "connected with peer" $STATE/a.log; then
+            while [ $(now_ms) -lt $deadline ] && ! grep -qs "^received" $STATE/b.log; do
+                sleep 0.01
+            done
+        fi
+    fi
+
+    # SIGINT, bash reports clients killed by SIGTERM
+    pkill -INT -f "nat_traversal -v -c $STATE/" 2> /dev/null
+    wait $A $B 2> /dev/null
+    kill $NAT
+    wait $NAT
+    local result=failed
+    if grep -qs "connected with peer" $STATE/a.log $STATE/b.log; then
+        result=ok
+    fi
+    measure $result
+}
+
+# p50 p90 p99 of the values on stdin, nearest rank, -1s left out
+percentiles() {
+    sort -g | awk '$1 >= 0 { v[n++] = $1 }
+        function rank(p,    i) { i = int(p * n + 0.999999) - 1; return v[i < 0 ? 0 : i] }
+        END { if (n) print rank(0.5), rank(0.9), rank(0.99); else print "-1 -1 -1" }'
+}
+
+METRICS=(detect enroll lookup burst first_packet connect probes drops syscalls fds socks mbps)
+echo "$RUNS runs a scenario, ${TIMEOUT} s each at most, p50 in ms, -1 if no run got there"
+printf "%-42s %8s %7s %7s %7s %7s %8s %8s %7s %6s %9s %5s %5s %7s\n" scenario success detect enroll lookup burst \
+    "1st pkt" connect probes drops syscalls fds socks Mb/s
+json_scenarios=()
+for scenario in "${SCENARIOS[@]}"; do
+    IFS=, read nat_a nat_b args <<< "$scenario"
+    ok=0
+    : > $STATE/results
+    rm -rf $STATE/a $STATE/b
+    for ((i = 0; i < RUNS; i++)); do
+        line=$(run $nat_a $nat_b $args)
+        echo "$line" >> $STATE/results
+        [[ $line == ok* ]] && ok=$((ok + 1))
+    done
+
+    p50=()
+    json_metrics=
+    for ((m = 0; m < ${#METRICS[@]}; m++)); do
+        # times over the runs that connected, resources and the burst over all of them
+        if [ $m -lt 6 ] && [ ${METRICS[m]} != burst ]; then
+            p=($(awk -v f=$((m + 2)) '$1 == "ok" { print $f }' $STATE/results | percentiles))
+        else
+            p=($(awk -v f=$((m + 2)) '{ print $f }' $STATE/results | percentiles))
+        fi
+        p50+=(${p[0]})
+        json_metrics+=", \"${METRICS[m]}\": {\"p50\": ${p[0]}, \"p90\": ${p[1]}, \"p99\": ${p[2]}}"
+    done
+    printf "%-42s %4d/%-3d %7s %7s %7s %7s %8s %8s %7s %6s %9s %5s %5s %7s\n" "$scenario" $ok $RUNS "${p50[@]}"
+    json_scenarios+=("{\"scenario\": \"$scenario\", \"nat_a\": \"$nat_a\", \"nat_b\": \"$nat_b\", \"args\": \"$args\", \"runs\": $RUNS, \"connected\": $ok$json_metrics}")
+done
+
+if [ -n "$JSON" ]; then
+    {
+        echo "{\"runs\": $RUNS, \"timeout_s\": $TIMEOUT, \"scenarios\": ["
+        for ((i = 0; i < ${#json_scenarios[@]}; i++)); do
+            echo "  ${json_scenarios[i]}$([ $i -lt $((${#json_scenarios[@]} - 1)) ] && echo ,)"
+        done
+        echo "]}"
+    } > $JSON
+    echo "results in $JSON"
+fi
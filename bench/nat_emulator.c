@@ -0,0 +1,611 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <arpa/inet.h>
+#include <linux/if_tun.h>
+
+/*
+ * userspace NAT in front of two local clients, a and b, on three TUN devices:
+ * one inside each NAT and one to the "internet" where the punch server and
+ * the STUN responder live. every NAT behaves like one of the nat_type ones
+ * (RFC 4787 mapping and filtering), hands out external ports sequentially,
+ * with a delta or at random, expires idle mappings and drops new ones above a
+ * rate, like a flooding protection would: a token bucket of FLOOD new mappings
+ * a second that holds BURST of them, answering the drops with an ICMP
+ * administratively prohibited if asked to, or silently. packets between the two NATs cross
+ * a few routers on the way, so a ttl limited probe dies before the other NAT.
+ * bench/nat_bench.sh moves the devices into network namespaces and runs the
+ * clients through it.
+ *
+ * a:  192.168.1.2 -- 192.168.1.1 [NAT a] 203.0.113.1 --+
+ * b:  192.168.2.2 -- 192.168.2.1 [NAT b] 203.0.113.2 --+-- internet
+ */
+
+#define NAT_A_INSIDE "192.168.1.1"
+#define NAT_A_PUBLIC "203.0.113.1"
+#define NAT_B_INSIDE "192.168.2.1"
+#define NAT_B_PUBLIC "203.0.113.2"
+
+#define OUT_BUCKETS 65536
+#define MIN_PORT 1024
+// RFC 5382 wants established TCP mappings to last two hours at least
+#define TCP_LIFETIME_S 7440
+#define MAX_PACKET 65536
+
+enum { FullCone, Restricted, PortRestricted, Symmetric };
+enum { AllocDelta, AllocRandom };
+
+static const char* type_names[] = {"full-cone", "restricted", "port-restricted", "symmetric"};
+
+struct endpoint {
+    uint32_t ip;        // both in network order
+    uint16_t port;
+};
+
+struct mapping {
+    struct mapping* next;       // in the out bucket
+    uint8_t proto;
+    struct endpoint inside;
+    struct endpoint remote;     // the only destination of a symmetric mapping
+    uint16_t ext_port;          // host order
+    time_t last_used;
+    // remote endpoints the inside sent to, what gets in through a filtering NAT
+    struct endpoint* perms;
+    int num_perms;
+    int cap_perms;
+};
+
+struct nat_stats {
+    int mappings;
+    int expired;
+    int packets_out;
+    int packets_in;
+    int probes;         // UDP sent to the other NAT
+    int filtered;
+    int flood_drops;
+    int ttl_drops;
+};
+
+struct nat {
+    char name;
+    int fd;
+    int type;
+    int alloc;
+    int delta;
+    int lifetime_s;
+    int flood;          // new mappings a second, 0 for no limit
+    int flood_burst;    // new mappings at once
+    int flood_icmp;     // tell the inside about dropped ones
+    uint32_t inside_ip;
+    uint32_t public_ip;
+    uint16_t last_port;
+    struct mapping* out[OUT_BUCKETS];
+    // [udp, tcp][external port]
+    struct mapping* in[2][65536];
+    double flood_tokens;
+    uint64_t flood_last_us;
+    struct nat_stats stats;
+};
+
+int verbose = 0;
+
+static struct nat nats[2];
+static int inet_fd;
+static int hops = 3;
+static volatile sig_atomic_t stopping = 0;
+
+static void on_signal(int sig) {
+    stopping = 1;
+}
+
+static time_t now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int open_tun(const char* name) {
+    int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static uint32_t sum16(const void* data, int len, uint32_t sum) {
+    const uint8_t* p = data;
+    int i;
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (p[i] << 8) | p[i + 1];
+    }
+    if (len & 1) {
+        sum += p[len - 1] << 8;
+    }
+
+    return sum;
+}
+
+static uint16_t fold(uint32_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return htons(~sum & 0xffff);
+}
+
+// header and transport checksums from scratch, packets are small enough
+static void fix_checksums(uint8_t* pkt, int len) {
+    struct iphdr* ip = (struct iphdr*)pkt;
+    int hlen = ip->ihl * 4;
+    ip->check = 0;
+    ip->check = fold(sum16(pkt, hlen, 0));
+
+    uint8_t* l4 = pkt + hlen;
+    int l4len = len - hlen;
+    uint16_t* check = (uint16_t*)(l4 + (ip->protocol == IPPROTO_UDP ? 6 : 16));
+    *check = 0;
+    uint32_t sum = sum16(&ip->saddr, 8, 0) + ip->protocol + l4len;
+    uint16_t c = fold(sum16(l4, l4len, sum));
+    // zero means no checksum for UDP
+    *check = c ? c : 0xffff;
+}
+
+static int proto_index(uint8_t proto) {
+    return proto == IPPROTO_TCP;
+}
+
+static unsigned hash_out(uint8_t proto, const struct endpoint* inside, const struct endpoint* remote) {
+    uint32_t h = inside->ip * 2654435761u ^ inside->port * 40503u ^ proto;
+    if (remote) {
+        h ^= remote->ip * 2246822519u ^ remote->port * 3266489917u;
+    }
+    h ^= h >> 16;
+
+    return h % OUT_BUCKETS;
+}
+
+static int same(const struct endpoint* a, const struct endpoint* b) {
+    return a->ip == b->ip && a->port == b->port;
+}
+
+static int expired(const struct nat* n, const struct mapping* m, time_t now) {
+    int lifetime = m->proto == IPPROTO_TCP ? TCP_LIFETIME_S : n->lifetime_s;
+    return now - m->last_used >= lifetime;
+}
+
+static void free_mapping(struct nat* n, struct mapping* m) {
+    unsigned h = hash_out(m->proto, &m->inside, n->type == Symmetric ? &m->remote : NULL);
+    struct mapping** p;
+    for (p = &n->out[h]; *p != m; p = &(*p)->next);
+    *p = m->next;
+    n->in[proto_index(m->proto)][m->ext_port] = NULL;
+    free(m->perms);
+    free(m);
+}
+
+// drops every idle mapping, once a second
+static void expire(struct nat* n, time_t now) {
+    int i;
+    for (i = 0; i < OUT_BUCKETS; ++i) {
+        struct mapping* m = n->out[i];
+        while (m) {
+            struct mapping* next = m->next;
+            if (expired(n, m, now)) {
+                free_mapping(n, m);
+                n->stats.expired++;
+            }
+            m = next;
+        }
+    }
+}
+
+static int alloc_port(struct nat* n, uint8_t proto) {
+    int tries;
+    for (tries = 0; tries < 65536; ++tries) {
+        int port;
+        if (n->alloc == AllocRandom) {
+            port = MIN_PORT + rand() % (65536 - MIN_PORT);
+        } else {
+            port = n->last_port + n->delta;
+            if (port > 65535) {
+                port = MIN_PORT + (port - 65536) % (65536 - MIN_PORT);
+            }
+            n->last_port = port;
+        }
+        if (!n->in[proto_index(proto)][port]) {
+            return port;
+        }
+    }
+
+    return -1;
+}
+
+static struct mapping* find_mapping(struct nat* n, uint8_t proto, const struct endpoint* inside,
+        const struct endpoint* remote) {
+    int symmetric = n->type == Symmetric;
+    struct mapping* m;
+    for (m = n->out[hash_out(proto, inside, symmetric ? remote : NULL)]; m; m = m->next) {
+        if (m->proto == proto && same(&m->inside, inside) && (!symmetric || same(&m->remote, remote))) {
+            return m;
+        }
+    }
+
+    return NULL;
+}
+
+static struct mapping* new_mapping(struct nat* n, uint8_t proto, const struct endpoint* inside,
+        const struct endpoint* remote, time_t now) {
+    // the flooding protection only counts new mappings, known ones keep working
+    if (n->flood) {
+        uint64_t us = now_us();
+        n->flood_tokens += (us - n->flood_last_us) * n->flood / 1e6;
+        if (n->flood_tokens > n->flood_burst) {
+            n->flood_tokens = n->flood_burst;
+        }
+        n->flood_last_us = us;
+        if (n->flood_tokens < 1) {
+            n->stats.flood_drops++;
+            return NULL;
+        }
+        n->flood_tokens--;
+    }
+
+    int port = alloc_port(n, proto);
+    if (port < 0) {
+        n->stats.flood_drops++;
+        return NULL;
+    }
+
+    struct mapping* m = calloc(1, sizeof(struct mapping));
+    m->proto = proto;
+    m->inside = *inside;
+    m->remote = *remote;
+    m->ext_port = port;
+    unsigned h = hash_out(proto, inside, n->type == Symmetric ? remote : NULL);
+    m->next = n->out[h];
+    n->out[h] = m;
+    n->in[proto_index(proto)][port] = m;
+    n->stats.mappings++;
+    if (verbose) {
+        struct in_addr addr = {remote->ip};
+        printf("nat %c: %s %d -> %d for %s:%d\n", n->name, proto == IPPROTO_TCP ? "tcp" : "udp",
+            ntohs(inside->port), port, inet_ntoa(addr), ntohs(remote->port));
+    }
+
+    return m;
+}
+
+static void permit(struct mapping* m, const struct endpoint* remote) {
+    int i;
+    for (i = 0; i < m->num_perms; ++i) {
+        if (same(&m->perms[i], remote)) {
+            return;
+        }
+    }
+    if (m->num_perms == m->cap_perms) {
+        m->cap_perms = m->cap_perms ? m->cap_perms * 2 : 4;
+        m->perms = realloc(m->perms, m->cap_perms * sizeof(struct endpoint));
+    }
+    m->perms[m->num_perms++] = *remote;
+}
+
+static int permitted(const struct nat* n, const struct mapping* m, const struct endpoint* remote) {
+    if (n->type == FullCone) {
+        return 1;
+    }
+    int i;
+    for (i = 0; i < m->num_perms; ++i) {
+        if (m->perms[i].ip == remote->ip && (n->type == Restricted || m->perms[i].port == remote->port)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// the answer of the NAT itself to a packet from the inside, a ttl that ran out or a refused mapping
+static void icmp_error(struct nat* n, uint8_t type, uint8_t code, const uint8_t* pkt, int len) {
+    const struct iphdr* orig = (const struct iphdr*)pkt;
+    uint8_t out[sizeof(struct iphdr) + 8 + 60 + 8];
+    int quoted = orig->ihl * 4 + 8;
+    if (quoted > len) {
+        quoted = len;
+    }
+
+    memset(out, 0, sizeof(out));
+    struct iphdr* ip = (struct iphdr*)out;
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tot_len = htons(sizeof(struct iphdr) + 8 + quoted);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_ICMP;
+    ip->saddr = n->inside_ip;
+    ip->daddr = orig->saddr;
+    ip->check = fold(sum16(out, sizeof(struct iphdr), 0));
+
+    uint8_t* icmp = out + sizeof(struct iphdr);
+    icmp[0] = type;
+    icmp[1] = code;
+    memcpy(icmp + 8, pkt, quoted);
+    uint16_t c = fold(sum16(icmp, 8 + quoted, 0));
+    memcpy(icmp + 2, &c, 2);
+
+    write(n->fd, out, sizeof(struct iphdr) + 8 + quoted);
+}
+
+static struct nat* nat_at(uint32_t public_ip) {
+    int i;
+    for (i = 0; i < 2; ++i) {
+        if (nats[i].public_ip == public_ip) {
+            return &nats[i];
+        }
+    }
+
+    return NULL;
+}
+
+// from the internet to the public address of n
+static void inbound(struct nat* n, uint8_t* pkt, int len, time_t now) {
+    struct iphdr* ip = (struct iphdr*)pkt;
+    int hlen = ip->ihl * 4;
+    if (ip->protocol != IPPROTO_UDP && ip->protocol != IPPROTO_TCP) {
+        return;
+    }
+    if (ip->ttl <= 1) {
+        n->stats.ttl_drops++;
+        return;
+    }
+    ip->ttl--;
+
+    uint16_t* ports = (uint16_t*)(pkt + hlen);
+    struct endpoint remote = {ip->saddr, ports[0]};
+    struct mapping* m = n->in[proto_index(ip->protocol)][ntohs(ports[1])];
+    if (m && expired(n, m, now)) {
+        free_mapping(n, m);
+        n->stats.expired++;
+        m = NULL;
+    }
+    if (!m || !permitted(n, m, &remote)) {
+        n->stats.filtered++;
+        return;
+    }
+
+    ip->daddr = m->inside.ip;
+    ports[1] = m->inside.port;
+    fix_checksums(pkt, len);
+    n->stats.packets_in++;
+    write(n->fd, pkt, len);
+}
+
+// from inside n, out to the internet or across it to the other NAT
+static void outbound(struct nat* n, uint8_t* pkt, int len, time_t now) {
+    struct iphdr* ip = (struct iphdr*)pkt;
+    int hlen = ip->ihl * 4;
+    if (ip->protocol != IPPROTO_UDP && ip->protocol != IPPROTO_TCP) {
+        return;
+    }
+    if (ip->ttl <= 1) {
+        n->stats.ttl_drops++;
+        // a traceroute sees the NAT as a hop
+        icmp_error(n, ICMP_TIME_EXCEEDED, ICMP_EXC_TTL, pkt, len);
+        return;
+    }
+    ip->ttl--;
+
+    uint16_t* ports = (uint16_t*)(pkt + hlen);
+    struct endpoint inside = {ip->saddr, ports[0]};
+    struct endpoint remote = {ip->daddr, ports[1]};
+    struct mapping* m = find_mapping(n, ip->protocol, &inside, &remote);
+    if (m && expired(n, m, now)) {
+        free_mapping(n, m);
+        n->stats.expired++;
+        m = NULL;
+    }
+    if (!m && !(m = new_mapping(n, ip->protocol, &inside, &remote, now))) {
+        if (n->flood_icmp) {
+            icmp_error(n, ICMP_DEST_UNREACH, ICMP_PKT_FILTERED, pkt, len);
+        }
+        return;
+    }
+    // only traffic from the inside keeps a mapping alive
+    m->last_used = now;
+    permit(m, &remote);
+
+    ip->saddr = n->public_ip;
+    ports[0] = htons(m->ext_port);
+    fix_checksums(pkt, len);
+    n->stats.packets_out++;
+
+    struct nat* other = nat_at(ip->daddr);
+    if (!other) {
+        write(inet_fd, pkt, len);
+        return;
+    }
+    if (ip->protocol == IPPROTO_UDP) {
+        n->stats.probes++;
+    }
+    // the routers between the two NATs don't answer
+    if (ip->ttl <= hops) {
+        n->stats.ttl_drops++;
+        return;
+    }
+    ip->ttl -= hops;
+    inbound(other, pkt, len, now);
+}
+
+// type[:seq|deltaN|random[:LIFETIME_S[:FLOOD[/BURST][:icmp]]]]
+static int parse_nat(struct nat* n, char* spec) {
+    char* type = strtok(spec, ":");
+    char* alloc = strtok(NULL, ":");
+    char* lifetime = strtok(NULL, ":");
+    char* flood = strtok(NULL, ":");
+    char* icmp = strtok(NULL, ":");
+
+    int i;
+    n->type = -1;
+    for (i = 0; i < 4; ++i) {
+        if (type && !strcmp(type, type_names[i])) {
+            n->type = i;
+        }
+    }
+    if (n->type < 0) {
+        return -1;
+    }
+
+    n->alloc = AllocDelta;
+    n->delta = 1;
+    if (alloc && !strcmp(alloc, "random")) {
+        n->alloc = AllocRandom;
+    } else if (alloc && !strncmp(alloc, "delta", strlen("delta"))) {
+        n->delta = atoi(alloc + strlen("delta"));
+        if (n->delta < 1) {
+            return -1;
+        }
+    } else if (alloc && strcmp(alloc, "seq")) {
+        return -1;
+    }
+
+    n->lifetime_s = lifetime ? atoi(lifetime) : 120;
+    n->flood = flood ? atoi(flood) : 0;
+    // a FLOOD alone takes a second's worth at once, as a counter reset every second would
+    char* burst = flood ? strchr(flood, '/') : NULL;
+    n->flood_burst = burst ? atoi(burst + 1) : n->flood;
+    if (n->flood < 0 || n->flood_burst < 0 || (n->flood && n->flood_burst < 1)) {
+        return -1;
+    }
+    n->flood_tokens = n->flood_burst;
+    n->flood_last_us = now_us();
+    if (icmp && strcmp(icmp, "icmp")) {
+        return -1;
+    }
+    n->flood_icmp = icmp != NULL;
+
+    return 0;
+}
+
+static void print_stats(const struct nat* n) {
+    const struct nat_stats* s = &n->stats;
+    printf("nat %c: mappings %d expired %d out %d in %d probes %d filtered %d flood_drops %d ttl_drops %d\n",
+        n->name, s->mappings, s->expired, s->packets_out, s->packets_in, s->probes, s->filtered, s->flood_drops,
+        s->ttl_drops);
+}
+
+int main(int argc, char** argv) {
+    char* specs[2] = {NULL, NULL};
+    const char* prefix = "nemu";
+
+    static char usage[] = "usage: -a NAT -b NAT [-r HOPS] [-n DEVICE_PREFIX] [-v]\n"
+        "NAT is full-cone|restricted|port-restricted|symmetric[:seq|deltaN|random[:LIFETIME_S[:FLOOD[/BURST][:icmp]]]]\n";
+    int opt;
+    while ((opt = getopt(argc, argv, "a:b:r:n:v")) != -1) {
+        switch (opt) {
+            case 'a': specs[0] = optarg; break;
+            case 'b': specs[1] = optarg; break;
+            case 'r': hops = atoi(optarg); break;
+            case 'n': prefix = optarg; break;
+            case 'v': verbose = 1; break;
+            default:
+                printf("%s", usage);
+                return -1;
+        }
+    }
+
+    const char* inside[2] = {NAT_A_INSIDE, NAT_B_INSIDE};
+    const char* public[2] = {NAT_A_PUBLIC, NAT_B_PUBLIC};
+    char name[IFNAMSIZ];
+    int i;
+    for (i = 0; i < 2; ++i) {
+        struct nat* n = &nats[i];
+        n->name = 'a' + i;
+        if (!specs[i] || parse_nat(n, specs[i]) < 0) {
+            printf("%s", usage);
+            return -1;
+        }
+        n->inside_ip = inet_addr(inside[i]);
+        n->public_ip = inet_addr(public[i]);
+        n->last_port = 20000 - n->delta;
+        snprintf(name, sizeof(name), "%s-%c", prefix, n->name);
+        if ((n->fd = open_tun(name)) < 0) {
+            perror(name);
+            return -1;
+        }
+    }
+    snprintf(name, sizeof(name), "%s-i", prefix);
+    if ((inet_fd = open_tun(name)) < 0) {
+        perror(name);
+        return -1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    srand(getpid());
+    printf("nat a %s, nat b %s, %d hops between\n", type_names[nats[0].type], type_names[nats[1].type], hops);
+    fflush(stdout);
+
+    struct pollfd fds[3] = {{nats[0].fd, POLLIN, 0}, {nats[1].fd, POLLIN, 0}, {inet_fd, POLLIN, 0}};
+    static uint8_t pkt[MAX_PACKET];
+    time_t last_expire = now_s();
+    while (!stopping) {
+        if (poll(fds, 3, 1000) < 0) {
+            continue;
+        }
+        time_t now = now_s();
+        for (i = 0; i < 3; ++i) {
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+            int len;
+            // drain it, a burst of probes comes in at once
+            while ((len = read(fds[i].fd, pkt, sizeof(pkt))) > 0) {
+                struct iphdr* ip = (struct iphdr*)pkt;
+                if (len < sizeof(struct iphdr) || ip->version != 4 || len < ip->ihl * 4 + 8) {
+                    continue;
+                }
+                if (i < 2) {
+                    outbound(&nats[i], pkt, len, now);
+                } else {
+                    struct nat* n = nat_at(ip->daddr);
+                    if (n) {
+                        inbound(n, pkt, len, now);
+                    }
+                }
+            }
+        }
+        if (now != last_expire) {
+            expire(&nats[0], now);
+            expire(&nats[1], now);
+            last_expire = now;
+        }
+    }
+
+    print_stats(&nats[0]);
+    print_stats(&nats[1]);
+    return 0;
+}
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "nat_type.h"
+#include "stun.h"
+
+/*
+ * local stand-in for a RFC 3489 STUN server. it listens on two addresses
+ * and two ports (127.0.0.1 and 127.0.0.2 both work on loopback), answers
+ * binding requests with MAPPED-ADDRESS and CHANGED-ADDRESS and honours
+ * CHANGE-REQUEST. replies can be delayed or dropped, and a NAT type can be
+ * faked by dropping change replies and rewriting the mapped port.
+ */
+
+#define MAX_PENDING 1024
+
+struct pending {
+    uint64_t due;
+    int sock;
+    struct sockaddr_in to;
+    int len;
+    char buf[MAX_STUN_MESSAGE_LENGTH];
+};
+
+static struct pending queue[MAX_PENDING];
+static int num_pending = 0;
+
+// mappings handed out by the faked symmetric NAT, per source and server endpoint
+#define MAX_MAPPINGS 4096
+
+struct mapping {
+    struct sockaddr_in src;
+    int endpoint;
+    uint16_t port;
+};
+
+static struct mapping mappings[MAX_MAPPINGS];
+static int num_mappings = 0;
+static uint16_t next_port = 20000;
+
+static uint16_t fake_mapping(const struct sockaddr_in* src, int endpoint, int random_ports) {
+    int i;
+    for (i = 0; i < num_mappings; ++i) {
+        if (mappings[i].endpoint == endpoint && mappings[i].src.sin_port == src->sin_port
+                && mappings[i].src.sin_addr.s_addr == src->sin_addr.s_addr) {
+            return mappings[i].port;
+        }
+    }
+
+    // sequential allocation, or anywhere in the non privileged range
+    uint16_t port = random_ports ? 1024 + rand() % (65536 - 1024) : next_port++;
+    if (num_mappings < MAX_MAPPINGS) {
+        mappings[num_mappings].src = *src;
+        mappings[num_mappings].endpoint = endpoint;
+        mappings[num_mappings].port = port;
+        num_mappings++;
+    }
+
+    return port;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int open_sock(const char* ip, uint16_t port) {
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip);
+    addr.sin_port = htons(port);
+    if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+
+    return s;
+}
+
+int main(int argc, char** argv) {
+    const char* ip1 = "127.0.0.1";
+    const char* ip2 = "127.0.0.2";
+    uint16_t port1 = DEFAULT_STUN_SERVER_PORT;
+    uint16_t port2 = DEFAULT_STUN_SERVER_PORT + 1;
+    int delay_ms = 0;
+    int loss = 0;
+    const char* fake = "none";
+
+    static char usage[] = "usage: [-a IP] [-A ALT_IP] [-p PORT] [-P ALT_PORT] [-d DELAY_MS] [-l LOSS_PERCENT]"
+        " [-t none|restricted|port-restricted|symmetric|symmetric-random]\n";
+    int opt;
+    while ((opt = getopt(argc, argv, "a:A:p:P:d:l:t:")) != -1) {
+        switch (opt) {
+            case 'a': ip1 = optarg; break;
+            case 'A': ip2 = optarg; break;
+            case 'p': port1 = atoi(optarg); break;
+            case 'P': port2 = atoi(optarg); break;
+            case 'd': delay_ms = atoi(optarg); break;
+            case 'l': loss = atoi(optarg); break;
+            case 't': fake = optarg; break;
+            default:
+                printf("%s", usage);
+                return -1;
+        }
+    }
+
+    int drop_change_ip = strcmp(fake, "none") != 0;
+    int drop_change_port = !strcmp(fake, "port-restricted") || !strncmp(fake, "symmetric", strlen("symmetric"));
+    int symmetric = !strncmp(fake, "symmetric", strlen("symmetric"));
+    int random_ports = !strcmp(fake, "symmetric-random");
+
+    // [ip][port], 0 for primary, 1 for alternate
+    int socks[2][2];
+    socks[0][0] = open_sock(ip1, port1);
+    socks[0][1] = open_sock(ip1, port2);
+    socks[1][0] = open_sock(ip2, port1);
+    socks[1][1] = open_sock(ip2, port2);
+    srand(getpid());
+
+    struct pollfd fds[4];
+    int i;
+    for (i = 0; i < 4; ++i) {
+        fds[i].fd = socks[i / 2][i % 2];
+        fds[i].events = POLLIN;
+    }
+
+    for (; ;) {
+        int timeout = -1;
+        uint64_t now = now_ms();
+        if (num_pending) {
+            timeout = queue[0].due > now ? queue[0].due - now : 0;
+        }
+
+        if (poll(fds, 4, timeout) > 0) {
+            for (i = 0; i < 4; ++i) {
+                if (!(fds[i].revents & POLLIN)) {
+                    continue;
+                }
+
+                char req[MAX_STUN_MESSAGE_LENGTH];
+                struct sockaddr_in from;
+                socklen_t fromlen = sizeof(from);
+                int n = recvfrom(fds[i].fd, req, sizeof(req), 0, (struct sockaddr*)&from, &fromlen);
+                struct stun_message msg;
+                if (stun_decode(req, n, &msg) < 0 || msg.type != BindRequest) {
+                    continue;
+                }
+                if (loss && rand() % 100 < loss) {
+                    continue;
+                }
+
+                uint32_t change = msg.change;
+                if (((change & ChangeIpFlag) && drop_change_ip) || ((change & ChangePortFlag) && drop_change_port)) {
+                    continue;
+                }
+
+                int ip_idx = i / 2, port_idx = i % 2;
+                if (change & ChangeIpFlag) {
+                    ip_idx ^= 1;
+                }
+                if (change & ChangePortFlag) {
+                    port_idx ^= 1;
+                }
+
+                // a symmetric NAT maps every destination to its own port
+                uint16_t mapped_port = ntohs(from.sin_port);
+                if (symmetric) {
+                    mapped_port = fake_mapping(&from, i, random_ports);
+                }
+
+                if (num_pending == MAX_PENDING) {
+                    continue;
+                }
+                struct pending* p = &queue[num_pending++];
+                StunAtrAddress mapped = {IPv4Family, mapped_port, {ntohl(from.sin_addr.s_addr)}};
+                StunAtrAddress changed = {IPv4Family, port2, {ntohl(inet_addr(ip2))}};
+                // requests with the magic cookie get XOR-MAPPED-ADDRESS as well
+                p->len = stun_encode_bind_response(p->buf, sizeof(p->buf), msg.tid, &mapped, &changed);
+                p->sock = socks[ip_idx][port_idx];
+                p->to = from;
+                p->due = now_ms() + delay_ms;
+            }
+        }
+
+        // the delay is constant, so the queue stays ordered by due time
+        now = now_ms();
+        while (num_pending && queue[0].due <= now) {
+            sendto(queue[0].sock, queue[0].buf, queue[0].len, 0, (struct sockaddr*)&queue[0].to, sizeof(queue[0].to));
+            memmove(queue, queue + 1, (num_pending - 1) * sizeof(struct pending));
+            num_pending--;
+        }
+    }
+
+    return 0;
+}
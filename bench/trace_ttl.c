@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ttl_trace.h"
+
+/*
+ * the ttl discovery on its own: every hop that answered, where our NAT seems
+ * to be and the ttl the limited probes would get. bench/ttl_netns.sh runs it
+ * across a chain of network namespaces.
+ */
+
+int main(int argc, char** argv) {
+    int max_ttl = TTL_TRACE_MAX_HOPS;
+    int timeout_ms = TTL_TRACE_TIMEOUT_MS;
+
+    static char usage[] = "usage: [-m MAX_TTL] [-w TIMEOUT_MS] PEER_IP\n";
+    int opt;
+    while ((opt = getopt(argc, argv, "m:w:")) != -1) {
+        switch (opt) {
+            case 'm': max_ttl = atoi(optarg); break;
+            case 'w': timeout_ms = atoi(optarg); break;
+            default:
+                printf("%s", usage);
+                return -1;
+        }
+    }
+    if (optind >= argc) {
+        printf("%s", usage);
+        return -1;
+    }
+
+    struct ttl_trace t;
+    if (ttl_trace_run(&t, argv[optind], max_ttl, timeout_ms) < 0) {
+        perror("trace");
+        return -1;
+    }
+
+    int ttl;
+    for (ttl = 1; ttl <= t.max_ttl; ++ttl) {
+        if (t.target_hop == ttl) {
+            printf("%2d  %s (peer)\n", ttl, argv[optind]);
+            break;
+        }
+        struct in_addr addr = {t.hops[ttl]};
+        printf("%2d  %s\n", ttl, t.hops[ttl] ? inet_ntoa(addr) : "*");
+    }
+    printf("our NAT at hop %d, peer at hop %d, ttl %d\n", ttl_trace_nat_hop(&t), t.target_hop, ttl_trace_pick(&t, 0));
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#!/bin/bash
+#
+# ttl discovery across a chain of network namespaces joined by veth pairs,
+# one namespace per hop: the client, our NAT, the routers on the way and the
+# peer's NAT at the end. the NATs don't translate, only the addresses they
+# answer from matter. every chain prints the trace and checks the ttl picked.
+#
+# usage: sudo bench/ttl_netns.sh, from the top directory after make benchmarks
+
+PREFIX=ttl$$
+FAILED=0
+
+cleanup() {
+    for ns in $(ip netns list | awk '{print $1}' | grep "^$PREFIX"); do
+        ip netns del $ns
+    done
+}
+trap cleanup EXIT
+
+# chain NAME EXPECTED_TTL SUBNET... , link i joins hop i and i + 1, hop i + 1 is .2 on it
+chain() {
+    local name=$1 expected=$2
+    shift 2
+    local subnets=("$@") n=$# i j
+    for ((i = 0; i <= n; ++i)); do
+        ip netns add $PREFIX$i
+        ip netns exec $PREFIX$i ip link set lo up
+        ip netns exec $PREFIX$i sysctl -qw net.ipv4.ip_forward=1
+    done
+    for ((i = 0; i < n; ++i)); do
+        ip link add ${PREFIX}l${i}a netns $PREFIX$i type veth peer name ${PREFIX}l${i}b netns $PREFIX$((i + 1))
+        ip netns exec $PREFIX$i ip addr add ${subnets[i]}.1/24 dev ${PREFIX}l${i}a
+        ip netns exec $PREFIX$i ip link set ${PREFIX}l${i}a up
+        ip netns exec $PREFIX$((i + 1)) ip addr add ${subnets[i]}.2/24 dev ${PREFIX}l${i}b
+        ip netns exec $PREFIX$((i + 1)) ip link set ${PREFIX}l${i}b up
+    done
+    # out towards the peer, back by the subnets behind
+    for ((i = 0; i < n - 1; ++i)); do
+        ip netns exec $PREFIX$i ip route add default via ${subnets[i]}.2
+    done
+    for ((i = 2; i <= n; ++i)); do
+        for ((j = 0; j < i - 1; ++j)); do
+            ip netns exec $PREFIX$i ip route add ${subnets[j]}.0/24 via ${subnets[i - 1]}.1
+        done
+    done
+
+    echo "== $name"
+    local out
+    out=$(ip netns exec ${PREFIX}0 bench/trace_ttl ${subnets[n - 1]}.2)
+    echo "$out"
+    if [[ $(echo "$out" | tail -1) == *"ttl $expected" ]]; then
+        echo "ok"
+    else
+        echo "FAILED, expected ttl $expected"
+        FAILED=1
+    fi
+    cleanup
+}
+
+chain "home NAT, two routers, peer NAT" 2 192.168.1 198.51.100 198.51.101 203.0.113
+chain "home NAT behind a carrier grade NAT" 3 192.168.1 100.64.0 198.51.100 203.0.113
+chain "no NAT of ours, the peer's answers" 0 198.51.100 198.51.101 203.0.113
+chain "peer NAT right behind ours, no ttl fits" 0 192.168.1 203.0.113
+
+exit $FAILED
@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+#include "burst.h"
+#include "uring.h"
+#include "metrics.h"
+
+#define DEFAULT_NUM_OF_SOCKS 700
+#define DEFAULT_BATCH_SIZE 50
+#define DEFAULT_GAP_US (10 * 1000)
+#define URING_ENTRIES 1024
+
+void burst_default_config(struct burst_config* cfg) {
+    cfg->num_socks = DEFAULT_NUM_OF_SOCKS;
+    cfg->probes_per_sock = 1;
+    cfg->batch_size = DEFAULT_BATCH_SIZE;
+    cfg->gap_us = DEFAULT_GAP_US;
+    cfg->ttl = 0;
+    cfg->use_uring = 0;
+}
+
+static int open_probe_socket(int ttl, int recverr) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // send short ttl packets to avoid triggering flooding protection of NAT in front of peer
+    if (ttl > 0) {
+        setsockopt(fd, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
+    }
+    // an unconnected socket hears of ICMP errors only with IP_RECVERR, see probe_set_wait()
+    if (recverr) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_IP, IP_RECVERR, &on, sizeof(on));
+    }
+
+    return fd;
+}
+
+// fire all probes of one socket with a single syscall
+static int fire_socket(int fd, struct sockaddr_in peer_addr, const uint16_t* ports, int n) {
+    static const char dummy = 'c';
+    struct sockaddr_in addrs[MAX_PROBES_PER_SOCK];
+    struct mmsghdr msgs[MAX_PROBES_PER_SOCK];
+    struct iovec iov = {(void*)&dummy, 1};
+
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+
+    int i;
+    for (i = 0; i < n; ++i) {
+        addrs[i] = peer_addr;
+        addrs[i].sin_port = htons(ports[i]);
+
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int sent = 0, reported = 0;
+    while (sent < n) {
+        int ret = sendmmsg(fd, msgs + sent, n - sent, 0);
+        if (ret < 0) {
+            // an ICMP error about an earlier probe fails the send instead, probe_set_wait() reads it all the same
+            if (errno == EINTR || ((errno == ECONNREFUSED || errno == EHOSTUNREACH || errno == ENETUNREACH)
+                    && ++reported <= n)) {
+                continue;
+            }
+            return sent ? sent : -1;
+        }
+        sent += ret;
+    }
+
+    return sent;
+}
+
+int burst_spray(int fd, struct sockaddr_in peer_addr, const uint16_t* ports, int n) {
+    int sent = 0;
+    while (sent < n) {
+        int chunk = n - sent < MAX_PROBES_PER_SOCK ? n - sent : MAX_PROBES_PER_SOCK;
+        int ret = fire_socket(fd, peer_addr, ports + sent, chunk);
+        if (ret <= 0) {
+            break;
+        }
+        sent += ret;
+    }
+    metrics_add(ProbesSent, sent);
+    metrics_add(ProbesFailed, n - sent);
+
+    return sent ? sent : -1;
+}
+
+// open and fire the sockets up to batch_end, one socket()/sendmmsg() pair each
+static int syscall_batch(struct burst* b, const struct burst_config* cfg, struct probe_set* set,
+        struct sockaddr_in peer_addr, const uint16_t* ports, int per_sock, int batch_end) {
+    for (; b->num_socks < batch_end; b->num_socks++) {
+        // the last socket of a batch is the first to be refused by a flooding protection,
+        // one of them listening for ICMP errors is enough and costs one setsockopt() a batch
+        int fd = open_probe_socket(cfg->ttl, set && b->num_socks == batch_end - 1);
+        if (fd < 0) {
+            // NAT in front of us or the kernel wouldn't tolerate more sockets
+            b->error = errno;
+            return -1;
+        }
+
+        b->socks[b->num_socks] = fd;
+        if (set) {
+            probe_set_add(set, fd);
+        }
+        int n = fire_socket(fd, peer_addr, ports + b->num_socks * per_sock, per_sock);
+        if (n < 0) {
+            // may trigger flooding protection
+            b->error = errno;
+            close(fd);
+            return -1;
+        }
+        b->probes_sent += n;
+    }
+
+    return 0;
+}
+
+// everything an in-flight sendmsg points to, alive until its completion
+struct uring_probe {
+    struct sockaddr_in addr;
+    struct msghdr msg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+};
+
+struct uring_burst {
+    struct uring ring;
+    int epoll_op;                  // EPOLL_CTL can go through the ring too
+    int* fds;                      // sockets of the current batch
+    struct uring_probe* probes;
+    struct epoll_event* events;
+    int max_batch;                 // sockets and probes the buffers have room for
+    int max_probes;
+    struct iovec iov;
+};
+
+static const char dummy_probe = 'c';
+
+struct uring_burst* uring_burst_open(void) {
+    struct uring_burst* u = calloc(1, sizeof(struct uring_burst));
+    if (u == NULL) {
+        return NULL;
+    }
+    if (uring_init(&u->ring, URING_ENTRIES) < 0) {
+        free(u);
+        return NULL;
+    }
+    if (!uring_supports(&u->ring, IORING_OP_SOCKET) || !uring_supports(&u->ring, IORING_OP_SENDMSG)) {
+        uring_destroy(&u->ring);
+        free(u);
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+    u->epoll_op = uring_supports(&u->ring, IORING_OP_EPOLL_CTL);
+    u->iov.iov_base = (void*)&dummy_probe;
+    u->iov.iov_len = 1;
+
+    return u;
+}
+
+void uring_burst_close(struct uring_burst* u) {
+    if (u == NULL) {
+        return;
+    }
+    free(u->fds);
+    free(u->probes);
+    free(u->events);
+    uring_destroy(&u->ring);
+    free(u);
+}
+
+// grow the buffers to a batch of batch_size sockets, they stay that big for the next bursts
+static int uring_burst_reserve(struct uring_burst* u, int batch_size, int per_sock) {
+    if (batch_size > u->max_batch) {
+        int* fds = realloc(u->fds, batch_size * sizeof(int));
+        if (fds == NULL) {
+            return -1;
+        }
+        u->fds = fds;
+        struct epoll_event* events = realloc(u->events, batch_size * sizeof(struct epoll_event));
+        if (events == NULL) {
+            return -1;
+        }
+        u->events = events;
+        u->max_batch = batch_size;
+    }
+    if (batch_size * per_sock > u->max_probes) {
+        struct uring_probe* probes = realloc(u->probes, batch_size * per_sock * sizeof(struct uring_probe));
+        if (probes == NULL) {
+            return -1;
+        }
+        u->probes = probes;
+        u->max_probes = batch_size * per_sock;
+    }
+
+    return 0;
+}
+
+/*
+ * reap n completions, the result of the one tagged i goes to results[i].
+ * returns the number of failed operations, the errno of one of them in *error
+ */
+static int reap(struct uring* r, int n, int* results, int* error) {
+    int reaped = 0, failed = 0;
+    while (reaped < n) {
+        struct io_uring_cqe* cqe = uring_peek_cqe(r);
+        if (cqe == NULL) {
+            if (uring_submit(r, 1) < 0) {
+                *error = errno;
+                return failed + n - reaped;
+            }
+            continue;
+        }
+
+        if (results) {
+            results[cqe->user_data] = cqe->res;
+        }
+        if (cqe->res < 0) {
+            *error = -cqe->res;
+            failed++;
+        }
+        uring_cqe_seen(r);
+        reaped++;
+    }
+
+    return failed;
+}
+
+/*
+ * a free sqe. a full ring is drained first, so no more operations than
+ * URING_ENTRIES are ever in flight and the completion queue can't overflow
+ */
+static struct io_uring_sqe* next_sqe(struct uring* r, int* in_flight, int* results, int* failed, int* error) {
+    if (*in_flight == URING_ENTRIES) {
+        *failed += reap(r, *in_flight, results, error);
+        *in_flight = 0;
+    }
+    (*in_flight)++;
+
+    return uring_get_sqe(r);
+}
+
+static void prep_probe(struct uring_probe* p, struct iovec* iov, struct sockaddr_in peer_addr, uint16_t port, int ttl) {
+    memset(&p->msg, 0, sizeof(p->msg));
+    p->addr = peer_addr;
+    p->addr.sin_port = htons(port);
+    p->msg.msg_name = &p->addr;
+    p->msg.msg_namelen = sizeof(p->addr);
+    p->msg.msg_iov = iov;
+    p->msg.msg_iovlen = 1;
+
+    // no setsockopt round trip, the ttl rides along with each packet
+    if (ttl > 0) {
+        p->msg.msg_control = p->control.buf;
+        p->msg.msg_controllen = sizeof(p->control.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&p->msg);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_TTL;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &ttl, sizeof(int));
+    }
+}
+
+/*
+ * the same batch in two rounds of submissions: every socket() of the batch
+ * first, then the epoll registrations and every probe of every socket
+ */
+static int uring_batch(struct uring_burst* u, struct burst* b, const struct burst_config* cfg, struct probe_set* set,
+        struct sockaddr_in peer_addr, const uint16_t* ports, int per_sock, int batch_end) {
+    struct uring* r = &u->ring;
+    int first = b->num_socks;
+    int n = batch_end - first;
+    int i, k, error = 0, failed = 0, in_flight = 0;
+
+    for (i = 0; i < n; ++i) {
+        struct io_uring_sqe* sqe = next_sqe(r, &in_flight, u->fds, &failed, &error);
+        sqe->opcode = IORING_OP_SOCKET;
+        sqe->fd = AF_INET;
+        sqe->off = SOCK_DGRAM;
+        sqe->user_data = i;
+    }
+    failed += reap(r, in_flight, u->fds, &error);
+    in_flight = 0;
+
+    // keep every socket that was opened, stop after this batch if one wasn't
+    int sends = 0, send_failed = 0;
+    for (i = 0; i < n; ++i) {
+        int fd = u->fds[i];
+        if (fd < 0) {
+            continue;
+        }
+        b->socks[b->num_socks++] = fd;
+
+        if (set && u->epoll_op) {
+            struct io_uring_sqe* sqe = next_sqe(r, &in_flight, NULL, &send_failed, &error);
+            u->events[i].events = EPOLLIN;
+            u->events[i].data.fd = fd;
+            sqe->opcode = IORING_OP_EPOLL_CTL;
+            sqe->fd = set->epfd;
+            sqe->off = fd;
+            sqe->len = EPOLL_CTL_ADD;
+            sqe->addr = (uintptr_t)&u->events[i];
+            set->count++;
+        } else if (set) {
+            probe_set_add(set, fd);
+        }
+
+        for (k = 0; k < per_sock; ++k) {
+            struct uring_probe* p = &u->probes[i * per_sock + k];
+            struct io_uring_sqe* sqe = next_sqe(r, &in_flight, NULL, &send_failed, &error);
+            prep_probe(p, &u->iov, peer_addr, ports[(first + i) * per_sock + k], cfg->ttl);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t)&p->msg;
+            sqe->len = 1;
+            sends++;
+        }
+    }
+    send_failed += reap(r, in_flight, NULL, &error);
+
+    // a failed registration is counted as a failed probe, close enough
+    b->probes_sent += sends - send_failed;
+    if (failed || send_failed) {
+        b->error = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+int burst_run(struct burst* b, const struct burst_config* cfg, struct uring_burst* u, struct probe_set* set,
+        struct sockaddr_in peer_addr, const uint16_t* ports) {
+    int per_sock = cfg->probes_per_sock;
+    if (per_sock < 1) {
+        per_sock = 1;
+    } else if (per_sock > MAX_PROBES_PER_SOCK) {
+        per_sock = MAX_PROBES_PER_SOCK;
+    }
+    int batch_size = cfg->batch_size > 0 ? cfg->batch_size : cfg->num_socks;
+
+    b->num_socks = 0;
+    b->probes_sent = 0;
+    b->error = 0;
+    b->ready_fd = -1;
+    b->uring = 0;
+    b->socks = malloc(cfg->num_socks * sizeof(int));
+    if (b->socks == NULL) {
+        b->error = errno;
+        return -1;
+    }
+
+    // falls back to plain syscalls when io_uring is missing or disabled
+    struct uring_burst* own = NULL;
+    if (cfg->use_uring && u == NULL) {
+        u = own = uring_burst_open();
+    }
+    if (cfg->use_uring && u && uring_burst_reserve(u, batch_size, per_sock) == 0) {
+        b->uring = 1;
+    }
+
+    while (b->num_socks < cfg->num_socks) {
+        int batch_end = b->num_socks + batch_size;
+        if (batch_end > cfg->num_socks) {
+            batch_end = cfg->num_socks;
+        }
+
+        int ret = b->uring ? uring_batch(u, b, cfg, set, peer_addr, ports, per_sock, batch_end)
+            : syscall_batch(b, cfg, set, peer_addr, ports, per_sock, batch_end);
+        if (ret < 0) {
+            break;
+        }
+
+        // peer already answered one of our probes, no need to go on
+        if (set && (b->ready_fd = probe_set_wait(set, 0)) >= 0) {
+            break;
+        }
+
+        if (b->num_socks < cfg->num_socks && cfg->gap_us > 0) {
+            usleep(cfg->gap_us);
+        }
+    }
+
+    uring_burst_close(own);
+    // once per burst, the per-probe paths stay as they are
+    metrics_add(ProbeSockets, b->num_socks);
+    metrics_add(ProbesSent, b->probes_sent);
+    metrics_add(ProbesFailed, b->num_socks * per_sock - b->probes_sent);
+
+    return b->probes_sent ? b->probes_sent : -1;
+}
+
+void burst_close(struct burst* b, int keep_fd) {
+    int i;
+    for (i = 0; i < b->num_socks; ++i) {
+        if (b->socks[i] != keep_fd) {
+            close(b->socks[i]);
+        }
+    }
+
+    free(b->socks);
+    b->socks = NULL;
+    b->num_socks = 0;
+}
@@ -0,0 +1,68 @@
+#ifndef BURST_H
+#define BURST_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "probe_set.h"
+
+// max destinations sprayed from one probe socket in a single sendmmsg()
+#define MAX_PROBES_PER_SOCK 64
+
+struct burst_config {
+    int num_socks;        // number of probe sockets to open
+    int probes_per_sock;  // destination ports sprayed from each socket
+    int batch_size;       // sockets opened and fired per batch
+    int gap_us;           // pause between two batches, in microseconds
+    int ttl;              // ttl of probe packets, 0 keeps the system default
+    int use_uring;        // submit sockets and probes through io_uring when the kernel has it
+};
+
+struct burst {
+    int* socks;           // opened probe sockets, owned by the burst
+    int num_socks;        // number of sockets actually opened
+    int probes_sent;
+    int error;            // errno of the failure that stopped the burst, 0 if none
+    int ready_fd;         // probe socket that got an answer during the burst, -1 if none
+    int uring;            // 1 if the burst went through io_uring
+};
+
+// an io_uring and the buffers of its batches, kept from one burst to the next
+struct uring_burst;
+
+void burst_default_config(struct burst_config* cfg);
+
+// NULL with errno set if the kernel has no io_uring or can't open sockets through it
+struct uring_burst* uring_burst_open(void);
+
+void uring_burst_close(struct uring_burst* u);
+
+/*
+ * open cfg->num_socks probe sockets and send cfg->probes_per_sock probes from
+ * each of them to peer_addr, using ports[] as the destination ports
+ * (num_socks * probes_per_sock entries). sockets are fired in batches with
+ * one sendmmsg() per socket and cfg->gap_us between batches. with
+ * cfg->use_uring a batch takes two io_uring submissions instead, one for
+ * the sockets and one for their probes and epoll registrations, through u
+ * or, if that is NULL, a ring set up for this burst alone.
+ * if set is not NULL every socket is registered to it as soon as it's opened,
+ * and the burst stops as soon as one of them becomes readable (b->ready_fd).
+ * without io_uring, the last socket of every batch also has ICMP errors
+ * reported, which probe_set_wait() counts in set->refused.
+ * stops early if the NAT or the kernel refuses more sockets or packets,
+ * returns the number of probes sent or -1 if nothing could be sent.
+ */
+int burst_run(struct burst* b, const struct burst_config* cfg, struct uring_burst* u, struct probe_set* set,
+        struct sockaddr_in peer_addr, const uint16_t* ports);
+
+/*
+ * send n probes from the one socket fd to peer_addr, ports[] as the
+ * destination ports, MAX_PROBES_PER_SOCK a sendmmsg(). returns the number
+ * sent or -1 if none was
+ */
+int burst_spray(int fd, struct sockaddr_in peer_addr, const uint16_t* ports, int n);
+
+// close every probe socket except keep_fd (pass -1 to close them all)
+void burst_close(struct burst* b, int keep_fd);
+
+#endif
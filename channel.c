@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#include "channel.h"
+
+// segments the kernel cuts from one send, UDP_MAX_SEGMENTS of older kernels
+#define MAX_GSO_SEGMENTS 64
+#define MAX_UDP_PAYLOAD 65507
+#define SOCKET_BUFFER (4 * 1024 * 1024)
+
+void channel_default_config(struct channel_config* cfg) {
+    cfg->payload = DEFAULT_CHANNEL_PAYLOAD;
+    cfg->use_mmsg = 1;
+    cfg->use_gso = 1;
+    cfg->use_gro = 1;
+}
+
+static socklen_t addr_len(const struct sockaddr_in6* addr) {
+    return addr->sin6_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+// the same address and port, of either family
+static int same_addr(const struct sockaddr_in6* a, const struct sockaddr_in6* b) {
+    if (a->sin6_family != b->sin6_family) {
+        return 0;
+    }
+    if (a->sin6_family == AF_INET6) {
+        return a->sin6_port == b->sin6_port && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr));
+    }
+    const struct sockaddr_in* a4 = (const struct sockaddr_in*)a;
+    const struct sockaddr_in* b4 = (const struct sockaddr_in*)b;
+
+    return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+static void put_header(char* buf, uint16_t flags, uint32_t seq) {
+    uint16_t magic = htons(CHANNEL_MAGIC);
+    flags = htons(flags);
+    seq = htonl(seq);
+    memcpy(buf, &magic, 2);
+    memcpy(buf + 2, &flags, 2);
+    memcpy(buf + 4, &seq, 4);
+}
+
+int channel_init(struct channel* ch, int sock, const struct sockaddr* peer, const struct channel_config* cfg) {
+    memset(ch, 0, sizeof(*ch));
+    ch->sock = sock;
+    memcpy(&ch->peer, peer, peer->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    if (cfg) {
+        ch->cfg = *cfg;
+    } else {
+        channel_default_config(&ch->cfg);
+    }
+    if (ch->cfg.payload < 1 || ch->cfg.payload > MAX_CHANNEL_PAYLOAD) {
+        errno = EINVAL;
+        return -1;
+    }
+    ch->seg = CHANNEL_HEADER_LENGTH + ch->cfg.payload;
+
+    // bursts of a whole ring shouldn't be dropped by the socket buffers
+    int size = SOCKET_BUFFER;
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    // both are per socket, older kernels refuse them and we go on without
+    if (ch->cfg.use_gso && ch->seg * 2 <= MAX_UDP_PAYLOAD
+            && setsockopt(sock, SOL_UDP, UDP_SEGMENT, &ch->seg, sizeof(ch->seg)) == 0) {
+        ch->gso = 1;
+    }
+    int on = 1;
+    if (ch->cfg.use_gro && setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0) {
+        ch->gro = 1;
+    }
+    // a coalesced run takes up to a whole datagram of the largest size
+    ch->rx_size = ch->gro ? MAX_UDP_PAYLOAD + 1 : ch->seg;
+
+    // zeroed, so whatever a caller leaves unwritten never leaks heap to the wire
+    ch->tx = calloc(CHANNEL_TX_SLOTS, ch->seg);
+    ch->rx = malloc(CHANNEL_RX_BATCH * ch->rx_size);
+    if (ch->tx == NULL || ch->rx == NULL) {
+        channel_destroy(ch);
+        return -1;
+    }
+
+    return 0;
+}
+
+char* channel_reserve(struct channel* ch) {
+    return ch->tx + ch->tx_queued * ch->seg + CHANNEL_HEADER_LENGTH;
+}
+
+int channel_commit(struct channel* ch, int len, uint16_t flags) {
+    if (len < 0 || len > ch->cfg.payload) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    put_header(ch->tx + ch->tx_queued * ch->seg, flags, ch->next_seq++);
+    ch->tx_len[ch->tx_queued++] = CHANNEL_HEADER_LENGTH + len;
+    if (ch->tx_queued == CHANNEL_TX_SLOTS) {
+        return channel_flush(ch);
+    }
+
+    return 0;
+}
+
+int channel_flush(struct channel* ch) {
+    struct mmsghdr msgs[CHANNEL_TX_SLOTS];
+    struct iovec iovs[CHANNEL_TX_SLOTS];
+    int datagrams[CHANNEL_TX_SLOTS];
+    int n = 0, i = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    while (i < ch->tx_queued) {
+        int len = ch->tx_len[i];
+        int j = i + 1;
+        // with GSO a run of full datagrams back to back is one send, only its last may be short
+        while (ch->gso && j < ch->tx_queued && ch->tx_len[j - 1] == ch->seg && j - i < MAX_GSO_SEGMENTS
+                && len + ch->tx_len[j] <= MAX_UDP_PAYLOAD) {
+            len += ch->tx_len[j++];
+        }
+
+        iovs[n].iov_base = ch->tx + i * ch->seg;
+        iovs[n].iov_len = len;
+        msgs[n].msg_hdr.msg_name = &ch->peer;
+        msgs[n].msg_hdr.msg_namelen = addr_len(&ch->peer);
+        msgs[n].msg_hdr.msg_iov = &iovs[n];
+        msgs[n].msg_hdr.msg_iovlen = 1;
+        datagrams[n++] = j - i;
+        i = j;
+    }
+
+    int sent = 0;
+    while (sent < n) {
+        int ret;
+        if (ch->cfg.use_mmsg) {
+            ret = sendmmsg(ch->sock, msgs + sent, n - sent, 0);
+        } else {
+            ret = sendmsg(ch->sock, &msgs[sent].msg_hdr, 0) < 0 ? -1 : 1;
+        }
+        ch->stats.syscalls++;
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // the device can't checksum segments, cut them ourselves from now on
+            if (errno == EIO && ch->gso && sent == 0) {
+                int off = 0;
+                setsockopt(ch->sock, SOL_UDP, UDP_SEGMENT, &off, sizeof(off));
+                ch->gso = 0;
+                return channel_flush(ch);
+            }
+            ch->tx_queued = 0;
+            return -1;
+        }
+
+        for (i = sent; i < sent + ret; ++i) {
+            ch->stats.sent += datagrams[i];
+            ch->stats.bytes_sent += iovs[i].iov_len - datagrams[i] * CHANNEL_HEADER_LENGTH;
+        }
+        sent += ret;
+    }
+    ch->tx_queued = 0;
+
+    return 0;
+}
+
+// read a batch of buffers, 0 if nothing came within timeout_ms
+static int fill(struct channel* ch, int timeout_ms) {
+    struct mmsghdr msgs[CHANNEL_RX_BATCH];
+    struct iovec iovs[CHANNEL_RX_BATCH];
+    struct sockaddr_in6 from[CHANNEL_RX_BATCH];
+    char control[CHANNEL_RX_BATCH][CMSG_SPACE(sizeof(int))];
+    int batch = ch->cfg.use_mmsg ? CHANNEL_RX_BATCH : 1;
+
+    int i;
+    memset(msgs, 0, batch * sizeof(struct mmsghdr));
+    for (i = 0; i < batch; ++i) {
+        iovs[i].iov_base = ch->rx + i * ch->rx_size;
+        iovs[i].iov_len = ch->rx_size;
+        msgs[i].msg_hdr.msg_name = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+
+    int n;
+    for (; ;) {
+        // only wait when the socket is empty, a busy receiver never polls
+        if (ch->cfg.use_mmsg) {
+            n = recvmmsg(ch->sock, msgs, batch, MSG_DONTWAIT, NULL);
+        } else {
+            n = recvmsg(ch->sock, &msgs[0].msg_hdr, MSG_DONTWAIT);
+            if (n >= 0) {
+                msgs[0].msg_len = n;
+                n = 1;
+            }
+        }
+        ch->stats.syscalls++;
+        if (n > 0) {
+            break;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+
+        struct pollfd fd = {ch->sock, POLLIN, 0};
+        int ready = poll(&fd, 1, timeout_ms);
+        if (ready <= 0) {
+            return ready;
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        ch->rx_len[i] = msgs[i].msg_len;
+        ch->rx_gso[i] = 0;
+        // the punched socket still gets stray probes from the others
+        if (!same_addr(&from[i], &ch->peer) || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+            ch->rx_len[i] = 0;
+            continue;
+        }
+
+        struct cmsghdr* cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                memcpy(&ch->rx_gso[i], CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+    }
+    ch->rx_count = n;
+    ch->rx_index = 0;
+    ch->rx_offset = 0;
+
+    return n;
+}
+
+// sequence and loss accounting, 0 if the datagram isn't one of ours or a duplicate
+static int accept_datagram(struct channel* ch, char* buf, int len, struct channel_msg* msg) {
+    uint16_t magic, flags;
+    uint32_t seq;
+    if (len < CHANNEL_HEADER_LENGTH) {
+        return 0;
+    }
+    memcpy(&magic, buf, 2);
+    memcpy(&flags, buf + 2, 2);
+    memcpy(&seq, buf + 4, 4);
+    if (ntohs(magic) != CHANNEL_MAGIC) {
+        return 0;
+    }
+    seq = ntohl(seq);
+
+    int32_t ahead = (int32_t)(seq - ch->expected);
+    if (ahead >= 0) {
+        // everything skipped counts as lost until it shows up
+        ch->stats.lost += ahead;
+        ch->window = ahead >= 63 ? 0 : ch->window << (ahead + 1);
+        ch->window |= 1;
+        ch->expected = seq + 1;
+    } else {
+        uint32_t back = -ahead - 1;
+        if (back < 64 && (ch->window & (1ULL << back))) {
+            ch->stats.duplicates++;
+            return 0;
+        }
+        if (back < 64) {
+            ch->window |= 1ULL << back;
+        }
+        ch->stats.reordered++;
+        if (ch->stats.lost) {
+            ch->stats.lost--;
+        }
+    }
+
+    msg->seq = seq;
+    msg->flags = ntohs(flags);
+    msg->data = buf + CHANNEL_HEADER_LENGTH;
+    msg->len = len - CHANNEL_HEADER_LENGTH;
+    ch->stats.received++;
+    ch->stats.bytes_received += msg->len;
+
+    return 1;
+}
+
+int channel_recv(struct channel* ch, struct channel_msg* msgs, int max, int timeout_ms) {
+    int n = 0;
+    while (n < max) {
+        if (ch->rx_index == ch->rx_count) {
+            if (n) {
+                break;
+            }
+            int ret = fill(ch, timeout_ms);
+            if (ret <= 0) {
+                return ret;
+            }
+        }
+
+        // a coalesced buffer holds segments of rx_gso bytes, the last one may be short
+        int i = ch->rx_index;
+        int len = ch->rx_len[i] - ch->rx_offset;
+        if (ch->rx_gso[i] && len > ch->rx_gso[i]) {
+            len = ch->rx_gso[i];
+        }
+        char* buf = ch->rx + i * ch->rx_size + ch->rx_offset;
+        ch->rx_offset += len;
+        if (len <= 0 || ch->rx_offset >= ch->rx_len[i]) {
+            ch->rx_index++;
+            ch->rx_offset = 0;
+        }
+
+        if (len > 0 && accept_datagram(ch, buf, len, &msgs[n])) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+void channel_destroy(struct channel* ch) {
+    free(ch->tx);
+    free(ch->rx);
+    ch->tx = NULL;
+    ch->rx = NULL;
+}
@@ -0,0 +1,105 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * data transfer over a punched socket. every datagram carries a small header
+ * with a sequence number, the receiver counts what's lost, late or duplicated.
+ * datagrams are queued in place in the channel's send ring and go out in
+ * batches with sendmmsg(), with UDP_SEGMENT letting the kernel cut runs of
+ * full datagrams itself. received datagrams are read in batches with
+ * recvmmsg(), with UDP_GRO the kernel hands over runs of them at once.
+ * payloads are written and read in the channel's own buffers, never copied.
+ */
+
+#define CHANNEL_HEADER_LENGTH 8
+#define CHANNEL_MAGIC 0x4e54
+// fits the IPv6 minimum MTU, so it crosses any path without fragmentation
+#define DEFAULT_CHANNEL_PAYLOAD 1200
+#define MAX_CHANNEL_PAYLOAD (65507 - CHANNEL_HEADER_LENGTH)
+// datagrams queued before the ring is flushed
+#define CHANNEL_TX_SLOTS 128
+// buffers per recvmmsg()
+#define CHANNEL_RX_BATCH 32
+
+// the last datagram of a transfer
+#define CHANNEL_FIN 0x0001
+
+struct channel_config {
+    int payload;   // payload bytes of a full datagram
+    int use_mmsg;  // batch with sendmmsg()/recvmmsg(), one syscall per datagram otherwise
+    int use_gso;   // UDP_SEGMENT, when the kernel has it
+    int use_gro;   // UDP_GRO, when the kernel has it
+};
+
+struct channel_stats {
+    uint64_t sent;
+    uint64_t bytes_sent;
+    uint64_t received;
+    uint64_t bytes_received;
+    uint64_t lost;        // sequence numbers skipped and never seen since
+    uint64_t reordered;   // arrived after a later one
+    uint64_t duplicates;  // dropped, seen already
+    uint64_t syscalls;
+};
+
+// a received datagram, data points into the channel until the next channel_recv()
+struct channel_msg {
+    uint32_t seq;
+    uint16_t flags;
+    char* data;
+    int len;
+};
+
+struct channel {
+    int sock;
+    // a struct sockaddr_in or a struct sockaddr_in6, the family tells
+    struct sockaddr_in6 peer;
+    struct channel_config cfg;
+    int seg;     // header and full payload
+    int gso;     // 1 if UDP_SEGMENT is on
+    int gro;     // 1 if UDP_GRO is on
+    struct channel_stats stats;
+
+    uint32_t next_seq;
+    char* tx;    // CHANNEL_TX_SLOTS slots of seg bytes, back to back
+    int tx_len[CHANNEL_TX_SLOTS];
+    int tx_queued;
+
+    // the receive window: next sequence number expected, bit i is expected - 1 - i
+    uint32_t expected;
+    uint64_t window;
+    char* rx;    // CHANNEL_RX_BATCH buffers of rx_size bytes
+    int rx_size;
+    int rx_len[CHANNEL_RX_BATCH];
+    int rx_gso[CHANNEL_RX_BATCH];
+    int rx_count;
+    int rx_index;
+    int rx_offset;
+};
+
+void channel_default_config(struct channel_config* cfg);
+
+// sock is the punched socket, peer the address that answered on it
+int channel_init(struct channel* ch, int sock, const struct sockaddr* peer, const struct channel_config* cfg);
+
+// room for the payload of the next datagram, cfg.payload bytes
+char* channel_reserve(struct channel* ch);
+
+// queue the reserved datagram with len bytes of payload, the ring is flushed once full
+int channel_commit(struct channel* ch, int len, uint16_t flags);
+
+// send everything queued
+int channel_flush(struct channel* ch);
+
+/*
+ * up to max datagrams, waiting up to timeout_ms for the first one.
+ * returns how many, 0 on timeout, -1 on error
+ */
+int channel_recv(struct channel* ch, struct channel_msg* msgs, int max, int timeout_ms);
+
+void channel_destroy(struct channel* ch);
+
+#endif
@@ -0,0 +1,173 @@
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "keepalive.h"
+#include "metrics.h"
+
+// the same one byte datagram as a probe, whatever reads the socket takes it for one
+static const char keepalive_byte = 'c';
+
+// everything an in-flight sendmsg points to, alive until its completion
+struct keepalive_msg {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+};
+
+int keepalive_set_init(struct keepalive_set* ks, int use_uring, uint64_t now) {
+    memset(&ks->stats, 0, sizeof(ks->stats));
+    timer_wheel_init(&ks->wheel, KEEPALIVE_TICK_MS, now);
+
+    ks->uring = 0;
+    if (use_uring && uring_init(&ks->ring, KEEPALIVE_BATCH) == 0) {
+        if (uring_supports(&ks->ring, IORING_OP_SENDMSG)) {
+            ks->uring = 1;
+        } else {
+            uring_destroy(&ks->ring);
+        }
+    }
+
+    return 0;
+}
+
+static socklen_t addr_len(const struct sockaddr_in6* addr) {
+    return addr->sin6_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+void keepalive_init(struct keepalive* k, int sock, const struct sockaddr* addr, int interval_ms) {
+    memset(k, 0, sizeof(*k));
+    timer_init(&k->timer);
+    k->sock = sock;
+    if (addr) {
+        memcpy(&k->addr, addr, addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    }
+    k->interval_ms = interval_ms;
+}
+
+void keepalive_add(struct keepalive_set* ks, struct keepalive* k, uint64_t now) {
+    timer_schedule(&ks->wheel, &k->timer, now + k->interval_ms);
+}
+
+void keepalive_remove(struct keepalive_set* ks, struct keepalive* k) {
+    timer_cancel(&ks->wheel, &k->timer);
+}
+
+static void prep_msg(struct keepalive_msg* m, struct keepalive* k) {
+    memset(&m->msg, 0, sizeof(m->msg));
+    m->iov.iov_base = (void*)&keepalive_byte;
+    m->iov.iov_len = 1;
+    m->msg.msg_name = &k->addr;
+    m->msg.msg_namelen = addr_len(&k->addr);
+    m->msg.msg_iov = &m->iov;
+    m->msg.msg_iovlen = 1;
+
+    if (k->ttl > 0) {
+        m->msg.msg_control = m->control.buf;
+        m->msg.msg_controllen = sizeof(m->control.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&m->msg);
+        // the hop limit is IPv6's ttl
+        cmsg->cmsg_level = k->addr.sin6_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+        cmsg->cmsg_type = k->addr.sin6_family == AF_INET6 ? IPV6_HOPLIMIT : IP_TTL;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &k->ttl, sizeof(int));
+    }
+}
+
+// submit the queued sends in one go and wait for all of them
+static void submit_batch(struct keepalive_set* ks, int n) {
+    if (n == 0) {
+        return;
+    }
+
+    ks->stats.syscalls++;
+    if (uring_submit(&ks->ring, n) < 0) {
+        ks->stats.failed += n;
+        return;
+    }
+
+    int reaped = 0;
+    while (reaped < n) {
+        struct io_uring_cqe* cqe = uring_peek_cqe(&ks->ring);
+        if (cqe == NULL) {
+            ks->stats.syscalls++;
+            if (uring_submit(&ks->ring, 1) < 0) {
+                ks->stats.failed += n - reaped;
+                return;
+            }
+            continue;
+        }
+
+        if (cqe->res < 0) {
+            ks->stats.failed++;
+        } else {
+            ks->stats.sent++;
+        }
+        uring_cqe_seen(&ks->ring);
+        reaped++;
+    }
+}
+
+int keepalive_run(struct keepalive_set* ks, uint64_t now) {
+    struct keepalive_msg msgs[KEEPALIVE_BATCH];
+    struct timer* t;
+    int n = timer_wheel_advance(&ks->wheel, now, &t);
+    if (n == 0) {
+        return 0;
+    }
+    ks->stats.wakeups++;
+    uint64_t sent = ks->stats.sent;
+
+    int queued = 0;
+    while (t) {
+        struct keepalive* k = (struct keepalive*)t;
+        t = t->next;
+        timer_schedule(&ks->wheel, &k->timer, now + k->interval_ms);
+
+        if (k->fire) {
+            k->fire(k, now);
+            continue;
+        }
+
+        struct keepalive_msg* m = &msgs[queued];
+        prep_msg(m, k);
+        if (!ks->uring) {
+            ks->stats.syscalls++;
+            if (sendmsg(k->sock, &m->msg, MSG_DONTWAIT) < 0) {
+                ks->stats.failed++;
+            } else {
+                ks->stats.sent++;
+            }
+            continue;
+        }
+
+        struct io_uring_sqe* sqe = uring_get_sqe(&ks->ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = k->sock;
+        sqe->addr = (uintptr_t)&m->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;
+        if (++queued == KEEPALIVE_BATCH) {
+            submit_batch(ks, queued);
+            queued = 0;
+        }
+    }
+    submit_batch(ks, queued);
+    metrics_add(KeepalivesSent, ks->stats.sent - sent);
+
+    return n;
+}
+
+int keepalive_timeout(struct keepalive_set* ks, uint64_t now) {
+    return timer_wheel_timeout(&ks->wheel, now);
+}
+
+void keepalive_set_destroy(struct keepalive_set* ks) {
+    if (ks->uring) {
+        uring_destroy(&ks->ring);
+        ks->uring = 0;
+    }
+}
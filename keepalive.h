@@ -0,0 +1,74 @@
+#ifndef KEEPALIVE_H
+#define KEEPALIVE_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "timer_wheel.h"
+#include "uring.h"
+
+/*
+ * keeps NAT bindings from expiring by sending a datagram through each of them
+ * every interval. all of them hang off one timing wheel, so a binding is added
+ * or dropped in O(1) and everything due within the same tick is refreshed by
+ * one wakeup, through io_uring in one submission per KEEPALIVE_BATCH when the
+ * kernel has it.
+ */
+
+// bindings due within the same tick are refreshed together
+#define KEEPALIVE_TICK_MS 1000
+// well below the 30 s some NATs forget an idle UDP mapping after
+#define PROBE_KEEPALIVE_INTERVAL_MS (15 * 1000)
+#define KEEPALIVE_BATCH 256
+
+struct keepalive;
+// refreshes k some other way than the keepalive datagram, it must not remove other bindings
+typedef void (*keepalive_fn)(struct keepalive* k, uint64_t now);
+
+struct keepalive {
+    // first, the wheel hands back timers
+    struct timer timer;
+    int sock;
+    // a struct sockaddr_in or a struct sockaddr_in6, the family tells
+    struct sockaddr_in6 addr;
+    int interval_ms;
+    // the ttl of the datagram, 0 for the socket's, so a probe keeps falling short of the peer's NAT
+    int ttl;
+    keepalive_fn fire;
+    void* ctx;
+};
+
+struct keepalive_stats {
+    uint64_t sent;
+    uint64_t failed;
+    uint64_t wakeups;       // keepalive_run() calls that had anything to refresh
+    uint64_t syscalls;
+};
+
+struct keepalive_set {
+    struct timer_wheel wheel;
+    int uring;
+    struct uring ring;
+    struct keepalive_stats stats;
+};
+
+// use_uring falls back to one sendmsg() per binding when the kernel has no io_uring
+int keepalive_set_init(struct keepalive_set* ks, int use_uring, uint64_t now);
+
+// a binding of sock to addr of either family, not scheduled yet
+void keepalive_init(struct keepalive* k, int sock, const struct sockaddr* addr, int interval_ms);
+
+// refreshed every interval from now on
+void keepalive_add(struct keepalive_set* ks, struct keepalive* k, uint64_t now);
+
+void keepalive_remove(struct keepalive_set* ks, struct keepalive* k);
+
+// refresh everything due by now, returns how many
+int keepalive_run(struct keepalive_set* ks, uint64_t now);
+
+// milliseconds until keepalive_run() has anything to do, -1 if nothing is scheduled
+int keepalive_timeout(struct keepalive_set* ks, uint64_t now);
+
+void keepalive_set_destroy(struct keepalive_set* ks);
+
+#endif
@@ -0,0 +1,550 @@
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "libnattraversal.h"
+#include "nat_traversal.h"
+#include "session.h"
+#include "stun_servers.h"
+#include "nat_cache.h"
+#include "resolver.h"
+#include "log.h"
+
+#define DEFAULT_SERVER_PORT 9988
+#define MAX_PATH_LENGTH 256
+#define RESOLVE_TIMEOUT_MS 5000
+
+// use public stun servers to detect port allocation rule
+static char *stun_servers[] = {
+    "stun.ideasip.com",
+    "stun.ekiga.net",
+    "203.183.172.196"
+};
+
+struct nt_context {
+    struct nt_config cfg;
+    client c;
+    struct session_loop loop;
+    // the cache entry of our NAT's profile, the loop adds the probe rate it learns
+    char profile_path[MAX_PATH_LENGTH + 32];
+    struct nat_cache_key profile_key;
+    // the nameserver of cfg, other contexts may have their own
+    struct resolver resolver;
+    // what this context prints and where, handed to the thread of every nt_*() call
+    struct logger log;
+};
+
+// scores and cached results of previous runs live in here
+static void default_state_dir(char* dir, size_t len) {
+    const char* home = getenv("HOME");
+    snprintf(dir, len, "%s/.nat_traversal", home ? home : ".");
+}
+
+static void cached_prediction(const struct nat_profile* profile, struct port_prediction* pred) {
+    // the allocation state is measured again right before punching anyway
+    memset(pred, 0, sizeof(*pred));
+    pred->pattern = profile->port_pattern;
+    pred->delta = profile->port_delta;
+    pred->base_port = profile->ext_port;
+}
+
+static int load_cached_profile(const char* state_dir, const char* local_ip, uint16_t local_port,
+        struct nat_profile* profile) {
+    char path[MAX_PATH_LENGTH + 32];
+    struct nat_cache_key key;
+    if (nat_cache_key_init(&key, local_ip, local_port) < 0) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/profiles", state_dir);
+    return nat_cache_lookup(path, &key, profile, time(NULL));
+}
+
+/*
+ * reuse the profile cached for this network when one binding request shows
+ * our external address hasn't changed, otherwise run the full detection
+ */
+static nat_type get_nat_profile(struct stun_server_list* servers, const char* state_dir,
+        const char* local_ip, uint16_t local_port, int force_detection,
+        struct nat_profile* profile, struct port_prediction* pred) {
+    char path[MAX_PATH_LENGTH + 32];
+    struct nat_cache_key key;
+    int cacheable = nat_cache_key_init(&key, local_ip, local_port) == 0;
+
+    // the same network likely has the same NAT, which takes probes as fast as before
+    uint32_t probe_rate = 0;
+    if (cacheable && !force_detection && load_cached_profile(state_dir, local_ip, local_port, profile) == 0) {
+        if (validate_nat_profile(profile, local_ip, local_port) == 0) {
+            verbose_log("cached NAT profile is still valid\n");
+            cached_prediction(profile, pred);
+            return profile->type;
+        }
+        verbose_log("cached NAT profile is stale, detecting again\n");
+        probe_rate = profile->probe_rate;
+    }
+
+    // try the server that answered fastest last time first
+    snprintf(path, sizeof(path), "%s/stun_servers", state_dir);
+    stun_servers_load(servers, path);
+    stun_servers_rank(servers);
+
+    nat_type type = detect_nat_type(servers, local_ip, local_port, profile);
+    profile->probe_rate = probe_rate;
+
+    // only a symmetric NAT needs its port allocation predicted
+    memset(pred, 0, sizeof(*pred));
+    if (type == SymmetricNAT && measure_port_prediction(profile, local_ip, pred) == 0) {
+        profile->port_pattern = pred->pattern;
+        profile->port_delta = pred->delta;
+    }
+
+    mkdir(state_dir, 0700);
+    if (stun_servers_save(servers, path) < 0) {
+        verbose_log("failed to save STUN server scores to %s\n", path);
+    }
+
+    if (cacheable && type != Error && type != Blocked) {
+        snprintf(path, sizeof(path), "%s/profiles", state_dir);
+        nat_cache_store(path, &key, profile, time(NULL), DEFAULT_PROFILE_TTL);
+    }
+
+    return type;
+}
+
+static int open_rendezvous_socket(const char* local_ip, uint16_t local_port, const struct sockaddr_in* server) {
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0) {
+        return -1;
+    }
+
+    int reuse_addr = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse_addr, sizeof(reuse_addr));
+
+    struct sockaddr_in local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr.s_addr = inet_addr(local_ip);
+    local_addr.sin_port = htons(local_port);
+    // connected, the server's datagrams keep coming here once a session binds the port too
+    if (bind(s, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0
+            || connect(s, (const struct sockaddr*)server, sizeof(*server)) < 0) {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+static void self_info(struct peer_info* self, const client* c, nat_type type, const struct nat_profile* profile,
+        const struct port_prediction* pred) {
+    memset(self, 0, sizeof(*self));
+    strncpy(self->ip, profile->ext_ip, 16);
+    self->port = profile->ext_port;
+    self->type = type;
+    self->pattern = pred->pattern;
+    self->delta = pred->delta;
+    self->base_port = pred->base_port;
+    memcpy(self->ip6, c->ip6, 16);
+    self->port6 = c->port6;
+    // the server puts in the port it sees our connection come from
+    self->tcp_port = c->tcp ? c->local_port : 0;
+}
+
+/*
+ * spec is an IPv6 address or "auto" for the first global one of our
+ * interfaces, usable if a socket binds to it at port. IPv6 rarely has a NAT,
+ * the address is taken as seen from the outside
+ */
+static int ipv6_candidate(const char* spec, uint16_t port, uint8_t* addr) {
+    struct in6_addr a;
+    if (strcmp(spec, "auto")) {
+        if (inet_pton(AF_INET6, spec, &a) != 1) {
+            return -1;
+        }
+    } else {
+        struct ifaddrs* ifs, *ifa;
+        if (getifaddrs(&ifs) < 0) {
+            return -1;
+        }
+        int found = 0;
+        for (ifa = ifs; ifa && !found; ifa = ifa->ifa_next) {
+            if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET6 || !(ifa->ifa_flags & IFF_UP)) {
+                continue;
+            }
+            a = ((struct sockaddr_in6*)ifa->ifa_addr)->sin6_addr;
+            found = !IN6_IS_ADDR_LOOPBACK(&a) && !IN6_IS_ADDR_LINKLOCAL(&a) && !IN6_IS_ADDR_MULTICAST(&a);
+        }
+        freeifaddrs(ifs);
+        if (!found) {
+            return -1;
+        }
+    }
+
+    int s = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (s < 0) {
+        return -1;
+    }
+    struct sockaddr_in6 local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin6_family = AF_INET6;
+    local_addr.sin6_addr = a;
+    local_addr.sin6_port = htons(port);
+    int ret = bind(s, (struct sockaddr*)&local_addr, sizeof(local_addr));
+    close(s);
+    memcpy(addr, &a, 16);
+
+    return ret;
+}
+
+/*
+ * the punch server sees the mapping of our source port as soon as we enroll,
+ * which validates a cached profile for free: a cone NAT must map to the same
+ * address and port, a symmetric one to the same address.
+ * a full detection only runs if that fails, then we enroll again with the result
+ */
+static nat_type rendezvous_udp(client* c, struct stun_server_list* servers, const char* state_dir,
+        const char* local_ip, uint16_t local_port, int force_detection,
+        struct nat_profile* profile, struct port_prediction* pred) {
+    struct peer_info self;
+    nat_type type = Error;
+
+    memset(profile, 0, sizeof(*profile));
+    memset(pred, 0, sizeof(*pred));
+    int cached = !force_detection && load_cached_profile(state_dir, local_ip, local_port, profile) == 0;
+    if (cached) {
+        type = profile->type;
+        cached_prediction(profile, pred);
+    }
+    self_info(&self, c, type, profile, pred);
+
+    c->sfd = open_rendezvous_socket(local_ip, local_port, &c->server_addr);
+    if (c->sfd < 0 || enroll_udp(self, c) < 0) {
+        return Error;
+    }
+    verbose_log("punch server sees us at %s:%d\n", c->ext_ip, c->ext_port);
+
+    if (cached && !strcmp(profile->ext_ip, c->ext_ip)
+            && (type == SymmetricNAT || profile->ext_port == c->ext_port)) {
+        verbose_log("cached NAT profile is still valid\n");
+        return type;
+    }
+
+    // detection binds our source port itself
+    close(c->sfd);
+    type = get_nat_profile(servers, state_dir, local_ip, local_port, 1, profile, pred);
+    self_info(&self, c, type, profile, pred);
+
+    c->sfd = open_rendezvous_socket(local_ip, local_port, &c->server_addr);
+    if (c->sfd < 0 || enroll_udp(self, c) < 0) {
+        return Error;
+    }
+
+    return type;
+}
+
+// the UDP socket, or the TCP connection once enrolled, enroll() cleans up after itself
+static void leave_server(client* c) {
+    if (c->udp) {
+        if (c->sfd >= 0) {
+            close(c->sfd);
+        }
+    } else if (c->id) {
+        rpc_close(&c->rpc);
+    }
+}
+
+static double elapsed_s(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void save_probe_rate(struct session_loop* l, uint32_t rate) {
+    nt_context* nt = l->ctx;
+    if (nat_cache_store(nt->profile_path, &nt->profile_key, &l->c->profile, time(NULL), DEFAULT_PROFILE_TTL) < 0) {
+        verbose_log("failed to save the probe rate to %s\n", nt->profile_path);
+    }
+}
+
+// greet the peer, then the socket is the caller's
+static void on_session_connected(struct session_loop* l, uint32_t peer_id, int sock) {
+    nt_context* nt = l->ctx;
+    struct sockaddr_in6 peer;
+    on_connected(sock, &peer);
+    nt->cfg.connected(nt, peer_id, sock, (struct sockaddr*)&peer, nt->cfg.ctx);
+}
+
+static void on_session_failed(struct session_loop* l, uint32_t peer_id, const char* why) {
+    nt_context* nt = l->ctx;
+    nt->cfg.failed(nt, peer_id, why, nt->cfg.ctx);
+}
+
+void nt_default_config(struct nt_config* cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->server_port = DEFAULT_SERVER_PORT;
+    cfg->stun_port = DEFAULT_STUN_SERVER_PORT;
+    cfg->local_port = DEFAULT_LOCAL_PORT;
+    cfg->ttl = NT_TTL_AUTO;
+
+    struct burst_config burst;
+    burst_default_config(&burst);
+    cfg->batch_size = burst.batch_size;
+    cfg->gap_us = burst.gap_us;
+    cfg->use_uring = burst.use_uring;
+
+    struct session_budget budget;
+    session_default_budget(&budget);
+    cfg->max_socks = budget.max_socks;
+    cfg->timeout_ms = budget.timeout_ms;
+}
+
+// detect our NAT or check the cached profile, then enroll, leave_server() undoes what got done
+static int join(nt_context* nt, const char* state_dir, const char* local_ip) {
+    const struct nt_config* cfg = &nt->cfg;
+    client* c = &nt->c;
+
+    // servers given by the caller replace the public ones
+    struct stun_server_list servers;
+    servers.count = 0;
+    servers.resolver = &nt->resolver;
+    int i;
+    if (cfg->num_stun_servers) {
+        for (i = 0; i < cfg->num_stun_servers && i < NT_MAX_STUN_SERVERS; ++i) {
+            stun_servers_add(&servers, cfg->stun_servers[i], cfg->stun_port);
+        }
+    } else {
+        for (i = 0; i < sizeof(stun_servers) / sizeof(stun_servers[0]); ++i) {
+            stun_servers_add(&servers, stun_servers[i], cfg->stun_port);
+        }
+    }
+
+    // resolve every host in the background while the cache is checked
+    if (resolver_init(&nt->resolver, cfg->nameserver) < 0) {
+        verbose_log("no nameserver, falling back to system resolver\n");
+    }
+    for (i = 0; i < servers.count; ++i) {
+        resolver_start(&nt->resolver, servers.servers[i].host);
+    }
+    if (cfg->punch_server) {
+        resolver_start(&nt->resolver, cfg->punch_server);
+    }
+
+    c->ttl = cfg->ttl;
+    strncpy(c->local_ip, local_ip, 15);
+    c->local_port = cfg->local_port;
+    if (cfg->ipv6) {
+        char ip6[INET6_ADDRSTRLEN] = "";
+        if (ipv6_candidate(cfg->ipv6, cfg->local_port, c->ip6) == 0) {
+            c->port6 = cfg->local_port;
+            info_log("IPv6 candidate: [%s]:%d\n", inet_ntop(AF_INET6, c->ip6, ip6, sizeof(ip6)), c->port6);
+        } else {
+            info_log("no IPv6 candidate for %s, IPv4 only\n", cfg->ipv6);
+        }
+    }
+    burst_default_config(&c->burst);
+    c->burst.batch_size = cfg->batch_size;
+    c->burst.gap_us = cfg->gap_us;
+    c->burst.use_uring = cfg->use_uring;
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(cfg->server_port);
+    if (cfg->udp && cfg->tcp) {
+        // only a TCP connection from our source port shows the server our TCP mapping
+        info_log("punching TCP needs a TCP enrollment\n");
+        errno = EINVAL;
+        return -1;
+    }
+    c->tcp = cfg->tcp;
+    if (cfg->udp) {
+        if (!cfg->punch_server) {
+            info_log("please specify punch server\n");
+            errno = EINVAL;
+            return -1;
+        }
+        if (resolver_lookup(&nt->resolver, cfg->punch_server, &server_addr.sin_addr, RESOLVE_TIMEOUT_MS) < 0) {
+            info_log("no such host, %s\n", cfg->punch_server);
+            return -1;
+        }
+        c->udp = 1;
+        c->server_addr = server_addr;
+    }
+
+    struct nat_profile profile;
+    struct port_prediction pred;
+    nat_type type;
+    // detection, and enrolling over TCP afterwards, timed for the benchmarks
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (cfg->udp) {
+        type = rendezvous_udp(c, &servers, state_dir, local_ip, cfg->local_port, cfg->force_detection, &profile, &pred);
+    } else {
+        type = get_nat_profile(&servers, state_dir, local_ip, cfg->local_port, cfg->force_detection, &profile, &pred);
+    }
+    double detect_s = elapsed_s(&started);
+
+    info_log("NAT type: %s\n", get_nat_desc(type));
+    if (type == SymmetricNAT) {
+        info_log("port allocation: %s\n", get_pattern_desc(pred.pattern));
+    }
+    if (profile.ext_port) {
+        info_log("external address: %s:%d\n", profile.ext_ip, profile.ext_port);
+    } else {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    if (!cfg->punch_server) {
+        info_log("please specify punch server\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    c->type = type;
+    c->profile = profile;
+    c->pred = pred;
+    if (cfg->udp) {
+        if (c->id == 0) {
+            info_log("failed to enroll\n");
+            errno = ECONNREFUSED;
+            return -1;
+        }
+    } else {
+        struct peer_info self;
+        self_info(&self, c, type, &profile, &pred);
+
+        if (resolver_lookup(&nt->resolver, cfg->punch_server, &server_addr.sin_addr, RESOLVE_TIMEOUT_MS) < 0) {
+            info_log("no such host, %s\n", cfg->punch_server);
+            return -1;
+        }
+        if (enroll(self, server_addr, c) < 0) {
+            info_log("failed to enroll\n");
+            return -1;
+        }
+    }
+    info_log("enroll successfully, ID: %d\n", c->id);
+    if (c->tcp_port) {
+        info_log("TCP mapping: %s:%d\n", profile.ext_ip, c->tcp_port);
+    } else if (c->tcp) {
+        info_log("the punch server didn't tell our TCP mapping, punching UDP only\n");
+    }
+    // the UDP rendezvous enrolls while detecting
+    verbose_log("timing: detect %.1f enroll %.1f ms\n", detect_s * 1000, (elapsed_s(&started) - detect_s) * 1000);
+
+    return 0;
+}
+
+nt_context* nt_open(const struct nt_config* cfg) {
+    nt_context* nt = calloc(1, sizeof(nt_context));
+    if (nt == NULL) {
+        return NULL;
+    }
+    nt->cfg = *cfg;
+    nt->c.sfd = -1;
+    nt->log.verbose = cfg->verbose;
+    nt->log.fn = cfg->log;
+    nt->log.ctx = cfg->ctx;
+    const struct logger* prev = log_use(&nt->log);
+
+    char state_dir[MAX_PATH_LENGTH];
+    if (cfg->state_dir) {
+        snprintf(state_dir, sizeof(state_dir), "%s", cfg->state_dir);
+    } else {
+        default_state_dir(state_dir, sizeof(state_dir));
+    }
+    const char* local_ip = cfg->local_ip ? cfg->local_ip : "0.0.0.0";
+
+    // every traversal attempt, ours and those other peers start, runs in one loop
+    struct session_budget budget;
+    budget.max_socks = cfg->max_socks;
+    budget.timeout_ms = cfg->timeout_ms;
+    int joined = join(nt, state_dir, local_ip) == 0;
+    if (!joined || session_loop_init(&nt->loop, &nt->c, &budget, cfg->connected ? on_session_connected : NULL) < 0) {
+        int error = errno;
+        if (joined) {
+            info_log("failed to start the session loop\n");
+        }
+        leave_server(&nt->c);
+        log_use(prev);
+        free(nt);
+        errno = error;
+        return NULL;
+    }
+    nt->loop.ctx = nt;
+    if (cfg->failed) {
+        nt->loop.failed_fn = on_session_failed;
+    }
+    if (nat_cache_key_init(&nt->profile_key, local_ip, cfg->local_port) == 0) {
+        snprintf(nt->profile_path, sizeof(nt->profile_path), "%s/profiles", state_dir);
+        nt->loop.rate_learned = save_probe_rate;
+    }
+
+    log_use(prev);
+    return nt;
+}
+
+uint32_t nt_id(const nt_context* nt) {
+    return nt->c.id;
+}
+
+int nt_fd(const nt_context* nt) {
+    return nt->loop.epfd;
+}
+
+int nt_connect(nt_context* nt, uint32_t peer_id) {
+    const struct logger* prev = log_use(&nt->log);
+    int ret = session_connect(&nt->loop, peer_id);
+    log_use(prev);
+
+    return ret;
+}
+
+int nt_keep(nt_context* nt, int sock, const struct sockaddr* peer) {
+    return session_loop_keep(&nt->loop, sock, peer);
+}
+
+uint64_t nt_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t nt_process(nt_context* nt, uint64_t now_ms) {
+    uint64_t next;
+    const struct logger* prev = log_use(&nt->log);
+    int ret = session_loop_process(&nt->loop, now_ms, &next);
+    log_use(prev);
+    if (ret < 0) {
+        return -1;
+    }
+
+    // the server connection's keepalive is always due some time
+    return next > INT64_MAX ? INT64_MAX : (int64_t)next;
+}
+
+void nt_stats(const nt_context* nt, struct nt_stats* stats) {
+    stats->in_flight = nt->loop.num_sessions;
+    stats->started = nt->loop.started;
+    stats->punched = nt->loop.punched;
+    stats->succeeded = nt->loop.succeeded;
+    stats->failed = nt->loop.failed;
+}
+
+void nt_close(nt_context* nt) {
+    const struct logger* prev = log_use(&nt->log);
+    session_loop_destroy(&nt->loop);
+    leave_server(&nt->c);
+    log_use(prev);
+    free(nt);
+}
@@ -0,0 +1,130 @@
+#ifndef LIBNATTRAVERSAL_H
+#define LIBNATTRAVERSAL_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * the client as a library, for programs that run an event loop of their own.
+ * nt_open() detects our NAT, or checks the cached profile, and enrolls with
+ * the punch server, which blocks for a few seconds at most. nothing blocks
+ * after that: every session of a context runs off one file descriptor that
+ * turns readable whenever nt_process() has work, and nt_process() tells when
+ * it wants to be called again at the latest. a context belongs to the thread
+ * that drives it, any number of sessions share it.
+ */
+
+#define NT_MAX_STUN_SERVERS 8
+// trace the ttl of the limited probes per peer
+#define NT_TTL_AUTO -1
+
+// the level of a line of diagnostics
+#define NT_LOG_INFO 0
+#define NT_LOG_VERBOSE 1
+
+// the library is built with hidden visibility, only what is marked here leaves libnattraversal.so
+#define NT_EXPORT __attribute__((visibility("default")))
+
+typedef struct nt_context nt_context;
+
+// a line of diagnostics ending in a newline, verbose ones only with verbose set
+typedef void (*nt_log_fn)(int level, const char* line, void* ctx);
+
+// sock reached peer_id and greeted it, the callback owns sock from now on, nt_keep() takes it back.
+// peer is of either family, sock a datagram socket or, with tcp, a stream
+typedef void (*nt_connected_fn)(nt_context* nt, uint32_t peer_id, int sock, const struct sockaddr* peer, void* ctx);
+// the session with peer_id ended without a connection, why is meant for humans
+typedef void (*nt_failed_fn)(nt_context* nt, uint32_t peer_id, const char* why, void* ctx);
+
+struct nt_config {
+    // host name or address of the punch server
+    const char* punch_server;
+    uint16_t server_port;
+    // raced against each other, the public ones if there are none
+    const char* stun_servers[NT_MAX_STUN_SERVERS];
+    int num_stun_servers;
+    uint16_t stun_port;
+    const char* local_ip;
+    uint16_t local_port;
+    // an IPv6 address or "auto" for a global one of ours, raced at local_port against IPv4
+    // with every peer that has one too. NULL for IPv4 only
+    const char* ipv6;
+    // cached NAT profiles and STUN server scores, NULL for ~/.nat_traversal
+    const char* state_dir;
+    // "ip[:port]", NULL for the first one in /etc/resolv.conf
+    const char* nameserver;
+    // enroll over UDP from local_port instead of TCP
+    int udp;
+    // punch TCP with every peer that does too and connect a stream, TCP enrollment only
+    int tcp;
+    int force_detection;
+    // of the limited probes, NT_TTL_AUTO to trace the path to every peer
+    int ttl;
+    // probe sockets per batch and the gap between two, where the pacer starts from
+    int batch_size;
+    int gap_us;
+    int use_uring;
+    // per session, 0 for no limit on the sockets
+    int max_socks;
+    int timeout_ms;
+    // of this context, others keep theirs
+    int verbose;
+    // NULL prints to stderr
+    nt_log_fn log;
+    // NULL keeps the binding of a connected socket alive inside the context, as nt_keep() does
+    nt_connected_fn connected;
+    nt_failed_fn failed;
+    void* ctx;
+};
+
+struct nt_stats {
+    int in_flight;
+    // totals since nt_open()
+    int started;
+    int punched;      // sessions that got all their probes out
+    int succeeded;
+    int failed;
+};
+
+NT_EXPORT void nt_default_config(struct nt_config* cfg);
+
+// cfg and its strings are only read until it returns. NULL with errno set if detection or enrollment failed
+NT_EXPORT nt_context* nt_open(const struct nt_config* cfg);
+
+// our id at the punch server, for peers to connect to
+NT_EXPORT uint32_t nt_id(const nt_context* nt);
+
+// readable whenever nt_process() has something to do
+NT_EXPORT int nt_fd(const nt_context* nt);
+
+/*
+ * start connecting to peer_id, its end is reported through connected or
+ * failed. -1 without a call to failed if a session with peer_id is in flight
+ * already or the context is full, the session in flight goes on. -1 after
+ * failed has been called if the request couldn't be sent
+ */
+NT_EXPORT int nt_connect(nt_context* nt, uint32_t peer_id);
+
+/*
+ * keep the NAT binding of sock to peer alive from the context, which owns
+ * sock from now on and closes it in nt_close(). for a socket the connected
+ * callback is done with, a stream has TCP keepalives already
+ */
+NT_EXPORT int nt_keep(nt_context* nt, int sock, const struct sockaddr* peer);
+
+// the clock of nt_process(), monotonic milliseconds
+NT_EXPORT uint64_t nt_now_ms(void);
+
+/*
+ * handle whatever is ready without blocking, returns when to be called again
+ * at the latest, on the clock of now_ms. -1 if the server connection is lost,
+ * the context is of no use anymore then
+ */
+NT_EXPORT int64_t nt_process(nt_context* nt, uint64_t now_ms);
+
+NT_EXPORT void nt_stats(const nt_context* nt, struct nt_stats* stats);
+
+// abort every session, close the kept sockets and leave the punch server
+NT_EXPORT void nt_close(nt_context* nt);
+
+#endif
@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "log.h"
+
+static __thread const struct logger* current = NULL;
+
+const struct logger* log_use(const struct logger* lg) {
+    const struct logger* prev = current;
+    current = lg;
+
+    return prev;
+}
+
+int log_verbose(void) {
+    return current && current->verbose;
+}
+
+void log_print(int level, const char* format, ...) {
+    if (level == LOG_VERBOSE && !log_verbose()) {
+        return;
+    }
+
+    char line[LOG_MAX_LINE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (current && current->fn) {
+        current->fn(level, line, current->ctx);
+    } else {
+        fputs(line, stderr);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef LOG_H
+#define LOG_H
+
+/*
+ * diagnostics of the library, a line at a time. a thread prints through the
+ * logger it was handed last, the nt_*() calls hand it their context's, so
+ * contexts driven by different threads keep their verbosity and their output
+ * apart. without one lines go to stderr and verbose ones nowhere
+ */
+
+// the values of NT_LOG_INFO and NT_LOG_VERBOSE
+#define LOG_INFO 0
+#define LOG_VERBOSE 1
+// longer lines are cut
+#define LOG_MAX_LINE 512
+
+// line ends in a newline
+typedef void (*log_fn)(int level, const char* line, void* ctx);
+
+struct logger {
+    int verbose;
+    log_fn fn;      // NULL for stderr
+    void* ctx;
+};
+
+// lg on this thread from now on, NULL for the default. returns the one before, to be handed back
+const struct logger* log_use(const struct logger* lg);
+
+// 1 if verbose lines get anywhere, to skip the work of one
+int log_verbose(void);
+
+void log_print(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+#define info_log(format, ...) log_print(LOG_INFO, format, ##__VA_ARGS__)
+#define verbose_log(format, ...) log_print(LOG_VERBOSE, format, ##__VA_ARGS__)
+
+#endif
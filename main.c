@@ -1,40 +1,232 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <arpa/inet.h>
+#include <time.h>
 
-#include "nat_traversal.h"
+#include "libnattraversal.h"
+#include "channel.h"
+#include "metrics.h"
+#include "tcp_punch.h"
 
-#define DEFAULT_SERVER_PORT 9988
-#define MSG_BUF_SIZE 512
+#define MAX_PATH_LENGTH 256
+// a receiving transfer ends this long after the last datagram if its FIN got lost
+#define TRANSFER_IDLE_MS 5000
+// a write() or read() of a stream transfer
+#define STREAM_CHUNK (256 * 1024)
 
-// use public stun servers to detect port allocation rule
-static char *stun_servers[] = {
-    "stun.ideasip.com",
-    "stun.ekiga.net",
-    "203.183.172.196"
+// what -x and -r ask for, the context of the connected callback
+struct transfer_config {
+    uint64_t bytes;     // to send, 0 to receive
+    int done_fd;        // a finished transfer is written here, for the loop to keep its socket
 };
 
-// definition checked against extern declaration
-int verbose = 0;
+struct transfer {
+    int sock;
+    // a struct sockaddr_in or a struct sockaddr_in6, the family tells
+    struct sockaddr_in6 peer;
+    uint64_t bytes;
+    int done_fd;
+};
+
+static double elapsed_s(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void send_transfer(struct channel* ch, uint64_t bytes) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // the payload is left as the ring has it, only the amount matters here
+    uint64_t left = bytes;
+    while (left > 0) {
+        int len = left < (uint64_t)ch->cfg.payload ? (int)left : ch->cfg.payload;
+        channel_reserve(ch);
+        left -= len;
+        if (channel_commit(ch, len, left ? 0 : CHANNEL_FIN) < 0) {
+            printf("transfer failed: %s\n", strerror(errno));
+            return;
+        }
+    }
+    if (channel_flush(ch) < 0) {
+        printf("transfer failed: %s\n", strerror(errno));
+        return;
+    }
+
+    double s = elapsed_s(&start);
+    printf("sent %llu bytes in %llu datagrams, %.2f s, %.2f Gb/s, %llu syscalls\n",
+        (unsigned long long)ch->stats.bytes_sent, (unsigned long long)ch->stats.sent, s,
+        ch->stats.bytes_sent * 8 / s / 1e9, (unsigned long long)ch->stats.syscalls);
+}
+
+static void receive_transfer(struct channel* ch) {
+    struct channel_msg msgs[CHANNEL_RX_BATCH];
+    struct timespec start;
+    int fin = 0;
+
+    while (!fin) {
+        int n = channel_recv(ch, msgs, CHANNEL_RX_BATCH, TRANSFER_IDLE_MS);
+        if (n <= 0) {
+            break;
+        }
+        if (ch->stats.received == (uint64_t)n) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+
+        int i;
+        for (i = 0; i < n; ++i) {
+            fin |= msgs[i].flags & CHANNEL_FIN;
+        }
+    }
+
+    // the peer didn't send anything, nothing to report
+    if (ch->stats.received == 0) {
+        return;
+    }
+    double s = elapsed_s(&start) - (fin ? 0 : TRANSFER_IDLE_MS / 1000.0);
+    printf("received %llu bytes in %llu datagrams%s, %.2f s, %.2f Gb/s\n",
+        (unsigned long long)ch->stats.bytes_received, (unsigned long long)ch->stats.received,
+        fin ? "" : " (no FIN)", s, s > 0 ? ch->stats.bytes_received * 8 / s / 1e9 : 0);
+    printf("lost %llu, reordered %llu, duplicates %llu\n", (unsigned long long)ch->stats.lost,
+        (unsigned long long)ch->stats.reordered, (unsigned long long)ch->stats.duplicates);
+}
+
+// the kernel does the batching, segmentation and pacing of a stream, and retransmits
+static void send_stream(int sock, uint64_t bytes) {
+    char* buf = calloc(1, STREAM_CHUNK);
+    if (buf == NULL) {
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t left = bytes, syscalls = 0;
+    while (left > 0) {
+        ssize_t n = send(sock, buf, left < STREAM_CHUNK ? left : STREAM_CHUNK, MSG_NOSIGNAL);
+        syscalls++;
+        if (n < 0 && errno != EINTR) {
+            printf("transfer failed: %s\n", strerror(errno));
+            free(buf);
+            return;
+        }
+        left -= n > 0 ? n : 0;
+    }
+    // the peer's read returns 0 once everything is in
+    shutdown(sock, SHUT_WR);
+    free(buf);
+
+    double s = elapsed_s(&start);
+    printf("sent %llu bytes over TCP, %.2f s, %.2f Gb/s, %llu syscalls\n",
+        (unsigned long long)bytes, s, bytes * 8 / s / 1e9, (unsigned long long)syscalls);
+}
+
+static void receive_stream(int sock) {
+    char* buf = malloc(STREAM_CHUNK);
+    if (buf == NULL) {
+        return;
+    }
+    // a peer that never sends leaves it at that
+    struct timeval idle = {TRANSFER_IDLE_MS / 1000, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+    struct timespec start;
+    uint64_t bytes = 0;
+    ssize_t n;
+    // a whole chunk a call, short only at the end or on the timeout
+    while ((n = recv(sock, buf, STREAM_CHUNK, MSG_WAITALL)) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0 && bytes == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        bytes += n > 0 ? n : 0;
+    }
+    free(buf);
+
+    if (bytes == 0) {
+        return;
+    }
+    double s = elapsed_s(&start) - (n == 0 ? 0 : TRANSFER_IDLE_MS / 1000.0);
+    printf("received %llu bytes over TCP%s, %.2f s, %.2f Gb/s\n", (unsigned long long)bytes,
+        n == 0 ? "" : " (no FIN)", s, s > 0 ? bytes * 8 / s / 1e9 : 0);
+}
+
+static void* run_transfer(void* arg) {
+    struct transfer* t = arg;
+    struct channel ch;
+    if (tcp_punch_is_stream(t->sock)) {
+        if (t->bytes) {
+            send_stream(t->sock, t->bytes);
+        } else {
+            receive_stream(t->sock);
+        }
+    } else if (channel_init(&ch, t->sock, (struct sockaddr*)&t->peer, NULL) < 0) {
+        printf("failed to set up the data channel\n");
+    } else {
+        if (t->bytes) {
+            send_transfer(&ch, t->bytes);
+        } else {
+            receive_transfer(&ch);
+        }
+        channel_destroy(&ch);
+    }
+
+    // the context belongs to the main thread, which takes the socket back from here
+    if (write(t->done_fd, &t, sizeof(t)) != sizeof(t)) {
+        close(t->sock);
+        free(t);
+    }
+    return NULL;
+}
+
+// move data over the punched socket without holding up the loop
+static void on_session_connected(nt_context* nt, uint32_t peer_id, int sock, const struct sockaddr* peer, void* ctx) {
+    struct transfer* t = malloc(sizeof(struct transfer));
+    if (t == NULL) {
+        close(sock);
+        return;
+    }
+    t->sock = sock;
+    memcpy(&t->peer, peer, peer->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    struct transfer_config* cfg = ctx;
+    t->bytes = cfg->bytes;
+    t->done_fd = cfg->done_fd;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, run_transfer, t) != 0) {
+        close(sock);
+        free(t);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+// the library's lines go with the CLI's own, nat_bench reads them off stdout
+static void print_log(int level, const char* line, void* ctx) {
+    fputs(line, stdout);
+}
 
 int main(int argc, char** argv)
 {
-    char* stun_server = stun_servers[0];
-    char local_ip[16] = "0.0.0.0";
-    uint16_t stun_port = DEFAULT_STUN_SERVER_PORT;
-    uint16_t local_port = DEFAULT_LOCAL_PORT;
-    char* punch_server = NULL;
+    struct nt_config cfg;
+    nt_default_config(&cfg);
+    cfg.log = print_log;
+    char state_dir[MAX_PATH_LENGTH];
     uint32_t peer_id = 0;
-    int ttl = 10;
+    struct transfer_config transfer = {0, -1};
+    int receive = 0;
+    char* metrics_file = NULL;
 
-    static char usage[] = "usage: [-h] [-H STUN_HOST] [-t ttl] [-P STUN_PORT] [-s punch server] [-d id] [-i SOURCE_IP] [-p SOURCE_PORT] [-v verbose]\n";
+    static char usage[] = "usage: [-h] [-H STUN_HOST[:PORT]]... [-t ttl, traced per peer if not given] [-g BURST_GAP_US] [-b BURST_BATCH] [-u use io_uring] [-k SOCKS_PER_SESSION] [-T SESSION_TIMEOUT_S] [-x MEGABYTES to send once connected] [-r receive what the peer sends once connected] [-M METRICS_FILE, rewritten every 10 s] [-U UDP rendezvous] [-S punch TCP and transfer over a stream] [-P STUN_PORT] [-s punch server] [-d id] [-i SOURCE_IP] [-p SOURCE_PORT] [-6 IPV6_ADDRESS|auto, raced against IPv4] [-c STATE_DIR] [-n NAMESERVER[:PORT]] [-f force NAT detection] [-v verbose]\n";
     int opt;
-    while ((opt = getopt (argc, argv, "H:h:t:P:p:s:d:i:v")) != -1)
+    while ((opt = getopt (argc, argv, "H:h:t:g:b:uk:T:x:rM:USP:p:6:s:d:i:c:n:fv")) != -1)
     {
         switch (opt)
         {
@@ -42,28 +234,75 @@ int main(int argc, char** argv)
                 printf("%s", usage);
                 break;
             case 'H':
-                stun_server = optarg;
+                // may be repeated, all of them are raced
+                if (cfg.num_stun_servers < NT_MAX_STUN_SERVERS) {
+                    cfg.stun_servers[cfg.num_stun_servers++] = optarg;
+                }
                 break;
             case 't':
-                ttl = atoi(optarg);
+                cfg.ttl = atoi(optarg);
+                break;
+            case 'g':
+                cfg.gap_us = atoi(optarg);
+                break;
+            case 'b':
+                cfg.batch_size = atoi(optarg);
+                break;
+            case 'u':
+                cfg.use_uring = 1;
+                break;
+            case 'k':
+                cfg.max_socks = atoi(optarg);
+                break;
+            case 'T':
+                cfg.timeout_ms = atoi(optarg) * 1000;
+                break;
+            case 'x':
+                transfer.bytes = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case 'r':
+                receive = 1;
+                break;
+            case 'M':
+                metrics_file = optarg;
+                break;
+            case 'U':
+                cfg.udp = 1;
+                break;
+            case 'S':
+                cfg.tcp = 1;
                 break;
             case 'P':
-                stun_port = atoi(optarg);
+                cfg.stun_port = atoi(optarg);
                 break;
             case 'p':
-                local_port = atoi(optarg);
+                cfg.local_port = atoi(optarg);
+                break;
+            case '6':
+                cfg.ipv6 = optarg;
                 break;
             case 's':
-                punch_server = optarg;
+                cfg.punch_server = optarg;
                 break;
             case 'd':
                 peer_id = atoi(optarg);
                 break;
             case 'i':
-                strncpy(local_ip, optarg, 16);
+                cfg.local_ip = optarg;
+                break;
+            case 'c':
+                strncpy(state_dir, optarg, MAX_PATH_LENGTH - 1);
+                state_dir[MAX_PATH_LENGTH - 1] = 0;
+                cfg.state_dir = state_dir;
+                break;
+            case 'n':
+                cfg.nameserver = optarg;
+                break;
+            case 'f':
+                cfg.force_detection = 1;
                 break;
             case 'v':
-                verbose = 1;
+                cfg.verbose = 1;
                 break;
             case '?':
             default:
@@ -74,54 +313,63 @@ int main(int argc, char** argv)
         }
     }
 
-    char ext_ip[16] = {0};
-    uint16_t ext_port = 0;
-
-    // TODO we should try another STUN server if failed
-    nat_type type = detect_nat_type(stun_server, stun_port, local_ip, local_port, ext_ip, &ext_port);
-
-    printf("NAT type: %s\n", get_nat_desc(type));
-    if (ext_port) {
-        printf("external address: %s:%d\n", ext_ip, ext_port);
-    } else {
+    // Prometheus text format, for a node exporter's textfile collector or a scraper of its own
+    if (metrics_file && metrics_start_writer(metrics_file, METRICS_INTERVAL_S) < 0) {
+        printf("failed to write metrics to %s\n", metrics_file);
         return -1;
     }
 
-    if (!punch_server) {
-        printf("please specify punch server\n");
-        return -1;
+    // without a transfer the library keeps the socket's binding alive, with one the socket goes back to it after
+    int done[2] = {-1, -1};
+    if (transfer.bytes || receive) {
+        if (pipe2(done, O_CLOEXEC) < 0) {
+            printf("failed to set up the transfer: %s\n", strerror(errno));
+            return -1;
+        }
+        transfer.done_fd = done[1];
+        cfg.connected = on_session_connected;
+        cfg.ctx = &transfer;
     }
-    struct peer_info self;
-    strncpy(self.ip, ext_ip, 16);
-    self.port = ext_port;
-    self.type = type;
-
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr(punch_server);
-    server_addr.sin_port = htons(DEFAULT_SERVER_PORT);
-
-    client c;
-    c.type = type;
-    c.ttl = ttl;
-    if (enroll(self, server_addr, &c) < 0) {
-        printf("failed to enroll\n");
 
+    // detection and enrollment, the library reports how they went
+    nt_context* nt = nt_open(&cfg);
+    if (nt == NULL) {
         return -1;
     }
-    printf("enroll successfully, ID: %d\n", c.id);
 
     if (peer_id) {
         printf("connecting to peer %d\n", peer_id);
-        if (connect_to_peer(&c, peer_id) < 0) {
+        if (nt_connect(nt, peer_id) < 0) {
             printf("failed to connect to peer %d\n", peer_id);
 
             return -1;
         }
     }
 
-    pthread_t tid = wait_for_command(&c.sfd);
+    // the CLI is an embedder like any other, its event loop only has the one fd to watch
+    printf("waiting for notification...\n");
+    struct pollfd pfds[2];
+    pfds[0].fd = nt_fd(nt);
+    pfds[0].events = POLLIN;
+    // -1 without a transfer, poll() leaves it out
+    pfds[1].fd = done[0];
+    pfds[1].events = POLLIN;
+    for (; ;) {
+        uint64_t now = nt_now_ms();
+        int64_t next = nt_process(nt, now);
+        if (next < 0) {
+            nt_close(nt);
+            return -1;
+        }
+        int64_t wait = next - (int64_t)nt_now_ms();
+        poll(pfds, 2, wait < 0 ? 0 : wait > INT32_MAX ? -1 : (int)wait);
 
-    pthread_join(tid, NULL);
-    return 0;
+        struct transfer* t;
+        if (pfds[1].revents & POLLIN && read(done[0], &t, sizeof(t)) == sizeof(t)) {
+            if (nt_keep(nt, t->sock, (struct sockaddr*)&t->peer) < 0) {
+                close(t->sock);
+            }
+            free(t);
+        }
+    }
 }
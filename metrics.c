@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+struct metrics_block {
+    uint64_t counters[NUM_COUNTERS];
+    uint64_t buckets[NUM_HISTOGRAMS][METRIC_BUCKETS];
+    uint64_t sums[NUM_HISTOGRAMS];
+    struct metrics_block* next;
+};
+
+// every thread's block, pushed once and never freed, a thread that is gone still counts
+static struct metrics_block* blocks = NULL;
+static __thread struct metrics_block* local = NULL;
+
+struct metric_desc {
+    const char* name;
+    const char* help;
+};
+
+static const struct metric_desc counter_descs[NUM_COUNTERS] = {
+    {"nat_traversal_stun_requests_total", "STUN binding requests, first transmissions."},
+    {"nat_traversal_stun_retries_total", "STUN binding requests retransmitted."},
+    {"nat_traversal_stun_timeouts_total", "STUN tests that got no response."},
+    {"nat_traversal_probe_sockets_total", "Probe sockets opened."},
+    {"nat_traversal_probes_sent_total", "Hole punching probes sent."},
+    {"nat_traversal_probes_failed_total", "Hole punching probes that couldn't be sent."},
+    {"nat_traversal_sessions_started_total", "Traversal sessions started, ours and the peers'."},
+    {"nat_traversal_sessions_connected_total", "Traversal sessions that connected."},
+    {"nat_traversal_sessions_failed_total", "Traversal sessions that failed."},
+    {"nat_traversal_keepalives_sent_total", "Keepalives sent to keep NAT bindings."},
+    {"nat_traversal_pacer_backoffs_total", "Probe batches refused, after which the probe rate was halved."},
+};
+
+static const struct metric_desc histogram_descs[NUM_HISTOGRAMS] = {
+    {"nat_traversal_stun_rtt_seconds", "Round trip of STUN requests answered without a retransmission."},
+    {"nat_traversal_lookup_seconds", "From the start of a session to the peer's info."},
+    {"nat_traversal_burst_seconds", "Time firing the probes of a session."},
+    {"nat_traversal_wait_for_peer_seconds", "From the last probe to the peer's first packet."},
+    {"nat_traversal_connect_seconds", "From the start of a session to connected."},
+    {"nat_traversal_winning_probe", "Index of the probe socket that reached the peer."},
+};
+
+// microseconds are exported in seconds
+static int is_time(enum metric_histogram h) {
+    return h != WinningProbe;
+}
+
+static struct metrics_block* block(void) {
+    if (local) {
+        return local;
+    }
+
+    // cache line aligned, the hot counters of two threads never share one
+    struct metrics_block* b;
+    if (posix_memalign((void**)&b, 64, sizeof(struct metrics_block)) != 0) {
+        return NULL;
+    }
+    memset(b, 0, sizeof(*b));
+    b->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&blocks, &b->next, b, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    local = b;
+
+    return b;
+}
+
+// only the owner writes, relaxed stores are enough for the writer to read whole values
+static void bump(uint64_t* v, uint64_t n) {
+    __atomic_store_n(v, *v + n, __ATOMIC_RELAXED);
+}
+
+void metrics_add(enum metric_counter c, uint64_t n) {
+    struct metrics_block* b = block();
+    if (b) {
+        bump(&b->counters[c], n);
+    }
+}
+
+void metrics_observe(enum metric_histogram h, uint64_t value) {
+    struct metrics_block* b = block();
+    if (b == NULL) {
+        return;
+    }
+
+    // the smallest i with value <= 2^i
+    int i = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+    if (i >= METRIC_BUCKETS) {
+        i = METRIC_BUCKETS - 1;
+    }
+    bump(&b->buckets[h][i], 1);
+    bump(&b->sums[h], value);
+}
+
+void metrics_write(FILE* f) {
+    struct metrics_block total;
+    memset(&total, 0, sizeof(total));
+    struct metrics_block* b;
+    for (b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+        int i, k;
+        for (i = 0; i < NUM_COUNTERS; ++i) {
+            total.counters[i] += __atomic_load_n(&b->counters[i], __ATOMIC_RELAXED);
+        }
+        for (i = 0; i < NUM_HISTOGRAMS; ++i) {
+            for (k = 0; k < METRIC_BUCKETS; ++k) {
+                total.buckets[i][k] += __atomic_load_n(&b->buckets[i][k], __ATOMIC_RELAXED);
+            }
+            total.sums[i] += __atomic_load_n(&b->sums[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    int i, k;
+    for (i = 0; i < NUM_COUNTERS; ++i) {
+        const struct metric_desc* d = &counter_descs[i];
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", d->name, d->help, d->name, d->name,
+            (unsigned long long)total.counters[i]);
+    }
+    for (i = 0; i < NUM_HISTOGRAMS; ++i) {
+        const struct metric_desc* d = &histogram_descs[i];
+        double scale = is_time(i) ? 1e-6 : 1;
+        fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", d->name, d->help, d->name);
+        // cumulative, as Prometheus wants them
+        uint64_t count = 0;
+        for (k = 0; k < METRIC_BUCKETS - 1; ++k) {
+            count += total.buckets[i][k];
+            fprintf(f, "%s_bucket{le=\"%.9g\"} %llu\n", d->name, (double)(1ull << k) * scale, (unsigned long long)count);
+        }
+        count += total.buckets[i][METRIC_BUCKETS - 1];
+        fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", d->name, (unsigned long long)count);
+        fprintf(f, "%s_sum %.9g\n%s_count %llu\n", d->name, total.sums[i] * scale, d->name, (unsigned long long)count);
+    }
+}
+
+int metrics_write_file(const char* path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    metrics_write(f);
+    if (fclose(f) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return rename(tmp, path);
+}
+
+struct writer {
+    char* path;
+    int interval_s;
+};
+
+static void* run_writer(void* arg) {
+    struct writer* w = arg;
+    for (; ;) {
+        metrics_write_file(w->path);
+        sleep(w->interval_s);
+    }
+
+    return NULL;
+}
+
+int metrics_start_writer(const char* path, int interval_s) {
+    // a path that can't be written fails right away rather than in the thread
+    if (metrics_write_file(path) < 0) {
+        return -1;
+    }
+    struct writer* w = malloc(sizeof(struct writer));
+    if (w == NULL || (w->path = strdup(path)) == NULL) {
+        free(w);
+        return -1;
+    }
+    w->interval_s = interval_s;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, run_writer, w) != 0) {
+        free(w->path);
+        free(w);
+        return -1;
+    }
+    pthread_detach(tid);
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * counters and histograms of the client. every thread records into a block
+ * of its own, no lock and no cache line shared with other threads, so it's
+ * cheap enough for the probe path. the writer sums the blocks up into the
+ * Prometheus text format, to a file a node exporter's textfile collector or
+ * anything else can pick up.
+ */
+
+enum metric_counter {
+    StunRequests,       // binding requests, first transmissions
+    StunRetries,        // retransmissions
+    StunTimeouts,       // tests that got no response at all
+    ProbeSockets,       // probe sockets opened
+    ProbesSent,
+    ProbesFailed,       // probes of opened sockets that couldn't be sent
+    SessionsStarted,
+    SessionsConnected,
+    SessionsFailed,
+    KeepalivesSent,
+    PacerBackoffs,      // probes refused by the kernel or a NAT, the pacer slowed down
+    NUM_COUNTERS,
+};
+
+enum metric_histogram {
+    StunRtt,            // microseconds at millisecond resolution, responses to a single transmission
+    LookupTime,         // microseconds from session start to the peer's info
+    BurstTime,          // microseconds firing the probes
+    WaitForPeerTime,    // microseconds from the last probe to the peer's first packet
+    ConnectTime,        // microseconds from session start to connected
+    WinningProbe,       // index of the probe socket that reached the peer
+    NUM_HISTOGRAMS,
+};
+
+// bucket i counts values up to 2^i, the last one everything above
+#define METRIC_BUCKETS 26
+// how often metrics_start_writer() rewrites the file
+#define METRICS_INTERVAL_S 10
+
+void metrics_add(enum metric_counter c, uint64_t n);
+
+void metrics_observe(enum metric_histogram h, uint64_t value);
+
+// everything recorded so far, summed over the threads
+void metrics_write(FILE* f);
+
+// replace path with the current metrics, readers never see half of a file
+int metrics_write_file(const char* path);
+
+// rewrite path every interval_s from a thread of its own
+int metrics_start_writer(const char* path, int interval_s);
+
+#endif
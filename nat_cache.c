@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "nat_cache.h"
+
+#define MAX_CACHE_ENTRIES 64
+#define MAX_LINE_LENGTH 512
+
+struct cache_entry {
+    struct nat_cache_key key;
+    time_t expires;
+    struct nat_profile profile;
+};
+
+// the interface and gateway of the default route, from /proc/net/route
+static int default_route(char* iface, size_t iface_len, char* gateway) {
+    FILE* f = fopen("/proc/net/route", "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char line[MAX_LINE_LENGTH];
+    char name[IF_NAMESIZE];
+    unsigned int dest, gw;
+    int found = -1;
+
+    // skip the header
+    if (fgets(line, sizeof(line), f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%15s %x %x", name, &dest, &gw) == 3 && dest == 0) {
+            struct in_addr addr = {gw};  // already in network byte order
+            strncpy(iface, name, iface_len - 1);
+            iface[iface_len - 1] = '\0';
+            strcpy(gateway, inet_ntoa(addr));
+            found = 0;
+            break;
+        }
+    }
+    fclose(f);
+
+    return found;
+}
+
+static int iface_addr(const char* iface, char* ip) {
+    struct ifaddrs* ifas;
+    if (getifaddrs(&ifas) < 0) {
+        return -1;
+    }
+
+    int found = -1;
+    struct ifaddrs* ifa;
+    for (ifa = ifas; ifa; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET && !strcmp(ifa->ifa_name, iface)) {
+            strcpy(ip, inet_ntoa(((struct sockaddr_in*)ifa->ifa_addr)->sin_addr));
+            found = 0;
+            break;
+        }
+    }
+    freeifaddrs(ifas);
+
+    return found;
+}
+
+int nat_cache_key_init(struct nat_cache_key* key, const char* local_ip, uint16_t local_port) {
+    char iface[IF_NAMESIZE] = {0};
+
+    memset(key, 0, sizeof(*key));
+    key->local_port = local_port;
+    strcpy(key->gateway, "0.0.0.0");
+    if (default_route(iface, sizeof(iface), key->gateway) < 0) {
+        return -1;
+    }
+
+    if (strcmp(local_ip, "0.0.0.0")) {
+        strncpy(key->iface_ip, local_ip, sizeof(key->iface_ip) - 1);
+        return 0;
+    }
+
+    return iface_addr(iface, key->iface_ip);
+}
+
+static int same_key(const struct nat_cache_key* a, const struct nat_cache_key* b) {
+    return !strcmp(a->iface_ip, b->iface_ip) && !strcmp(a->gateway, b->gateway) && a->local_port == b->local_port;
+}
+
+// iface_ip gateway local_port expires type ext_ip ext_port stun_ip stun_port changed_ip changed_port port_delta port_pattern
+// [probe_rate], entries written before the rate was remembered don't have it
+static int parse_entry(const char* line, struct cache_entry* e) {
+    unsigned int local_port, type, ext_port, stun_port, changed_port, port_pattern, probe_rate = 0;
+    long expires;
+    struct nat_profile* p = &e->profile;
+
+    memset(e, 0, sizeof(*e));
+    int n = sscanf(line, "%15s %15s %u %ld %u %15s %u %15s %u %15s %u %d %u %u",
+                e->key.iface_ip, e->key.gateway, &local_port, &expires,
+                &type, p->ext_ip, &ext_port, p->stun_ip, &stun_port,
+                p->changed_ip, &changed_port, &p->port_delta, &port_pattern, &probe_rate);
+    if (n < 13 || type >= Error) {
+        return -1;
+    }
+    p->probe_rate = probe_rate;
+    e->key.local_port = local_port;
+    e->expires = expires;
+    p->type = type;
+    p->ext_port = ext_port;
+    p->stun_port = stun_port;
+    p->changed_port = changed_port;
+    p->port_pattern = port_pattern;
+
+    return 0;
+}
+
+static void write_entry(FILE* f, const struct cache_entry* e) {
+    const struct nat_profile* p = &e->profile;
+    fprintf(f, "%s %s %u %ld %u %s %u %s %u %s %u %d %u %u\n",
+            e->key.iface_ip, e->key.gateway, e->key.local_port, (long)e->expires,
+            p->type, p->ext_ip, p->ext_port, p->stun_ip, p->stun_port,
+            p->changed_ip, p->changed_port, p->port_delta, p->port_pattern, p->probe_rate);
+}
+
+static int load_entries(const char* path, struct cache_entry* entries) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    char line[MAX_LINE_LENGTH];
+    int n = 0;
+    while (n < MAX_CACHE_ENTRIES && fgets(line, sizeof(line), f)) {
+        if (parse_entry(line, &entries[n]) == 0) {
+            n++;
+        }
+    }
+    fclose(f);
+
+    return n;
+}
+
+int nat_cache_lookup(const char* path, const struct nat_cache_key* key, struct nat_profile* profile, time_t now) {
+    struct cache_entry entries[MAX_CACHE_ENTRIES];
+    int n = load_entries(path, entries);
+
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (same_key(&entries[i].key, key) && entries[i].expires > now) {
+            *profile = entries[i].profile;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int nat_cache_store(const char* path, const struct nat_cache_key* key, const struct nat_profile* profile, time_t now, int ttl) {
+    struct cache_entry entries[MAX_CACHE_ENTRIES];
+    int n = load_entries(path, entries);
+
+    // a name of its own next to the cache, clients saving at once don't write into each other's
+    char tmp_path[MAX_LINE_LENGTH];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        return -1;
+    }
+    FILE* f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        remove(tmp_path);
+        return -1;
+    }
+
+    struct cache_entry e;
+    e.key = *key;
+    e.expires = now + ttl;
+    e.profile = *profile;
+    write_entry(f, &e);
+
+    int i;
+    for (i = 0; i < n && i < MAX_CACHE_ENTRIES - 1; ++i) {
+        if (!same_key(&entries[i].key, key) && entries[i].expires > now) {
+            write_entry(f, &entries[i]);
+        }
+    }
+
+    // replace the cache atomically so a concurrent reader never sees half of it
+    if (fclose(f) != 0 || rename(tmp_path, path) < 0) {
+        remove(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
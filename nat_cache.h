@@ -0,0 +1,28 @@
+#ifndef NAT_CACHE_H
+#define NAT_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "nat_type.h"
+
+// a detected profile is trusted this long, in seconds
+#define DEFAULT_PROFILE_TTL 3600
+
+// a profile only holds on the network it was detected on
+struct nat_cache_key {
+    char iface_ip[16];
+    char gateway[16];
+    uint16_t local_port;
+};
+
+// fills the key from the default route, local_ip overrides the interface address
+int nat_cache_key_init(struct nat_cache_key* key, const char* local_ip, uint16_t local_port);
+
+// 0 and the profile if an unexpired entry exists for key
+int nat_cache_lookup(const char* path, const struct nat_cache_key* key, struct nat_profile* profile, time_t now);
+
+// replaces the entry of key, expired entries of other networks are dropped on the way
+int nat_cache_store(const char* path, const struct nat_cache_key* key, const struct nat_profile* profile, time_t now, int ttl);
+
+#endif
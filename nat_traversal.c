@@ -10,385 +10,442 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <poll.h>
 
 #include "nat_traversal.h"
+#include "burst.h"
+#include "probe_set.h"
+#include "predict.h"
+#include "port_perm.h"
+#include "tcp_punch.h"
+#include "log.h"
 
 #define MAX_PORT 65535
 #define MIN_PORT 1025
-#define NUM_OF_PORTS 700
 
 #define MSG_BUF_SIZE 512
+// how long a TCP request waits for its reply
+#define RPC_TIMEOUT_MS 5000
+// probes per side when both NATs are predictable
+#define PREDICT_WINDOW (2 * (DEFAULT_PREDICT_SPREAD + 1))
+/*
+ * a cone NAT sends all of its filter opening probes from one mapping, cheap
+ * enough to let a sixteenth of the port range in. a randomly allocating
+ * symmetric NAT then gets through with 96 sockets but for 0.2% of the time
+ */
+#define CONE_FILTER_PORTS 4096
+#define CONE_SPRAY_SOCKS 96
+// the cone side's window takes any drift, a few sockets are for lost probes
+#define CONE_PREDICTED_SOCKS 4
+
+static void decode_peer_info(struct peer_info* peer) {
+    peer->port = ntohs(peer->port);
+    peer->type = ntohs(peer->type);
+    peer->pattern = ntohs(peer->pattern);
+    peer->delta = (int16_t)ntohs(peer->delta);
+    peer->base_port = ntohs(peer->base_port);
+    peer->port6 = ntohs(peer->port6);
+    peer->tcp_port = ntohs(peer->tcp_port);
+}
+
+// header of every UDP request after enrollment, the server checks id and token
+static char* encode_udp_header(client* c, uint16_t type) {
+    c->msg_buf = c->buf;
+    c->msg_buf = encode16(c->msg_buf, type);
+    c->msg_buf = encode32(c->msg_buf, c->id);
+    c->msg_buf = encode(c->msg_buf, c->token, UDP_TOKEN_SIZE);
+
+    return c->msg_buf;
+}
+
+uint16_t decode16(const char* buf) {
+    uint16_t v;
+    memcpy(&v, buf, sizeof(v));
 
-// file scope variables
-static int ports[MAX_PORT - MIN_PORT];
+    return ntohs(v);
+}
 
-static int send_to_punch_server(client* c) {
-    int n = send(c->sfd, c->buf, c->msg_buf - c->buf, 0);
-    c->msg_buf= c->buf;
+uint32_t decode32(const char* buf) {
+    uint32_t v;
+    memcpy(&v, buf, sizeof(v));
 
-    return n;
+    return ntohl(v);
 }
 
-static int get_peer_info(client* cli, uint32_t peer_id, struct peer_info *peer) {
-    cli->msg_buf = encode16(cli->msg_buf, GetPeerInfo);
-    cli->msg_buf = encode32(cli->msg_buf, peer_id);
-    if (-1 == send_to_punch_server(cli)) {
+// body of a Notification: id of the notifying peer and its info
+int decode_notification(const char* body, int n, uint32_t* peer_id, struct peer_info* peer) {
+    if (n < sizeof(uint32_t) + sizeof(struct peer_info)) {
         return -1;
     }
+    *peer_id = decode32(body);
+    memcpy(peer, body + 4, sizeof(struct peer_info));
+    decode_peer_info(peer);
 
-    int n_bytes = recv(cli->sfd, (void*)peer, sizeof(struct peer_info), 0);
-    if (n_bytes <= 0) {
+    return 0;
+}
+
+// body of a PeerInfo: the peer's id, whether it is online, padding and its info
+int decode_peer_info_reply(const char* body, int n, struct peer_info* peer) {
+    if (n < 6 + sizeof(struct peer_info)) {
         return -1;
-    } else if (n_bytes == 1) {
+    }
+    if (body[4] == 0) {
         // offline
         return 1;
-    } else {
-        peer->port = ntohs(peer->port);
-        peer->type = ntohs(peer->type);
-
-        return 0;
     }
-}
+    memcpy(peer, body + 6, sizeof(struct peer_info));
+    decode_peer_info(peer);
 
-static int send_dummy_udp_packet(int fd, struct sockaddr_in addr) {
-    char dummy = 'c';
-
-    struct timeval tv = {5, 0};
-    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv, sizeof(tv));
-    
-    return sendto(fd, &dummy, 1, 0, (struct sockaddr *)&addr, sizeof(addr));
+    return 0;
 }
 
+/*
+ * send the request body in c->buf as a frame of type and wait for its reply,
+ * returns the length of the reply body or -1
+ */
+static int tcp_request(client* c, uint16_t type, uint16_t reply_type, struct rpc_frame* reply) {
+    int len = c->msg_buf - c->buf;
+    c->msg_buf = c->buf;
 
-static int punch_hole(struct sockaddr_in peer_addr, int ttl) {
-    int hole = socket(AF_INET, SOCK_DGRAM, 0);
-    if (hole != -1) {
-          //struct sockaddr_in local_addr;
-          //local_addr.sin_family = AF_INET;
-          //local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-          //local_addr.sin_port = htons(DEFAULT_LOCAL_PORT + 1); 
-          //int reuse_addr = 1;
-          //setsockopt(hole, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse_addr, sizeof(reuse_addr));
-          //if (bind(hole, (struct sockaddr *)&local_addr, sizeof(local_addr))) {
-          //    if (errno == EADDRINUSE) {
-          //        printf("addr already in use, try another port\n");
-          //        return -1; 
-          //    }   
-          //}
-
-        /* TODO we can use traceroute to get the number of hops to the peer
-         * to make sure this packet woudn't reach the peer but get through the NAT in front of itself
-         */
-        setsockopt(hole, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
-
-        // send short ttl packets to avoid triggering flooding protection of NAT in front of peer
-        if (send_dummy_udp_packet(hole, peer_addr) < 0) {
-            return -1;
-        }
+    if (rpc_call(&c->rpc, type, c->buf, len, reply, RPC_TIMEOUT_MS) < 0 || reply->type != reply_type) {
+        return -1;
     }
 
-    return hole;
+    return reply->len;
 }
 
-static int wait_for_peer(int* socks, int sock_num, struct timeval *timeout) {
-    fd_set fds;  
-    int max_fd = 0;
-    FD_ZERO(&fds);
+/*
+ * send the request in c->buf to the punch server until a reply of reply_type
+ * whose first field is match_id (anything for 0) comes back, retransmitting
+ * like a STUN client.
+ * a notification arriving meanwhile is kept for recv_notification()
+ */
+static int udp_request(client* c, uint16_t reply_type, uint32_t match_id, char* reply, int reply_size) {
+    int len = c->msg_buf - c->buf;
+    c->msg_buf = c->buf;
 
-    int i;
-    for (i = 0; i < sock_num; ++i) {
-        FD_SET(socks[i], &fds);
-        if (socks[i] > max_fd) {
-            max_fd = socks[i];
+    int rto = UDP_INITIAL_RTO_MS, tries;
+    for (tries = 0; tries < UDP_MAX_TRIES; ++tries, rto *= 2) {
+        if (sendto(c->sfd, c->buf, len, 0, (struct sockaddr*)&c->server_addr, sizeof(c->server_addr)) < 0) {
+            return -1;
         }
-    }
-    int ret = select(max_fd + 1, &fds, NULL, NULL, timeout);
 
-    int index = -1;
-    if (ret > 0) {
-        for (i = 0; i < sock_num; ++i) {
-            if (FD_ISSET(socks[i], &fds)) {
-                index = i;
-                break;
+        struct pollfd fd = {c->sfd, POLLIN, 0};
+        while (poll(&fd, 1, rto) > 0) {
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            int n = recvfrom(c->sfd, reply, reply_size, 0, (struct sockaddr*)&from, &fromlen);
+            if (n < 6 || from.sin_addr.s_addr != c->server_addr.sin_addr.s_addr
+                    || from.sin_port != c->server_addr.sin_port) {
+                continue;
             }
-        }
-    } else {
-        // timeout or error
-    }
-
-    // one of the fds is ready, close others
-    if (index != -1) {
-        for (i = 0; i < sock_num; ++i) {
-            if (index != i) {
-                close(socks[i]);
+            if (decode16(reply) == reply_type && (match_id == 0 || decode32(reply + 2) == match_id)) {
+                return n;
+            }
+            if (!c->has_notification && decode16(reply) == Notification
+                    && decode_notification(reply + 2, n - 2, &c->notification_id, &c->notification) == 0) {
+                c->has_notification = 1;
             }
         }
-
-        return socks[index];
     }
 
     return -1;
 }
 
-static void shuffle(int *num, int len) {
-    srand(time(NULL));
+// both NATs hand out ports with a known stride, so both sides aim at a small window
+int use_prediction(client* c, const struct peer_info* peer) {
+    return c->pred.pattern == PatternDelta && peer->pattern == PatternDelta;
+}
 
-    // Fisher-Yates shuffle algorithm
-    int i, r, temp;
-    for (i = len - 1; i > 0; i--) {
-        r = rand() % i;
+int is_cone(nat_type type) {
+    return type == OpenInternet || type == FullCone || type == RestricNAT || type == RestricPortNAT;
+}
 
-        temp = num[i];
-        num[i] = num[r];
-        num[r] = temp;
+int punch_plan(client* c, const struct peer_info* peer) {
+    int ours = is_cone(c->type), theirs = is_cone(peer->type);
+    if ((!ours && c->type != SymmetricNAT) || (!theirs && peer->type != SymmetricNAT)) {
+        return PlanNone;
     }
+    if (ours && theirs) {
+        return PlanDirect;
+    }
+    if (ours || theirs) {
+        return PlanConeOpens;
+    }
+
+    return use_prediction(c, peer) ? PlanPredict : PlanSpray;
 }
 
-static int connect_to_symmetric_nat(client* c, uint32_t peer_id, struct peer_info remote_peer) {
-    // TODO choose port prediction strategy
-
-    /* 
-    * according to birthday paradox, probability that port randomly chosen from [1024, 65535] 
-    * will collide with another one chosen by the same way is 
-    * p(n) = 1-(64511!/(64511^n*64511!))
-    * where '!' is the factorial operator, n is the number of ports chosen.
-    * P(100)=0.073898
-    * P(200)=0.265667
-    * P(300)=0.501578
-    * P(400)=0.710488
-    * P(500)=0.856122
-    * P(600)=0.938839
-    * but symmetric NAT has port sensitive filter for incoming packet
-    * which makes the probalility decline dramatically. 
-    * Moreover, symmetric NATs don't really allocate ports randomly.
-    */  
-    struct sockaddr_in peer_addr;
-
-    peer_addr.sin_family = AF_INET;
-    peer_addr.sin_addr.s_addr = inet_addr(remote_peer.ip);
-
-    int *holes = malloc(NUM_OF_PORTS * sizeof(int));
-    shuffle(ports, MAX_PORT - MIN_PORT + 1);
-
-    int i = 0;
-    for (; i < NUM_OF_PORTS;) {
-        uint16_t port = ports[i];
-        if (port != remote_peer.port) { // exclude the used one
-            peer_addr.sin_port = htons(port);
-
-            if ((holes[i] = punch_hole(peer_addr, c->ttl)) < 0) {
-                // NAT in front of us wound't tolerate too many ports used by one application
-                verbose_log("failed to punch hole, error: %s\n", strerror(errno));
-                break;
-            }
-            // sleep for a while to avoid flooding protection
-            usleep(1000 * 100);
-            ++i;
-        } else {
-            ports[i] = ports[1000];
-            continue;
-        }
+int open_mapped_socket(client* c) {
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0) {
+        return -1;
     }
 
-    // hole punched, notify remote peer via punch server
-    c->msg_buf = encode16(c->msg_buf, NotifyPeer);
-    c->msg_buf = encode32(c->msg_buf, peer_id);
-    send_to_punch_server(c);
-
-    struct timeval timeout={100, 0};
-    int fd = wait_for_peer(holes, i, &timeout);
-    if (fd > 0) {
-        on_connected(fd);
-    } else {
-        int j = 0;
-        for (; j < i; ++j) {
-            close(holes[j]);
-        }
-        printf("timout, not connected\n");
+    // the rendezvous socket of -U sits on the same port, connected to the server it keeps its datagrams
+    int reuse_addr = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+
+    struct sockaddr_in local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr.s_addr = inet_addr(c->local_ip);
+    local_addr.sin_port = htons(c->local_port);
+    if (bind(s, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
+        close(s);
+        return -1;
     }
 
-    return 0;
+    return s;
 }
 
-// run in another thread
-static void* server_notify_handler(void* data) {
-    int server_sock = *(int*)data;
-    struct peer_info peer;
+int use_ipv6(client* c, const struct peer_info* peer) {
+    return c->port6 && peer->port6;
+}
 
-    // wait for notification 
-    printf("waiting for notification...\n");
-    for (; ;) {
-        if (recv(server_sock, &peer, sizeof peer, 0) > 0) {
-            break;
-        }
+int open_ipv6_socket(client* c, const struct peer_info* peer, struct sockaddr_in6* peer_addr) {
+    int s = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (s < 0) {
+        return -1;
     }
 
-    peer.port = ntohs(peer.port);
-    peer.type = ntohs(peer.type);
+    // one socket a session, each connected to another peer
+    int reuse_addr = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+
+    struct sockaddr_in6 local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin6_family = AF_INET6;
+    memcpy(&local_addr.sin6_addr, c->ip6, 16);
+    local_addr.sin6_port = htons(c->port6);
+    memset(peer_addr, 0, sizeof(*peer_addr));
+    peer_addr->sin6_family = AF_INET6;
+    memcpy(&peer_addr->sin6_addr, peer->ip6, 16);
+    peer_addr->sin6_port = htons(peer->port6);
+    if (bind(s, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0
+            || connect(s, (struct sockaddr*)peer_addr, sizeof(*peer_addr)) < 0) {
+        close(s);
+        return -1;
+    }
 
-    printf("recved command, ready to connect to %s:%d\n", peer.ip, peer.port);
+    return s;
+}
 
-    struct sockaddr_in peer_addr;
+int use_tcp(client* c, const struct peer_info* peer) {
+    if (!c->tcp_port || !peer->tcp_port) {
+        return 0;
+    }
 
-    peer_addr.sin_family = AF_INET;
-    peer_addr.sin_addr.s_addr = inet_addr(peer.ip);
+    // a SYN takes a socket of its own, spraying random ports is left to UDP
+    nat_type cone = is_cone(c->type) ? c->type : peer->type;
+    uint16_t pattern = is_cone(c->type) ? peer->pattern : c->pred.pattern;
+    switch (punch_plan(c, peer)) {
+    case PlanDirect:
+    case PlanPredict:
+        return 1;
+    case PlanConeOpens:
+        // a port-restricted cone's filter is opened one port at a time, only a window is cheap enough
+        return cone != RestricPortNAT || pattern == PatternDelta;
+    default:
+        return 0;
+    }
+}
 
-    int sock_array[NUM_OF_PORTS];
-    int i = 0;
+static void peer_prediction(const struct peer_info* peer, struct port_prediction* pred) {
+    memset(pred, 0, sizeof(*pred));
+    pred->pattern = peer->pattern;
+    pred->delta = peer->delta;
+    pred->base_port = peer->base_port;
+}
 
-    shuffle(ports, MAX_PORT - MIN_PORT + 1);
-    // send probe packets, check if connected with peer, if yes, stop probing
-    for (; i < NUM_OF_PORTS;) {
-        if (ports[i] == peer.port) {
-            ports[i] = ports[1000]; // TODO
-            continue;
-        }
-        if ((sock_array[i] = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-            printf("failed to create socket, send %d probe packets\n", i);
-            break;
-        }
+// where our NAT is right now, the published pattern is kept so both sides pick the same strategy
+void fresh_prediction(client* c, struct port_prediction* pred) {
+    if (measure_port_prediction(&c->profile, c->local_ip, pred) < 0 || pred->pattern != PatternDelta) {
+        *pred = c->pred;
+    }
+    pred->pattern = c->pred.pattern;
+}
 
-        peer_addr.sin_port = htons(ports[i]);
+int random_ports(client* c, const struct peer_info* peer, uint16_t** probe_ports) {
+    // a fresh order every attempt, the peer's known port is no use as a guess
+    struct port_perm perm;
+    port_perm_init(&perm, MIN_PORT, MAX_PORT);
 
-        // let OS choose available ports
-        if (send_dummy_udp_packet(sock_array[i], peer_addr) < 0) {
-            printf("may trigger flooding protection\n");
-            break;
-        }
+    int num_ports = c->burst.num_socks * c->burst.probes_per_sock;
+    *probe_ports = malloc(num_ports * sizeof(uint16_t));
+    if (*probe_ports == NULL) {
+        return -1;
+    }
 
-        // wait for a while
-        struct timeval tv = {0, 1000 * 100};
-        int fd = wait_for_peer(sock_array, ++i, &tv);
-        if (fd > 0) {
-            // connected
-            on_connected(fd);
+    return port_perm_take(&perm, *probe_ports, num_ports, &peer->port, 1);
+}
 
-            // TODO
-            return NULL;
-        }
+// the aim of the predicted window, same number of probes on both sides
+int window_ports(const struct peer_info* peer, int sweep, uint16_t** probe_ports) {
+    struct port_prediction pred;
+    peer_prediction(peer, &pred);
+
+    int num_ports = PREDICT_WINDOW;
+    *probe_ports = malloc(num_ports * sizeof(uint16_t));
+    if (*probe_ports == NULL) {
+        return -1;
+    }
+    if (sweep) {
+        return predict_sweep(&pred, DEFAULT_PREDICT_SPREAD, *probe_ports, num_ports);
     }
 
-    printf("holes punched, waiting for peer\n");
-    struct timeval tv = {100, 0};
-    int fd = wait_for_peer(sock_array, i, &tv);
-    if (fd > 0) {
-        on_connected(fd);
-    } else {
-        int j = 0;
-        for (j = 0; j < i; ++j) {
-            close(sock_array[j]);
+    return predict_window(&pred, *probe_ports, num_ports);
+}
+
+int filter_ports(client* c, const struct peer_info* peer, uint16_t** probe_ports) {
+    if (c->type != RestricPortNAT) {
+        // the peer's address is all the filter looks at, if anything
+        *probe_ports = malloc(sizeof(uint16_t));
+        if (*probe_ports == NULL) {
+            return -1;
         }
+        (*probe_ports)[0] = peer->port;
+        return 1;
+    }
+    if (peer->pattern == PatternDelta) {
+        return window_ports(peer, 0, probe_ports);
     }
 
-    // TODO wait for next notification
+    struct port_perm perm;
+    port_perm_init(&perm, MIN_PORT, MAX_PORT);
+    *probe_ports = malloc(CONE_FILTER_PORTS * sizeof(uint16_t));
+    if (*probe_ports == NULL) {
+        return -1;
+    }
 
-    return NULL;
+    return port_perm_take(&perm, *probe_ports, CONE_FILTER_PORTS, &peer->port, 1);
 }
 
-int enroll(struct peer_info self, struct sockaddr_in punch_server, client* c) {
-    int i, temp;
-    for (i = 0, temp = MIN_PORT; temp <= MAX_PORT; i++, temp++) {
-        ports[i] = temp;
+int cone_ports(client* c, const struct peer_info* cone, uint16_t** probe_ports) {
+    int num_ports = CONE_SPRAY_SOCKS;
+    if (cone->type != RestricPortNAT) {
+        num_ports = 1;
+    } else if (c->pred.pattern == PatternDelta) {
+        num_ports = CONE_PREDICTED_SOCKS;
+    }
+    *probe_ports = malloc(num_ports * sizeof(uint16_t));
+    if (*probe_ports == NULL) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < num_ports; ++i) {
+        (*probe_ports)[i] = cone->port;
     }
 
-    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    return num_ports;
+}
+
+int enroll(struct peer_info self, struct sockaddr_in punch_server, client* c) {
+    // from our source port, the server sees the TCP mapping our punching sockets share
+    int server_sock = c->tcp ? tcp_punch_socket(c->local_ip, c->local_port) : socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0) {
+        return -1;
+    }
 
     if (connect(server_sock, (struct sockaddr *)&punch_server, sizeof(punch_server)) < 0) {
-        printf("failed to connect to punch server\n");
+        info_log("failed to connect to punch server\n");
+        close(server_sock);
 
         return -1;
     }
 
+    if (rpc_init(&c->rpc, server_sock) < 0) {
+        close(server_sock);
+        return -1;
+    }
     c->sfd = server_sock;
+
     c->msg_buf = c->buf;
-    c->msg_buf = encode16(c->msg_buf, Enroll);
     c->msg_buf = encode(c->msg_buf, self.ip, 16);
     c->msg_buf = encode16(c->msg_buf, self.port);
     c->msg_buf = encode16(c->msg_buf, self.type);
-
-    if (-1 == send_to_punch_server(c)) {
-        return -1;
-    }
+    c->msg_buf = encode16(c->msg_buf, self.pattern);
+    c->msg_buf = encode16(c->msg_buf, self.delta);
+    c->msg_buf = encode16(c->msg_buf, self.base_port);
+    c->msg_buf = encode(c->msg_buf, (const char*)self.ip6, 16);
+    c->msg_buf = encode16(c->msg_buf, self.port6);
+    c->msg_buf = encode16(c->msg_buf, self.tcp_port);
 
     // wait for server reply to get own ID
-    uint32_t peer_id = 0;
-    struct timeval tv;
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
-    setsockopt(server_sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-    int n = recv(server_sock, &peer_id, sizeof(uint32_t), 0);
-    if (n != sizeof(uint32_t)) {
+    struct rpc_frame reply;
+    if (tcp_request(c, Enroll, Enrolled, &reply) < 4) {
+        // the caller may live on, the reader thread goes with the connection
+        rpc_close(&c->rpc);
+        c->sfd = -1;
         return -1;
     }
 
-    c->id = ntohl(peer_id);
+    c->id = decode32(reply.body);
+    // followed by the address the server sees us at if we asked for it
+    if (self.tcp_port && reply.len >= 10) {
+        c->tcp_port = decode16(reply.body + 8);
+    }
 
     return 0;
 }
 
-pthread_t wait_for_command(int* server_sock)
-{
-    // wait for command from punch server in another thread
-    pthread_t thread_id;
-    pthread_create(&thread_id, NULL, server_notify_handler, (void*)server_sock);
+int enroll_udp(struct peer_info self, client* c) {
+    // a notification may come in instead
+    char reply[64];
+    encode_udp_header(c, UdpEnroll);
+    c->msg_buf = encode16(c->msg_buf, self.type);
+    c->msg_buf = encode16(c->msg_buf, self.pattern);
+    c->msg_buf = encode16(c->msg_buf, self.delta);
+    c->msg_buf = encode16(c->msg_buf, self.base_port);
+    c->msg_buf = encode(c->msg_buf, (const char*)self.ip6, 16);
+    c->msg_buf = encode16(c->msg_buf, self.port6);
+
+    // a new peer doesn't know its id yet and takes any Enrolled reply
+    int n = udp_request(c, Enrolled, c->id, reply, sizeof(reply));
+    if (n < UDP_HEADER_SIZE + 6) {
+        return -1;
+    }
+
+    c->id = decode32(reply + 2);
+    memcpy(c->token, reply + 6, UDP_TOKEN_SIZE);
+    struct in_addr ext;
+    memcpy(&ext.s_addr, reply + UDP_HEADER_SIZE, 4);
+    strcpy(c->ext_ip, inet_ntoa(ext));
+    c->ext_port = decode16(reply + UDP_HEADER_SIZE + 4);
 
-    return thread_id;
+    return 0;
 }
 
-void on_connected(int sock) {
+void on_connected(int sock, struct sockaddr_in6* peer) {
     char buf[MSG_BUF_SIZE] = {0};
-    struct sockaddr_in remote_addr;
+    struct sockaddr_in6 remote_addr;
     socklen_t fromlen = sizeof remote_addr;
+    if (tcp_punch_is_stream(sock)) {
+        getpeername(sock, (struct sockaddr *)&remote_addr, &fromlen);
+        struct sockaddr_in* remote4 = (struct sockaddr_in*)&remote_addr;
+        info_log("connected with peer over TCP from %s:%d\n", inet_ntoa(remote4->sin_addr), ntohs(remote4->sin_port));
+        if (peer) {
+            *peer = remote_addr;
+        }
+        return;
+    }
     recvfrom(sock, buf, MSG_BUF_SIZE, 0, (struct sockaddr *)&remote_addr, &fromlen);
-    printf("recv %s\n", buf);
+    info_log("recv %s\n", buf);
 
-    printf("connected with peer from %s:%d\n", inet_ntoa(remote_addr.sin_addr), ntohs(remote_addr.sin_port));
-
-    // restore the ttl
-    int ttl = 64;
-    setsockopt(sock, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
-    sendto(sock, "hello, peer", strlen("hello, peer"), 0, (struct sockaddr *)&remote_addr, sizeof(remote_addr));
-}
-
-int connect_to_peer(client* cli, uint32_t peer_id) {
-    struct peer_info peer;
-    int n = get_peer_info(cli, peer_id, &peer);
-    if (n) {
-        verbose_log("get_peer_info() return %d\n", n);
-        printf("failed to get info of remote peer\n");
-
-        return -1;
+    char ip[INET6_ADDRSTRLEN] = "";
+    if (remote_addr.sin6_family == AF_INET6) {
+        inet_ntop(AF_INET6, &remote_addr.sin6_addr, ip, sizeof(ip));
+        info_log("connected with peer from [%s]:%d\n", ip, ntohs(remote_addr.sin6_port));
+    } else {
+        struct sockaddr_in* remote4 = (struct sockaddr_in*)&remote_addr;
+        info_log("connected with peer from %s:%d\n", inet_ntoa(remote4->sin_addr), ntohs(remote4->sin_port));
+        // restore the ttl
+        int ttl = 64;
+        setsockopt(sock, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
     }
-
-    printf("peer %d: %s:%d, nat type: %s\n", peer_id, peer.ip, peer.port, get_nat_desc(peer.type));
-
-    // choose less restricted peer as initiator
-    switch(peer.type) {
-        case OpenInternet:
-            // todo
-            break;
-        case FullCone:
-            break;
-        case RestricNAT:
-            // todo
-            break;
-        case RestricPortNAT:
-            // todo 
-            break;
-        case SymmetricNAT:
-            if (cli->type == SymmetricNAT) {
-                connect_to_symmetric_nat(cli, peer_id, peer);
-            }
-            else {
-                // todo
-            }
-            break;
-        default:
-            printf("unknown nat type\n");
-            return -1;
-            // log
+    sendto(sock, "hello, peer", strlen("hello, peer"), 0, (struct sockaddr *)&remote_addr, fromlen);
+    if (peer) {
+        *peer = remote_addr;
     }
-
-    return 0;
 }
 
@@ -1,10 +1,37 @@
+#ifndef NAT_TRAVERSAL_H
+#define NAT_TRAVERSAL_H
+
 #include <stdint.h>
 
 #include "nat_type.h"
+#include "burst.h"
+#include "predict.h"
+#include "rpc.h"
+
+// UDP requests are [type u16][id u32][token][body], the token is what the server handed out on enrollment
+#define UDP_TOKEN_SIZE 8
+#define UDP_HEADER_SIZE (6 + UDP_TOKEN_SIZE)
+
+struct peer_info {
+    char ip[16];
+    uint16_t port;
+    uint16_t type;
+    // port allocation of the peer's NAT, see struct port_prediction
+    uint16_t pattern;
+    int16_t delta;
+    uint16_t base_port;
+    // an IPv6 address that takes datagrams to port6 straight away, port6 is 0 if there is none
+    uint8_t ip6[16];
+    uint16_t port6;
+    // the mapping the punch server saw the peer's TCP connection come from, 0 if it doesn't punch TCP
+    uint16_t tcp_port;
+};
 
 typedef struct client client;
 struct client {
     int sfd;
+    // framed requests over the TCP connection sfd, unused in UDP mode
+    struct rpc rpc;
     uint32_t id;
     char buf[128];
     //use a stack-based buffer to prevent memory allocation every time
@@ -15,24 +42,111 @@ struct client {
     // ttl of hole punching packets, 
     // it should be greater than the number of hops between host to NAT of own side
     // and less than the number of hops between host to NAT of remote side,
-    // so that the hole punching packets just die in the way
+    // so that the hole punching packets just die in the way.
+    // TTL_AUTO traces the path to every peer for it
     int ttl; 
+    // how the hole punching probes are fired
+    struct burst_config burst;
+    // what detection found, used to measure the port allocation again before punching
+    struct nat_profile profile;
+    char local_ip[16];
+    // the source port detection ran from, a cone NAT maps it to ext_port for every destination
+    uint16_t local_port;
+    // our IPv6 candidate, raced against IPv4 with every peer that has one too. port6 is 0 without
+    uint8_t ip6[16];
+    uint16_t port6;
+    // punch TCP with peers that do too, the server connection then comes from local_port as well
+    int tcp;
+    // our NAT's mapping of that connection, 0 until enrolled
+    uint16_t tcp_port;
+    // published port allocation pattern of our NAT
+    struct port_prediction pred;
+    // UDP rendezvous, sfd is then the UDP socket bound to our source port
+    int udp;
+    struct sockaddr_in server_addr;
+    // from the server's Enrolled reply, it keeps our address for whoever presents it
+    char token[UDP_TOKEN_SIZE];
+    // a notification that arrived while waiting for a reply
+    int has_notification;
+    uint32_t notification_id;
+    struct peer_info notification;
 };
 
-struct peer_info {
-    char ip[16];
-    uint16_t port;
-    uint16_t type;
-};
 
 enum msg_type {     
      Enroll = 0x01,      
      GetPeerInfo = 0x02,     
      NotifyPeer = 0x03,      
+     // TCP only, not answered
+     Keepalive = 0x04,
+     // UDP rendezvous only
+     UdpEnroll = 0x11,
+     // replies and pushes, for both transports
+     Enrolled = 0x12,
+     PeerInfo = 0x13,
+     NotifyAck = 0x14,
+     Notification = 0x15,
  };
 
+// how a pair of NATs gets punched, both sides work it out the same way from the two types
+enum punch_plan {
+    PlanNone,       // either side is blocked or undetected
+    PlanSpray,      // symmetric both, random ports from both sides
+    PlanPredict,    // symmetric both, allocating with a known stride, both aim at a window
+    PlanDirect,     // cone both, one probe each way between the enrolled mappings
+    PlanConeOpens,  // one of each, the cone side lets the symmetric side's ports in, then it sprays at the cone's mapping
+};
+
+#define TTL_AUTO -1
+// the ttl when the trace can't tell where our NAT is
+#define DEFAULT_TTL 10
+
+// UDP peers refresh their enrollment this often, so the server and NAT keep their mapping
+#define UDP_KEEPALIVE_INTERVAL 20
+// TCP peers send a Keepalive this often, NATs drop idle TCP mappings after a few minutes at the earliest
+#define TCP_KEEPALIVE_INTERVAL 60
+// retransmission of UDP rendezvous requests, as for STUN
+#define UDP_INITIAL_RTO_MS 500
+#define UDP_MAX_TRIES 3
+
 // public functions
 int enroll(struct peer_info self, struct sockaddr_in punch_server, client* c);
-pthread_t wait_for_command(int* server_sock);
-int connect_to_peer(client* cli, uint32_t peer_id);
-void on_connected(int sock);
+// enroll, or refresh the enrollment if c->id is set, over the UDP socket c->sfd.
+// fills c->ext_ip and c->ext_port with the mapping the server observed
+int enroll_udp(struct peer_info self, client* c);
+// greet the peer that reached sock, its address of either family goes to peer unless NULL.
+// an established stream needs no greeting
+void on_connected(int sock, struct sockaddr_in6* peer);
+
+// building blocks of the session loop, see session.h
+uint16_t decode16(const char* buf);
+uint32_t decode32(const char* buf);
+// body of a Notification: id of the notifying peer and its info
+int decode_notification(const char* body, int n, uint32_t* peer_id, struct peer_info* peer);
+// body of a PeerInfo reply, 1 if the peer is offline
+int decode_peer_info_reply(const char* body, int n, struct peer_info* peer);
+// both NATs hand out ports with a known stride, so both sides aim at a small window
+int use_prediction(client* c, const struct peer_info* peer);
+// the cheapest enum punch_plan for our NAT and the peer's
+int punch_plan(client* c, const struct peer_info* peer);
+// anything but a symmetric NAT keeps the mapping of a source port for every destination
+int is_cone(nat_type type);
+// a socket on our enrolled mapping, bound to local_ip:local_port next to any other one there
+int open_mapped_socket(client* c);
+// both of us have an IPv6 candidate, which likely needs no traversal at all
+int use_ipv6(client* c, const struct peer_info* peer);
+// both of us punch TCP and the plan for our NATs takes few enough sockets for it
+int use_tcp(client* c, const struct peer_info* peer);
+// a socket on our IPv6 candidate connected to the peer's, its address goes to peer_addr
+int open_ipv6_socket(client* c, const struct peer_info* peer, struct sockaddr_in6* peer_addr);
+// where our NAT is right now, measured with a few binding requests
+void fresh_prediction(client* c, struct port_prediction* pred);
+// probe ports to spray at the peer, the array is allocated for the caller, -1 if it can't be
+int random_ports(client* c, const struct peer_info* peer, uint16_t** probe_ports);
+int window_ports(const struct peer_info* peer, int sweep, uint16_t** probe_ports);
+// on a cone NAT, the symmetric peer's ports to let in through our mapping
+int filter_ports(client* c, const struct peer_info* peer, uint16_t** probe_ports);
+// on a symmetric NAT, one probe socket per port, all at the cone peer's mapping
+int cone_ports(client* c, const struct peer_info* cone, uint16_t** probe_ports);
+
+#endif
@@ -7,9 +7,16 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <netdb.h> 
+#include <poll.h>
+#include <time.h>
+#include <stddef.h>
 
 #include "nat_type.h"
+#include "stun.h"
+#include "stun_servers.h"
+#include "resolver.h"
+#include "metrics.h"
+#include "log.h"
 
 #define MAX_RETRIES_NUM 3
 
@@ -38,290 +45,558 @@ char* encode32(char* buf, uint32_t data)
     return buf + sizeof(uint32_t);
 }
 
-char* encodeAtrUInt32(char* ptr, uint16_t type, uint32_t value)
-{
-    ptr = encode16(ptr, type);
-    ptr = encode16(ptr, 4);
-    ptr = encode32(ptr, value);
-
-    return ptr;
-}
-
 char* encode(char* buf, const char* data, unsigned int length)
 {
     memcpy(buf, data, length);
     return buf + length;
 }
 
-static int stun_parse_atr_addr( char* body, unsigned int hdrLen, StunAtrAddress* result )
-{
-    if (hdrLen != 8 /* ipv4 size */ && hdrLen != 20 /* ipv6 size */ ) {
+// addr_array[0] for mapped addr, addr_array[1] for changed addr
+static int parse_bind_response(const char* buf, int len, StunAtrAddress* addr_array) {
+    struct stun_message msg;
+    if (stun_decode(buf, len, &msg) < 0 || msg.type != BindResponse) {
         return -1;
     }
-    body++;  // Skip pad
-    result->family = *body++;
 
-    uint16_t nport;
-    memcpy(&nport, body, 2);
-    body+=2;
-    result->port = ntohs(nport);
+    const StunAtrAddress* mapped = stun_mapped_address(&msg);
+    if (mapped == NULL || mapped->family != IPv4Family) {
+        return -1;
+    }
+    addr_array[0] = *mapped;
 
-    if (result->family == IPv4Family) {     
-        uint32_t naddr;
-        memcpy(&naddr, body, sizeof(uint32_t)); body+=sizeof(uint32_t);
-        result->addr.ipv4 = ntohl(naddr);
-        // Note:  addr.ipv4 is stored in host byte order
-        return 0;
-    } else if (result->family == IPv6Family) {
-        printf("ipv6 is not implemented yet");
+    memset(&addr_array[1], 0, sizeof(addr_array[1]));
+    if ((msg.attrs & STUN_HAS_CHANGED) && msg.changed.family == IPv4Family) {
+        addr_array[1] = msg.changed;
     }
 
-    return -1;
+    return 0;
 }
 
-static void gen_random_string(char *s, const int len) {
-    static const char alphanum[] =
-        "0123456789"
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-        "abcdefghijklmnopqrstuvwxyz";
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    int i = 0;
-    for (; i < len; ++i) {
-        s[i] = alphanum[rand() % (sizeof(alphanum) - 1)];
-    }
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static int send_bind_request(int sock, const char* remote_host, uint16_t remote_port, uint32_t change_ip, uint32_t change_port, StunAtrAddress* addr_array) {
-    char* buf = malloc(MAX_STUN_MESSAGE_LENGTH);
-    char* ptr = buf;
+const char* get_nat_desc(nat_type type) {
+    return nat_types[type];
+}
+
+/*
+ * RFC 3489 binding tests, all in flight at the same time and told apart by
+ * transaction ID. a test that isn't answered is retransmitted after RTO,
+ * RTO doubles on each retransmission, and the test fails RTO after the
+ * last transmission.
+ */
+#define INITIAL_RTO_MS 500
+// servers are raced in rank order, each one this long after the previous
+#define RACE_STAGGER_MS 50
+// a server whose name isn't resolved by then drops out of the race
+#define RESOLVE_TIMEOUT_MS 3000
+// how often the race checks for names resolved in the background
+#define RESOLVE_POLL_MS 5
+
+enum {
+    TEST_IDLE,
+    TEST_PENDING,
+    TEST_DONE,
+    TEST_FAILED,
+};
+
+struct bind_test {
+    int sock;
+    struct sockaddr_in dst;
+    uint32_t change;
+    uint8_t tid[STUN_TID_LENGTH];
+    int state;
+    int tx_count;
+    uint32_t rto;
+    uint64_t next_tx;
+    uint64_t first_tx;
+    uint64_t rtt;
+    // 0 for mapped addr, 1 for changed addr
+    StunAtrAddress result[2];
+};
 
-    StunHeader h;
-    h.msgType = BindRequest;
-    
-    gen_random_string((char*)&h.magicCookieAndTid, 16);
+// tests sent to every raced server on the bound socket
+enum {
+    TEST_MAPPED,        // plain request
+    TEST_CHANGE_IP,     // reply from the other ip and port
+    TEST_CHANGE_PORT,   // reply from the other port
+    TESTS_PER_SERVER,
+};
 
-    ptr = encode16(ptr, h.msgType);
-    char* lengthp = ptr;
-    ptr = encode16(ptr, 0);
-    ptr = encode(ptr, (const char*)&h.id, sizeof(h.id));
+// the mapping test runs against the winner only, on its own socket
+#define MAP_PRIMARY (MAX_STUN_SERVERS * TESTS_PER_SERVER)
+#define MAP_ALTERNATE (MAP_PRIMARY + 1)
+#define NUM_OF_TESTS (MAP_ALTERNATE + 1)
 
-    if (change_ip || change_port) {
-        ptr = encodeAtrUInt32(ptr, ChangeRequest, change_ip | change_port);
+#define server_test(d, server, test) (&(d)->tests[(server) * TESTS_PER_SERVER + (test)])
 
-        // length of stun body
-        encode16(lengthp, ptr - buf - sizeof(StunHeader));
-    }
+struct detection {
+    struct bind_test tests[NUM_OF_TESTS];
+    int num_servers;
+    int winner;  // first server that answered with a CHANGED-ADDRESS, -1 until then
+    int resolving[MAX_STUN_SERVERS];  // name still being resolved, tests not started yet
+    const struct resolver* resolver;
+};
 
-    struct hostent *server = gethostbyname(remote_host);
-    if (server == NULL) {
-        fprintf(stderr, "no such host, %s\n", remote_host);
-        free(buf);
+static int transmit(struct bind_test* t, uint64_t now) {
+    char buf[MAX_STUN_MESSAGE_LENGTH];
+    int len = stun_encode_bind_request(buf, sizeof(buf), t->tid, t->change);
 
+    if (sendto(t->sock, buf, len, 0, (struct sockaddr *)&t->dst, sizeof(t->dst)) < 0) {
+        t->state = TEST_FAILED;
         return -1;
     }
-    struct sockaddr_in remote_addr;
 
-    remote_addr.sin_family = AF_INET;
-    memcpy(&remote_addr.sin_addr.s_addr, server->h_addr_list[0], server->h_length);
-    remote_addr.sin_port = htons(remote_port); 
+    metrics_add(t->tx_count ? StunRetries : StunRequests, 1);
+    if (t->tx_count++ == 0) {
+        t->first_tx = now;
+    }
+    t->next_tx = now + t->rto;
+    if (t->tx_count < MAX_RETRIES_NUM) {
+        t->rto *= 2;
+    }
 
-    int retries;
-    for (retries = 0; retries < MAX_RETRIES_NUM; retries++) {
-        if (-1 == sendto(sock, buf, ptr - buf, 0, (struct sockaddr *)&remote_addr, sizeof(remote_addr))) {
-            // sendto() barely failed
-            free(buf);
+    return 0;
+}
 
-            return -1;
-        }
+// the first transmission goes out when start_at is due
+static void start_test(struct bind_test* t, int sock, struct sockaddr_in dst, uint32_t change, uint64_t start_at) {
+    memset(t, 0, sizeof(*t));
+    t->sock = sock;
+    t->dst = dst;
+    t->change = change;
+    t->rto = INITIAL_RTO_MS;
+    t->state = TEST_PENDING;
+    t->next_tx = start_at;
+    // no request rather than one with a guessable transaction ID
+    if (stun_new_tid(t->tid) < 0) {
+        t->state = TEST_FAILED;
+    }
+}
 
-        socklen_t fromlen = sizeof remote_addr;
+static void on_timer(struct bind_test* t, uint64_t now) {
+    if (t->state != TEST_PENDING || now < t->next_tx) {
+        return;
+    }
 
-        struct timeval tv;
-        tv.tv_sec = 3;
-        tv.tv_usec = 0;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
+    if (t->tx_count == MAX_RETRIES_NUM) {
+        // no response to the last transmission either
+        t->state = TEST_FAILED;
+        metrics_add(StunTimeouts, 1);
+    } else {
+        transmit(t, now);
+    }
+}
 
-        if (recvfrom(sock, buf, 512, 0, (struct sockaddr *)&remote_addr, &fromlen) <= 0) {
-            if (errno != EAGAIN || errno != EWOULDBLOCK) {
-                free(buf);
+// read every pending response on sock and hand it to the test it answers
+static void on_readable(int sock, struct bind_test* tests, int num_tests) {
+    char buf[MAX_STUN_MESSAGE_LENGTH];
+    int n;
 
-                return -1;
+    while ((n = recv(sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        if (n < sizeof(StunHeader)) {
+            continue;
+        }
+
+        int i;
+        for (i = 0; i < num_tests; ++i) {
+            struct bind_test* t = &tests[i];
+            if (t->state == TEST_PENDING && t->sock == sock
+                    && !memcmp(buf + offsetof(StunHeader, magicCookieAndTid), t->tid, sizeof(t->tid))) {
+                t->state = parse_bind_response(buf, n, t->result) ? TEST_FAILED : TEST_DONE;
+                t->rtt = now_ms() - t->first_tx;
+                if (t->tx_count == 1) {
+                    metrics_observe(StunRtt, t->rtt * 1000);
+                }
+                break;
             }
-            //timout, retry
-        } else {
-            // got response
-            break;
         }
     }
+}
 
-    if (retries == MAX_RETRIES_NUM)
-        return -1;
+static int open_test_socket(const char* local_ip, uint16_t local_port) {
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0)  {  
+        return -1;  
+    }
 
-    StunHeader reply_header;
-    memcpy(&reply_header, buf, sizeof(StunHeader));
+    int reuse_addr = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse_addr, sizeof(reuse_addr));
 
-    uint16_t msg_type = ntohs(reply_header.msgType);
+    struct sockaddr_in local_addr;
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr.s_addr = inet_addr(local_ip);
 
-    if (msg_type == BindResponse) {
-        char* body = buf + sizeof(StunHeader);
-        uint16_t size = ntohs(reply_header.msgLength);
+    local_addr.sin_port = htons(local_port);  
+    if (bind(s, (struct sockaddr *)&local_addr, sizeof(local_addr))) {
+        if (errno == EADDRINUSE) {
+            info_log("addr in use, try another port\n");
+            close(s);
+            return -1;
+        }
+    }
 
-        StunAtrHdr* attr;
-        unsigned int attrLen;
-        unsigned int attrLenPad;  
-        int atrType;
+    return s;
+}
 
-        while (size > 0) {
-            attr = (StunAtrHdr*)(body);
+static int has_changed_addr(const struct bind_test* t) {
+    return t->result[1].addr.ipv4 != 0 && t->result[1].port != 0;
+}
 
-            attrLen = ntohs(attr->length);
-            // attrLen may not be on 4 byte boundary, in which case we need to pad to 4 bytes when advancing to next attribute
-            attrLenPad = attrLen % 4 == 0 ? 0 : 4 - (attrLen % 4);  
-            atrType = ntohs(attr->type);
+// pick the first server whose plain request got a complete answer
+static void pick_winner(struct detection* d, int map_sock, uint64_t now) {
+    int i;
+    for (i = 0; i < d->num_servers && d->winner < 0; ++i) {
+        struct bind_test* t = server_test(d, i, TEST_MAPPED);
+        if (t->state == TEST_DONE && has_changed_addr(t)) {
+            d->winner = i;
+        }
+    }
+    if (d->winner < 0) {
+        return;
+    }
 
-            if ( attrLen + attrLenPad + 4 > size ) {
-                free(buf);
+    // the race is over, the other servers' filtering tests are of no use
+    for (i = 0; i < d->num_servers; ++i) {
+        if (i != d->winner) {
+            server_test(d, i, TEST_CHANGE_IP)->state = TEST_IDLE;
+            server_test(d, i, TEST_CHANGE_PORT)->state = TEST_IDLE;
+        }
+    }
 
-                return -1;
-            }
+    struct bind_test* mapped = server_test(d, d->winner, TEST_MAPPED);
+    struct sockaddr_in alternate;
+    alternate.sin_family = AF_INET;
+    alternate.sin_addr.s_addr = htonl(mapped->result[1].addr.ipv4);
+    alternate.sin_port = htons(mapped->result[1].port);
+    start_test(&d->tests[MAP_PRIMARY], map_sock, mapped->dst, 0, now);
+    start_test(&d->tests[MAP_ALTERNATE], map_sock, alternate, 0, now);
+}
 
-            body += 4; // skip the length and type in attribute header
-            size -= 4;
+/*
+ * start the tests of a server once its name is resolved, not before its turn
+ * in the race. returns 1 while the name is still being resolved
+ */
+static int resolve_server(struct detection* d, int i, struct stun_server* server, int sock,
+        uint64_t start_at, uint64_t now, int give_up) {
+    struct in_addr addr;
+    if (resolver_lookup(d->resolver, server->host, &addr, 0) < 0) {
+        if (errno == EAGAIN && !give_up) {
+            return 1;
+        }
+        info_log("no such host, %s\n", server->host);
+        server_test(d, i, TEST_MAPPED)->state = TEST_FAILED;
+        d->resolving[i] = 0;
+        return 0;
+    }
+    d->resolving[i] = 0;
 
-            switch (atrType) {
-            case MappedAddress:
-                if (stun_parse_atr_addr(body, attrLen, addr_array)) {
-                    free(buf);
+    server->addr.sin_family = AF_INET;
+    server->addr.sin_addr = addr;
+    server->addr.sin_port = htons(server->port);
 
-                    return -1;
-                }
-                break;
-            case ChangedAddress:
-                if (stun_parse_atr_addr( body, attrLen, addr_array + 1)) {
-                    free(buf);
+    if (start_at < now) {
+        start_at = now;
+    }
+    start_test(server_test(d, i, TEST_MAPPED), sock, server->addr, 0, start_at);
+    // the filtering tests are of no use once another server won
+    if (d->winner < 0) {
+        start_test(server_test(d, i, TEST_CHANGE_IP), sock, server->addr, ChangeIpFlag | ChangePortFlag, start_at);
+        start_test(server_test(d, i, TEST_CHANGE_PORT), sock, server->addr, ChangePortFlag, start_at);
+    }
 
-                    return -1;
-                }
-                break;
-            default:
-                // ignore other attributes
-                break;
+    return 0;
+}
+
+// decide as soon as the finished tests allow it, Error means not yet
+static nat_type classify(struct detection* d, const char* local_ip, int* done) {
+    *done = 1;
+
+    int i, answered = 0, pending = 0;
+    for (i = 0; i < d->num_servers; ++i) {
+        struct bind_test* mapped = server_test(d, i, TEST_MAPPED);
+        if (mapped->state == TEST_DONE) {
+            struct in_addr mapped_addr;
+            mapped_addr.s_addr = htonl(mapped->result[0].addr.ipv4);
+
+            /* TODO use getifaddrs() to get interface address, 
+            * then compare it with mapped address to determine
+            * if it's open Internet
+            */
+            if (!strcmp(local_ip, inet_ntoa(mapped_addr))) {
+                return OpenInternet;
             }
-            body += attrLen + attrLenPad;
-            size -= attrLen + attrLenPad;
+            answered = 1;
+        } else if (mapped->state == TEST_PENDING || d->resolving[i]) {
+            pending = 1;
         }
     }
-    
-    free(buf);
 
-    return 0;
+    if (d->winner < 0) {
+        if (pending) {
+            *done = 0;
+            return Error;
+        }
+        if (answered) {
+            info_log("no alterative server, can't detect nat type\n");
+            return Error;
+        }
+        return Blocked;
+    }
+
+    struct bind_test* change_ip = server_test(d, d->winner, TEST_CHANGE_IP);
+    struct bind_test* change_port = server_test(d, d->winner, TEST_CHANGE_PORT);
+    struct bind_test* map_primary = &d->tests[MAP_PRIMARY];
+    struct bind_test* map_alternate = &d->tests[MAP_ALTERNATE];
+
+    if (change_ip->state == TEST_DONE) {
+        return FullCone;
+    }
+    if (change_ip->state == TEST_FAILED) {
+        if (map_primary->state == TEST_FAILED || map_alternate->state == TEST_FAILED) {
+            info_log("failed to send request to alterative server\n");
+            return Error;
+        }
+        if (map_primary->state == TEST_DONE && map_alternate->state == TEST_DONE) {
+            if (map_primary->result[0].addr.ipv4 != map_alternate->result[0].addr.ipv4
+                    || map_primary->result[0].port != map_alternate->result[0].port) {
+                return SymmetricNAT;
+            }
+            if (change_port->state == TEST_DONE) {
+                return RestricNAT;
+            }
+            if (change_port->state == TEST_FAILED) {
+                return RestricPortNAT;
+            }
+        }
+    }
+
+    *done = 0;
+    return Error;
 }
 
-const char* get_nat_desc(nat_type type) {
-    return nat_types[type];
+// feed what the race taught us back into the server scores
+static void record_race(struct detection* d, struct stun_server_list* servers) {
+    int i;
+    for (i = 0; i < d->num_servers; ++i) {
+        struct bind_test* mapped = server_test(d, i, TEST_MAPPED);
+        if (mapped->state == TEST_DONE) {
+            // Karn's rule, a retransmitted request gives no usable rtt sample
+            uint32_t rtt = mapped->tx_count == 1 ? (mapped->rtt ? mapped->rtt : 1) : 0;
+            stun_servers_record(&servers->servers[i], 1, rtt);
+        } else if (mapped->state == TEST_FAILED
+                || (mapped->state == TEST_PENDING && mapped->tx_count && now_ms() - mapped->first_tx >= INITIAL_RTO_MS)) {
+            // still silent a full RTO after the first request counts as a failure too
+            stun_servers_record(&servers->servers[i], 0, 0);
+        }
+    }
 }
 
-nat_type detect_nat_type(const char* stun_host, uint16_t stun_port, const char* local_ip, uint16_t local_port, char* ext_ip, uint16_t* ext_port) {
+nat_type detect_nat_type(struct stun_server_list* servers, const char* local_ip, uint16_t local_port, struct nat_profile* profile) {
     uint32_t mapped_ip = 0;
     uint16_t mapped_port = 0;
-    int s = socket(AF_INET, SOCK_DGRAM, 0);
-    if (s <= 0)  {  
-        return Error;  
+    nat_type nat_type = Error;
+
+    // the bound socket runs the filtering tests, the mapping test uses its own
+    // socket so its packets to the alternate server can't open a hole
+    // for the change request replies
+    int s = open_test_socket(local_ip, local_port);
+    if (s < 0) {
+        return Error;
+    }
+    int map_sock = open_test_socket(local_ip, 0);
+    if (map_sock < 0) {
+        close(s);
+        return Error;
     }
 
-    nat_type nat_type;
-
-    int reuse_addr = 1;
-    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse_addr, sizeof(reuse_addr));
-
-    struct sockaddr_in local_addr;
-    local_addr.sin_family = AF_INET;
-    local_addr.sin_addr.s_addr = inet_addr(local_ip);
-
-    local_addr.sin_port = htons(local_port);  
-    if (bind(s, (struct sockaddr *)&local_addr, sizeof(local_addr))) {
-        if (errno == EADDRINUSE) {
-            printf("addr in use, try another port\n");
-            nat_type = Error;
-            goto cleanup_sock;
-        }
+    struct detection d;
+    memset(&d, 0, sizeof(d));
+    d.num_servers = servers->count;
+    d.winner = -1;
+    d.resolver = servers->resolver;
+
+    // race the servers, best ranked first. names are resolved in the background,
+    // so a slow lookup only delays its own server
+    uint64_t now = now_ms();
+    uint64_t start_at = now;
+    uint64_t resolve_deadline = now + RESOLVE_TIMEOUT_MS;
+    int i, j;
+    for (i = 0; i < d.num_servers; ++i) {
+        resolver_start(servers->resolver, servers->servers[i].host);
+        d.resolving[i] = 1;
     }
 
-    // 0 for mapped addr, 1 for changed addr
-    StunAtrAddress bind_result[2];
-
-    memset(bind_result, 0, sizeof(StunAtrAddress) * 2);
-    if (send_bind_request(s, stun_host, stun_port, 0, 0, bind_result)) {
-        nat_type = Blocked;
-        goto cleanup_sock;
-    }
-
-    mapped_ip = bind_result[0].addr.ipv4; // in host byte order
-    mapped_port = bind_result[0].port;
-    uint32_t changed_ip = bind_result[1].addr.ipv4;
-    uint16_t changed_port = bind_result[1].port;
-
-    struct in_addr mapped_addr;
-    mapped_addr.s_addr = htonl(mapped_ip);
-
-    /*
-    * it's complicated to get the RECEIVER address of UDP packet,
-    * For Linux/Windows, set IP_PKTINFO option to enable ancillary 
-    * message that contains a pktinfo structure that supplies 
-    * some information about the incoming packets
-    */
-
-    /* TODO use getifaddrs() to get interface address, 
-    * then compare it with mapped address to determine
-    * if it's open Internet
-    */
-
-    if (!strcmp(local_ip, inet_ntoa(mapped_addr))) {
-        nat_type = OpenInternet;
-        goto cleanup_sock;
-    } else { 
-        if (changed_ip != 0 && changed_port != 0) {
-            if (send_bind_request(s, stun_host, stun_port, ChangeIpFlag, ChangePortFlag, bind_result)) {
-                struct in_addr addr = {htonl(changed_ip)};
-                char* alt_host = inet_ntoa(addr);
-
-                memset(bind_result, 0, sizeof(StunAtrAddress) * 2);
-
-                if (send_bind_request(s, alt_host, changed_port, 0, 0, bind_result)) {
-                    printf("failed to send request to alterative server\n");
-                    nat_type = Error;
-                    goto cleanup_sock;
-                }
+    int done = 0;
+    for (; ;) {
+        now = now_ms();
+        int resolving = 0;
+        for (i = 0; i < d.num_servers; ++i) {
+            if (d.resolving[i]) {
+                resolving |= resolve_server(&d, i, &servers->servers[i], s,
+                        start_at + i * RACE_STAGGER_MS, now, now >= resolve_deadline);
+            }
+        }
+        if (d.winner < 0) {
+            pick_winner(&d, map_sock, now);
+        }
+        for (j = 0; j < NUM_OF_TESTS; ++j) {
+            on_timer(&d.tests[j], now);
+        }
 
-                if (mapped_ip != bind_result[0].addr.ipv4 || mapped_port != bind_result[0].port) {
-                    nat_type = SymmetricNAT;
-                    goto cleanup_sock;
-                }
+        nat_type = classify(&d, local_ip, &done);
+        if (done) {
+            break;
+        }
 
-                if (send_bind_request(s, alt_host, changed_port, 0, ChangePortFlag, bind_result)) {
-                    nat_type = RestricPortNAT;
-                    goto cleanup_sock;
-                }
+        // sleep until the next retransmission or a response
+        uint64_t next = UINT64_MAX;
+        for (j = 0; j < NUM_OF_TESTS; ++j) {
+            if (d.tests[j].state == TEST_PENDING && d.tests[j].next_tx < next) {
+                next = d.tests[j].next_tx;
+            }
+        }
+        if (resolving && next > now + RESOLVE_POLL_MS) {
+            next = now + RESOLVE_POLL_MS;
+        }
+        if (next == UINT64_MAX) {
+            // nothing in flight and still undecided
+            break;
+        }
 
-                nat_type = RestricNAT;
-                goto cleanup_sock;
+        struct pollfd fds[2] = {{s, POLLIN, 0}, {map_sock, POLLIN, 0}};
+        int timeout = next > now ? next - now : 0;
+        if (poll(fds, 2, timeout) > 0) {
+            if (fds[0].revents & POLLIN) {
+                on_readable(s, d.tests, NUM_OF_TESTS);
             }
-            else {
-                nat_type = FullCone;    
-                goto cleanup_sock;
+            if (fds[1].revents & POLLIN) {
+                on_readable(map_sock, d.tests, NUM_OF_TESTS);
             }
-        } else {
-            printf("no alterative server, can't detect nat type\n");
-            nat_type = Error;
-            goto cleanup_sock;
         }
     }
-cleanup_sock:
+
+    memset(profile, 0, sizeof(*profile));
+    if (d.winner >= 0) {
+        verbose_log("STUN server %s:%d answered first\n", servers->servers[d.winner].host, servers->servers[d.winner].port);
+        struct bind_test* mapped = server_test(&d, d.winner, TEST_MAPPED);
+        mapped_ip = mapped->result[0].addr.ipv4; // in host byte order
+        mapped_port = mapped->result[0].port;
+
+        strcpy(profile->stun_ip, inet_ntoa(mapped->dst.sin_addr));
+        profile->stun_port = ntohs(mapped->dst.sin_port);
+        struct in_addr changed_addr = {htonl(mapped->result[1].addr.ipv4)};
+        strcpy(profile->changed_ip, inet_ntoa(changed_addr));
+        profile->changed_port = mapped->result[1].port;
+        if (nat_type == SymmetricNAT) {
+            profile->port_delta = d.tests[MAP_ALTERNATE].result[0].port - d.tests[MAP_PRIMARY].result[0].port;
+        }
+    } else {
+        for (i = 0; i < d.num_servers; ++i) {
+            if (server_test(&d, i, TEST_MAPPED)->state == TEST_DONE) {
+                mapped_ip = server_test(&d, i, TEST_MAPPED)->result[0].addr.ipv4;
+                mapped_port = server_test(&d, i, TEST_MAPPED)->result[0].port;
+                break;
+            }
+        }
+    }
+    record_race(&d, servers);
+
+    close(map_sock);
     close(s);
     struct in_addr ext_addr;
     ext_addr.s_addr = htonl(mapped_ip);
-    strcpy(ext_ip, inet_ntoa(ext_addr));
-    *ext_port = mapped_port;
+    strcpy(profile->ext_ip, inet_ntoa(ext_addr));
+    profile->ext_port = mapped_port;
+    profile->type = nat_type;
 
     return nat_type;
 }
+
+// drive tests that all run on sock until none of them is pending
+static void run_tests(int sock, struct bind_test* tests, int num_tests) {
+    for (; ;) {
+        uint64_t now = now_ms();
+        uint64_t next = UINT64_MAX;
+        int i;
+        for (i = 0; i < num_tests; ++i) {
+            on_timer(&tests[i], now);
+            if (tests[i].state == TEST_PENDING && tests[i].next_tx < next) {
+                next = tests[i].next_tx;
+            }
+        }
+        if (next == UINT64_MAX) {
+            break;
+        }
+
+        struct pollfd fd = {sock, POLLIN, 0};
+        if (poll(&fd, 1, next > now ? next - now : 0) > 0) {
+            on_readable(sock, tests, num_tests);
+        }
+    }
+}
+
+int validate_nat_profile(struct nat_profile* profile, const char* local_ip, uint16_t local_port) {
+    struct sockaddr_in server;
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(profile->stun_ip);
+    server.sin_port = htons(profile->stun_port);
+
+    int s = open_test_socket(local_ip, local_port);
+    if (s < 0) {
+        return -1;
+    }
+
+    struct bind_test t;
+    start_test(&t, s, server, 0, now_ms());
+    run_tests(s, &t, 1);
+    close(s);
+
+    if (t.state != TEST_DONE) {
+        return -1;
+    }
+
+    struct in_addr mapped_addr = {htonl(t.result[0].addr.ipv4)};
+    if (strcmp(profile->ext_ip, inet_ntoa(mapped_addr))) {
+        return -1;
+    }
+    // a symmetric NAT may hand out another port once the old mapping expired,
+    // the others must keep the mapping of our local port
+    if (t.result[0].port != profile->ext_port) {
+        if (profile->type != SymmetricNAT) {
+            return -1;
+        }
+        profile->ext_port = t.result[0].port;
+    }
+
+    return 0;
+}
+
+int query_mapped_ports(int sock, const struct sockaddr_in* dsts, int n, uint16_t* ports) {
+    struct bind_test tests[MAX_MAPPING_QUERIES];
+    if (n > MAX_MAPPING_QUERIES) {
+        n = MAX_MAPPING_QUERIES;
+    }
+
+    // back to back, so the NAT allocates the mappings in this order
+    uint64_t now = now_ms();
+    int i;
+    for (i = 0; i < n; ++i) {
+        start_test(&tests[i], sock, dsts[i], 0, now);
+        on_timer(&tests[i], now);
+    }
+    run_tests(sock, tests, n);
+
+    for (i = 0; i < n; ++i) {
+        if (tests[i].state != TEST_DONE) {
+            return -1;
+        }
+        ports[i] = tests[i].result[0].port;
+    }
+
+    return 0;
+}
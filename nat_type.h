@@ -1,3 +1,6 @@
+#ifndef NAT_TYPE_H
+#define NAT_TYPE_H
+
 #include <stdint.h>
 
 typedef enum {
@@ -18,6 +21,9 @@ typedef enum {
 #define MappedAddress 0x0001
 #define SourceAddress 0x0004
 #define ChangedAddress 0x0005
+#define ChangeRequest 0x0003 /* removed from rfc 5389.*/
+#define ErrorCode 0x0009
+#define XorMappedAddress 0x0020
 
 // define stun constants
 const static uint8_t  IPv4Family = 0x01;
@@ -30,11 +36,8 @@ const static uint16_t BindRequest      = 0x0001;
 const static uint16_t BindResponse     = 0x0101;
 
 const static uint16_t ResponseAddress  = 0x0002;
-const static uint16_t ChangeRequest    = 0x0003; /* removed from rfc 5389.*/
 const static uint16_t MessageIntegrity = 0x0008;
-const static uint16_t ErrorCode        = 0x0009;
 const static uint16_t UnknownAttribute = 0x000A;
-const static uint16_t XorMappedAddress = 0x0020;
 
 typedef struct { uint32_t longpart[4]; }  UInt128;
 typedef struct { uint32_t longpart[3]; }  UInt96;
@@ -76,13 +79,43 @@ typedef struct
 char* encode16(char* buf, uint16_t data);
 char* encode32(char* buf, uint32_t data);
 char* encode(char* buf, const char* data, unsigned int length);
-extern int verbose;
-
-#define verbose_log(format, ...) do {       \
-        if (verbose)                        \
-            printf(format, ##__VA_ARGS__);  \
-} while(0)
 
-nat_type detect_nat_type(const char* stun_host, uint16_t stun_port, const char* local_host, uint16_t local_port, char* ext_ip, uint16_t* ext_port);
+// what detection learned about the NAT in front of us, addresses in dotted quad
+struct nat_profile {
+    nat_type type;
+    char ext_ip[16];
+    uint16_t ext_port;
+    // STUN server that answered first and its alternate address
+    char stun_ip[16];
+    uint16_t stun_port;
+    char changed_ip[16];
+    uint16_t changed_port;
+    // mapped port to the alternate server minus mapped port to the primary one,
+    // 0 unless the NAT maps every destination to its own port
+    int port_delta;
+    // measured allocation pattern of new mappings, see enum port_pattern
+    uint16_t port_pattern;
+    // probe sockets a second the NAT took without refusing any, 0 if unknown
+    uint32_t probe_rate;
+};
+
+struct stun_server_list;
+
+// races every server in the list, best ranked first, and updates their scores
+nat_type detect_nat_type(struct stun_server_list* servers, const char* local_host, uint16_t local_port, struct nat_profile* profile);
+
+// one binding request to the profile's server, 0 if our external address hasn't changed
+int validate_nat_profile(struct nat_profile* profile, const char* local_host, uint16_t local_port);
+
+#define MAX_MAPPING_QUERIES 16
+
+/*
+ * send a binding request from sock to each of dsts in that order and
+ * collect the mapped ports, 0 if every request was answered
+ */
+struct sockaddr_in;
+int query_mapped_ports(int sock, const struct sockaddr_in* dsts, int n, uint16_t* ports);
 
 const char* get_nat_desc(nat_type type);
+
+#endif
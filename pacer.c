@@ -0,0 +1,105 @@
+#include <errno.h>
+
+#include "pacer.h"
+
+static void refill(struct pacer* p, uint64_t now_us) {
+    if (now_us > p->last_us) {
+        p->tokens += (now_us - p->last_us) * p->rate / 1e6;
+        if (p->tokens > p->depth) {
+            p->tokens = p->depth;
+        }
+    }
+    p->last_us = now_us;
+}
+
+static double clamp(double rate) {
+    if (rate < PACER_MIN_RATE) {
+        return PACER_MIN_RATE;
+    }
+
+    return rate > PACER_MAX_RATE ? PACER_MAX_RATE : rate;
+}
+
+void pacer_init(struct pacer* p, double rate, int depth, int ramping, uint64_t now_us) {
+    p->rate = clamp(rate);
+    p->depth = depth > 0 ? depth : 1;
+    // the first batch goes out right away
+    p->tokens = p->depth;
+    p->last_us = now_us;
+    p->grown_us = now_us;
+    p->backoff_us = 0;
+    p->refused_rate = 0;
+    p->ramping = ramping;
+    p->refusals = 0;
+}
+
+int pacer_take(struct pacer* p, int want, uint64_t now_us) {
+    refill(p, now_us);
+    int n = (int)p->tokens;
+    if (n > want) {
+        n = want;
+    }
+    p->tokens -= n;
+
+    return n;
+}
+
+uint64_t pacer_delay_us(struct pacer* p, int n, uint64_t now_us) {
+    refill(p, now_us);
+    if (n > p->depth) {
+        n = p->depth;
+    }
+    if (p->tokens >= n) {
+        return 0;
+    }
+
+    return (uint64_t)((n - p->tokens) * 1e6 / p->rate) + 1;
+}
+
+void pacer_sent(struct pacer* p, uint64_t now_us) {
+    // in proportion to the time since the last growth, at most a whole period's,
+    // the rate grows as fast however the batches are spread
+    double periods = (double)(now_us - p->grown_us) / PACER_PERIOD_US;
+    if (periods > 1) {
+        periods = 1;
+    }
+    double growth = p->ramping ? PACER_RAMP : PACER_CLIMB;
+    p->rate = clamp(p->rate * (1 + (growth - 1) * periods));
+    p->grown_us = now_us;
+}
+
+void pacer_refused(struct pacer* p, uint64_t now_us) {
+    refill(p, now_us);
+    p->tokens = 0;
+    p->grown_us = now_us;
+    if (p->backoff_us && now_us - p->backoff_us < PACER_PERIOD_US) {
+        return;
+    }
+    p->refused_rate = p->rate;
+    p->rate = clamp(p->rate / 2);
+    p->backoff_us = now_us;
+    p->ramping = 0;
+    p->refusals++;
+}
+
+double pacer_sustained(const struct pacer* p) {
+    if (p->refusals == 0) {
+        return p->rate;
+    }
+
+    return clamp(p->refused_rate * 3 / 4);
+}
+
+int pacer_is_refusal(int error) {
+    switch (error) {
+        case ENOBUFS:
+        case EAGAIN:
+        case EPERM:
+        case EACCES:
+        case EMFILE:
+        case ENFILE:
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+
+/*
+ * token bucket over the probe sockets of every session behind one NAT. the
+ * bucket fills at rate tokens a second, accounted in microseconds, and holds
+ * depth of them, the most a single wakeup may open. the rate doubles every
+ * PACER_PERIOD_US of sending until something refuses a probe, the kernel
+ * (ENOBUFS, EPERM, EMFILE...) or the NAT with an ICMP error, then it's halved
+ * and climbs by a tenth a period from there. news of a refusal takes a while,
+ * the refusals within a period of a backoff are of probes sent before it and
+ * don't halve the rate again. the rate swings between the one refused and
+ * half of it, three quarters of the refused one is what the NAT sustains,
+ * worth remembering with the NAT's profile and starting from next time.
+ */
+
+#define PACER_MIN_RATE 100
+#define PACER_MAX_RATE 1000000
+// growth per period before and after the first refusal
+#define PACER_RAMP 2.0
+#define PACER_CLIMB 1.1
+// about a round trip to our NAT and back, for ICMP errors, with time to spare
+#define PACER_PERIOD_US 10000
+
+struct pacer {
+    double rate;        // probe sockets a second
+    double tokens;
+    int depth;
+    uint64_t last_us;   // when tokens was last brought up to date
+    uint64_t grown_us;  // when rate last grew
+    uint64_t backoff_us;
+    double refused_rate;    // the rate when the last backoff halved it
+    int ramping;            // doubling, nothing refused yet
+    int refusals;
+};
+
+// ramping 0 starts from a rate learned before, climbing slowly
+void pacer_init(struct pacer* p, double rate, int depth, int ramping, uint64_t now_us);
+
+// how many of want may go out now, they're taken from the bucket
+int pacer_take(struct pacer* p, int want, uint64_t now_us);
+
+// microseconds until n tokens are in the bucket, n is capped at depth
+uint64_t pacer_delay_us(struct pacer* p, int n, uint64_t now_us);
+
+// a batch went out without being refused
+void pacer_sent(struct pacer* p, uint64_t now_us);
+
+// a probe was refused, empty the bucket and back off unless that was just done
+void pacer_refused(struct pacer* p, uint64_t now_us);
+
+// the rate to start from next time, in probe sockets a second
+double pacer_sustained(const struct pacer* p);
+
+// 1 if a socket() or send errno means slow down rather than give up
+int pacer_is_refusal(int error);
+
+#endif
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/random.h>
+
+#include "port_perm.h"
+
+static uint64_t splitmix64(uint64_t* state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+    return z ^ (z >> 31);
+}
+
+// round function, a 32 bit integer hash of the half and the round key
+static uint32_t mix(uint32_t x, uint32_t key) {
+    x ^= key;
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    x *= 0x846CA68B;
+    x ^= x >> 16;
+
+    return x;
+}
+
+int port_perm_init_key(struct port_perm* p, uint16_t min, uint16_t max, uint64_t key) {
+    if (max < min) {
+        return -1;
+    }
+
+    memset(p, 0, sizeof(*p));
+    p->min = min;
+    p->size = (uint32_t)max - min + 1;
+    // the smallest even width covering every index
+    int bits = 2;
+    while ((1u << bits) < p->size) {
+        bits += 2;
+    }
+    p->half_bits = bits / 2;
+
+    int i;
+    for (i = 0; i < PORT_PERM_ROUNDS; ++i) {
+        p->keys[i] = (uint32_t)splitmix64(&key);
+    }
+
+    return 0;
+}
+
+int port_perm_init(struct port_perm* p, uint16_t min, uint16_t max) {
+    uint64_t key;
+    if (getrandom(&key, sizeof(key), GRND_NONBLOCK) != sizeof(key)) {
+        // the order only has to be unguessable to the NATs, not to an attacker
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        key = (uint64_t)ts.tv_sec * 1000000007 ^ ts.tv_nsec ^ (uint64_t)getpid() << 32 ^ (uintptr_t)p;
+    }
+
+    return port_perm_init_key(p, min, max, key);
+}
+
+// one pass through the network, a bijection of [0, 2^(2 * half_bits))
+static uint32_t feistel(const struct port_perm* p, uint32_t x) {
+    uint32_t mask = (1u << p->half_bits) - 1;
+    uint32_t l = x >> p->half_bits, r = x & mask;
+    int i;
+    for (i = 0; i < PORT_PERM_ROUNDS; ++i) {
+        uint32_t t = r;
+        r = l ^ (mix(r, p->keys[i]) & mask);
+        l = t;
+    }
+
+    return l << p->half_bits | r;
+}
+
+uint16_t port_perm_at(const struct port_perm* p, uint32_t i) {
+    // cycle walking: the cycle through i comes back into the range, so the
+    // indices in it stay a permutation. the domain is less than 4 times the
+    // range, a handful of passes at worst
+    uint32_t x = i;
+    do {
+        x = feistel(p, x);
+    } while (x >= p->size);
+
+    return (uint16_t)(p->min + x);
+}
+
+static int excluded(uint16_t port, const uint16_t* exclude, int num_exclude) {
+    int i;
+    for (i = 0; i < num_exclude; ++i) {
+        if (exclude[i] == port) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int port_perm_take(struct port_perm* p, uint16_t* out, int n, const uint16_t* exclude, int num_exclude) {
+    int taken = 0;
+    while (taken < n && p->next < p->size) {
+        uint16_t port = port_perm_at(p, p->next++);
+        if (!excluded(port, exclude, num_exclude)) {
+            out[taken++] = port;
+        }
+    }
+
+    return taken;
+}
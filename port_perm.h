@@ -0,0 +1,37 @@
+#ifndef PORT_PERM_H
+#define PORT_PERM_H
+
+#include <stdint.h>
+
+/*
+ * a random order of the ports in [min, max], drawn on demand from a keyed
+ * bijection of their indices: a Feistel network just wide enough for the
+ * range, walked again whenever it lands past the end. no table, no shuffle,
+ * a few bytes whatever the range, and every order has a key of its own, so
+ * concurrent sessions share nothing.
+ */
+
+#define PORT_PERM_ROUNDS 4
+
+struct port_perm {
+    uint16_t min;
+    uint32_t size;      // ports in the range
+    int half_bits;      // width of each Feistel half
+    uint32_t keys[PORT_PERM_ROUNDS];
+    uint32_t next;      // index of the next port port_perm_take() hands out
+};
+
+// a fresh random key, -1 if max < min
+int port_perm_init(struct port_perm* p, uint16_t min, uint16_t max);
+
+// a given key, the same key gives the same order
+int port_perm_init_key(struct port_perm* p, uint16_t min, uint16_t max, uint64_t key);
+
+// the port at position i of the order, i < size
+uint16_t port_perm_at(const struct port_perm* p, uint32_t i);
+
+// the next n ports of the order, skipping the num_exclude ports in exclude.
+// returns how many it took, fewer than n only once the order runs out
+int port_perm_take(struct port_perm* p, uint16_t* out, int n, const uint16_t* exclude, int num_exclude);
+
+#endif
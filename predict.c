@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "predict.h"
+#include "log.h"
+
+// NATs allocate from the non privileged range and wrap around
+#define MIN_ALLOC_PORT 1024
+#define NUM_OF_ALLOC_PORTS (65536 - MIN_ALLOC_PORT)
+// most ports other hosts may take between two of our allocations
+#define MAX_JITTER 16
+#define MAX_STRIDE 64
+#define MEASURE_SOCKETS 2
+#define ENDPOINTS_PER_SERVER 4
+
+static const char* patterns[] = {
+    "unknown",
+    "port preserving",
+    "delta",
+    "random",
+};
+
+const char* get_pattern_desc(uint16_t pattern) {
+    return pattern <= PatternRandom ? patterns[pattern] : patterns[PatternUnknown];
+}
+
+// difference between two allocations, taking the wrap around into account
+static int port_step(uint16_t from, uint16_t to) {
+    int step = (int)to - (int)from;
+    if (step > NUM_OF_ALLOC_PORTS / 2) {
+        step -= NUM_OF_ALLOC_PORTS;
+    } else if (step < -NUM_OF_ALLOC_PORTS / 2) {
+        step += NUM_OF_ALLOC_PORTS;
+    }
+
+    return step;
+}
+
+static uint16_t wrap_port(long port) {
+    long offset = (port - MIN_ALLOC_PORT) % NUM_OF_ALLOC_PORTS;
+    if (offset < 0) {
+        offset += NUM_OF_ALLOC_PORTS;
+    }
+
+    return MIN_ALLOC_PORT + offset;
+}
+
+void classify_ports(const uint16_t* ports, int n, struct port_prediction* pred) {
+    memset(pred, 0, sizeof(*pred));
+    if (n < 3) {
+        pred->pattern = PatternUnknown;
+        return;
+    }
+    pred->base_port = ports[n - 1];
+
+    // the smallest step is the stride, larger ones are other hosts allocating in between
+    int i, min_step = 0, max_step = 0;
+    for (i = 1; i < n; ++i) {
+        int step = port_step(ports[i - 1], ports[i]);
+        if (i == 1 || abs(step) < abs(min_step)) {
+            min_step = step;
+        }
+        if (i == 1 || abs(step) > abs(max_step)) {
+            max_step = step;
+        }
+    }
+
+    if (min_step == 0) {
+        // the same port for every destination, or for some of them only
+        pred->pattern = max_step == 0 ? PatternPreserving : PatternRandom;
+        return;
+    }
+
+    // every step must go the same way and be a multiple of the stride,
+    // a busy NAT skips the ports other hosts took in between
+    int jitter = 0;
+    for (i = 1; i < n; ++i) {
+        int step = port_step(ports[i - 1], ports[i]);
+        if (step == 0 || (step > 0) != (min_step > 0) || step % min_step) {
+            pred->pattern = PatternRandom;
+            return;
+        }
+        if (step / min_step - 1 > jitter) {
+            jitter = step / min_step - 1;
+        }
+    }
+    if (jitter > MAX_JITTER || abs(min_step) > MAX_STRIDE) {
+        pred->pattern = PatternRandom;
+        return;
+    }
+
+    pred->pattern = PatternDelta;
+    pred->delta = min_step;
+    pred->jitter = jitter;
+}
+
+int measure_port_prediction(const struct nat_profile* profile, const char* local_ip, struct port_prediction* pred) {
+    struct sockaddr_in dsts[ENDPOINTS_PER_SERVER];
+    const char* ips[2] = {profile->stun_ip, profile->changed_ip};
+    uint16_t ports[2] = {profile->stun_port, profile->changed_port};
+    int i;
+
+    memset(pred, 0, sizeof(*pred));
+    for (i = 0; i < ENDPOINTS_PER_SERVER; ++i) {
+        memset(&dsts[i], 0, sizeof(dsts[i]));
+        dsts[i].sin_family = AF_INET;
+        dsts[i].sin_addr.s_addr = inet_addr(ips[i / 2]);
+        dsts[i].sin_port = htons(ports[i % 2]);
+    }
+
+    uint16_t mapped[MEASURE_SOCKETS * ENDPOINTS_PER_SERVER];
+    for (i = 0; i < MEASURE_SOCKETS; ++i) {
+        int s = socket(AF_INET, SOCK_DGRAM, 0);
+        if (s < 0) {
+            return -1;
+        }
+
+        struct sockaddr_in local_addr;
+        memset(&local_addr, 0, sizeof(local_addr));
+        local_addr.sin_family = AF_INET;
+        local_addr.sin_addr.s_addr = inet_addr(local_ip);
+        bind(s, (struct sockaddr *)&local_addr, sizeof(local_addr));
+
+        int ret = query_mapped_ports(s, dsts, ENDPOINTS_PER_SERVER, mapped + i * ENDPOINTS_PER_SERVER);
+        close(s);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+
+    classify_ports(mapped, MEASURE_SOCKETS * ENDPOINTS_PER_SERVER, pred);
+    verbose_log("port allocation: %s, delta %d, jitter %d, last port %d\n",
+            get_pattern_desc(pred->pattern), pred->delta, pred->jitter, pred->base_port);
+
+    return 0;
+}
+
+int is_predictable(const struct port_prediction* pred) {
+    return pred->pattern == PatternDelta;
+}
+
+int predict_window(const struct port_prediction* pred, uint16_t* out, int n) {
+    if (!is_predictable(pred)) {
+        return 0;
+    }
+
+    int k;
+    for (k = 1; k <= n; ++k) {
+        out[k - 1] = wrap_port(pred->base_port + (long)pred->delta * k);
+    }
+
+    return n;
+}
+
+int predict_sweep(const struct port_prediction* pred, int spread, uint16_t* out, int n) {
+    if (!is_predictable(pred)) {
+        return 0;
+    }
+
+    int k;
+    for (k = 1; k <= n; ++k) {
+        out[k - 1] = wrap_port(pred->base_port + (long)pred->delta * (k + k % (spread + 1)));
+    }
+
+    return n;
+}
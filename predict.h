@@ -0,0 +1,52 @@
+#ifndef PREDICT_H
+#define PREDICT_H
+
+#include <stdint.h>
+
+#include "nat_type.h"
+
+/*
+ * how the NAT in front of us hands out external ports to new mappings,
+ * measured by binding to distinct STUN endpoints from one socket
+ */
+enum port_pattern {
+    PatternUnknown,
+    PatternPreserving,  // every destination sees the same port
+    PatternDelta,       // next port = previous port + delta, give or take jitter
+    PatternRandom,
+};
+
+struct port_prediction {
+    uint16_t pattern;
+    int16_t delta;
+    uint16_t base_port;  // last port handed out when it was measured
+    uint16_t jitter;     // most allocations skipped between two of ours
+};
+
+// offsets of the next allocation swept by the predicted window, see predict_sweep()
+#define DEFAULT_PREDICT_SPREAD 32
+
+/*
+ * bind to the four endpoints of the profile's STUN server (both addresses,
+ * both ports) from two fresh sockets and derive the allocation pattern
+ */
+int measure_port_prediction(const struct nat_profile* profile, const char* local_ip, struct port_prediction* pred);
+
+// classify a sequence of ports allocated one after another
+void classify_ports(const uint16_t* ports, int n, struct port_prediction* pred);
+
+// ports of the next n allocations, base + delta * k for k = 1..n. 0 if not predictable
+int predict_window(const struct port_prediction* pred, uint16_t* out, int n);
+
+/*
+ * like predict_window() but allocation k is aimed at k + (k mod (spread + 1)),
+ * so that one of the first spread + 1 probes lines up with the peer's holes
+ * whatever the drift between both sides in [0, spread]
+ */
+int predict_sweep(const struct port_prediction* pred, int spread, uint16_t* out, int n);
+
+int is_predictable(const struct port_prediction* pred);
+
+const char* get_pattern_desc(uint16_t pattern);
+
+#endif
@@ -0,0 +1,112 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <linux/errqueue.h>
+
+#include "probe_set.h"
+
+int probe_set_init(struct probe_set* ps) {
+    ps->count = 0;
+    ps->refused = 0;
+    ps->peer.s_addr = 0;
+    ps->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    return ps->epfd < 0 ? -1 : 0;
+}
+
+static int add(struct probe_set* ps, int fd, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(ps->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return -1;
+    }
+    ps->count++;
+
+    return 0;
+}
+
+int probe_set_add(struct probe_set* ps, int fd) {
+    return add(ps, fd, EPOLLIN);
+}
+
+int probe_set_add_stream(struct probe_set* ps, int fd) {
+    // writable once the handshake is done
+    return add(ps, fd, EPOLLOUT);
+}
+
+// everything on the error queue of fd, epoll reports it until it's empty
+static void read_errors(struct probe_set* ps, int fd) {
+    char control[256];
+    struct msghdr msg;
+    for (; ;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+
+        struct cmsghdr* cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != IPPROTO_IP || cmsg->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            struct sock_extended_err* ee = (struct sock_extended_err*)CMSG_DATA(cmsg);
+            if (ee->ee_origin != SO_EE_ORIGIN_ICMP || ee->ee_type != ICMP_DEST_UNREACH) {
+                continue;
+            }
+            // what bench/nat_emulator and REJECT rules of a NAT send, port unreachable is the peer's side
+            int prohibited = ee->ee_code == ICMP_PKT_FILTERED || ee->ee_code == ICMP_NET_ANO
+                || ee->ee_code == ICMP_HOST_ANO;
+            struct sockaddr_in* offender = (struct sockaddr_in*)SO_EE_OFFENDER(ee);
+            if (prohibited && offender->sin_addr.s_addr != ps->peer.s_addr) {
+                ps->refused++;
+            }
+        }
+    }
+}
+
+int probe_set_wait(struct probe_set* ps, int timeout_ms) {
+    struct epoll_event ev;
+    int n;
+    for (; ;) {
+        // only the winner matters, so one event is enough
+        n = epoll_wait(ps->epfd, &ev, 1, timeout_ms);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n != 1) {
+            return -1;
+        }
+        if (ev.events & EPOLLERR) {
+            read_errors(ps, ev.data.fd);
+            // the IPv6 socket has no IP_RECVERR, an unreachable peer stays pending on it until read
+            int err;
+            socklen_t len = sizeof(err);
+            getsockopt(ev.data.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        }
+        if (ev.events & EPOLLHUP) {
+            // a stream whose SYN was answered with a RST or timed out
+            epoll_ctl(ps->epfd, EPOLL_CTL_DEL, ev.data.fd, NULL);
+            ps->count--;
+            continue;
+        }
+        if (ev.events & (EPOLLIN | EPOLLOUT)) {
+            return ev.data.fd;
+        }
+    }
+}
+
+void probe_set_destroy(struct probe_set* ps) {
+    if (ps->epfd >= 0) {
+        close(ps->epfd);
+    }
+    ps->epfd = -1;
+    ps->count = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef PROBE_SET_H
+#define PROBE_SET_H
+
+#include <netinet/in.h>
+
+/*
+ * readiness set over the probe sockets of one traversal attempt.
+ * sockets are registered once, waiting costs O(ready) instead of
+ * rebuilding an fd_set, and there is no FD_SETSIZE limit.
+ */
+struct probe_set {
+    int epfd;
+    int count;      // number of registered sockets
+    // ICMP administratively prohibited read off sockets with IP_RECVERR, a NAT
+    // refusing new mappings. a ttl running out, a closed port and anything the
+    // peer sends itself are no refusal and aren't counted
+    int refused;
+    struct in_addr peer;    // 0 until the caller sets it
+};
+
+int probe_set_init(struct probe_set* ps);
+int probe_set_add(struct probe_set* ps, int fd);
+// a connecting TCP socket, ready once it is established and dropped if its connect() fails
+int probe_set_add_stream(struct probe_set* ps, int fd);
+
+// returns the first readable socket or established stream, or -1 on timeout/error. timeout in ms, -1 blocks.
+// pending ICMP errors are read off on the way
+int probe_set_wait(struct probe_set* ps, int timeout_ms);
+
+// closes the epoll instance only, probe sockets are owned by the caller
+void probe_set_destroy(struct probe_set* ps);
+
+#endif
@@ -1,111 +1,644 @@
 package main
 
 import (
+	"bufio"
+	"bytes"
+	"crypto/rand"
+	"crypto/subtle"
 	"encoding/binary"
+	"flag"
 	"fmt"
+	"io"
 	"net"
+	"net/http"
+	"os"
 	"sync"
+	"sync/atomic"
+	"time"
 )
 
 type nat_info struct {
 	Ip       [16]byte
 	Port     uint16
 	Nat_type uint16
+	// port allocation of the peer's NAT, updated by every notification it sends
+	Pattern   uint16
+	Delta     int16
+	Base_port uint16
+	// IPv6 candidate, an address that takes datagrams to Port6 as it is. Port6 is 0 without
+	Ip6   [16]byte
+	Port6 uint16
+	// the port a TCP peer's connection comes from, its NAT's mapping for punching TCP.
+	// the peer asks for it with any port there, 0 if it doesn't punch TCP
+	Tcp_port uint16
+}
+
+type prediction struct {
+	Pattern   uint16
+	Delta     int16
+	Base_port uint16
+}
+
+// what a notified peer receives: who wants to connect and how to reach it
+type notification struct {
+	Id   uint32
+	Info nat_info
 }
 
 const (
 	Enroll      = 1
 	GetPeerInfo = 2
 	NotifyPeer  = 3
+	// keeps the NATs on the way from dropping the connection, not answered
+	Keepalive = 4
+)
+
+// UDP rendezvous, the server records the address it sees the datagrams come from.
+// requests are [type u16][id u32][token][body], after UdpEnroll with the id and token it returned.
+// the replies and the Notification push are framed the same way over TCP
+const (
+	UdpEnroll    = 0x11
+	Enrolled     = 0x12
+	PeerInfo     = 0x13
+	NotifyAck    = 0x14
+	Notification = 0x15
 )
 
-var seq uint32 = 1
-var peers map[uint32]nat_info
-var peers_conn map[uint32]net.Conn
-var m sync.Mutex
+// a UDP peer that hasn't refreshed its enrollment for this long is gone,
+// its NAT mapping has most likely expired anyway
+const udpPeerTimeout = 90 * time.Second
+
+// wire sizes, everything is big endian and fixed size
+const (
+	natInfoSize = 46
+	// the token of a UDP peer, random, as its address may be rewritten by anyone who has it
+	tokenSize     = 8
+	udpHeaderSize = 6 + tokenSize
+	// nat_info of clients without an IPv6 candidate, and without a TCP port
+	natInfoSizeV4    = 26
+	natInfoSizeV6    = 44
+	candidateSize    = 18
+	predictionSize   = 6
+	notificationSize = 4 + natInfoSize
+)
+
+// TCP frames are [length u16][type u16][request id u32][body], the length counts
+// everything after itself. replies echo the request id, pushes have id 0
+const (
+	frameHeaderSize = 8
+	maxFrameBody    = 64
+)
+
+func putFrameHeader(b []byte, typ uint16, id uint32, bodyLen int) {
+	binary.BigEndian.PutUint16(b, uint16(frameHeaderSize-2+bodyLen))
+	binary.BigEndian.PutUint16(b[2:], typ)
+	binary.BigEndian.PutUint32(b[4:], id)
+}
+
+// buffered writes to a TCP peer, shared by its own replies and the notifications
+// other peers' goroutines push to it
+type connWriter struct {
+	sync.Mutex
+	w *bufio.Writer
+}
+
+func newConnWriter(w io.Writer) *connWriter {
+	return &connWriter{w: bufio.NewWriter(w)}
+}
+
+// replies to pipelined requests are flushed together once the reader runs dry
+func (cw *connWriter) write(msg []byte, flush bool) error {
+	cw.Lock()
+	defer cw.Unlock()
+	if _, err := cw.w.Write(msg); err != nil {
+		return err
+	}
+	if flush {
+		return cw.w.Flush()
+	}
+	return nil
+}
+
+func decodeNatInfo(b []byte) (info nat_info) {
+	copy(info.Ip[:], b[:16])
+	info.Port = binary.BigEndian.Uint16(b[16:])
+	info.Nat_type = binary.BigEndian.Uint16(b[18:])
+	info.Pattern = binary.BigEndian.Uint16(b[20:])
+	info.Delta = int16(binary.BigEndian.Uint16(b[22:]))
+	info.Base_port = binary.BigEndian.Uint16(b[24:])
+	if len(b) >= natInfoSizeV6 {
+		copy(info.Ip6[:], b[26:42])
+		info.Port6 = binary.BigEndian.Uint16(b[42:])
+	}
+	if len(b) >= natInfoSize {
+		info.Tcp_port = binary.BigEndian.Uint16(b[44:])
+	}
+	return
+}
+
+func encodeNatInfo(b []byte, info *nat_info) {
+	copy(b[:16], info.Ip[:])
+	binary.BigEndian.PutUint16(b[16:], info.Port)
+	binary.BigEndian.PutUint16(b[18:], info.Nat_type)
+	binary.BigEndian.PutUint16(b[20:], info.Pattern)
+	binary.BigEndian.PutUint16(b[22:], uint16(info.Delta))
+	binary.BigEndian.PutUint16(b[24:], info.Base_port)
+	copy(b[26:42], info.Ip6[:])
+	binary.BigEndian.PutUint16(b[42:], info.Port6)
+	binary.BigEndian.PutUint16(b[44:], info.Tcp_port)
+}
+
+func decodePrediction(b []byte) prediction {
+	return prediction{
+		binary.BigEndian.Uint16(b),
+		int16(binary.BigEndian.Uint16(b[2:])),
+		binary.BigEndian.Uint16(b[4:]),
+	}
+}
+
+type peer struct {
+	info nat_info
+	conn *connWriter
+	// set for peers enrolled over UDP, the address is the mapping we observed
+	udp      *net.UDPAddr
+	token    [tokenSize]byte
+	lastSeen time.Time
+}
+
+// peers are spread over shards by id, each shard has its own lock
+const numShards = 64
+
+type shard struct {
+	sync.RWMutex
+	peers map[uint32]*peer
+	// requests about the peers of this shard, atomic and outside the lock, so
+	// goroutines serving different shards don't share them
+	enrolls        uint64
+	lookups        uint64
+	lookupMisses   uint64
+	notifies       uint64
+	notifyFailures uint64
+}
+
+type registry struct {
+	seq    uint32
+	shards [numShards]shard
+	// where UDP peers are reached, nil until the UDP listener is up
+	pc *net.UDPConn
+}
+
+func newRegistry() *registry {
+	r := &registry{seq: 1}
+	for i := range r.shards {
+		r.shards[i].peers = make(map[uint32]*peer)
+	}
+	return r
+}
+
+func (r *registry) shard(id uint32) *shard {
+	return &r.shards[id%numShards]
+}
+
+func (r *registry) enroll(info nat_info, conn *connWriter) uint32 {
+	id := atomic.AddUint32(&r.seq, 1)
+	s := r.shard(id)
+	atomic.AddUint64(&s.enrolls, 1)
+	s.Lock()
+	s.peers[id] = &peer{info: info, conn: conn}
+	s.Unlock()
+	return id
+}
+
+func (r *registry) remove(id uint32) {
+	s := r.shard(id)
+	s.Lock()
+	delete(s.peers, id)
+	s.Unlock()
+}
+
+func (r *registry) lookup(id uint32) (nat_info, bool) {
+	s := r.shard(id)
+	atomic.AddUint64(&s.lookups, 1)
+	s.RLock()
+	p, ok := s.peers[id]
+	var info nat_info
+	if ok {
+		info = p.info
+	}
+	s.RUnlock()
+	if !ok {
+		atomic.AddUint64(&s.lookupMisses, 1)
+	}
+	return info, ok
+}
+
+// record the sender's fresh prediction and return what its peer gets to see
+func (r *registry) updatePrediction(id uint32, pred prediction) nat_info {
+	s := r.shard(id)
+	s.Lock()
+	var info nat_info
+	if p, ok := s.peers[id]; ok {
+		p.info.Pattern = pred.Pattern
+		p.info.Delta = pred.Delta
+		p.info.Base_port = pred.Base_port
+		info = p.info
+	}
+	s.Unlock()
+	return info
+}
+
+// push a notification from peer from to peer id, framed for the transport id enrolled with
+func (r *registry) notify(id, from uint32, info *nat_info) bool {
+	ok := r.push(id, from, info)
+	s := r.shard(id)
+	atomic.AddUint64(&s.notifies, 1)
+	if !ok {
+		atomic.AddUint64(&s.notifyFailures, 1)
+	}
+	return ok
+}
+
+func (r *registry) push(id, from uint32, info *nat_info) bool {
+	s := r.shard(id)
+	s.RLock()
+	p, ok := s.peers[id]
+	var addr *net.UDPAddr
+	if ok {
+		addr = p.udp
+	}
+	s.RUnlock()
+	if !ok {
+		return false
+	}
+
+	var buf [frameHeaderSize + notificationSize]byte
+	body := buf[frameHeaderSize:]
+	binary.BigEndian.PutUint32(body, from)
+	encodeNatInfo(body[4:], info)
+
+	if addr != nil {
+		// a datagram only has the type in front
+		msg := buf[frameHeaderSize-2:]
+		binary.BigEndian.PutUint16(msg, Notification)
+		_, err := r.pc.WriteToUDP(msg, addr)
+		return err == nil
+	}
+	putFrameHeader(buf[:], Notification, 0, notificationSize)
+	return p.conn.write(buf[:], true) == nil
+}
+
+// enroll a UDP peer at the address its datagram came from, or refresh it if id is already
+// enrolled with this token. returns the id and token, ok is false for a wrong token
+func (r *registry) enrollUDP(id uint32, token []byte, info nat_info, addr *net.UDPAddr) (uint32, [tokenSize]byte, bool) {
+	var issued [tokenSize]byte
+	ip := addr.IP.To4()
+	if ip == nil {
+		return 0, issued, false
+	}
+	info.Ip = [16]byte{}
+	copy(info.Ip[:], ip.String())
+	info.Port = uint16(addr.Port)
+	if info.Base_port == 0 {
+		info.Base_port = info.Port
+	}
+
+	if id != 0 {
+		s := r.shard(id)
+		s.Lock()
+		defer s.Unlock()
+		p, ok := s.peers[id]
+		if !ok || p.udp == nil || subtle.ConstantTimeCompare(p.token[:], token) != 1 {
+			return 0, issued, false
+		}
+		p.info = info
+		p.udp = addr
+		p.lastSeen = time.Now()
+		return id, p.token, true
+	}
+
+	if _, err := rand.Read(issued[:]); err != nil {
+		return 0, issued, false
+	}
+	id = atomic.AddUint32(&r.seq, 1)
+	s := r.shard(id)
+	atomic.AddUint64(&s.enrolls, 1)
+	s.Lock()
+	s.peers[id] = &peer{info: info, udp: addr, token: issued, lastSeen: time.Now()}
+	s.Unlock()
+	return id, issued, true
+}
+
+// a UDP request is only served for the token its id was enrolled with
+func (r *registry) checkUDP(id uint32, token []byte, addr *net.UDPAddr) bool {
+	s := r.shard(id)
+	s.Lock()
+	defer s.Unlock()
+	p, ok := s.peers[id]
+	if !ok || p.udp == nil || subtle.ConstantTimeCompare(p.token[:], token) != 1 {
+		return false
+	}
+	p.lastSeen = time.Now()
+	return true
+}
+
+func (r *registry) expireUDP(now time.Time) {
+	for i := range r.shards {
+		s := &r.shards[i]
+		s.Lock()
+		for id, p := range s.peers {
+			if p.udp != nil && now.Sub(p.lastSeen) > udpPeerTimeout {
+				delete(s.peers, id)
+			}
+		}
+		s.Unlock()
+	}
+}
+
+// Prometheus text format, the request counters summed over the shards and the registry size
+func (r *registry) writeMetrics(w io.Writer) {
+	var enrolls, lookups, lookupMisses, notifies, notifyFailures uint64
+	var tcpPeers, udpPeers int
+	for i := range r.shards {
+		s := &r.shards[i]
+		enrolls += atomic.LoadUint64(&s.enrolls)
+		lookups += atomic.LoadUint64(&s.lookups)
+		lookupMisses += atomic.LoadUint64(&s.lookupMisses)
+		notifies += atomic.LoadUint64(&s.notifies)
+		notifyFailures += atomic.LoadUint64(&s.notifyFailures)
+		s.RLock()
+		for _, p := range s.peers {
+			if p.udp != nil {
+				udpPeers++
+			} else {
+				tcpPeers++
+			}
+		}
+		s.RUnlock()
+	}
+
+	counter := func(name, help string, v uint64) {
+		fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s counter\n%s %d\n", name, help, name, name, v)
+	}
+	counter("punch_server_enrolls_total", "Peers enrolled over TCP or UDP.", enrolls)
+	counter("punch_server_lookups_total", "Peer info requests.", lookups)
+	counter("punch_server_lookup_misses_total", "Peer info requests for a peer that isn't enrolled.", lookupMisses)
+	counter("punch_server_notifies_total", "Notifications pushed to a peer.", notifies)
+	counter("punch_server_notify_failures_total", "Notifications that couldn't be delivered.", notifyFailures)
+	fmt.Fprintf(w, "# HELP punch_server_peers Enrolled peers.\n# TYPE punch_server_peers gauge\n")
+	fmt.Fprintf(w, "punch_server_peers{transport=\"tcp\"} %d\npunch_server_peers{transport=\"udp\"} %d\n", tcpPeers, udpPeers)
+}
+
+var verbose = flag.Bool("v", false, "log every message")
+var replyDelay = flag.Duration("delay", 0, "delay every reply, to emulate a distant server in benchmarks")
 
 func main() {
-	peers = make(map[uint32]nat_info)
-	peers_conn = make(map[uint32]net.Conn)
+	metricsAddr := flag.String("metrics", "", "serve Prometheus metrics on this address at /metrics, e.g. :9989")
+	flag.Parse()
 
-	l, _ := net.Listen("tcp", ":9988")
+	reg := newRegistry()
+	l, err := net.Listen("tcp", ":9988")
+	if err != nil {
+		fmt.Println(err)
+		os.Exit(1)
+	}
 
 	defer l.Close()
 
+	pc, err := net.ListenUDP("udp4", &net.UDPAddr{Port: 9988})
+	if err != nil {
+		fmt.Println(err)
+		os.Exit(1)
+	}
+	reg.pc = pc
+	go serveUDP(reg, pc)
+	if *metricsAddr != "" {
+		http.HandleFunc("/metrics", func(w http.ResponseWriter, req *http.Request) {
+			w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+			reg.writeMetrics(w)
+		})
+		go func() {
+			if err := http.ListenAndServe(*metricsAddr, nil); err != nil {
+				fmt.Println(err)
+			}
+		}()
+	}
+	go func() {
+		for now := range time.Tick(udpPeerTimeout / 3) {
+			reg.expireUDP(now)
+		}
+	}()
+
 	for {
 		conn, err := l.Accept()
 		if err != nil {
 			continue
 		}
 
-		go handleConn(conn)
+		go handleConn(reg, conn)
+	}
+}
+
+// whether the next request can be read without blocking
+func frameBuffered(r *bufio.Reader) bool {
+	// Peek would block for less
+	if r.Buffered() < 2 {
+		return false
 	}
+	hdr, _ := r.Peek(2)
+	return r.Buffered() >= 2+int(binary.BigEndian.Uint16(hdr))
 }
 
-// 2 bytes for message type
-func handleConn(c net.Conn) {
+// every request is a frame, answered by a frame with the same id
+func handleConn(reg *registry, c net.Conn) {
 	defer c.Close()
 	var peerID uint32 = 0
+	r := bufio.NewReader(c)
+	cw := newConnWriter(c)
+	// one buffer per connection, large enough for any frame
+	var in, out [frameHeaderSize + maxFrameBody]byte
+	reply := func(typ uint16, id uint32, body []byte) {
+		msg := out[:frameHeaderSize+len(body)]
+		putFrameHeader(msg, typ, id, len(body))
+		copy(msg[frameHeaderSize:], body)
+		if *replyDelay == 0 {
+			cw.write(msg, !frameBuffered(r))
+			return
+		}
+		// pipelined replies are delayed concurrently, like over a long path
+		delayed := append([]byte(nil), msg...)
+		time.AfterFunc(*replyDelay, func() { cw.write(delayed, true) })
+	}
 	for {
-		// read message type first
-		data := make([]byte, 2)
-		_, err := c.Read(data)
-		if err != nil {
-			m.Lock()
+		if _, err := io.ReadFull(r, in[:2]); err != nil {
 			fmt.Printf("error: %v, peer %d disconnected\n", err, peerID)
-			delete(peers, peerID)
-			delete(peers_conn, peerID)
-			m.Unlock()
+			if peerID != 0 {
+				reg.remove(peerID)
+			}
 			return
 		}
+		n := int(binary.BigEndian.Uint16(in[:]))
+		if n < frameHeaderSize-2 || n > len(in)-2 {
+			fmt.Println("illegal frame length", n)
+			if peerID != 0 {
+				reg.remove(peerID)
+			}
+			return
+		}
+		if _, err := io.ReadFull(r, in[2:2+n]); err != nil {
+			continue
+		}
+		typ := binary.BigEndian.Uint16(in[2:])
+		reqID := binary.BigEndian.Uint32(in[4:])
+		body := in[frameHeaderSize : 2+n]
+		var b [8 + natInfoSize]byte
 
-		switch binary.BigEndian.Uint16(data[:]) {
+		switch typ {
 		case Enroll:
-			var peer nat_info
-			err = binary.Read(c, binary.BigEndian, &peer)
-			if err != nil {
+			if len(body) < natInfoSizeV4 {
 				continue
 			}
+			peer := decodeNatInfo(body)
+			// the connection comes from the port the peer punches TCP from
+			tcpAddr, _ := c.RemoteAddr().(*net.TCPAddr)
+			if peer.Tcp_port != 0 && tcpAddr != nil {
+				peer.Tcp_port = uint16(tcpAddr.Port)
+			}
 
-			fmt.Println("peer enrolled, addr: ", string(peer.Ip[:]), peer.Port, peer.Nat_type)
-
-			m.Lock()
-			seq++
-			peerID = seq
-			peers[peerID] = peer
-			peers_conn[peerID] = c
-			fmt.Println("new peer, id : ", peerID)
-			m.Unlock()
-			err = binary.Write(c, binary.BigEndian, peerID)
-			if err != nil {
-				continue
+			if peerID != 0 {
+				reg.remove(peerID)
 			}
+			peerID = reg.enroll(peer, cw)
+			if *verbose {
+				fmt.Println("peer enrolled, addr: ", string(bytes.TrimRight(peer.Ip[:], "\x00")), peer.Port, peer.Nat_type)
+				fmt.Println("new peer, id : ", peerID)
+			}
+			binary.BigEndian.PutUint32(b[:], peerID)
+			if peer.Tcp_port == 0 || tcpAddr == nil || tcpAddr.IP.To4() == nil {
+				reply(Enrolled, reqID, b[:4])
+				break
+			}
+			// and where we see it, like the reply over UDP
+			copy(b[4:8], tcpAddr.IP.To4())
+			binary.BigEndian.PutUint16(b[8:], peer.Tcp_port)
+			reply(Enrolled, reqID, b[:10])
 		case GetPeerInfo:
-			var peer_id uint32
-			binary.Read(c, binary.BigEndian, &peer_id)
-			if val, ok := peers[peer_id]; ok {
-				binary.Write(c, binary.BigEndian, val)
+			if len(body) < 4 {
+				continue
+			}
+			peer_id := binary.BigEndian.Uint32(body)
+			val, ok := reg.lookup(peer_id)
+			binary.BigEndian.PutUint32(b[:], peer_id)
+			b[4], b[5] = 0, 0
+			if ok {
+				b[4] = 1
 			} else {
-				var offline uint8 = 0
-				binary.Write(c, binary.BigEndian, offline)
 				fmt.Printf("%d offline\n", peer_id)
 			}
+			encodeNatInfo(b[6:], &val)
+			reply(PeerInfo, reqID, b[:6+natInfoSize])
 		case NotifyPeer:
-			var peer_id uint32
-			binary.Read(c, binary.BigEndian, &peer_id)
-			fmt.Println("notify to peer", peer_id)
-			if val, ok := peers_conn[peer_id]; ok {
-				if err = binary.Write(val, binary.BigEndian, peers[peerID]); err != nil {
-					// unable to notify peer
-					fmt.Println("offline")
-				}
-			} else {
+			if len(body) < 4+predictionSize {
+				continue
+			}
+			peer_id := binary.BigEndian.Uint32(body)
+			pred := decodePrediction(body[4:])
+			if *verbose {
+				fmt.Println("notify to peer", peer_id)
+			}
+
+			self := reg.updatePrediction(peerID, pred)
+			binary.BigEndian.PutUint32(b[:], peer_id)
+			b[4] = 1
+			if !reg.notify(peer_id, peerID, &self) {
+				// unable to notify peer
 				fmt.Println("offline")
+				b[4] = 0
 			}
+			reply(NotifyAck, reqID, b[:5])
+		case Keepalive:
 		default:
 			fmt.Println("illegal message")
 		}
 	}
+}
 
-	return
+func replyUDP(pc *net.UDPConn, msg []byte, addr *net.UDPAddr) {
+	if *replyDelay == 0 {
+		pc.WriteToUDP(msg, addr)
+		return
+	}
+	delayed := append([]byte(nil), msg...)
+	time.AfterFunc(*replyDelay, func() { pc.WriteToUDP(delayed, addr) })
+}
+
+// every UDP datagram is a complete request, answered to the address it came from
+func serveUDP(reg *registry, pc *net.UDPConn) {
+	var in, out [64]byte
+	for {
+		n, addr, err := pc.ReadFromUDP(in[:])
+		if err != nil {
+			continue
+		}
+		if n < udpHeaderSize {
+			continue
+		}
+		id := binary.BigEndian.Uint32(in[2:])
+		token := in[6:udpHeaderSize]
+		body := in[udpHeaderSize:n]
+
+		switch binary.BigEndian.Uint16(in[:]) {
+		case UdpEnroll:
+			if len(body) < 2+predictionSize {
+				continue
+			}
+			var info nat_info
+			info.Nat_type = binary.BigEndian.Uint16(body)
+			pred := decodePrediction(body[2:])
+			info.Pattern, info.Delta, info.Base_port = pred.Pattern, pred.Delta, pred.Base_port
+			if c := body[2+predictionSize:]; len(c) >= candidateSize {
+				copy(info.Ip6[:], c[:16])
+				info.Port6 = binary.BigEndian.Uint16(c[16:])
+			}
+			id, token, ok := reg.enrollUDP(id, token, info, addr)
+			if !ok {
+				continue
+			}
+			if *verbose {
+				fmt.Println("peer enrolled over UDP, addr: ", addr, info.Nat_type, "id: ", id)
+			}
+			binary.BigEndian.PutUint16(out[:], Enrolled)
+			binary.BigEndian.PutUint32(out[2:], id)
+			copy(out[6:udpHeaderSize], token[:])
+			copy(out[udpHeaderSize:udpHeaderSize+4], addr.IP.To4())
+			binary.BigEndian.PutUint16(out[udpHeaderSize+4:], uint16(addr.Port))
+			replyUDP(pc, out[:udpHeaderSize+6], addr)
+		case GetPeerInfo:
+			if len(body) < 4 || !reg.checkUDP(id, token, addr) {
+				continue
+			}
+			peer_id := binary.BigEndian.Uint32(body)
+			val, ok := reg.lookup(peer_id)
+			binary.BigEndian.PutUint16(out[:], PeerInfo)
+			binary.BigEndian.PutUint32(out[2:], peer_id)
+			out[6], out[7] = 0, 0
+			if ok {
+				out[6] = 1
+			}
+			encodeNatInfo(out[8:], &val)
+			replyUDP(pc, out[:8+natInfoSize], addr)
+		case NotifyPeer:
+			if len(body) < 4+predictionSize || !reg.checkUDP(id, token, addr) {
+				continue
+			}
+			peer_id := binary.BigEndian.Uint32(body)
+			self := reg.updatePrediction(id, decodePrediction(body[4:]))
+			binary.BigEndian.PutUint16(out[:], NotifyAck)
+			binary.BigEndian.PutUint32(out[2:], peer_id)
+			out[6] = 0
+			if reg.notify(peer_id, id, &self) {
+				out[6] = 1
+			}
+			replyUDP(pc, out[:7], addr)
+		}
+	}
 }
@@ -0,0 +1,186 @@
+package main
+
+// throughput of the peer registry against the one it replaced, with simulated peers:
+// go test -bench . punch_server.go punch_server_test.go
+
+import (
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"math/rand"
+	"sync"
+	"sync/atomic"
+	"testing"
+)
+
+// the registry as it was before sharding, kept as the benchmark baseline:
+// one lock around plain maps and reflection based decoding
+type legacyRegistry struct {
+	m          sync.Mutex
+	seq        uint32
+	peers      map[uint32]nat_info
+	peers_conn map[uint32]io.Writer
+}
+
+// the operations the benchmark drives, each one decodes its request like the handler does
+type benchTarget interface {
+	enroll(msg []byte, conn io.Writer) uint32
+	lookup(msg []byte) bool
+	notify(self uint32, msg []byte) bool
+}
+
+type shardedTarget struct{ r *registry }
+
+func (t shardedTarget) enroll(msg []byte, conn io.Writer) uint32 {
+	return t.r.enroll(decodeNatInfo(msg), newConnWriter(conn))
+}
+
+func (t shardedTarget) lookup(msg []byte) bool {
+	info, ok := t.r.lookup(binary.BigEndian.Uint32(msg))
+	var out [natInfoSize]byte
+	encodeNatInfo(out[:], &info)
+	return ok
+}
+
+func (t shardedTarget) notify(self uint32, msg []byte) bool {
+	info := t.r.updatePrediction(self, decodePrediction(msg[4:]))
+	return t.r.notify(binary.BigEndian.Uint32(msg), self, &info)
+}
+
+func (t *legacyRegistry) enroll(msg []byte, conn io.Writer) uint32 {
+	var info nat_info
+	binary.Read(bytes.NewReader(msg), binary.BigEndian, &info)
+	t.m.Lock()
+	t.seq++
+	id := t.seq
+	t.peers[id] = info
+	t.peers_conn[id] = conn
+	t.m.Unlock()
+	return id
+}
+
+func (t *legacyRegistry) lookup(msg []byte) bool {
+	var id uint32
+	binary.Read(bytes.NewReader(msg), binary.BigEndian, &id)
+	t.m.Lock()
+	info, ok := t.peers[id]
+	t.m.Unlock()
+	binary.Write(io.Discard, binary.BigEndian, info)
+	return ok
+}
+
+func (t *legacyRegistry) notify(self uint32, msg []byte) bool {
+	r := bytes.NewReader(msg)
+	var id uint32
+	var pred prediction
+	binary.Read(r, binary.BigEndian, &id)
+	binary.Read(r, binary.BigEndian, &pred)
+	t.m.Lock()
+	info := t.peers[self]
+	info.Pattern, info.Delta, info.Base_port = pred.Pattern, pred.Delta, pred.Base_port
+	t.peers[self] = info
+	conn, ok := t.peers_conn[id]
+	t.m.Unlock()
+	if ok {
+		binary.Write(conn, binary.BigEndian, notification{self, info})
+	}
+	return ok
+}
+
+var benchTargets = []struct {
+	name string
+	new  func() benchTarget
+}{
+	{"legacy", func() benchTarget {
+		return &legacyRegistry{peers: make(map[uint32]nat_info), peers_conn: make(map[uint32]io.Writer)}
+	}},
+	{"sharded", func() benchTarget { return shardedTarget{newRegistry()} }},
+}
+
+var benchPeers = []int{10000, 100000}
+
+// concurrent simulated clients per GOMAXPROCS
+const benchParallelism = 16
+
+func enrollMsg() []byte {
+	msg := make([]byte, natInfoSize)
+	copy(msg, "203.0.113.7")
+	return msg
+}
+
+// a registry of n simulated peers and their ids
+func enrolledTarget(newTarget func() benchTarget, n int) (benchTarget, []uint32) {
+	target := newTarget()
+	ids := make([]uint32, n)
+	msg := enrollMsg()
+	for i := range ids {
+		ids[i] = target.enroll(msg, io.Discard)
+	}
+	return target, ids
+}
+
+// every simulated client picks its peers from a generator of its own
+func benchRand(seed *int64) *rand.Rand {
+	return rand.New(rand.NewSource(atomic.AddInt64(seed, 1)))
+}
+
+func BenchmarkEnroll(b *testing.B) {
+	for _, t := range benchTargets {
+		b.Run(t.name, func(b *testing.B) {
+			target := t.new()
+			msg := enrollMsg()
+			b.SetParallelism(benchParallelism)
+			b.RunParallel(func(pb *testing.PB) {
+				for pb.Next() {
+					target.enroll(msg, io.Discard)
+				}
+			})
+		})
+	}
+}
+
+func BenchmarkLookup(b *testing.B) {
+	for _, t := range benchTargets {
+		for _, n := range benchPeers {
+			b.Run(fmt.Sprintf("%s/%d", t.name, n), func(b *testing.B) {
+				target, ids := enrolledTarget(t.new, n)
+				var seed int64
+				b.SetParallelism(benchParallelism)
+				b.ResetTimer()
+				b.RunParallel(func(pb *testing.PB) {
+					rng := benchRand(&seed)
+					var msg [4]byte
+					for pb.Next() {
+						binary.BigEndian.PutUint32(msg[:], ids[rng.Intn(n)])
+						target.lookup(msg[:])
+					}
+				})
+			})
+		}
+	}
+}
+
+func BenchmarkNotify(b *testing.B) {
+	for _, t := range benchTargets {
+		for _, n := range benchPeers {
+			b.Run(fmt.Sprintf("%s/%d", t.name, n), func(b *testing.B) {
+				target, ids := enrolledTarget(t.new, n)
+				var seed int64
+				b.SetParallelism(benchParallelism)
+				b.ResetTimer()
+				b.RunParallel(func(pb *testing.PB) {
+					rng := benchRand(&seed)
+					var msg [4 + predictionSize]byte
+					for i := 0; pb.Next(); i++ {
+						binary.BigEndian.PutUint32(msg[:], ids[rng.Intn(n)])
+						binary.BigEndian.PutUint16(msg[4:], 2)
+						binary.BigEndian.PutUint16(msg[6:], 1)
+						binary.BigEndian.PutUint16(msg[8:], uint16(i))
+						target.notify(ids[rng.Intn(n)], msg[:])
+					}
+				})
+			})
+		}
+	}
+}
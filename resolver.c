@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+
+#include "resolver.h"
+
+#define MAX_CACHED_HOSTS 32
+#define MAX_HOST_LENGTH 256
+#define MAX_DNS_MESSAGE_LENGTH 512
+#define DNS_TIMEOUT_MS 1000
+#define DNS_RETRIES 2
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_CLASS_IN 1
+
+enum {
+    ENTRY_EMPTY,
+    ENTRY_PENDING,
+    ENTRY_READY,
+    ENTRY_FAILED,
+};
+
+struct cache_entry {
+    char host[MAX_HOST_LENGTH];
+    struct resolver via;
+    int state;
+    struct in_addr addr;
+    time_t expires;
+};
+
+static struct cache_entry cache[MAX_CACHED_HOSTS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolved = PTHREAD_COND_INITIALIZER;
+static const struct resolver system_resolver;
+
+static time_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec;
+}
+
+static int parse_nameserver(const char* ns, struct sockaddr_in* addr) {
+    char ip[INET_ADDRSTRLEN];
+    uint16_t port = DEFAULT_DNS_PORT;
+
+    strncpy(ip, ns, sizeof(ip) - 1);
+    ip[sizeof(ip) - 1] = '\0';
+    char* colon = strchr(ip, ':');
+    if (colon) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+
+    return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+static int system_nameserver(struct sockaddr_in* addr) {
+    FILE* f = fopen("/etc/resolv.conf", "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char line[MAX_HOST_LENGTH], ns[INET_ADDRSTRLEN];
+    int found = -1;
+    while (found && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "nameserver %15s", ns) == 1) {
+            found = parse_nameserver(ns, addr);
+        }
+    }
+    fclose(f);
+
+    return found;
+}
+
+int resolver_init(struct resolver* r, const char* ns) {
+    r->has_nameserver = (ns ? parse_nameserver(ns, &r->nameserver) : system_nameserver(&r->nameserver)) == 0;
+
+    return r->has_nameserver ? 0 : -1;
+}
+
+static int same_resolver(const struct resolver* a, const struct resolver* b) {
+    if (!a->has_nameserver || !b->has_nameserver) {
+        return a->has_nameserver == b->has_nameserver;
+    }
+
+    return a->nameserver.sin_addr.s_addr == b->nameserver.sin_addr.s_addr
+        && a->nameserver.sin_port == b->nameserver.sin_port;
+}
+
+static int encode_query(char* buf, uint16_t id, const char* host) {
+    char* ptr = buf;
+    uint16_t header[6] = {htons(id), htons(0x0100) /* recursion desired */, htons(1), 0, 0, 0};
+    memcpy(ptr, header, sizeof(header));
+    ptr += sizeof(header);
+
+    // www.example.com -> 3www7example3com0
+    const char* label = host;
+    while (*label) {
+        const char* dot = strchr(label, '.');
+        size_t len = dot ? (size_t)(dot - label) : strlen(label);
+        if (len == 0 || len > 63 || ptr + len + 6 - buf > MAX_DNS_MESSAGE_LENGTH) {
+            return -1;
+        }
+        *ptr++ = len;
+        memcpy(ptr, label, len);
+        ptr += len;
+        label += len + (dot ? 1 : 0);
+    }
+    *ptr++ = 0;
+
+    uint16_t question[2] = {htons(DNS_TYPE_A), htons(DNS_CLASS_IN)};
+    memcpy(ptr, question, sizeof(question));
+    ptr += sizeof(question);
+
+    return ptr - buf;
+}
+
+// skip a possibly compressed name, NULL if it runs past end
+static const unsigned char* skip_name(const unsigned char* ptr, const unsigned char* end) {
+    while (ptr < end) {
+        if (*ptr == 0) {
+            return ptr + 1;
+        }
+        if ((*ptr & 0xC0) == 0xC0) {
+            return ptr + 2 <= end ? ptr + 2 : NULL;
+        }
+        ptr += *ptr + 1;
+    }
+
+    return NULL;
+}
+
+static uint16_t read16(const unsigned char* p) {
+    return (p[0] << 8) | p[1];
+}
+
+static int parse_answer(const unsigned char* buf, int len, uint16_t id, struct in_addr* addr, uint32_t* ttl) {
+    const unsigned char* end = buf + len;
+    if (len < 12 || read16(buf) != id) {
+        return -1;
+    }
+    // rcode must be NOERROR
+    if ((buf[3] & 0x0F) != 0) {
+        return -1;
+    }
+
+    int qdcount = read16(buf + 4), ancount = read16(buf + 6);
+    const unsigned char* ptr = buf + 12;
+    while (qdcount--) {
+        if ((ptr = skip_name(ptr, end)) == NULL || ptr + 4 > end) {
+            return -1;
+        }
+        ptr += 4;
+    }
+
+    // the TTL of the answer is the smallest one along the CNAME chain
+    int found = -1;
+    uint32_t min_ttl = UINT32_MAX;
+    while (ancount--) {
+        if ((ptr = skip_name(ptr, end)) == NULL || ptr + 10 > end) {
+            return -1;
+        }
+        uint16_t type = read16(ptr), class = read16(ptr + 2);
+        uint32_t rr_ttl = ((uint32_t)read16(ptr + 4) << 16) | read16(ptr + 6);
+        uint16_t rdlength = read16(ptr + 8);
+        ptr += 10;
+        if (ptr + rdlength > end) {
+            return -1;
+        }
+
+        if (class == DNS_CLASS_IN && (type == DNS_TYPE_A || type == DNS_TYPE_CNAME)) {
+            if (rr_ttl < min_ttl) {
+                min_ttl = rr_ttl;
+            }
+            if (type == DNS_TYPE_A && rdlength == 4 && found) {
+                memcpy(&addr->s_addr, ptr, 4);
+                found = 0;
+            }
+        }
+        ptr += rdlength;
+    }
+    *ttl = min_ttl;
+
+    return found;
+}
+
+static int dns_query(const char* host, struct sockaddr_in ns, struct in_addr* addr, uint32_t* ttl) {
+    char query[MAX_DNS_MESSAGE_LENGTH];
+    unsigned char answer[MAX_DNS_MESSAGE_LENGTH];
+    uint16_t id;
+
+    // the id is our only defence against spoofed answers, no query rather than a guessable one
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+        return -1;
+    }
+
+    int len = encode_query(query, id, host);
+    if (len < 0) {
+        return -1;
+    }
+
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0) {
+        return -1;
+    }
+    // only accept answers from the nameserver
+    if (connect(s, (struct sockaddr*)&ns, sizeof(ns)) < 0) {
+        close(s);
+        return -1;
+    }
+
+    int retries, ret = -1;
+    for (retries = 0; retries < DNS_RETRIES && ret < 0; retries++) {
+        if (send(s, query, len, 0) < 0) {
+            break;
+        }
+
+        struct pollfd fd = {s, POLLIN, 0};
+        while (poll(&fd, 1, DNS_TIMEOUT_MS) > 0) {
+            int n = recv(s, answer, sizeof(answer), 0);
+            if (n < 0) {
+                break;
+            }
+            if ((ret = parse_answer(answer, n, id, addr, ttl)) == 0 || (n >= 2 && read16(answer) == id)) {
+                // answered, positively or not
+                retries = DNS_RETRIES;
+                break;
+            }
+        }
+    }
+    close(s);
+
+    return ret;
+}
+
+// /etc/hosts and whatever else nsswitch knows about
+static int system_lookup(const char* host, struct in_addr* addr) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+        return -1;
+    }
+    *addr = ((struct sockaddr_in*)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+static void* resolve_worker(void* data) {
+    struct cache_entry* e = data;
+    char host[MAX_HOST_LENGTH];
+    struct resolver via;
+
+    pthread_mutex_lock(&lock);
+    strcpy(host, e->host);
+    via = e->via;
+    pthread_mutex_unlock(&lock);
+
+    struct in_addr addr;
+    uint32_t ttl = DEFAULT_RESOLVER_TTL;
+    int ret = via.has_nameserver ? dns_query(host, via.nameserver, &addr, &ttl) : -1;
+    if (ret < 0) {
+        ttl = DEFAULT_RESOLVER_TTL;
+        ret = system_lookup(host, &addr);
+    }
+
+    pthread_mutex_lock(&lock);
+    // the entry may have been flushed meanwhile
+    if (e->state == ENTRY_PENDING && !strcmp(e->host, host) && same_resolver(&e->via, &via)) {
+        if (ret == 0) {
+            e->state = ENTRY_READY;
+            e->addr = addr;
+            e->expires = now_sec() + ttl;
+        } else {
+            e->state = ENTRY_FAILED;
+            e->expires = now_sec() + NEGATIVE_RESOLVER_TTL;
+        }
+    }
+    pthread_cond_broadcast(&resolved);
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+// with lock held. the entry of host through r, a new or recycled one if there's none
+static struct cache_entry* find_entry(const struct resolver* r, const char* host, time_t now) {
+    struct cache_entry* victim = NULL;
+    int i;
+    for (i = 0; i < MAX_CACHED_HOSTS; ++i) {
+        struct cache_entry* e = &cache[i];
+        if (e->state != ENTRY_EMPTY && !strcmp(e->host, host) && same_resolver(&e->via, r)) {
+            return e;
+        }
+        if (e->state == ENTRY_EMPTY || (e->state != ENTRY_PENDING && e->expires <= now)) {
+            victim = victim ? victim : e;
+        }
+    }
+    if (victim == NULL) {
+        // full of live entries, evict the one that expires first
+        for (i = 0; i < MAX_CACHED_HOSTS; ++i) {
+            if (cache[i].state != ENTRY_PENDING && (victim == NULL || cache[i].expires < victim->expires)) {
+                victim = &cache[i];
+            }
+        }
+    }
+    if (victim) {
+        strncpy(victim->host, host, MAX_HOST_LENGTH - 1);
+        victim->host[MAX_HOST_LENGTH - 1] = '\0';
+        victim->via = *r;
+        victim->state = ENTRY_EMPTY;
+    }
+
+    return victim;
+}
+
+// with lock held
+static struct cache_entry* start_locked(const struct resolver* r, const char* host) {
+    time_t now = now_sec();
+    struct cache_entry* e = find_entry(r, host, now);
+    if (e == NULL) {
+        return NULL;
+    }
+
+    if (e->state == ENTRY_PENDING || (e->state != ENTRY_EMPTY && e->expires > now)) {
+        return e;
+    }
+
+    // dotted quads need no lookup
+    if (inet_pton(AF_INET, host, &e->addr) == 1) {
+        e->state = ENTRY_READY;
+        e->expires = (time_t)1 << (sizeof(time_t) * 8 - 2);
+        return e;
+    }
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    e->state = ENTRY_PENDING;
+    if (pthread_create(&tid, &attr, resolve_worker, e) != 0) {
+        e->state = ENTRY_FAILED;
+        e->expires = now + NEGATIVE_RESOLVER_TTL;
+    }
+    pthread_attr_destroy(&attr);
+
+    return e;
+}
+
+void resolver_start(const struct resolver* r, const char* host) {
+    pthread_mutex_lock(&lock);
+    start_locked(r ? r : &system_resolver, host);
+    pthread_mutex_unlock(&lock);
+}
+
+int resolver_lookup(const struct resolver* r, const char* host, struct in_addr* addr, int timeout_ms) {
+    if (r == NULL) {
+        r = &system_resolver;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int ret = -1;
+    pthread_mutex_lock(&lock);
+    // the entry is recycled for another host or nameserver if it's flushed meanwhile
+    struct cache_entry* e = start_locked(r, host);
+    while (e && e->state == ENTRY_PENDING && !strcmp(e->host, host) && same_resolver(&e->via, r)) {
+        if (pthread_cond_timedwait(&resolved, &lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (e && e->state == ENTRY_READY && !strcmp(e->host, host) && same_resolver(&e->via, r)) {
+        *addr = e->addr;
+        ret = 0;
+    } else {
+        errno = e && e->state == ENTRY_PENDING ? EAGAIN : ENOENT;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return ret;
+}
+
+void resolver_flush(void) {
+    pthread_mutex_lock(&lock);
+    int i;
+    for (i = 0; i < MAX_CACHED_HOSTS; ++i) {
+        // pending lookups finish into a flushed entry and are dropped
+        cache[i].state = ENTRY_EMPTY;
+        cache[i].host[0] = '\0';
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,35 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <netinet/in.h>
+
+#define DEFAULT_DNS_PORT 53
+// lifetime of answers that don't come with a TTL, e.g. from /etc/hosts
+#define DEFAULT_RESOLVER_TTL 300
+// a failed lookup is retried after this many seconds
+#define NEGATIVE_RESOLVER_TTL 5
+
+// where one user of the resolver looks names up, the cache is shared by all of them
+struct resolver {
+    struct sockaddr_in nameserver;
+    int has_nameserver;     // 0 asks the system resolver only
+};
+
+// "ip" or "ip:port", NULL for the first nameserver of /etc/resolv.conf. -1 if there is none, r asks the system then
+int resolver_init(struct resolver* r, const char* nameserver);
+
+// resolve host in the background unless the cache already has a live answer from r's nameserver, r may be NULL
+void resolver_start(const struct resolver* r, const char* host);
+
+/*
+ * wait up to timeout_ms for host to be resolved, starting the lookup if needed.
+ * answers are cached per nameserver for the TTL it gave them, failures for
+ * NEGATIVE_RESOLVER_TTL. returns 0 and the address, or -1 with errno set to
+ * EAGAIN if the lookup is still running and ENOENT if it failed
+ */
+int resolver_lookup(const struct resolver* r, const char* host, struct in_addr* addr, int timeout_ms);
+
+// forget every cached answer
+void resolver_flush(void);
+
+#endif
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "rpc.h"
+
+// the reader pulls as many frames as the socket has in one recv()
+#define RPC_READ_BUFFER 4096
+
+static void put16(char* buf, uint16_t v) {
+    v = htons(v);
+    memcpy(buf, &v, sizeof(v));
+}
+
+static void put32(char* buf, uint32_t v) {
+    v = htonl(v);
+    memcpy(buf, &v, sizeof(v));
+}
+
+static uint16_t get16(const char* buf) {
+    uint16_t v;
+    memcpy(&v, buf, sizeof(v));
+
+    return ntohs(v);
+}
+
+static uint32_t get32(const char* buf) {
+    uint32_t v;
+    memcpy(&v, buf, sizeof(v));
+
+    return ntohl(v);
+}
+
+static void wake(struct rpc* r) {
+    uint64_t one = 1;
+    write(r->efd, &one, sizeof(one));
+}
+
+static void deadline_after(struct timespec* deadline, int timeout_ms) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// hand a complete frame to its waiter, or queue it if the server pushed it
+static void dispatch(struct rpc* r, const char* frame, int len) {
+    struct rpc_frame* f = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    uint32_t id = get32(frame + 2);
+    if (id == 0) {
+        // stop reading until there's room, TCP holds the server back meanwhile
+        while (r->num_pushes == RPC_MAX_PUSHES && !r->closing) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        if (r->num_pushes < RPC_MAX_PUSHES) {
+            f = &r->pushes[(r->push_head + r->num_pushes++) % RPC_MAX_PUSHES];
+        }
+    } else {
+        struct rpc_slot* s = &r->slots[id % RPC_MAX_PENDING];
+        // a reply nobody waits for anymore is dropped
+        if (s->id == id && !s->done) {
+            s->done = 1;
+            f = &s->reply;
+        }
+    }
+
+    if (f) {
+        f->type = get16(frame);
+        f->id = id;
+        f->len = len - (RPC_HEADER_LENGTH - 2);
+        if (f->len > RPC_MAX_BODY) {
+            f->len = RPC_MAX_BODY;
+        }
+        memcpy(f->body, frame + RPC_HEADER_LENGTH - 2, f->len);
+        pthread_cond_broadcast(&r->cond);
+        wake(r);
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void* reader(void* data) {
+    struct rpc* r = (struct rpc*)data;
+    char buf[RPC_READ_BUFFER];
+    int filled = 0;
+
+    for (; ;) {
+        int n = recv(r->sock, buf + filled, sizeof(buf) - filled, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            pthread_mutex_lock(&r->lock);
+            r->error = n < 0 ? errno : ECONNRESET;
+            pthread_cond_broadcast(&r->cond);
+            wake(r);
+            pthread_mutex_unlock(&r->lock);
+            return NULL;
+        }
+        filled += n;
+
+        char* p = buf;
+        while (filled >= 2) {
+            int len = get16(p);
+            if (len < RPC_HEADER_LENGTH - 2 || len > sizeof(buf) - 2) {
+                // out of sync, nothing after this can be trusted
+                shutdown(r->sock, SHUT_RDWR);
+                filled = 0;
+                break;
+            }
+            if (filled < 2 + len) {
+                break;
+            }
+            dispatch(r, p + 2, len);
+            p += 2 + len;
+            filled -= 2 + len;
+        }
+        memmove(buf, p, filled);
+    }
+
+    return NULL;
+}
+
+static void destroy_locks(struct rpc* r) {
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->send_lock);
+    pthread_mutex_destroy(&r->lock);
+}
+
+int rpc_init(struct rpc* r, int sock) {
+    memset(r, 0, sizeof(*r));
+    r->sock = sock;
+    r->next_id = 1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_mutex_init(&r->send_lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->efd < 0) {
+        destroy_locks(r);
+        return -1;
+    }
+
+    // frames are small and pipelined, Nagle would hold them back until the previous one is acked
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // the socket stays the caller's if there is no reader
+    int error = pthread_create(&r->reader, NULL, reader, r);
+    if (error != 0) {
+        close(r->efd);
+        destroy_locks(r);
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_frame(struct rpc* r, uint16_t type, uint32_t id, const void* body, int len) {
+    char frame[RPC_HEADER_LENGTH + RPC_MAX_BODY];
+    put16(frame, RPC_HEADER_LENGTH - 2 + len);
+    put16(frame + 2, type);
+    put32(frame + 4, id);
+    if (len) {
+        memcpy(frame + RPC_HEADER_LENGTH, body, len);
+    }
+
+    pthread_mutex_lock(&r->send_lock);
+    int sent = 0, total = RPC_HEADER_LENGTH + len;
+    while (sent < total) {
+        int n = send(r->sock, frame + sent, total - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        sent += n > 0 ? n : 0;
+    }
+    pthread_mutex_unlock(&r->send_lock);
+
+    return sent < total ? -1 : 0;
+}
+
+uint32_t rpc_send(struct rpc* r, uint16_t type, const void* body, int len) {
+    if (len > RPC_MAX_BODY) {
+        errno = EMSGSIZE;
+        return 0;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    if (r->error) {
+        errno = r->error;
+        pthread_mutex_unlock(&r->lock);
+        return 0;
+    }
+    uint32_t id = r->next_id;
+    struct rpc_slot* s = &r->slots[id % RPC_MAX_PENDING];
+    if (s->id) {
+        pthread_mutex_unlock(&r->lock);
+        errno = EAGAIN;
+        return 0;
+    }
+    // 0 is reserved for pushes
+    r->next_id = id + 1 ? id + 1 : 1;
+    // the slot is taken before sending, the reply may come back before send() returns
+    s->id = id;
+    s->done = 0;
+    pthread_mutex_unlock(&r->lock);
+
+    if (write_frame(r, type, id, body, len) < 0) {
+        int err = errno;
+        pthread_mutex_lock(&r->lock);
+        s->id = 0;
+        pthread_mutex_unlock(&r->lock);
+        errno = err;
+        return 0;
+    }
+
+    return id;
+}
+
+int rpc_post(struct rpc* r, uint16_t type, const void* body, int len) {
+    if (len > RPC_MAX_BODY) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    int err = r->error;
+    pthread_mutex_unlock(&r->lock);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return write_frame(r, type, 0, body, len);
+}
+
+int rpc_wait(struct rpc* r, uint32_t id, struct rpc_frame* reply, int timeout_ms) {
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        deadline_after(&deadline, timeout_ms);
+    }
+
+    int ret = -1;
+    pthread_mutex_lock(&r->lock);
+    struct rpc_slot* s = &r->slots[id % RPC_MAX_PENDING];
+    if (s->id != id) {
+        pthread_mutex_unlock(&r->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    while (!s->done && !r->error) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        } else if (pthread_cond_timedwait(&r->cond, &r->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (s->done) {
+        *reply = s->reply;
+        ret = 0;
+    } else {
+        errno = r->error ? r->error : ETIMEDOUT;
+    }
+    s->id = 0;
+    pthread_mutex_unlock(&r->lock);
+
+    return ret;
+}
+
+int rpc_poll(struct rpc* r, uint32_t id, struct rpc_frame* reply) {
+    int ret = -1;
+    pthread_mutex_lock(&r->lock);
+    struct rpc_slot* s = &r->slots[id % RPC_MAX_PENDING];
+    if (s->id != id) {
+        errno = EINVAL;
+    } else if (s->done) {
+        *reply = s->reply;
+        s->id = 0;
+        ret = 0;
+    } else if (r->error) {
+        errno = r->error;
+        s->id = 0;
+    } else {
+        errno = EAGAIN;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return ret;
+}
+
+void rpc_cancel(struct rpc* r, uint32_t id) {
+    pthread_mutex_lock(&r->lock);
+    struct rpc_slot* s = &r->slots[id % RPC_MAX_PENDING];
+    if (s->id == id) {
+        s->id = 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+int rpc_call(struct rpc* r, uint16_t type, const void* body, int len, struct rpc_frame* reply, int timeout_ms) {
+    uint32_t id = rpc_send(r, type, body, len);
+    if (id == 0) {
+        return -1;
+    }
+
+    return rpc_wait(r, id, reply, timeout_ms);
+}
+
+int rpc_next_push(struct rpc* r, struct rpc_frame* push, int timeout_ms) {
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        deadline_after(&deadline, timeout_ms);
+    }
+
+    int ret = -1;
+    pthread_mutex_lock(&r->lock);
+    while (!r->num_pushes && !r->error) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        } else if (pthread_cond_timedwait(&r->cond, &r->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    // pushes that arrived before the connection dropped are still delivered
+    if (r->num_pushes) {
+        *push = r->pushes[r->push_head];
+        r->push_head = (r->push_head + 1) % RPC_MAX_PUSHES;
+        r->num_pushes--;
+        pthread_cond_broadcast(&r->cond);
+        ret = 0;
+    } else {
+        errno = r->error ? r->error : ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return ret;
+}
+
+void rpc_close(struct rpc* r) {
+    pthread_mutex_lock(&r->lock);
+    r->closing = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    shutdown(r->sock, SHUT_RDWR);
+    pthread_join(r->reader, NULL);
+    close(r->sock);
+    close(r->efd);
+    destroy_locks(r);
+}
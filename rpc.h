@@ -0,0 +1,88 @@
+#ifndef RPC_H
+#define RPC_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * framed requests to the punch server over its TCP connection. every frame is
+ * [length u16][type u16][request id u32][body], big endian, the length counting
+ * everything after itself. a reply carries the id of its request, so requests
+ * can be pipelined and answered by whoever waits for them. frames with id 0 are
+ * pushed by the server and queued for rpc_next_push().
+ * one reader thread owns the socket, any thread may send and wait, an event
+ * loop can watch efd and collect replies with rpc_poll() instead.
+ */
+
+#define RPC_HEADER_LENGTH 8
+#define RPC_MAX_BODY 64
+// unanswered requests on one connection
+#define RPC_MAX_PENDING 256
+// pushes nobody picked up yet, the reader waits for room before it reads on,
+// so replies queue up behind pushes until somebody takes them
+#define RPC_MAX_PUSHES 256
+
+struct rpc_frame {
+    uint16_t type;
+    uint32_t id;
+    int len;
+    char body[RPC_MAX_BODY];
+};
+
+struct rpc_slot {
+    // id of the request waiting here, 0 when free
+    uint32_t id;
+    int done;
+    struct rpc_frame reply;
+};
+
+struct rpc {
+    int sock;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t next_id;
+    // request id modulo RPC_MAX_PENDING
+    struct rpc_slot slots[RPC_MAX_PENDING];
+    struct rpc_frame pushes[RPC_MAX_PUSHES];
+    int push_head;
+    int num_pushes;
+    // errno of the reader once the connection is gone
+    int error;
+    int closing;
+    // eventfd, readable after every frame handed out and once the connection is gone
+    int efd;
+    // frames are written whole, one thread at a time
+    pthread_mutex_t send_lock;
+};
+
+// take over the connected socket and start reading it
+int rpc_init(struct rpc* r, int sock);
+
+/*
+ * send a request without waiting for its reply, returns its id or 0 on error.
+ * fails with EAGAIN if the request RPC_MAX_PENDING ids ago is still unanswered
+ */
+uint32_t rpc_send(struct rpc* r, uint16_t type, const void* body, int len);
+
+// send a frame with id 0 that the server doesn't answer
+int rpc_post(struct rpc* r, uint16_t type, const void* body, int len);
+
+// wait up to timeout_ms, or forever if negative, for the reply to request id
+int rpc_wait(struct rpc* r, uint32_t id, struct rpc_frame* reply, int timeout_ms);
+
+// the reply to request id without waiting, -1 with errno EAGAIN while it's pending
+int rpc_poll(struct rpc* r, uint32_t id, struct rpc_frame* reply);
+
+// give up on request id, its reply is dropped when it comes
+void rpc_cancel(struct rpc* r, uint32_t id);
+
+int rpc_call(struct rpc* r, uint16_t type, const void* body, int len, struct rpc_frame* reply, int timeout_ms);
+
+// the oldest frame the server pushed, -1 with errno ETIMEDOUT if none came in time
+int rpc_next_push(struct rpc* r, struct rpc_frame* push, int timeout_ms);
+
+// shut the connection down and wait for the reader
+void rpc_close(struct rpc* r);
+
+#endif
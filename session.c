@@ -0,0 +1,1361 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "session.h"
+#include "burst.h"
+#include "probe_set.h"
+#include "ttl_trace.h"
+#include "metrics.h"
+#include "tcp_punch.h"
+#include "log.h"
+
+#define MAX_EVENTS 64
+#define MAX_REQUEST_LENGTH 48
+
+enum session_state {
+    SessionLookup,      // GetPeerInfo sent
+    SessionRacing,      // IPv6 probed, the IPv4 plan waits for its head start or the initiator's
+    SessionAwaitReady,  // notified the peer, waiting for it to open its holes
+    SessionTracing,     // finding the ttl that gets the probes past our NAT only
+    SessionPunching,    // firing one batch of probe sockets per timer, or connecting every stream at once
+    SessionOpening,     // a cone plan's socket firing one sendmmsg() of probes per timer
+    SessionWaiting,     // every probe sent, waiting for the peer's
+};
+
+// when each phase was over, microseconds, 0 if the session didn't get that far
+struct phase_times {
+    uint64_t start;
+    uint64_t lookup;        // the peer's info in hand, or notified by the peer
+    uint64_t punching;      // the peer ready and the ttl traced, about to fire
+    uint64_t punched;       // every probe out
+    uint64_t first_packet;  // a probe socket heard from the peer
+    uint64_t connected;     // the peer greeted
+};
+
+struct session {
+    struct session* next;
+    struct session* prev;
+    uint32_t peer_id;
+    int outgoing;
+    int state;
+    struct peer_info peer;
+    uint64_t started;
+    uint64_t deadline;
+    // next batch or retransmission, 0 if none
+    uint64_t due;
+
+    // the one request in flight, an rpc id over TCP and a datagram to retransmit over UDP
+    int pending;
+    uint16_t req_type;
+    uint16_t reply_type;
+    char req[MAX_REQUEST_LENGTH];
+    int req_len;
+    uint32_t rpc_id;
+    int tries;
+
+    // our NAT's allocation state sent along once the probes are out, if notify is set
+    int notify;
+    struct port_prediction pred;
+
+    uint16_t* ports;
+    int num_ports;
+    int per_sock;
+    int sprayed;        // probes out of the socket of a cone plan
+    int ttl;
+    int* socks;
+    // the NAT binding of every probe socket, kept alive while waiting for the peer
+    struct keepalive* keeps;
+    int num_socks;
+    int max_socks;
+    int flood_warned;
+    int icmp_refused;   // set.refused already acted on
+    struct probe_set set;
+    // the IPv6 attempt raced against the IPv4 plan, -1 if there is none
+    int sock6;
+    struct keepalive keep6;
+    // when the initiator starts its IPv4 plan unless IPv6 has won, 0 once it has
+    uint64_t fallback;
+    // punching TCP, the probe sockets connect streams
+    int stream;
+    // listening on our TCP mapping for the peer's SYN, -1 if not
+    int lsock;
+    struct ttl_trace trace;
+    struct phase_times times;
+    // over, waiting on l->ended for the round of events that may still name it
+    int ended;
+};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// file descriptors open right now, probe sockets included
+static int count_fds(void) {
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return -1;
+    }
+    int n = 0;
+    while (readdir(dir)) {
+        n++;
+    }
+    closedir(dir);
+
+    // ., .. and the one of the listing
+    return n - 3;
+}
+
+// one line per session in verbose mode, in ms since it started, for bench/nat_bench.sh to pick up
+static void log_times(uint32_t peer_id, const struct phase_times* t, int fds, int socks) {
+    if (!log_verbose()) {
+        return;
+    }
+    uint64_t marks[] = {t->lookup, t->punching, t->punched, t->first_packet, t->connected};
+    double ms[5];
+    int i;
+    for (i = 0; i < 5; ++i) {
+        ms[i] = marks[i] ? (marks[i] - t->start) / 1000.0 : -1;
+    }
+    // the start is on the monotonic clock, which both clients of a benchmark share
+    info_log("timing: peer %d at %llu lookup %.1f punching %.1f punched %.1f first_packet %.1f connected %.1f ms, %d fds, %d sockets\n",
+        peer_id, (unsigned long long)t->start, ms[0], ms[1], ms[2], ms[3], ms[4], fds, socks);
+}
+
+void session_default_budget(struct session_budget* budget) {
+    budget->max_socks = 0;
+    budget->timeout_ms = DEFAULT_SESSION_TIMEOUT_MS;
+}
+
+static struct session* find_session(struct session_loop* l, uint32_t peer_id) {
+    struct session* s;
+    for (s = l->sessions; s; s = s->next) {
+        if (s->peer_id == peer_id) {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+static struct session* new_session(struct session_loop* l, uint32_t peer_id, int outgoing, uint64_t now) {
+    if (l->num_sessions >= l->max_sessions || find_session(l, peer_id)) {
+        return NULL;
+    }
+
+    struct session* s = calloc(1, sizeof(struct session));
+    if (s == NULL) {
+        return NULL;
+    }
+    if (probe_set_init(&s->set) < 0) {
+        free(s);
+        return NULL;
+    }
+    // the probe set is an epoll instance itself, readable once any probe socket is
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, s->set.epfd, &ev) < 0) {
+        probe_set_destroy(&s->set);
+        free(s);
+        return NULL;
+    }
+
+    s->peer_id = peer_id;
+    s->outgoing = outgoing;
+    s->sock6 = -1;
+    s->lsock = -1;
+    s->trace.sock = -1;
+    s->started = now;
+    s->times.start = now_us();
+    metrics_add(SessionsStarted, 1);
+    s->deadline = now + l->budget.timeout_ms;
+
+    s->next = l->sessions;
+    if (l->sessions) {
+        l->sessions->prev = s;
+    }
+    l->sessions = s;
+    l->num_sessions++;
+    l->started++;
+
+    return s;
+}
+
+// close every probe socket but keep_fd and forget the session, it is freed once the round of events is over
+static void end_session(struct session_loop* l, struct session* s, int keep_fd) {
+    verbose_log("peer %d: %d probe sockets used\n", s->peer_id, s->num_socks);
+    int i;
+    for (i = 0; i < s->num_socks; ++i) {
+        keepalive_remove(&l->keepalives, &s->keeps[i]);
+        if (s->socks[i] != keep_fd) {
+            close(s->socks[i]);
+        }
+    }
+    if (s->sock6 >= 0) {
+        keepalive_remove(&l->keepalives, &s->keep6);
+        if (s->sock6 != keep_fd) {
+            close(s->sock6);
+        }
+    }
+    if (s->lsock >= 0) {
+        close(s->lsock);
+    }
+    // the server may still answer a request we gave up on
+    if (s->rpc_id) {
+        rpc_cancel(&l->c->rpc, s->rpc_id);
+    }
+    probe_set_destroy(&s->set);
+    ttl_trace_close(&s->trace);
+    free(s->socks);
+    free(s->keeps);
+    free(s->ports);
+
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        l->sessions = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    if (l->listener == s) {
+        l->listener = NULL;
+    }
+    if (l->acceptor == s) {
+        l->acceptor = NULL;
+    }
+    l->num_sessions--;
+    s->ended = 1;
+    s->next = l->ended;
+    l->ended = s;
+}
+
+static void free_ended(struct session_loop* l) {
+    while (l->ended) {
+        struct session* s = l->ended;
+        l->ended = s->next;
+        free(s);
+    }
+}
+
+static void fail_session(struct session_loop* l, struct session* s, const char* why) {
+    info_log("peer %d: %s\n", s->peer_id, why);
+    log_times(s->peer_id, &s->times, log_verbose() ? count_fds() : 0, s->num_socks + (s->sock6 >= 0) + (s->lsock >= 0));
+    metrics_add(SessionsFailed, 1);
+    l->failed++;
+    uint32_t peer_id = s->peer_id;
+    end_session(l, s, -1);
+    if (l->failed_fn) {
+        l->failed_fn(l, peer_id, why);
+    }
+}
+
+static void connect_session(struct session_loop* l, struct session* s, int fd) {
+    if (fd == s->lsock) {
+        // the peer's SYN came from a port none of our connecting sockets aimed at
+        fd = accept4(s->lsock, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+    }
+    uint32_t peer_id = s->peer_id;
+    struct phase_times times = s->times;
+    times.first_packet = now_us();
+    int fds = log_verbose() ? count_fds() : 0;
+    int socks = s->num_socks + (s->sock6 >= 0) + (s->lsock >= 0);
+    if (s->stream) {
+        // established, the handshake was the greeting
+        tcp_punch_established(fd, TCP_KEEPALIVE_INTERVAL);
+    }
+    if (l->listener == s) {
+        // the peer's probes may get in from more ports than the first, only its winner is of use
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        char byte;
+        if (recvfrom(fd, &byte, 1, MSG_PEEK, (struct sockaddr*)&from, &fromlen) >= 0) {
+            connect(fd, (struct sockaddr*)&from, fromlen);
+        }
+    }
+    int i;
+    for (i = 0; i < s->num_socks && s->socks[i] != fd; ++i);
+    if (i < s->num_socks) {
+        metrics_observe(WinningProbe, i);
+    }
+    if (times.punched) {
+        metrics_observe(WaitForPeerTime, times.first_packet - times.punched);
+    }
+    metrics_add(SessionsConnected, 1);
+    l->succeeded++;
+    end_session(l, s, fd);
+
+    if (l->connected) {
+        l->connected(l, peer_id, fd);
+    } else {
+        struct sockaddr_in6 peer;
+        on_connected(fd, &peer);
+        if (session_loop_keep(l, fd, (struct sockaddr*)&peer) < 0) {
+            close(fd);
+        }
+    }
+    times.connected = now_us();
+    metrics_observe(ConnectTime, times.connected - times.start);
+    log_times(peer_id, &times, fds, socks);
+}
+
+static int send_request(struct session_loop* l, struct session* s, uint64_t now) {
+    client* c = l->c;
+    if (c->udp) {
+        if (sendto(c->sfd, s->req, s->req_len, 0, (struct sockaddr*)&c->server_addr, sizeof(c->server_addr)) < 0) {
+            return -1;
+        }
+        // retransmit like a STUN client
+        s->due = now + (UDP_INITIAL_RTO_MS << s->tries);
+        s->tries++;
+        return 0;
+    }
+
+    s->rpc_id = rpc_send(&c->rpc, s->req_type, s->req, s->req_len);
+    if (s->rpc_id == 0) {
+        if (errno != EAGAIN) {
+            return -1;
+        }
+        // every rpc slot is taken, try again on the next tick
+        s->due = now + 1;
+    } else {
+        s->due = 0;
+    }
+
+    return 0;
+}
+
+// a request whose body starts with the peer's id, the reply's body does so too
+static int request(struct session_loop* l, struct session* s, uint16_t type, uint16_t reply_type,
+        const struct port_prediction* pred, uint64_t now) {
+    client* c = l->c;
+    char* p = s->req;
+    if (c->udp) {
+        p = encode16(p, type);
+        p = encode32(p, c->id);
+        p = encode(p, c->token, UDP_TOKEN_SIZE);
+    }
+    p = encode32(p, s->peer_id);
+    if (pred) {
+        p = encode16(p, pred->pattern);
+        p = encode16(p, pred->delta);
+        p = encode16(p, pred->base_port);
+    }
+    s->req_len = p - s->req;
+    s->req_type = type;
+    s->reply_type = reply_type;
+    s->pending = 1;
+    s->tries = 0;
+
+    return send_request(l, s, now);
+}
+
+/*
+ * get ready to open one socket per probe port, pred is sent to the peer once the probes are out.
+ * the probes are fired in batches from the loop's timer, so other sessions go on meanwhile
+ */
+static void start_punching(struct session_loop* l, struct session* s, uint16_t* probe_ports, int num_ports,
+        int ttl, const struct port_prediction* pred, uint64_t now) {
+    client* c = l->c;
+    s->ports = probe_ports;
+    if (num_ports < 0) {
+        fail_session(l, s, "out of memory for the probe ports");
+        return;
+    }
+    s->ttl = ttl;
+    s->per_sock = c->burst.probes_per_sock;
+    // a stream sends one SYN
+    if (s->stream || num_ports % s->per_sock) {
+        s->per_sock = 1;
+    }
+    s->max_socks = num_ports / s->per_sock;
+    if (l->budget.max_socks && s->max_socks > l->budget.max_socks) {
+        s->max_socks = l->budget.max_socks;
+    }
+    s->num_ports = s->max_socks * s->per_sock;
+    if (s->num_ports > 0 && s->num_ports < num_ports) {
+        uint16_t* trimmed = realloc(probe_ports, s->num_ports * sizeof(uint16_t));
+        if (trimmed) {
+            s->ports = trimmed;
+        }
+    }
+    s->socks = malloc(s->max_socks * sizeof(int));
+    s->keeps = malloc(s->max_socks * sizeof(struct keepalive));
+    if (s->socks == NULL || s->keeps == NULL) {
+        fail_session(l, s, "out of memory for the probe sockets");
+        return;
+    }
+    s->notify = pred != NULL;
+    if (pred) {
+        s->pred = *pred;
+    }
+    s->state = SessionPunching;
+    s->due = now;
+
+    if (ttl != TTL_AUTO) {
+        s->times.punching = now_us();
+        return;
+    }
+    // the trace socket reports to the loop like the probe set does
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    if (ttl_trace_start(&s->trace, s->peer.ip, TTL_TRACE_MAX_HOPS) < 0
+            || epoll_ctl(l->epfd, EPOLL_CTL_ADD, s->trace.sock, &ev) < 0) {
+        verbose_log("failed to trace the path to peer %d, ttl %d\n", s->peer_id, DEFAULT_TTL);
+        ttl_trace_close(&s->trace);
+        s->ttl = DEFAULT_TTL;
+        s->times.punching = now_us();
+        return;
+    }
+    s->state = SessionTracing;
+    s->due = now + TTL_TRACE_TIMEOUT_MS;
+}
+
+// every hop answered or time is up, punch with what we know
+static void finish_trace(struct session_loop* l, struct session* s, uint64_t now) {
+    s->ttl = ttl_trace_pick(&s->trace, DEFAULT_TTL);
+    verbose_log("peer %d: our NAT at hop %d, peer's at %d, ttl %d\n", s->peer_id,
+        ttl_trace_nat_hop(&s->trace), s->trace.target_hop, s->ttl);
+    ttl_trace_close(&s->trace);
+    s->state = SessionPunching;
+    s->due = now;
+    s->times.punching = now_us();
+}
+
+// tell the owner when the rate our NAT takes has moved by more than a tenth
+static void remember_rate(struct session_loop* l) {
+    client* c = l->c;
+    uint32_t rate = pacer_sustained(&l->pacer);
+    uint32_t known = c->profile.probe_rate;
+    if (rate * 10 >= known * 9 && rate * 10 <= known * 11) {
+        return;
+    }
+    verbose_log("our NAT takes %u probe sockets a second\n", rate);
+    c->profile.probe_rate = rate;
+    if (l->rate_learned) {
+        l->rate_learned(l, rate);
+    }
+}
+
+// probes are out, tell the peer if it waits for us and wait for its probes
+static int finish_punching(struct session_loop* l, struct session* s, uint64_t now) {
+    info_log("holes punched, waiting for peer %d\n", s->peer_id);
+    s->times.punched = now_us();
+    if (s->times.punching) {
+        metrics_observe(BurstTime, s->times.punched - s->times.punching);
+    }
+    l->punched++;
+    s->state = SessionWaiting;
+    s->due = 0;
+    if (s->notify) {
+        return request(l, s, NotifyPeer, NotifyAck, &s->pred, now);
+    }
+
+    return 0;
+}
+
+static uint64_t us_to_ms(uint64_t us) {
+    return (us + 999) / 1000;
+}
+
+// 1 and the pacer backs off if a probe was refused, by the kernel (error) or by a NAT through an ICMP error
+static int check_refused(struct session_loop* l, struct session* s, int error) {
+    int refused = (error && pacer_is_refusal(error)) || s->set.refused > s->icmp_refused;
+    s->icmp_refused = s->set.refused;
+    if (!refused) {
+        return 0;
+    }
+
+    int backoffs = l->pacer.refusals;
+    pacer_refused(&l->pacer, now_us());
+    if (l->pacer.refusals > backoffs) {
+        metrics_add(PacerBackoffs, 1);
+        verbose_log("peer %d: probes refused after %d sockets, down to %.0f a second\n",
+            s->peer_id, s->num_socks, l->pacer.rate);
+    }
+
+    return 1;
+}
+
+/*
+ * as many probe sockets as the pacer lets out now. the bucket counts in
+ * microseconds while the loop wakes up in milliseconds, so a late wakeup
+ * makes a bigger batch and the rate holds
+ */
+static void fire_batch(struct session_loop* l, struct session* s, uint64_t now) {
+    client* c = l->c;
+    int want = s->max_socks - s->num_socks;
+    struct burst_config cfg = c->burst;
+    cfg.ttl = s->ttl;
+    cfg.probes_per_sock = s->per_sock;
+    cfg.num_socks = pacer_take(&l->pacer, want, now_us());
+    if (cfg.num_socks == 0) {
+        s->due = now + us_to_ms(pacer_delay_us(&l->pacer, 1, now_us()));
+        return;
+    }
+    cfg.batch_size = cfg.num_socks;
+    cfg.gap_us = 0;
+
+    struct sockaddr_in peer_addr;
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_addr.s_addr = inet_addr(s->peer.ip);
+    // the peer's own ICMP errors say nothing about our NAT
+    s->set.peer = peer_addr.sin_addr;
+
+    // the session takes over the sockets of the burst
+    struct burst b;
+    // one ring for every batch, setting one up is several syscalls of its own
+    cfg.use_uring = l->uring != NULL;
+    int ret = burst_run(&b, &cfg, l->uring, &s->set, peer_addr, s->ports + s->num_socks * s->per_sock);
+    if (b.socks) {
+        int i;
+        for (i = 0; i < b.num_socks; ++i) {
+            // each socket refreshes the binding of the first port it probed
+            struct keepalive* k = &s->keeps[s->num_socks];
+            peer_addr.sin_port = htons(s->ports[s->num_socks * s->per_sock]);
+            keepalive_init(k, b.socks[i], (struct sockaddr*)&peer_addr, PROBE_KEEPALIVE_INTERVAL_MS);
+            k->ttl = s->ttl;
+            keepalive_add(&l->keepalives, k, now);
+            s->socks[s->num_socks++] = b.socks[i];
+        }
+        free(b.socks);
+    }
+
+    int done = s->num_socks >= s->max_socks;
+    // refused even at the slowest rate, there's no point in going on
+    int slowest = l->pacer.rate <= PACER_MIN_RATE && now_us() - l->pacer.backoff_us >= PACER_PERIOD_US;
+    int refused = check_refused(l, s, b.error);
+    if (!refused && ret >= 0) {
+        pacer_sent(&l->pacer, now_us());
+    }
+    if ((!refused && (ret < 0 || b.error)) || (refused && slowest)) {
+        if (!s->flood_warned) {
+            // NAT in front of us wound't tolerate too many ports used by one application
+            info_log("may trigger flooding protection, %d probe sockets opened for peer %d\n", s->num_socks, s->peer_id);
+            s->flood_warned = 1;
+        }
+        done = 1;
+    }
+
+    if (b.ready_fd >= 0) {
+        connect_session(l, s, b.ready_fd);
+    } else if (done) {
+        remember_rate(l);
+        if (finish_punching(l, s, now) < 0) {
+            fail_session(l, s, "lost connection to punch server");
+        }
+    } else {
+        // small batches as soon as there are tokens, the pace is smoother and refusals come back sooner
+        uint64_t delay = us_to_ms(pacer_delay_us(&l->pacer, 1, now_us()));
+        s->due = now + (delay > 0 ? delay : 1);
+    }
+}
+
+/*
+ * a nonblocking connect() per port, each SYN opens a mapping of our NAT. a
+ * cone NAT maps our source port the same way for every destination, so every
+ * socket binds it, and the cone side of a mixed pair listens there too for
+ * the symmetric peer's SYN, whatever port that comes from. behind a symmetric
+ * NAT each socket takes a port of the kernel's and gets a mapping of its own.
+ * the kernel retransmits the SYNs, there are no keepalives to send
+ */
+static void connect_streams(struct session_loop* l, struct session* s, uint64_t now) {
+    client* c = l->c;
+    int cone = is_cone(c->type);
+    if (cone && !is_cone(s->peer.type)) {
+        if (l->acceptor) {
+            fail_session(l, s, "our TCP mapping is taken by another session");
+            return;
+        }
+        s->lsock = tcp_punch_listen(c->local_ip, c->local_port);
+        if (s->lsock < 0 || probe_set_add(&s->set, s->lsock) < 0) {
+            fail_session(l, s, "failed to listen on our TCP mapping");
+            return;
+        }
+        l->acceptor = s;
+    }
+
+    struct sockaddr_in peer_addr;
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_addr.s_addr = inet_addr(s->peer.ip);
+    int i;
+    for (i = 0; i < s->num_ports; ++i) {
+        int fd = tcp_punch_socket(c->local_ip, cone ? c->local_port : 0);
+        if (fd < 0) {
+            break;
+        }
+        peer_addr.sin_port = htons(s->ports[i]);
+        if (tcp_punch_connect(fd, &peer_addr, s->ttl) < 0 || probe_set_add_stream(&s->set, fd) < 0) {
+            metrics_add(ProbesFailed, 1);
+            close(fd);
+            continue;
+        }
+        metrics_add(ProbesSent, 1);
+        keepalive_init(&s->keeps[s->num_socks], fd, NULL, 0);
+        s->socks[s->num_socks++] = fd;
+    }
+    metrics_add(ProbeSockets, s->num_socks);
+
+    if (s->num_socks == 0) {
+        fail_session(l, s, "no SYN got out");
+    } else if (finish_punching(l, s, now) < 0) {
+        fail_session(l, s, "lost connection to punch server");
+    }
+}
+
+// n sockets aimed at the peer's TCP mapping
+static int tcp_mapping_ports(const struct peer_info* peer, int n, uint16_t** probe_ports) {
+    *probe_ports = malloc(n * sizeof(uint16_t));
+    if (*probe_ports == NULL) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < n; ++i) {
+        (*probe_ports)[i] = peer->tcp_port;
+    }
+
+    return n;
+}
+
+/*
+ * the probes of a cone plan, a sendmmsg() a tick. they all leave through one
+ * mapping, but queues on the way drop a burst of thousands all the same
+ */
+static void spray_mapped(struct session_loop* l, struct session* s, uint64_t now) {
+    struct sockaddr_in peer_addr;
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_addr.s_addr = inet_addr(s->peer.ip);
+
+    const uint16_t* ports = s->ports ? s->ports : &s->peer.port;
+    int n = s->ports ? s->num_ports - s->sprayed : 1;
+    if (n > MAX_PROBES_PER_SOCK) {
+        n = MAX_PROBES_PER_SOCK;
+    }
+    // a probe that didn't get out is sent again by the keepalive
+    if (burst_spray(s->socks[0], peer_addr, ports + s->sprayed, n) < 0) {
+        verbose_log("peer %d: probes didn't leave our mapping\n", s->peer_id);
+    }
+    s->sprayed += n;
+    if (s->ports && s->sprayed < s->num_ports) {
+        s->due = now + 1;
+        return;
+    }
+
+    if (finish_punching(l, s, now) < 0) {
+        fail_session(l, s, "lost connection to punch server");
+    }
+}
+
+/*
+ * a cone plan gets by with one socket, on our enrolled mapping: connected to
+ * the peer's when that is where its probes come from, or taking any of the
+ * peer's ports, which only one session at a time can. it fires the probes at
+ * ports, the peer's mapping if NULL, and waits for the peer's, notify tells
+ * the peer to go once they are out
+ */
+static void punch_mapped(struct session_loop* l, struct session* s, int to_mapping, uint16_t* probe_ports,
+        int num_ports, int notify, uint64_t now) {
+    client* c = l->c;
+    s->ports = probe_ports;
+    s->num_ports = num_ports;
+    s->times.punching = now_us();
+    if (!to_mapping && l->listener) {
+        fail_session(l, s, "our mapping is taken by another session");
+        return;
+    }
+    s->socks = malloc(sizeof(int));
+    s->keeps = malloc(sizeof(struct keepalive));
+    if (num_ports < 0 || s->socks == NULL || s->keeps == NULL) {
+        fail_session(l, s, "out of memory for the probes");
+        return;
+    }
+
+    struct sockaddr_in peer_addr;
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_addr.s_addr = inet_addr(s->peer.ip);
+    peer_addr.sin_port = htons(s->peer.port);
+
+    int fd = open_mapped_socket(c);
+    if (fd >= 0 && ((to_mapping && connect(fd, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) < 0)
+            || probe_set_add(&s->set, fd) < 0)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        fail_session(l, s, "failed to open a socket on our mapping");
+        return;
+    }
+    metrics_add(ProbeSockets, 1);
+    s->socks[0] = fd;
+    s->num_socks = s->max_socks = 1;
+    keepalive_init(&s->keeps[0], fd, (struct sockaddr*)&peer_addr, PROBE_KEEPALIVE_INTERVAL_MS);
+    keepalive_add(&l->keepalives, &s->keeps[0], now);
+    if (!to_mapping) {
+        l->listener = s;
+    }
+
+    s->notify = notify;
+    s->pred = c->pred;
+    s->state = SessionOpening;
+    spray_mapped(l, s, now);
+}
+
+// tell the peer where our NAT stands and wait for it to get ready in turn
+static void await_ready(struct session_loop* l, struct session* s, const struct port_prediction* pred, uint64_t now) {
+    s->state = SessionAwaitReady;
+    if (s->deadline > now + SESSION_READY_TIMEOUT_MS) {
+        s->deadline = now + SESSION_READY_TIMEOUT_MS;
+    }
+    if (request(l, s, NotifyPeer, NotifyAck, pred, now) < 0) {
+        fail_session(l, s, "lost connection to punch server");
+    }
+}
+
+// on a cone NAT, let the symmetric peer's next ports in and tell it to aim at our mapping
+static void open_filter(struct session_loop* l, struct session* s, uint64_t now) {
+    client* c = l->c;
+    uint16_t* probe_ports;
+    int num_ports;
+    if (s->stream) {
+        // a SYN at each of its next ports if our filter looks at them, the listener takes a SYN from any other
+        if (c->type == RestricPortNAT) {
+            num_ports = window_ports(&s->peer, 0, &probe_ports);
+        } else {
+            num_ports = tcp_mapping_ports(&s->peer, 1, &probe_ports);
+        }
+        start_punching(l, s, probe_ports, num_ports, c->ttl, &c->pred, now);
+        return;
+    }
+    num_ports = filter_ports(c, &s->peer, &probe_ports);
+    punch_mapped(l, s, 0, probe_ports, num_ports, 1, now);
+}
+
+/*
+ * probe the peer's IPv6 candidate from ours, one more socket that may win.
+ * a stateful firewall on either side lets the peer's probe in once ours is
+ * out. -1 if there is no socket, the peer goes on expecting us all the same
+ */
+static int start_ipv6(struct session_loop* l, struct session* s, uint64_t now) {
+    struct sockaddr_in6 peer_addr;
+    int fd = open_ipv6_socket(l->c, &s->peer, &peer_addr);
+    if (fd >= 0 && probe_set_add(&s->set, fd) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        verbose_log("peer %d: no socket on our IPv6 candidate\n", s->peer_id);
+        return -1;
+    }
+    metrics_add(ProbeSockets, 1);
+    s->sock6 = fd;
+    keepalive_init(&s->keep6, fd, (struct sockaddr*)&peer_addr, PROBE_KEEPALIVE_INTERVAL_MS);
+    keepalive_add(&l->keepalives, &s->keep6, now);
+
+    // a probe that didn't get out is sent again by the keepalive
+    if (send(fd, "c", 1, 0) == 1) {
+        metrics_add(ProbesSent, 1);
+    } else {
+        metrics_add(ProbesFailed, 1);
+    }
+
+    return 0;
+}
+
+// no IPv4 plan gets through our NATs, IPv6 is the only way left if there is one
+static void give_up_ipv4(struct session_loop* l, struct session* s) {
+    if (s->sock6 < 0) {
+        fail_session(l, s, "can't be reached behind its NAT");
+        return;
+    }
+    verbose_log("peer %d: no way through our NATs, waiting on IPv6\n", s->peer_id);
+    s->state = SessionWaiting;
+    s->due = 0;
+}
+
+// the IPv4 plan of the initiator
+static void punch_outgoing(struct session_loop* l, struct session* s, uint64_t now) {
+    client* c = l->c;
+    struct port_prediction pred;
+    uint16_t* probe_ports;
+    int num_ports;
+    switch (punch_plan(c, &s->peer)) {
+    case PlanDirect:
+        if (s->stream) {
+            // our SYN opens our mapping and dies on the way, the peer's meets our socket in SYN_SENT
+            num_ports = tcp_mapping_ports(&s->peer, 1, &probe_ports);
+            start_punching(l, s, probe_ports, num_ports, c->ttl, &c->pred, now);
+            break;
+        }
+        // both mappings are known and stay put, one probe each way opens both filters
+        punch_mapped(l, s, 1, NULL, 0, 1, now);
+        break;
+    case PlanConeOpens:
+        /*
+         * the symmetric side's next ports are anyone's guess but its own, it
+         * tells the cone side where its NAT stands, the cone side lets those
+         * ports in through its mapping, and only then the symmetric side sprays
+         */
+        if (is_cone(c->type)) {
+            await_ready(l, s, &c->pred, now);
+        } else {
+            fresh_prediction(c, &pred);
+            await_ready(l, s, &pred, now);
+        }
+        break;
+    case PlanPredict:
+        /*
+         * the peer opens holes with limited ttl towards the ports our NAT is about
+         * to allocate, then tells us where its own NAT stands, we probe its next ports
+         */
+        fresh_prediction(c, &pred);
+        await_ready(l, s, &pred, now);
+        break;
+    case PlanSpray:
+        /*
+         * according to birthday paradox, probability that port randomly chosen from [1024, 65535]
+         * will collide with another one chosen by the same way is
+         * p(n) = 1-(64511!/(64511^n*64511!))
+         * where '!' is the factorial operator, n is the number of ports chosen.
+         * P(100)=0.073898
+         * P(200)=0.265667
+         * P(300)=0.501578
+         * P(400)=0.710488
+         * P(500)=0.856122
+         * P(600)=0.938839
+         * but symmetric NAT has port sensitive filter for incoming packet
+         * which makes the probalility decline dramatically.
+         * Moreover, symmetric NATs don't really allocate ports randomly,
+         * when both of them allocate with a known stride, PlanPredict aims at the predicted ports instead.
+         */
+        num_ports = random_ports(c, &s->peer, &probe_ports);
+        // hole punched, notify remote peer via punch server
+        start_punching(l, s, probe_ports, num_ports, c->ttl, &c->pred, now);
+        break;
+    default:
+        give_up_ipv4(l, s);
+    }
+}
+
+static void on_peer_info(struct session_loop* l, struct session* s, const struct rpc_frame* reply, uint64_t now) {
+    client* c = l->c;
+    int n = decode_peer_info_reply(reply->body, reply->len, &s->peer);
+    if (n) {
+        verbose_log("get_peer_info() return %d\n", n);
+        fail_session(l, s, "failed to get info of remote peer");
+        return;
+    }
+    s->times.lookup = now_us();
+    metrics_observe(LookupTime, s->times.lookup - s->times.start);
+
+    info_log("peer %d: %s:%d, nat type: %s\n", s->peer_id, s->peer.ip, s->peer.port, get_nat_desc(s->peer.type));
+    // a stream is punched over IPv4 only
+    s->stream = use_tcp(c, &s->peer);
+    if (s->stream) {
+        verbose_log("peer %d: punching TCP, its mapping is at port %d\n", s->peer_id, s->peer.tcp_port);
+    } else if (use_ipv6(c, &s->peer)) {
+        // the peer probes back as soon as it hears from us, IPv4 waits out IPv6's head start
+        start_ipv6(l, s, now);
+        s->state = SessionRacing;
+        s->fallback = now + HAPPY_EYEBALLS_DELAY_MS;
+        if (request(l, s, NotifyPeer, NotifyAck, &c->pred, now) < 0) {
+            fail_session(l, s, "lost connection to punch server");
+        }
+        return;
+    }
+
+    punch_outgoing(l, s, now);
+}
+
+// IPv6 hasn't won within its head start, race the IPv4 plan against it
+static void fall_back(struct session_loop* l, struct session* s, uint64_t now) {
+    s->fallback = 0;
+    verbose_log("peer %d: no IPv6 connection within %d ms, punching over IPv4\n", s->peer_id, HAPPY_EYEBALLS_DELAY_MS);
+    punch_outgoing(l, s, now);
+}
+
+static void on_reply(struct session_loop* l, struct session* s, const struct rpc_frame* reply, uint64_t now) {
+    s->pending = 0;
+    s->rpc_id = 0;
+    // a peer quicker than the server may have us tracing or punching on our own timer already
+    if (s->state == SessionLookup || s->state == SessionAwaitReady || s->state == SessionRacing) {
+        s->due = 0;
+    }
+    if (reply->type != s->reply_type) {
+        fail_session(l, s, "unexpected reply from punch server");
+        return;
+    }
+
+    if (reply->type == PeerInfo) {
+        on_peer_info(l, s, reply, now);
+    } else if (reply->type == NotifyAck && (reply->len < 5 || !reply->body[4])) {
+        fail_session(l, s, "offline");
+    } else if (s->fallback && now >= s->fallback) {
+        // the head start ran out before the peer knew of the race
+        fall_back(l, s, now);
+    }
+}
+
+// the IPv4 plan of the responder, peer is the initiator's info as notified
+static void punch_incoming(struct session_loop* l, struct session* s, const struct peer_info* peer, uint64_t now) {
+    client* c = l->c;
+    uint16_t* probe_ports;
+    int num_ports;
+    struct port_prediction pred;
+    switch (punch_plan(c, peer)) {
+    case PlanDirect:
+        if (s->stream) {
+            // the initiator's SYN opened its filter, ours goes all the way
+            num_ports = tcp_mapping_ports(peer, 1, &probe_ports);
+            start_punching(l, s, probe_ports, num_ports, 0, NULL, now);
+            break;
+        }
+        // the initiator's probe opened its filter for us already
+        punch_mapped(l, s, 1, NULL, 0, 0, now);
+        break;
+    case PlanConeOpens:
+        if (is_cone(c->type)) {
+            // the symmetric initiator sent where its NAT stands
+            open_filter(l, s, now);
+        } else {
+            // the cone initiator waits for where our NAT stands
+            fresh_prediction(c, &pred);
+            await_ready(l, s, &pred, now);
+        }
+        break;
+    case PlanPredict:
+        // open holes towards the peer's next ports, sweeping the drift between both sides
+        fresh_prediction(c, &pred);
+        num_ports = window_ports(peer, 1, &probe_ports);
+        start_punching(l, s, probe_ports, num_ports, c->ttl, &pred, now);
+        break;
+    case PlanSpray:
+        // let OS choose available ports, probes of the responder don't need a limited ttl
+        num_ports = random_ports(c, peer, &probe_ports);
+        start_punching(l, s, probe_ports, num_ports, 0, NULL, now);
+        break;
+    default:
+        give_up_ipv4(l, s);
+    }
+}
+
+static void on_notification(struct session_loop* l, uint32_t peer_id, const struct peer_info* peer, uint64_t now) {
+    client* c = l->c;
+    struct session* s = find_session(l, peer_id);
+    uint16_t* probe_ports;
+    int num_ports;
+    if (s && s->state == SessionAwaitReady) {
+        // the peer is ready and tells us where its NAT stands
+        s->peer = *peer;
+        verbose_log("peer %d ready, its NAT is at port %d\n", peer_id, peer->base_port);
+        s->deadline = s->started + l->budget.timeout_ms;
+
+        if (is_cone(c->type)) {
+            open_filter(l, s, now);
+        } else if (is_cone(peer->type)) {
+            // its filter lets our next ports in, every probe socket aims at its mapping
+            num_ports = cone_ports(c, peer, &probe_ports);
+            if (s->stream && num_ports > 0) {
+                free(probe_ports);
+                num_ports = tcp_mapping_ports(peer, num_ports, &probe_ports);
+            }
+            start_punching(l, s, probe_ports, num_ports, 0, NULL, now);
+        } else {
+            num_ports = window_ports(&s->peer, 0, &probe_ports);
+            start_punching(l, s, probe_ports, num_ports, 0, NULL, now);
+        }
+        return;
+    }
+    if (s && s->state == SessionRacing) {
+        // the initiator's IPv4 plan has started, IPv6 stays in the race
+        s->peer = *peer;
+        punch_incoming(l, s, peer, now);
+        return;
+    }
+    if (s) {
+        verbose_log("peer %d notified us again\n", peer_id);
+        return;
+    }
+
+    s = new_session(l, peer_id, 0, now);
+    if (s == NULL) {
+        info_log("too many sessions, ignoring peer %d\n", peer_id);
+        return;
+    }
+    s->peer = *peer;
+    s->times.lookup = s->times.start;
+    info_log("recved command, ready to connect to %s:%d\n", peer->ip, peer->port);
+    s->stream = use_tcp(c, peer);
+    if (s->stream) {
+        verbose_log("peer %d: punching TCP, its mapping is at port %d\n", peer_id, peer->tcp_port);
+    } else if (use_ipv6(c, peer)) {
+        // the initiator probed us over IPv6 and notified us first, its IPv4 plan comes with the next notification
+        start_ipv6(l, s, now);
+        s->state = SessionRacing;
+        return;
+    }
+
+    punch_incoming(l, s, peer, now);
+}
+
+
+// replies and pushes the rpc reader collected, -1 once the connection is gone
+static int drain_rpc(struct session_loop* l, uint64_t now) {
+    struct rpc* r = &l->c->rpc;
+    uint64_t count;
+    if (read(r->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        return -1;
+    }
+
+    struct session* s, *next;
+    for (s = l->sessions; s; s = next) {
+        next = s->next;
+        struct rpc_frame reply;
+        if (s->rpc_id == 0) {
+            continue;
+        }
+        if (rpc_poll(r, s->rpc_id, &reply) == 0) {
+            on_reply(l, s, &reply, now);
+        } else if (errno != EAGAIN) {
+            s->rpc_id = 0;
+            fail_session(l, s, "lost connection to punch server");
+        }
+    }
+
+    struct rpc_frame push;
+    while (rpc_next_push(r, &push, 0) == 0) {
+        uint32_t peer_id;
+        struct peer_info peer;
+        if (push.type == Notification && decode_notification(push.body, push.len, &peer_id, &peer) == 0) {
+            on_notification(l, peer_id, &peer, now);
+        }
+    }
+
+    return errno == ETIMEDOUT ? 0 : -1;
+}
+
+static void drain_udp(struct session_loop* l, uint64_t now) {
+    client* c = l->c;
+    char buf[64];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    int n;
+    while ((n = recvfrom(c->sfd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&from, &fromlen)) >= 0) {
+        fromlen = sizeof(from);
+        if (n < 6 || from.sin_addr.s_addr != c->server_addr.sin_addr.s_addr
+                || from.sin_port != c->server_addr.sin_port) {
+            continue;
+        }
+
+        // same layout as the TCP frames, with the type in front instead of a frame header
+        struct rpc_frame reply;
+        reply.type = decode16(buf);
+        reply.len = n - 2;
+        memcpy(reply.body, buf + 2, reply.len);
+
+        if (reply.type == Notification) {
+            uint32_t peer_id;
+            struct peer_info peer;
+            if (decode_notification(reply.body, reply.len, &peer_id, &peer) == 0) {
+                on_notification(l, peer_id, &peer, now);
+            }
+            continue;
+        }
+
+        // retransmissions may be answered twice
+        struct session* s = find_session(l, decode32(reply.body));
+        if (s && s->pending && s->reply_type == reply.type) {
+            on_reply(l, s, &reply, now);
+        }
+    }
+}
+
+// the server and the NAT would forget our mapping otherwise
+static void keep_server(struct keepalive* k, uint64_t now) {
+    struct session_loop* l = k->ctx;
+    client* c = l->c;
+    if (!c->udp) {
+        rpc_post(&c->rpc, Keepalive, NULL, 0);
+        return;
+    }
+
+    char buf[MAX_REQUEST_LENGTH];
+    char* p = buf;
+    p = encode16(p, UdpEnroll);
+    p = encode32(p, c->id);
+    p = encode(p, c->token, UDP_TOKEN_SIZE);
+    p = encode16(p, c->type);
+    p = encode16(p, c->pred.pattern);
+    p = encode16(p, c->pred.delta);
+    p = encode16(p, c->pred.base_port);
+    p = encode(p, (const char*)c->ip6, 16);
+    p = encode16(p, c->port6);
+    sendto(c->sfd, buf, p - buf, 0, (struct sockaddr*)&c->server_addr, sizeof(c->server_addr));
+}
+
+static void run_timers(struct session_loop* l, uint64_t now) {
+    struct session* s, *next;
+    for (s = l->sessions; s; s = next) {
+        next = s->next;
+        if (now >= s->deadline) {
+            if (s->state == SessionAwaitReady) {
+                fail_session(l, s, "didn't open its holes");
+            } else {
+                fail_session(l, s, "timeout, not connected");
+            }
+            continue;
+        }
+        if (s->fallback && !s->pending && now >= s->fallback) {
+            fall_back(l, s, now);
+            continue;
+        }
+        if (!s->due || now < s->due) {
+            continue;
+        }
+
+        if (s->state == SessionPunching && s->stream) {
+            connect_streams(l, s, now);
+        } else if (s->state == SessionPunching) {
+            fire_batch(l, s, now);
+        } else if (s->state == SessionOpening) {
+            spray_mapped(l, s, now);
+        } else if (s->state == SessionTracing) {
+            finish_trace(l, s, now);
+        } else if (!s->pending) {
+            s->due = 0;
+        } else if (l->c->udp && s->tries >= UDP_MAX_TRIES) {
+            fail_session(l, s, "no reply from punch server");
+        } else if (send_request(l, s, now) < 0) {
+            fail_session(l, s, "lost connection to punch server");
+        }
+    }
+    keepalive_run(&l->keepalives, now);
+}
+
+// milliseconds until the first timer, -1 if there is none
+static int next_timeout(struct session_loop* l, uint64_t now) {
+    int wait = keepalive_timeout(&l->keepalives, now);
+    uint64_t first = wait < 0 ? UINT64_MAX : now + wait;
+    struct session* s;
+    for (s = l->sessions; s; s = s->next) {
+        if (s->due && s->due < first) {
+            first = s->due;
+        }
+        if (s->deadline < first) {
+            first = s->deadline;
+        }
+        // not before the peer has been told of the race
+        if (s->fallback && !s->pending && s->fallback < first) {
+            first = s->fallback;
+        }
+    }
+
+    if (first == UINT64_MAX) {
+        return -1;
+    }
+
+    return first > now ? first - now : 0;
+}
+
+int session_loop_init(struct session_loop* l, client* c, const struct session_budget* budget,
+        session_connected_fn connected) {
+    memset(l, 0, sizeof(*l));
+    l->c = c;
+    l->connected = connected;
+    l->max_sessions = DEFAULT_MAX_SESSIONS;
+    if (budget) {
+        l->budget = *budget;
+    } else {
+        session_default_budget(&l->budget);
+    }
+
+    l->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (l->epfd < 0) {
+        return -1;
+    }
+
+    // session events carry the session, server events carry NULL
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->udp ? c->sfd : c->rpc.efd, &ev) < 0) {
+        close(l->epfd);
+        return -1;
+    }
+
+    // start from the rate remembered for our NAT, or ramp up from what -b and -g amount to
+    struct burst_config* cfg = &c->burst;
+    double rate = c->profile.probe_rate;
+    int ramping = rate == 0;
+    if (ramping) {
+        rate = cfg->gap_us > 0 ? cfg->batch_size * 1e6 / cfg->gap_us : PACER_MAX_RATE;
+    }
+    pacer_init(&l->pacer, rate, cfg->batch_size > 0 ? cfg->batch_size : cfg->num_socks, ramping, now_us());
+    if (cfg->use_uring && (l->uring = uring_burst_open()) == NULL) {
+        verbose_log("no io_uring for the probe sockets, %s\n", strerror(errno));
+    }
+
+    // the server connection is a binding too, its keepalive is a message the server understands
+    keepalive_set_init(&l->keepalives, c->burst.use_uring, now_ms());
+    keepalive_init(&l->server, -1, NULL, (c->udp ? UDP_KEEPALIVE_INTERVAL : TCP_KEEPALIVE_INTERVAL) * 1000);
+    l->server.fire = keep_server;
+    l->server.ctx = l;
+    keepalive_add(&l->keepalives, &l->server, now_ms());
+
+    // a notification may have come in while enrolling
+    if (c->has_notification) {
+        c->has_notification = 0;
+        on_notification(l, c->notification_id, &c->notification, now_ms());
+    }
+
+    return 0;
+}
+
+int session_connect(struct session_loop* l, uint32_t peer_id) {
+    uint64_t now = now_ms();
+    struct session* s = new_session(l, peer_id, 1, now);
+    if (s == NULL) {
+        return -1;
+    }
+
+    s->state = SessionLookup;
+    if (request(l, s, GetPeerInfo, PeerInfo, NULL, now) < 0) {
+        fail_session(l, s, "lost connection to punch server");
+        return -1;
+    }
+
+    return 0;
+}
+
+// the events epoll_wait() returned, then the timers due at now
+static int handle_events(struct session_loop* l, const struct epoll_event* events, int n, uint64_t now) {
+    int i, ret = 0;
+    for (i = 0; i < n; ++i) {
+        struct session* s = events[i].data.ptr;
+        if (s) {
+            int fd;
+            // an earlier event of the same round ended it
+            if (s->ended) {
+                continue;
+            }
+            if (s->state == SessionTracing) {
+                if (ttl_trace_read(&s->trace)) {
+                    finish_trace(l, s, now);
+                }
+            } else if ((fd = probe_set_wait(&s->set, 0)) >= 0) {
+                connect_session(l, s, fd);
+            } else if (s->state == SessionPunching) {
+                // slow down before the next batch is due rather than after it
+                check_refused(l, s, 0);
+            }
+        } else if (l->c->udp) {
+            drain_udp(l, now);
+        } else if (drain_rpc(l, now) < 0) {
+            info_log("lost connection to punch server\n");
+            ret = -1;
+        }
+    }
+    run_timers(l, now);
+    free_ended(l);
+
+    return ret;
+}
+
+int session_loop_run_once(struct session_loop* l, int timeout_ms) {
+    int wait = next_timeout(l, now_ms());
+    if (timeout_ms >= 0 && (wait < 0 || timeout_ms < wait)) {
+        wait = timeout_ms;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(l->epfd, events, MAX_EVENTS, wait);
+    if (n < 0 && errno != EINTR) {
+        return -1;
+    }
+
+    return handle_events(l, events, n > 0 ? n : 0, now_ms());
+}
+
+int session_loop_process(struct session_loop* l, uint64_t now, uint64_t* next) {
+    // more than MAX_EVENTS ready leaves epfd readable, the caller comes back right away
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(l->epfd, events, MAX_EVENTS, 0);
+    if (n < 0 && errno != EINTR) {
+        return -1;
+    }
+
+    int ret = handle_events(l, events, n > 0 ? n : 0, now);
+    int wait = next_timeout(l, now);
+    *next = wait < 0 ? UINT64_MAX : now + wait;
+
+    return ret;
+}
+
+int session_loop_run(struct session_loop* l) {
+    while (!l->stop) {
+        if (session_loop_run_once(l, -1) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int session_loop_keep(struct session_loop* l, int sock, const struct sockaddr* peer) {
+    struct kept_socket* k = malloc(sizeof(struct kept_socket));
+    if (k == NULL) {
+        return -1;
+    }
+
+    keepalive_init(&k->binding, sock, peer, PROBE_KEEPALIVE_INTERVAL_MS);
+    // a stream sends TCP keepalives of its own
+    if (!tcp_punch_is_stream(sock)) {
+        keepalive_add(&l->keepalives, &k->binding, now_ms());
+    }
+    k->next = l->kept;
+    l->kept = k;
+
+    return 0;
+}
+
+void session_loop_destroy(struct session_loop* l) {
+    while (l->sessions) {
+        end_session(l, l->sessions, -1);
+    }
+    free_ended(l);
+    while (l->kept) {
+        struct kept_socket* k = l->kept;
+        l->kept = k->next;
+        close(k->binding.sock);
+        free(k);
+    }
+    keepalive_set_destroy(&l->keepalives);
+    uring_burst_close(l->uring);
+    close(l->epfd);
+}
@@ -0,0 +1,116 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+
+#include "nat_traversal.h"
+#include "keepalive.h"
+#include "pacer.h"
+
+/*
+ * every traversal attempt of one enrolled client, outgoing and incoming, runs
+ * as a state machine in a single threaded event loop. the loop owns the probe
+ * sockets, timers and server requests of all of them, and keeps the NAT
+ * bindings of the probe sockets and of the server connection alive. loops
+ * don't share anything but the client, so one per core only needs one
+ * client each.
+ */
+
+#define DEFAULT_MAX_SESSIONS 1024
+// a session gives up this long after it started
+#define DEFAULT_SESSION_TIMEOUT_MS (110 * 1000)
+// the initiator waits this long for the peer to open its holes
+#define SESSION_READY_TIMEOUT_MS (10 * 1000)
+// the head start of IPv6 over the IPv4 plan, the connection attempt delay of RFC 8305
+#define HAPPY_EYEBALLS_DELAY_MS 250
+
+struct session_budget {
+    int max_socks;      // probe sockets a session may open, 0 for no limit
+    int timeout_ms;     // from start to connected
+};
+
+struct session;
+struct session_loop;
+
+// a connected socket the loop keeps the binding of
+struct kept_socket {
+    struct keepalive binding;
+    struct kept_socket* next;
+};
+
+// the socket that reached peer_id is owned by the callback
+typedef void (*session_connected_fn)(struct session_loop* l, uint32_t peer_id, int sock);
+// the session with peer_id ended without a connection, why is meant for humans
+typedef void (*session_failed_fn)(struct session_loop* l, uint32_t peer_id, const char* why);
+// the probe rate our NAT sustains has moved, in probe sockets a second
+typedef void (*session_rate_fn)(struct session_loop* l, uint32_t rate);
+
+struct session_loop {
+    client* c;
+    int epfd;
+    struct session_budget budget;
+    int max_sessions;
+    session_connected_fn connected;
+    // optional, failed below counts the same sessions
+    session_failed_fn failed_fn;
+    void* ctx;
+    // sessions in flight, most recent first
+    struct session* sessions;
+    int num_sessions;
+    // sessions over but not freed yet, the events of the round that ended them may still point at them
+    struct session* ended;
+    struct keepalive_set keepalives;
+    struct keepalive server;
+    struct kept_socket* kept;
+    // the session whose socket on our mapping takes any of the peer's ports, one at a time
+    struct session* listener;
+    // the session listening on our TCP mapping for a SYN from any port, one at a time as well
+    struct session* acceptor;
+    // every session's probe sockets go through the same NAT and the same bucket
+    struct pacer pacer;
+    // the ring of every batch with -u, NULL without or if the kernel has none
+    struct uring_burst* uring;
+    // optional, to remember the rate with the NAT's profile
+    session_rate_fn rate_learned;
+    // set to leave session_loop_run()
+    int stop;
+    // totals since the loop started
+    int started;
+    int punched;      // sessions that got all their probes out
+    int succeeded;
+    int failed;
+};
+
+void session_default_budget(struct session_budget* budget);
+
+/*
+ * take over the server connection of the enrolled client c. budget may be
+ * NULL for the defaults, connected may be NULL to greet the peer with
+ * on_connected() and keep the socket's binding alive with session_loop_keep()
+ */
+int session_loop_init(struct session_loop* l, client* c, const struct session_budget* budget,
+        session_connected_fn connected);
+
+// start connecting to peer_id, -1 if a session with it is in flight already or the loop is full
+int session_connect(struct session_loop* l, uint32_t peer_id);
+
+// keep the NAT binding of a connected socket to peer of either family alive, the loop owns sock from now on
+int session_loop_keep(struct session_loop* l, int sock, const struct sockaddr* peer);
+
+// handle whatever is ready within timeout_ms, -1 if the server connection is lost
+int session_loop_run_once(struct session_loop* l, int timeout_ms);
+
+/*
+ * handle whatever is ready without blocking, and the timers due at now, in ms
+ * on the monotonic clock. next is when the first timer is due, epfd becomes
+ * readable for everything else. -1 if the server connection is lost
+ */
+int session_loop_process(struct session_loop* l, uint64_t now, uint64_t* next);
+
+// run until stop is set or the server connection is lost
+int session_loop_run(struct session_loop* l);
+
+// abort every session in flight
+void session_loop_destroy(struct session_loop* l);
+
+#endif
@@ -0,0 +1,240 @@
+#include <string.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+
+#include "stun.h"
+
+#define IPV4_ATR_LENGTH 8
+#define IPV6_ATR_LENGTH 20
+
+static inline void put16(uint8_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void put32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline uint16_t get16(const uint8_t* p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t get32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int has_magic_cookie(const uint8_t* tid) {
+    return get32(tid) == STUN_MAGIC_COOKIE;
+}
+
+// RFC 5389 wants them cryptographically random, an off-path host that guesses one can answer with any mapped address
+int stun_new_tid(uint8_t* tid) {
+    put32(tid, STUN_MAGIC_COOKIE);
+    if (getrandom(tid + 4, STUN_TID_LENGTH - 4, 0) != STUN_TID_LENGTH - 4) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint8_t* put_header(uint8_t* p, uint16_t type, uint16_t length, const uint8_t* tid) {
+    put16(p, type);
+    put16(p + 2, length);
+    memcpy(p + 4, tid, STUN_TID_LENGTH);
+
+    return p + STUN_HEADER_LENGTH;
+}
+
+int stun_encode_bind_request(char* buf, size_t size, const uint8_t* tid, uint32_t change) {
+    uint16_t body = change ? 8 : 0;
+    if (size < STUN_HEADER_LENGTH + body) {
+        return -1;
+    }
+
+    uint8_t* p = put_header((uint8_t*)buf, BindRequest, body, tid);
+    if (change) {
+        put16(p, ChangeRequest);
+        put16(p + 2, 4);
+        put32(p + 4, change);
+    }
+
+    return STUN_HEADER_LENGTH + body;
+}
+
+static int address_length(const StunAtrAddress* addr) {
+    return addr->family == IPv6Family ? IPV6_ATR_LENGTH : IPV4_ATR_LENGTH;
+}
+
+// mask is the magic cookie and transaction ID for XOR-MAPPED-ADDRESS, NULL otherwise
+static uint8_t* put_address(uint8_t* p, uint16_t type, const StunAtrAddress* addr, const uint8_t* mask) {
+    int len = address_length(addr);
+    put16(p, type);
+    put16(p + 2, len);
+    p[4] = 0;
+    p[5] = addr->family;
+    put16(p + 6, addr->port ^ (mask ? get16(mask) : 0));
+
+    if (addr->family == IPv6Family) {
+        memcpy(p + 8, &addr->addr.ipv6, 16);
+        int i;
+        for (i = 0; mask && i < 16; ++i) {
+            p[8 + i] ^= mask[i];
+        }
+    } else {
+        put32(p + 8, addr->addr.ipv4 ^ (mask ? get32(mask) : 0));
+    }
+
+    return p + 4 + len;
+}
+
+int stun_encode_bind_response(char* buf, size_t size, const uint8_t* tid,
+        const StunAtrAddress* mapped, const StunAtrAddress* changed) {
+    int xor = has_magic_cookie(tid);
+    size_t body = 4 + address_length(mapped);
+    if (xor) {
+        body += 4 + address_length(mapped);
+    }
+    if (changed) {
+        body += 4 + address_length(changed);
+    }
+    if (size < STUN_HEADER_LENGTH + body) {
+        return -1;
+    }
+
+    uint8_t* p = put_header((uint8_t*)buf, BindResponse, body, tid);
+    p = put_address(p, MappedAddress, mapped, NULL);
+    if (xor) {
+        p = put_address(p, XorMappedAddress, mapped, tid);
+    }
+    if (changed) {
+        p = put_address(p, ChangedAddress, changed, NULL);
+    }
+
+    return p - (uint8_t*)buf;
+}
+
+static int get_address(const uint8_t* p, unsigned int len, const uint8_t* mask, StunAtrAddress* addr) {
+    if (len != IPV4_ATR_LENGTH && len != IPV6_ATR_LENGTH) {
+        return -1;
+    }
+    addr->family = p[1];
+    addr->port = get16(p + 2) ^ (mask ? get16(mask) : 0);
+
+    if (addr->family == IPv4Family && len == IPV4_ATR_LENGTH) {
+        addr->addr.ipv4 = get32(p + 4) ^ (mask ? get32(mask) : 0);
+        return 0;
+    }
+    if (addr->family == IPv6Family && len == IPV6_ATR_LENGTH) {
+        memcpy(&addr->addr.ipv6, p + 4, 16);
+        uint8_t* a = (uint8_t*)&addr->addr.ipv6;
+        int i;
+        for (i = 0; mask && i < 16; ++i) {
+            a[i] ^= mask[i];
+        }
+        return 0;
+    }
+
+    return -1;
+}
+
+int stun_decode(const char* buf, size_t len, struct stun_message* msg) {
+    const uint8_t* p = (const uint8_t*)buf;
+    if (len < STUN_HEADER_LENGTH) {
+        return -1;
+    }
+
+    msg->type = get16(p);
+    // the two most significant bits tell STUN apart from other protocols
+    if (msg->type & 0xC000) {
+        return -1;
+    }
+    size_t size = get16(p + 2);
+    if (size > len - STUN_HEADER_LENGTH) {
+        return -1;
+    }
+    memcpy(msg->tid, p + 4, STUN_TID_LENGTH);
+    msg->attrs = 0;
+    msg->error_code = 0;
+    msg->change = 0;
+
+    // XOR-MAPPED-ADDRESS means nothing without the cookie to unxor it
+    const uint8_t* mask = has_magic_cookie(msg->tid) ? msg->tid : NULL;
+
+    p += STUN_HEADER_LENGTH;
+    while (size >= 4) {
+        uint16_t type = get16(p);
+        unsigned int attr_len = get16(p + 2);
+        // RFC 3489 attributes are 4 byte aligned already, RFC 5389 ones are padded
+        unsigned int padded = (attr_len + 3) & ~3u;
+        if (attr_len + 4 > size) {
+            return -1;
+        }
+        p += 4;
+        size -= 4;
+
+        switch (type) {
+        case MappedAddress:
+            if (get_address(p, attr_len, NULL, &msg->mapped)) {
+                return -1;
+            }
+            msg->attrs |= STUN_HAS_MAPPED;
+            break;
+        case XorMappedAddress:
+        case XorMappedAddressOld:
+            if (mask) {
+                if (get_address(p, attr_len, mask, &msg->xor_mapped)) {
+                    return -1;
+                }
+                msg->attrs |= STUN_HAS_XOR_MAPPED;
+            }
+            break;
+        case ChangedAddress:
+            if (get_address(p, attr_len, NULL, &msg->changed)) {
+                return -1;
+            }
+            msg->attrs |= STUN_HAS_CHANGED;
+            break;
+        case ErrorCode:
+            if (attr_len < 4) {
+                return -1;
+            }
+            msg->error_code = (p[2] & 0x07) * 100 + p[3];
+            msg->attrs |= STUN_HAS_ERROR_CODE;
+            break;
+        case ChangeRequest:
+            if (attr_len != 4) {
+                return -1;
+            }
+            msg->change = get32(p) & (ChangeIpFlag | ChangePortFlag);
+            msg->attrs |= STUN_HAS_CHANGE_REQUEST;
+            break;
+        default:
+            // ignore other attributes
+            break;
+        }
+
+        // the last attribute may come without its padding
+        if (padded > size) {
+            padded = size;
+        }
+        p += padded;
+        size -= padded;
+    }
+
+    return 0;
+}
+
+const StunAtrAddress* stun_mapped_address(const struct stun_message* msg) {
+    if (msg->attrs & STUN_HAS_XOR_MAPPED) {
+        return &msg->xor_mapped;
+    }
+    if (msg->attrs & STUN_HAS_MAPPED) {
+        return &msg->mapped;
+    }
+
+    return NULL;
+}
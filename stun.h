@@ -0,0 +1,64 @@
+#ifndef STUN_H
+#define STUN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nat_type.h"
+
+/*
+ * STUN message codec, RFC 3489 and RFC 5389. everything is encoded into and
+ * decoded from caller provided buffers, nothing is allocated.
+ */
+
+#define STUN_HEADER_LENGTH 20
+#define STUN_TID_LENGTH 16  // magic cookie and transaction ID, as echoed by the server
+#define STUN_MAGIC_COOKIE 0x2112A442
+
+#define ErrorResponse 0x0111
+// XOR-MAPPED-ADDRESS as sent by servers predating RFC 5389
+#define XorMappedAddressOld 0x8020
+
+// attributes found by stun_decode()
+#define STUN_HAS_MAPPED      0x01
+#define STUN_HAS_XOR_MAPPED  0x02
+#define STUN_HAS_CHANGED     0x04
+#define STUN_HAS_ERROR_CODE  0x08
+#define STUN_HAS_CHANGE_REQUEST 0x10
+
+struct stun_message {
+    uint16_t type;
+    uint8_t tid[STUN_TID_LENGTH];
+    uint32_t attrs;             // STUN_HAS_* of the attributes below
+    StunAtrAddress mapped;
+    StunAtrAddress xor_mapped;  // already unxored
+    StunAtrAddress changed;
+    uint16_t error_code;        // class * 100 + number
+    uint32_t change;            // ChangeIpFlag and ChangePortFlag of a request
+};
+
+// magic cookie followed by 12 random bytes, so RFC 5389 servers answer with XOR-MAPPED-ADDRESS.
+// -1 if the kernel has no randomness to give
+int stun_new_tid(uint8_t* tid);
+
+// returns the length of the message or -1 if buf is too small
+int stun_encode_bind_request(char* buf, size_t size, const uint8_t* tid, uint32_t change);
+
+/*
+ * MAPPED-ADDRESS, XOR-MAPPED-ADDRESS if tid carries the magic cookie,
+ * and CHANGED-ADDRESS unless changed is NULL
+ */
+int stun_encode_bind_response(char* buf, size_t size, const uint8_t* tid,
+        const StunAtrAddress* mapped, const StunAtrAddress* changed);
+
+/*
+ * decode a message of len bytes, every length is checked against len.
+ * unknown attributes are skipped, malformed ones fail the whole message.
+ * returns 0 or -1
+ */
+int stun_decode(const char* buf, size_t len, struct stun_message* msg);
+
+// XOR-MAPPED-ADDRESS if present, a NAT may rewrite the plain one
+const StunAtrAddress* stun_mapped_address(const struct stun_message* msg);
+
+#endif
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stun_servers.h"
+
+// assumed rtt of a server that never answered
+#define UNMEASURED_RTT_MS 500
+// don't let a dead server sink below the point where it's never retried
+#define MAX_FAIL_SHIFT 6
+
+int stun_servers_add(struct stun_server_list* list, const char* host, uint16_t default_port) {
+    char name[MAX_STUN_HOST_LENGTH];
+    uint16_t port = default_port;
+
+    strncpy(name, host, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    char* colon = strchr(name, ':');
+    if (colon) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+
+    int i;
+    for (i = 0; i < list->count; ++i) {
+        if (!strcmp(list->servers[i].host, name) && list->servers[i].port == port) {
+            return 0;
+        }
+    }
+    if (list->count == MAX_STUN_SERVERS) {
+        return -1;
+    }
+
+    struct stun_server* s = &list->servers[list->count++];
+    memset(s, 0, sizeof(*s));
+    strcpy(s->host, name);
+    s->port = port;
+
+    return 0;
+}
+
+static struct stun_server* find(struct stun_server_list* list, const char* host, uint16_t port) {
+    int i;
+    for (i = 0; i < list->count; ++i) {
+        if (!strcmp(list->servers[i].host, host) && list->servers[i].port == port) {
+            return &list->servers[i];
+        }
+    }
+
+    return NULL;
+}
+
+// one line per server: host port srtt fails successes
+int stun_servers_load(struct stun_server_list* list, const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    char host[MAX_STUN_HOST_LENGTH];
+    unsigned int port, srtt, fails, successes;
+    while (fscanf(f, "%63s %u %u %u %u", host, &port, &srtt, &fails, &successes) == 5) {
+        struct stun_server* s = find(list, host, port);
+        if (s) {
+            s->srtt = srtt;
+            s->fails = fails;
+            s->successes = successes;
+        }
+    }
+    fclose(f);
+
+    return 0;
+}
+
+int stun_servers_save(const struct stun_server_list* list, const char* path) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < list->count; ++i) {
+        const struct stun_server* s = &list->servers[i];
+        fprintf(f, "%s %u %u %u %u\n", s->host, s->port, s->srtt, s->fails, s->successes);
+    }
+
+    return fclose(f);
+}
+
+static uint64_t score(const struct stun_server* s) {
+    uint64_t rtt = s->srtt ? s->srtt : UNMEASURED_RTT_MS;
+    uint32_t shift = s->fails < MAX_FAIL_SHIFT ? s->fails : MAX_FAIL_SHIFT;
+
+    return rtt << shift;
+}
+
+static int compare(const void* a, const void* b) {
+    uint64_t sa = score(a), sb = score(b);
+
+    return sa < sb ? -1 : sa > sb;
+}
+
+void stun_servers_rank(struct stun_server_list* list) {
+    // stable enough for a handful of servers, ties keep configured order
+    int i, j;
+    for (i = 1; i < list->count; ++i) {
+        struct stun_server tmp = list->servers[i];
+        for (j = i; j > 0 && compare(&list->servers[j - 1], &tmp) > 0; --j) {
+            list->servers[j] = list->servers[j - 1];
+        }
+        list->servers[j] = tmp;
+    }
+}
+
+void stun_servers_record(struct stun_server* server, int ok, uint32_t rtt) {
+    if (!ok) {
+        server->fails++;
+        return;
+    }
+
+    server->fails = 0;
+    server->successes++;
+    if (rtt) {
+        // same smoothing as TCP: srtt = 7/8 srtt + 1/8 sample
+        server->srtt = server->srtt ? (server->srtt * 7 + rtt) / 8 : rtt;
+        if (server->srtt == 0) {
+            server->srtt = 1;
+        }
+    }
+}
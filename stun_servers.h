@@ -0,0 +1,41 @@
+#ifndef STUN_SERVERS_H
+#define STUN_SERVERS_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "resolver.h"
+
+#define MAX_STUN_SERVERS 8
+#define MAX_STUN_HOST_LENGTH 64
+
+struct stun_server {
+    char host[MAX_STUN_HOST_LENGTH];
+    uint16_t port;
+    struct sockaddr_in addr;  // filled in when detection resolves the host
+    uint32_t srtt;            // smoothed rtt in ms, 0 if never measured
+    uint32_t fails;           // consecutive failures, reset by an answer
+    uint32_t successes;
+};
+
+// candidate STUN servers, raced against each other by detect_nat_type()
+struct stun_server_list {
+    struct stun_server servers[MAX_STUN_SERVERS];
+    int count;
+    const struct resolver* resolver;    // the hosts are looked up through, NULL for the system's
+};
+
+// "host" or "host:port", duplicates are ignored
+int stun_servers_add(struct stun_server_list* list, const char* host, uint16_t default_port);
+
+// merge scores saved by a previous run, servers not in the list are skipped
+int stun_servers_load(struct stun_server_list* list, const char* path);
+int stun_servers_save(const struct stun_server_list* list, const char* path);
+
+// sort best first: fastest answer, pushed back by consecutive failures
+void stun_servers_rank(struct stun_server_list* list);
+
+// rtt is ignored for failures or when the sample is ambiguous (0)
+void stun_servers_record(struct stun_server* server, int ok, uint32_t rtt);
+
+#endif
@@ -0,0 +1,92 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "tcp_punch.h"
+
+int tcp_punch_socket(const char* local_ip, uint16_t local_port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // the server connection, the listener and the connecting sockets all sit on the port of our mapping
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+    struct sockaddr_in local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sin_family = AF_INET;
+    local_addr.sin_addr.s_addr = inet_addr(local_ip);
+    local_addr.sin_port = htons(local_port);
+    if (bind(fd, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int tcp_punch_listen(const char* local_ip, uint16_t local_port) {
+    int fd = tcp_punch_socket(local_ip, local_port);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 || listen(fd, TCP_PUNCH_BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int tcp_punch_connect(int fd, const struct sockaddr_in* peer, int ttl) {
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+        return -1;
+    }
+    if (ttl > 0) {
+        setsockopt(fd, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
+    }
+
+    // the SYN is out by the time connect() returns
+    int ret = connect(fd, (const struct sockaddr*)peer, sizeof(*peer));
+    int error = errno;
+    if (ttl > 0) {
+        // -1 is the route's default
+        int restore = -1;
+        setsockopt(fd, IPPROTO_IP, IP_TTL, &restore, sizeof(restore));
+    }
+    if (ret < 0 && error != EINPROGRESS) {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+int tcp_punch_established(int fd, int interval_s) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &interval_s, sizeof(interval_s));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval_s, sizeof(interval_s));
+
+    return 0;
+}
+
+int tcp_punch_is_stream(int fd) {
+    int type;
+    socklen_t len = sizeof(type);
+
+    return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM;
+}
@@ -0,0 +1,37 @@
+#ifndef TCP_PUNCH_H
+#define TCP_PUNCH_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * TCP hole punching by simultaneous open. the sockets of one side share a
+ * source port through SO_REUSEADDR and SO_REUSEPORT, and each nonblocking
+ * connect() sends one SYN that opens a mapping of our NAT. the first side's
+ * SYNs go out with a limited ttl and die before the peer's NAT, which could
+ * answer them with a RST. the peer's SYN then meets one of our sockets in
+ * SYN_SENT, or a listening socket on the same port, and both ends get one
+ * established stream with the kernel's congestion control and offloads.
+ */
+
+#define TCP_PUNCH_BACKLOG 16
+
+// a blocking socket on local_ip:local_port next to every other one there, 0 for a port of the kernel's
+int tcp_punch_socket(const char* local_ip, uint16_t local_port);
+
+// a nonblocking socket listening on local_ip:local_port, for the SYNs no connecting socket matches
+int tcp_punch_listen(const char* local_ip, uint16_t local_port);
+
+/*
+ * make fd nonblocking and send its SYN to peer with ttl, 0 for the default.
+ * the ttl is restored right after, so a retransmitted SYN and the SYN-ACK reach the peer
+ */
+int tcp_punch_connect(int fd, const struct sockaddr_in* peer, int ttl);
+
+// blocking again, with TCP keepalives every interval_s so the NATs keep the mapping
+int tcp_punch_established(int fd, int interval_s);
+
+// 1 if fd is a TCP socket
+int tcp_punch_is_stream(int fd);
+
+#endif
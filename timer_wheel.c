@@ -0,0 +1,194 @@
+#include <stddef.h>
+
+#include "timer_wheel.h"
+
+// timers further out than the top level can reach are parked in its last slot and moved again
+#define WHEEL_RANGE (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+void timer_wheel_init(struct timer_wheel* w, int tick_ms, uint64_t now_ms) {
+    w->tick_ms = tick_ms;
+    w->tick = now_ms / tick_ms;
+    w->count = 0;
+
+    int l, i;
+    for (l = 0; l < WHEEL_LEVELS; ++l) {
+        w->occupied[l] = 0;
+        for (i = 0; i < WHEEL_SIZE; ++i) {
+            w->slots[l][i].next = &w->slots[l][i];
+            w->slots[l][i].prev = &w->slots[l][i];
+        }
+    }
+}
+
+void timer_init(struct timer* t) {
+    t->next = NULL;
+    t->prev = NULL;
+    t->expires = 0;
+}
+
+// an expired timer is still chained through next, only a pending one has prev
+int timer_pending(const struct timer* t) {
+    return t->prev != NULL;
+}
+
+// a timer moved down from above may be due on the tick being expired right now
+static void place(struct timer_wheel* w, struct timer* t) {
+    uint64_t expires = t->expires;
+    if (expires < w->tick) {
+        expires = w->tick;
+    } else if (expires - w->tick >= WHEEL_RANGE) {
+        expires = w->tick + WHEEL_RANGE - 1;
+    }
+
+    // the lowest level whose turn still reaches it
+    uint64_t delta = expires - w->tick;
+    int l = 0;
+    while (l < WHEEL_LEVELS - 1 && delta >= 1ULL << (WHEEL_BITS * (l + 1))) {
+        l++;
+    }
+    int i = (expires >> (WHEEL_BITS * l)) & WHEEL_MASK;
+
+    struct timer* head = &w->slots[l][i];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    w->occupied[l] |= 1ULL << i;
+}
+
+static void unlink_timer(struct timer_wheel* w, struct timer* t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+
+    // the neighbours are the head alone once the slot is empty
+    struct timer* head = t->next;
+    if (head == t->prev && head >= &w->slots[0][0] && head <= &w->slots[WHEEL_LEVELS - 1][WHEEL_MASK]) {
+        ptrdiff_t slot = head - &w->slots[0][0];
+        w->occupied[slot / WHEEL_SIZE] &= ~(1ULL << (slot % WHEEL_SIZE));
+    }
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+void timer_schedule(struct timer_wheel* w, struct timer* t, uint64_t when_ms) {
+    if (timer_pending(t)) {
+        unlink_timer(w, t);
+        w->count--;
+    }
+
+    // the current tick has expired already
+    t->expires = (when_ms + w->tick_ms - 1) / w->tick_ms;
+    if (t->expires <= w->tick) {
+        t->expires = w->tick + 1;
+    }
+    place(w, t);
+    w->count++;
+}
+
+void timer_cancel(struct timer_wheel* w, struct timer* t) {
+    if (timer_pending(t)) {
+        unlink_timer(w, t);
+        w->count--;
+    }
+}
+
+// smallest k such that slot (from + k) % WHEEL_SIZE is occupied, -1 if none is
+static int first_occupied(uint64_t occupied, int from) {
+    if (!occupied) {
+        return -1;
+    }
+    uint64_t rotated = from ? (occupied >> from) | (occupied << (WHEEL_SIZE - from)) : occupied;
+
+    return __builtin_ctzll(rotated);
+}
+
+/*
+ * the next tick with anything to do, a level 0 slot to expire or a slot above
+ * to move down. 0 if the wheel is empty
+ */
+static uint64_t next_tick(const struct timer_wheel* w) {
+    uint64_t next = 0;
+    int l;
+    for (l = 0; l < WHEEL_LEVELS; ++l) {
+        uint64_t turn = w->tick >> (WHEEL_BITS * l);
+        int k = first_occupied(w->occupied[l], (turn + 1) & WHEEL_MASK);
+        if (k < 0) {
+            continue;
+        }
+
+        uint64_t tick = (turn + 1 + k) << (WHEEL_BITS * l);
+        if (!next || tick < next) {
+            next = tick;
+        }
+    }
+
+    return next;
+}
+
+// move the timers of a slot above down to where they belong now
+static int cascade(struct timer_wheel* w, int l, int i) {
+    struct timer* head = &w->slots[l][i];
+    struct timer* t = head->next;
+    head->next = head;
+    head->prev = head;
+    w->occupied[l] &= ~(1ULL << i);
+
+    while (t != head) {
+        struct timer* next = t->next;
+        place(w, t);
+        t = next;
+    }
+
+    return i;
+}
+
+int timer_wheel_advance(struct timer_wheel* w, uint64_t now_ms, struct timer** expired) {
+    uint64_t now = now_ms / w->tick_ms;
+    struct timer* first = NULL;
+    struct timer** last = &first;
+    int n = 0;
+
+    // only the ticks with something in their slots are visited
+    while (w->tick < now) {
+        uint64_t tick = next_tick(w);
+        if (!tick || tick > now) {
+            w->tick = now;
+            break;
+        }
+        w->tick = tick;
+
+        int l;
+        for (l = 1; l < WHEEL_LEVELS; ++l) {
+            if ((tick & ((1ULL << (WHEEL_BITS * l)) - 1)) != 0
+                    || cascade(w, l, (tick >> (WHEEL_BITS * l)) & WHEEL_MASK) != 0) {
+                break;
+            }
+        }
+
+        // cascading may have brought timers of a later tick only
+        int i = tick & WHEEL_MASK;
+        struct timer* head = &w->slots[0][i];
+        while (head->next != head) {
+            struct timer* t = head->next;
+            unlink_timer(w, t);
+            w->count--;
+            *last = t;
+            last = &t->next;
+            n++;
+        }
+    }
+
+    *last = NULL;
+    *expired = first;
+    return n;
+}
+
+int timer_wheel_timeout(const struct timer_wheel* w, uint64_t now_ms) {
+    uint64_t tick = next_tick(w);
+    if (!tick) {
+        return -1;
+    }
+
+    uint64_t when = tick * w->tick_ms;
+    return when > now_ms ? when - now_ms : 0;
+}
@@ -0,0 +1,56 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/*
+ * hierarchical timing wheel. time is counted in ticks of tick_ms, level 0 has
+ * one slot per tick, every level above one slot per whole turn of the level
+ * below, whose timers are moved down when their turn comes. scheduling and
+ * cancelling are O(1), timers due within the same tick expire together.
+ * timers are embedded in whatever they time, the wheel never allocates.
+ */
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+struct timer {
+    struct timer* next;
+    struct timer* prev;
+    uint64_t expires;   // tick
+};
+
+struct timer_wheel {
+    int tick_ms;
+    // every tick up to this one has expired
+    uint64_t tick;
+    int count;
+    // bit i of level l set if slots[l][i] isn't empty
+    uint64_t occupied[WHEEL_LEVELS];
+    // list heads
+    struct timer slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+void timer_wheel_init(struct timer_wheel* w, int tick_ms, uint64_t now_ms);
+
+void timer_init(struct timer* t);
+
+int timer_pending(const struct timer* t);
+
+// (re)schedule t at when_ms, rounded up to the next tick
+void timer_schedule(struct timer_wheel* w, struct timer* t, uint64_t when_ms);
+
+void timer_cancel(struct timer_wheel* w, struct timer* t);
+
+/*
+ * expire every timer due by now_ms. returns how many, chained through their
+ * next pointers from *expired, none of them is pending anymore
+ */
+int timer_wheel_advance(struct timer_wheel* w, uint64_t now_ms, struct timer** expired);
+
+// milliseconds from now_ms until the wheel has to be advanced again, -1 if it's empty
+int timer_wheel_timeout(const struct timer_wheel* w, uint64_t now_ms);
+
+#endif
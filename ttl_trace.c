@@ -0,0 +1,179 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+
+#include "ttl_trace.h"
+
+int ttl_trace_start(struct ttl_trace* t, const char* ip, int max_ttl) {
+    memset(t, 0, sizeof(*t));
+    // ttl_trace_close() is safe whatever fails below
+    t->sock = -1;
+    t->max_ttl = max_ttl < TTL_TRACE_MAX_HOPS ? max_ttl : TTL_TRACE_MAX_HOPS;
+    t->target.sin_family = AF_INET;
+    if (inet_pton(AF_INET, ip, &t->target.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    t->sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (t->sock < 0) {
+        return -1;
+    }
+    // ICMP errors of an unconnected socket are only kept with this
+    int on = 1;
+    if (setsockopt(t->sock, IPPROTO_IP, IP_RECVERR, &on, sizeof(on)) < 0) {
+        ttl_trace_close(t);
+        return -1;
+    }
+
+    /*
+     * the ttl is told by the destination port as traceroute does, routers may
+     * quote no more than the UDP header of a probe in their ICMP error
+     */
+    int ttl;
+    for (ttl = 1; ttl <= t->max_ttl; ++ttl) {
+        struct sockaddr_in to = t->target;
+        to.sin_port = htons(TTL_TRACE_PORT + ttl);
+        setsockopt(t->sock, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
+        // an answer to an earlier probe fails the send instead, it's in the error queue all the same
+        int tries = 0;
+        while (sendto(t->sock, "c", 1, 0, (struct sockaddr*)&to, sizeof(to)) < 0) {
+            if (++tries > 2 || (errno != EHOSTUNREACH && errno != ENETUNREACH && errno != ECONNREFUSED)) {
+                ttl_trace_close(t);
+                return -1;
+            }
+        }
+    }
+
+    return t->sock;
+}
+
+// every hop up to the target, or up to max_ttl without one, has answered
+static int complete(const struct ttl_trace* t) {
+    int last = t->target_hop ? t->target_hop - 1 : t->max_ttl;
+    int ttl;
+    for (ttl = 1; ttl <= last; ++ttl) {
+        if (!t->hops[ttl]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int ttl_trace_read(struct ttl_trace* t) {
+    for (; ;) {
+        unsigned char probe;
+        struct iovec iov = {&probe, 1};
+        char control[256];
+        struct sockaddr_in from;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        // the name is where the failed probe was sent to
+        if (recvmsg(t->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        int ttl = ntohs(from.sin_port) - TTL_TRACE_PORT;
+        if (ttl < 1 || ttl > t->max_ttl) {
+            continue;
+        }
+
+        struct cmsghdr* cmsg;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != IPPROTO_IP || cmsg->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            struct sock_extended_err* ee = (struct sock_extended_err*)CMSG_DATA(cmsg);
+            if (ee->ee_origin != SO_EE_ORIGIN_ICMP) {
+                continue;
+            }
+            struct sockaddr_in* offender = (struct sockaddr_in*)SO_EE_OFFENDER(ee);
+
+            if (ee->ee_type == ICMP_TIME_EXCEEDED) {
+                t->hops[ttl] = offender->sin_addr.s_addr;
+            } else if (ee->ee_type == ICMP_DEST_UNREACH
+                    && offender->sin_addr.s_addr == t->target.sin_addr.s_addr
+                    && (!t->target_hop || ttl < t->target_hop)) {
+                // the lowest ttl that got there is how far it is
+                t->target_hop = ttl;
+            }
+        }
+    }
+
+    return complete(t);
+}
+
+// RFC 1918, shared address space of carrier grade NATs, link local
+static int is_private(uint32_t addr) {
+    uint32_t a = ntohl(addr);
+    return (a >> 24) == 10 || (a >> 20) == ((172 << 4) | 1) || (a >> 16) == ((192 << 8) | 168)
+        || (a >> 22) == ((100 << 2) | 1) || (a >> 16) == ((169 << 8) | 254);
+}
+
+int ttl_trace_nat_hop(const struct ttl_trace* t) {
+    int last = t->target_hop ? t->target_hop - 1 : t->max_ttl;
+    int ttl, nat = 0;
+    for (ttl = 1; ttl <= last; ++ttl) {
+        if (t->hops[ttl] && is_private(t->hops[ttl])) {
+            nat = ttl;
+        }
+    }
+
+    return nat;
+}
+
+int ttl_trace_pick(const struct ttl_trace* t, int fallback) {
+    int nat = ttl_trace_nat_hop(t);
+    if (!nat) {
+        return fallback;
+    }
+
+    // right behind each other, a limited probe can't open ours without reaching theirs
+    int ttl = nat + 1;
+    if (t->target_hop && ttl >= t->target_hop) {
+        return fallback;
+    }
+
+    return ttl;
+}
+
+void ttl_trace_close(struct ttl_trace* t) {
+    if (t->sock >= 0) {
+        close(t->sock);
+    }
+    t->sock = -1;
+}
+
+int ttl_trace_run(struct ttl_trace* t, const char* ip, int max_ttl, int timeout_ms) {
+    if (ttl_trace_start(t, ip, max_ttl) < 0) {
+        return -1;
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct pollfd fd = {t->sock, POLLERR, 0};
+    while (!ttl_trace_read(t)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int left = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (left <= 0 || poll(&fd, 1, left) <= 0) {
+            break;
+        }
+    }
+    ttl_trace_close(t);
+
+    return 0;
+}
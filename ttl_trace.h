@@ -0,0 +1,48 @@
+#ifndef TTL_TRACE_H
+#define TTL_TRACE_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * picks the ttl of the limited probes from the path to the peer: one UDP probe
+ * per ttl goes out at once, the routers on the way answer with ICMP time
+ * exceeded, read back from the socket's error queue (IP_RECVERR), the peer's
+ * NAT with port unreachable if it isn't silent. our own NAT is the farthest hop
+ * that answers from a private address, the probes have to get one hop past it
+ * and stop short of the peer's NAT.
+ */
+
+#define TTL_TRACE_MAX_HOPS 16
+#define TTL_TRACE_TIMEOUT_MS 600
+// probe ttl goes to this port plus ttl, as traceroute's do
+#define TTL_TRACE_PORT 33434
+
+struct ttl_trace {
+    int sock;
+    struct sockaddr_in target;
+    int max_ttl;
+    // address that answered probe ttl, 0 if none did
+    uint32_t hops[TTL_TRACE_MAX_HOPS + 1];
+    // ttl the target itself answered at, 0 if it didn't
+    int target_hop;
+};
+
+// open the socket and send every probe, the socket gets readable (EPOLLERR) as answers come in
+int ttl_trace_start(struct ttl_trace* t, const char* ip, int max_ttl);
+
+// read the answers that came in, returns 1 once nothing else is expected
+int ttl_trace_read(struct ttl_trace* t);
+
+// hop count of our own NAT, 0 if none of the answers is from one
+int ttl_trace_nat_hop(const struct ttl_trace* t);
+
+// a ttl past our NAT that doesn't reach the peer's, fallback if the path doesn't tell
+int ttl_trace_pick(const struct ttl_trace* t, int fallback);
+
+void ttl_trace_close(struct ttl_trace* t);
+
+// the whole trace, waiting up to timeout_ms for the answers
+int ttl_trace_run(struct ttl_trace* t, const char* ip, int max_ttl, int timeout_ms);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+/*
+ * minimal io_uring wrapper on the raw syscalls, liburing isn't required.
+ * one thread submits and reaps, so the only barriers needed are the
+ * acquire/release pairs on the ring heads and tails.
+ */
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned sq_local_tail;      // sqes handed out but not submitted yet end here
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// returns -1 with errno set if the kernel has no (or a disabled) io_uring
+int uring_init(struct uring* r, unsigned entries);
+
+// 1 if the running kernel implements opcode op
+int uring_supports(struct uring* r, int op);
+
+// a zeroed sqe, NULL when the submission queue is full
+struct io_uring_sqe* uring_get_sqe(struct uring* r);
+
+// submit every queued sqe and wait for at least wait_nr completions
+int uring_submit(struct uring* r, unsigned wait_nr);
+
+// next completion, NULL if there's none. uring_cqe_seen() hands it back
+struct io_uring_cqe* uring_peek_cqe(struct uring* r);
+void uring_cqe_seen(struct uring* r);
+
+void uring_destroy(struct uring* r);
+
+#endif